@@ -0,0 +1,86 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <Eigen/Sparse>
+#include <opm/core/utility/parameters/ParameterGroup.hpp>
+
+#include "equelle/KrylovSolver.hpp"
+#include "equelle/HaloExchange.hpp"
+#include "equelle/Trace.hpp"
+
+namespace equelle {
+
+/** DistributedKrylovSolver solves the linear systems of a Newton iteration distributed by RuntimeMPI.
+ *
+ *  Each node holds the matrix rows of the unknowns it owns. The columns refer to all local
+ *  unknowns, so the columns of the ghost cells couple the node to its neighbours: before each
+ *  matrix-vector product the ghost values are fetched by a halo exchange, and dot products are
+ *  summed over all nodes.
+ *
+ *  The method is right-preconditioned BiCGStab, as in KrylovSolver. The preconditioner is
+ *  block-Jacobi over the nodes (additive Schwarz without overlap): each node applies the
+ *  preconditioner given by the "preconditioner" parameter (ilu0, jacobi or none) to the block
+ *  of its owned unknowns, ignoring the couplings to the ghost cells.
+ *
+ *  Parameters: linear_solver_tol, linear_solver_max_iter and preconditioner, as for KrylovSolver.
+ */
+class DistributedKrylovSolver {
+public:
+    typedef Eigen::SparseMatrix<double, Eigen::RowMajor> RowMatrix;
+
+    /**
+     * @param halo Exchange plan for the cells of the subGrid.
+     * @param num_local_cells Number of cells in the subGrid, including ghost cells.
+     * @param num_owned_cells Number of owned cells, which come first in the subGrid.
+     */
+    DistributedKrylovSolver( const Opm::parameter::ParameterGroup& param, HaloExchange& halo,
+                             const int num_local_cells, const int num_owned_cells );
+
+    /**
+     * @brief solve Solve A x = b. Collective over all nodes.
+     * @param A Compressed matrix with num_fields*num_owned_cells rows, one for each owned unknown,
+     *        ordered field by field. Column f*num_local_cells + c is field f in local cell c.
+     * @param rhs Right hand side for the owned unknowns, in the order of the rows.
+     * @param x Solution for the owned unknowns, in the order of the rows.
+     * @param tolerance Relative residual tolerance. If not positive, linear_solver_tol is used.
+     */
+    KrylovSolver::Report solve( const RowMatrix& A, const int num_fields, const double* rhs, double* x,
+                                const double tolerance = 0.0 );
+
+    /// A short description such as "bicgstab+ilu0 (block-Jacobi)".
+    std::string name() const;
+
+    /// Record the global dot products (krylov_dot) in trace.
+    void setTrace( Trace* trace ) { trace_ = trace; }
+
+private:
+    typedef std::vector<double> Vec;
+
+    void setupPreconditioner( const RowMatrix& A, const int num_fields, KrylovSolver::Report& report );
+    void multiply( const RowMatrix& A, const int num_fields, const double* x, double* y );
+    double dot( const Vec& a, const Vec& b ) const;
+    int solveBiCGStab( const RowMatrix& A, const int num_fields, const double* rhs, const double tolerance,
+                       double* x, double& residual );
+
+    HaloExchange& halo_;
+    const int num_local_cells_;
+    const int num_owned_cells_;
+    double tolerance_;
+    int max_iter_;
+    KrylovSolver::PreconditionerType preconditioner_type_;
+    int num_threads_; // Threads per rank, 1 unless num_threads is given.
+    std::unique_ptr<Preconditioner> preconditioner_;
+
+    // The block of owned unknowns, in compressed rows. The pattern is kept for as long as it
+    // does not change, since the preconditioner analysis depends only on it.
+    std::vector<int> block_start_;
+    std::vector<int> block_index_;
+    std::vector<double> block_values_;
+
+    Vec ext_; // Vector over all local unknowns, for the matrix-vector product.
+    Trace* trace_;
+};
+
+} // namespace equelle
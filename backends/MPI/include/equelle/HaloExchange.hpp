@@ -0,0 +1,90 @@
+#pragma once
+
+#include <vector>
+#include <mpi.h>
+
+#include "equelle/SubGridBuilder.hpp"
+#include "equelle/Trace.hpp"
+
+namespace equelle {
+
+/** HaloExchange updates the ghost cells of a SubGrid with the values of their owners.
+ *
+ *  The communication plan is built once, collectively, after the decomposition:
+ *  for every neighbouring rank we store the local indices of the owned cells it
+ *  needs from us (the send list) and the local indices of our ghost cells it owns
+ *  (the receive list). An exchange then only packs, sends and unpacks values,
+ *  using non-blocking point-to-point messages and buffers allocated up front.
+ *
+ *  The owners of the ghost cells are found through a directory distributed over
+ *  the ranks (global cell g is registered on rank g % size), so no rank needs the
+ *  partition of the whole grid.
+ */
+class HaloExchange {
+public:
+    /** The lists of an exchange. For neighbour n, send_index[send_start[n]..send_start[n+1]) are
+     *  the local indices of the cells we send to neighbour_ranks[n], and likewise recv_index for
+     *  the ghost cells we receive from it, in the same order as the neighbour sends them.
+     */
+    struct Plan {
+        std::vector<int> neighbour_ranks;
+        std::vector<int> send_start;
+        std::vector<int> send_index;
+        std::vector<int> recv_start;
+        std::vector<int> recv_index;
+    };
+
+    /**
+     * @brief Build the exchange plan. Collective over comm.
+     * @param subGrid The local subGrid, with the ghost cells last in the cell enumeration.
+     */
+    HaloExchange( const SubGrid& subGrid, MPI_Comm comm = MPI_COMM_WORLD );
+
+    /// Use a plan computed beforehand, such as one read by PartitionIO. Not collective.
+    HaloExchange( const Plan& plan, MPI_Comm comm = MPI_COMM_WORLD );
+    ~HaloExchange();
+
+    /**
+     * @brief begin Pack the owned values requested by our neighbours and start the transfers.
+     * @param values Values for all local cells. Must not be modified before end() is called.
+     */
+    void begin( const double* values );
+
+    /**
+     * @brief end Wait for the transfers started by begin() and write the ghost values.
+     * @param values Values for all local cells. The ghost cells are overwritten.
+     */
+    void end( double* values );
+
+    /// Same as begin() followed by end().
+    void exchange( double* values );
+
+    /// Number of ranks we exchange values with.
+    int numNeighbours() const { return plan_.neighbour_ranks.size(); }
+
+    /// Number of values sent and received by each exchange.
+    int numSendValues() const { return plan_.send_index.size(); }
+    int numRecvValues() const { return plan_.recv_index.size(); }
+
+    const Plan& plan() const { return plan_; }
+
+    /// Record the exchanges in trace: starting them (halo_begin) and waiting for them (halo_wait).
+    void setTrace( Trace* trace ) { trace_ = trace; }
+
+private:
+    HaloExchange( const HaloExchange& );
+    HaloExchange& operator=( const HaloExchange& );
+
+    void allocateBuffers();
+
+    MPI_Comm comm_;
+    Plan plan_;
+
+    std::vector<double> send_buffer_;
+    std::vector<double> recv_buffer_;
+    std::vector<MPI_Request> requests_;
+    bool in_progress_;
+    Trace* trace_;
+};
+
+} // namespace equelle
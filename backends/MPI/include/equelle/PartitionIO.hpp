@@ -0,0 +1,57 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "equelle/SubGridBuilder.hpp"
+#include "equelle/HaloExchange.hpp"
+
+struct UnstructuredGrid;
+
+namespace equelle {
+
+/** PartitionIO stores a partition of a grid for a given number of nodes, with the subGrid and
+ *  the halo exchange plan of every node. The partition can then be computed once, offline
+ *  (see tools/standalonepartition), and each node of a run reads only its own piece instead
+ *  of reading the grid and partitioning it (RuntimeMPI's partition_file parameter).
+ *
+ *  For the prefix p the files are, in the format of BinaryIO.hpp:
+ *  - p.owner.eqbin: a record with the number of nodes, cells and faces, and a record with
+ *    the owner of each cell of the grid.
+ *  - p.<rank>.ints.eqbin: the integer part of the subGrid as packed by SubGridBuilder::pack,
+ *    followed by the halo exchange plan (neighbour ranks, send start and index, receive
+ *    start and index), one record each.
+ *  - p.<rank>.doubles.eqbin: the geometry of the subGrid.
+ */
+class PartitionIO {
+public:
+    /// The piece of one node.
+    struct Piece {
+        SubGrid subGrid;
+        HaloExchange::Plan plan;
+        int global_number_of_cells;
+        int global_number_of_faces;
+    };
+
+    /**
+     * @brief write Build the subGrid and halo exchange plan of every node and write them.
+     *        The subGrids are built one at a time, so the memory needed is that of the grid
+     *        and one subGrid. Not collective.
+     * @param owner The node owning each cell of the grid.
+     */
+    static void write( const std::string& prefix, const UnstructuredGrid* grid,
+                       const std::vector<int>& owner, const int num_nodes );
+
+    /// Read the piece of a node. Throws if the partition is for another number of nodes.
+    static Piece read( const std::string& prefix, const int rank, const int num_nodes );
+
+    /// The halo exchange plans of all nodes, for the subGrids built by SubGridBuilder from
+    /// the cells of each node in increasing order.
+    static std::vector<HaloExchange::Plan> haloPlans( const UnstructuredGrid* grid,
+                                                      const std::vector<int>& owner, const int num_nodes );
+
+private:
+    PartitionIO();
+};
+
+} // namespace equelle
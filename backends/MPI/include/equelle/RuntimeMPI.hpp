@@ -1,7 +1,9 @@
 #pragma once
 
+#include <array>
 #include <memory>
 #include <fstream>
+#include <map>
 #include <opm/core/utility/parameters/ParameterGroup.hpp>
 #include <opm/core/grid/GridManager.hpp>
 #include <opm/core/grid.h>
@@ -10,6 +12,9 @@
 #include "equelle/mpiutils.hpp"
 #include "equelle/ZoltanGrid.hpp"
 #include "equelle/SubGridBuilder.hpp"
+#include "equelle/HaloExchange.hpp"
+#include "equelle/DistributedKrylovSolver.hpp"
+#include "equelle/Trace.hpp"
 
 class Zoltan;
 
@@ -19,10 +24,43 @@ class EquelleRuntimeCPU;
 /** RuntimeMPI is responsible for executing Equelle-simulators using MPI.
  *  It handles both the MPI context and the domain decomposition, using Zoltan.
  *
- *  The current domain-decomposition and subgrid-building relies on all nodes
- *  reading the globalGrid from disk and then extracting the local subGrid from it.
- *  This is because the current subGrid-building (with ghost cells) relies on full
+ *  By default (grid_distribution=replicated) the domain-decomposition and subgrid-building
+ *  relies on all nodes reading the globalGrid from disk and then extracting the local
+ *  subGrid from it. This is because the subGrid-building (with ghost cells) relies on full
  *  access to the neighborhood.
+ *
+ *  The partition is computed by Zoltan with the method given by partition_method: graph
+ *  (default), or one of the geometric methods rcb, rib and hsfc on the cell centroids.
+ *  The cells may be weighted by their compute cost, read on rank 0 from the file given by
+ *  partition_cell_weights (one weight per cell), and the graph edges by the faces, given by
+ *  partition_edge_weights (none, area or transmissibility). A running simulation can be
+ *  rebalanced with repartition.
+ *
+ *  With grid_distribution=scatter only rank 0 reads the globalGrid. It partitions it, builds
+ *  the subGrid (owned cells and ghost layer) of every node and sends it as a compact piece,
+ *  then releases the globalGrid. The memory needed on the other nodes is then proportional
+ *  to the size of their subGrid only.
+ *
+ *  A partition can also be computed once, offline, for a given number of nodes (see
+ *  computeOwners, PartitionIO and tools/standalonepartition). With partition_file set to
+ *  its prefix, no node reads the grid, and decompose reads the subGrid and halo exchange
+ *  plan of each node from the files instead of partitioning.
+ *
+ *  Values on the ghost cells are refreshed by a halo exchange inside the operators
+ *  that read the neighbours of a cell (gradient, and restriction of cell data to
+ *  other cells), so generated code never needs to call it explicitly. Other
+ *  operators compute the ghost values locally, where they may be incomplete.
+ *
+ *  These operators are evaluated in two phases to hide the communication latency:
+ *  the exchange is started, the operator is applied to all entities using the old
+ *  ghost values, and once the exchange has completed only the results that depend
+ *  on a ghost cell (the boundary layer) are recomputed.
+ *
+ *  Only values are exchanged. The derivative rows of a ghost cell refer to cells
+ *  beyond the ghost layer on its owner, so they can not be sent. For collections
+ *  with derivatives the exchange therefore only checks that the local ghost values
+ *  (and so their derivatives) agree with the owners', which holds for anything
+ *  computed cell by cell from the unknowns, and the operators throw otherwise.
  */
 class  RuntimeMPI {
 public:
@@ -30,12 +68,34 @@ public:
     RuntimeMPI( const Opm::parameter::ParameterGroup& param );
     virtual ~RuntimeMPI();
 
-    std::unique_ptr<Opm::GridManager> globalGrid; //! Assumed to be read from disk on every node.
+    std::unique_ptr<Opm::GridManager> globalGrid; //! Read from disk on every node, or only on rank 0 until
+                                                  //! decompose when scattering the grid.
     equelle::SubGrid subGrid; //! Filled with the local subGrid after call to decompose.
 
     void decompose();
     equelle::zoltanReturns computePartition();
 
+    /**
+     * @brief computeOwners Partition the grid into num_nodes parts, which need not be the
+     *        number of nodes of this run. Collective over all nodes.
+     * @return The part of each cell of the grid on rank 0, empty on the other nodes.
+     */
+    std::vector<int> computeOwners( const int num_nodes );
+
+    /**
+     * @brief repartition Rebalance the partition, starting from the current one (Zoltan's
+     *        REPARTITION approach), and rebuild the subGrid. Collective over all nodes.
+     *
+     * Requires grid_distribution=replicated, as the new subGrid is built from the global grid.
+     * Collections on all cells that were computed on the old subGrid are invalid afterwards,
+     * except for those passed in fields, whose values are moved to the new subGrid (the
+     * derivatives are dropped). Only the values of the cells that change owner are sent.
+     *
+     * @param cell_cost The compute cost of each cell, for example measured, used as cell weights.
+     * @param fields Collections on all cells to move along with their cells.
+     */
+    void repartition( const CollOfScalar& cell_cost, const std::vector<CollOfScalar*>& fields );
+
     ///@{ Topology and geometry related.
     CollOfCell allCells() const;
     CollOfFace allFaces() const;
@@ -47,6 +107,46 @@ public:
      */
     CollOfCell boundaryCells() const;
     CollOfFace boundaryFaces() const;
+    const CollOfCell& interiorCells() const;
+    const CollOfFace& interiorFaces() const;
+    CollOfCell firstCell( const CollOfFace& faces ) const;
+    CollOfCell secondCell( const CollOfFace& faces ) const;
+    CollOfScalar norm( const CollOfFace& faces ) const;
+    CollOfScalar norm( const CollOfCell& cells ) const;
+    CollOfScalar norm( const CollOfVector& vectors ) const;
+    CollOfVector centroid( const CollOfFace& faces ) const;
+    CollOfVector centroid( const CollOfCell& cells ) const;
+    CollOfVector normal( const CollOfFace& faces ) const;
+    ///@}
+
+    ///@{ Operators. Those that read neighbouring cells do a halo exchange first.
+    CollOfScalar gradient( const CollOfScalar& cell_scalarfield ) const;
+    CollOfScalar negGradient( const CollOfScalar& cell_scalarfield ) const;
+    CollOfScalar divergence( const CollOfScalar& face_fluxes ) const;
+    CollOfScalar interiorDivergence( const CollOfScalar& face_fluxes ) const;
+
+    CollOfScalar operatorOn( const CollOfScalar& data, const CollOfCell& from_set, const CollOfCell& to_set );
+    CollOfScalar operatorOn( const CollOfScalar& data, const CollOfFace& from_set, const CollOfFace& to_set );
+    ///@}
+
+    ///@{ Operators that only use local data, forwarded to the serial runtime.
+    CollOfScalar sqrt( const CollOfScalar& x ) const;
+    CollOfScalar dot( const CollOfVector& v1, const CollOfVector& v2 ) const;
+    CollOfBool isEmpty( const CollOfCell& cells ) const;
+    CollOfBool isEmpty( const CollOfFace& faces ) const;
+
+    template <class EntityCollection>
+    CollOfScalar operatorExtend( const Scalar data, const EntityCollection& to_set );
+
+    template <class SomeCollection, class EntityCollection>
+    SomeCollection operatorExtend( const SomeCollection& data, const EntityCollection& from_set, const EntityCollection& to_set );
+
+    template <class SomeCollection, class EntityCollection>
+    typename CollType<SomeCollection>::Type operatorOn( const SomeCollection& data, const EntityCollection& from_set, const EntityCollection& to_set );
+
+    template <class SomeCollection1, class SomeCollection2>
+    typename CollType<SomeCollection1>::Type
+    trinaryIf( const CollOfBool& predicate, const SomeCollection1& iftrue, const SomeCollection2& iffalse ) const;
     ///@}
 
     /// Return the number of cells in collection. Will do MPI-transfer.
@@ -67,19 +167,90 @@ public:
 
     Scalar inputScalarWithDefault(const String& name,
                                   const Scalar default_value);
+
+    SeqOfScalar inputSequenceOfScalar( const String& name );
     ///@}
 
-    void output(const String& tag, const CollOfScalar& vals);
+    ///@{ Reductions over the entities owned by each node, so ghost cells are not counted twice.
+    /// The generated code gives the domain of the collection, which may be any set of cells
+    /// or faces. Without it, the collection must be on all cells or all faces (found from its
+    /// size), and other collections throw.
+    Scalar minReduce( const CollOfScalar& x ) const;
+    Scalar maxReduce( const CollOfScalar& x ) const;
+    Scalar sumReduce( const CollOfScalar& x ) const;
+    Scalar prodReduce( const CollOfScalar& x ) const;
+    Scalar minReduce( const CollOfScalar& x, const CollOfCell& domain ) const;
+    Scalar minReduce( const CollOfScalar& x, const CollOfFace& domain ) const;
+    Scalar maxReduce( const CollOfScalar& x, const CollOfCell& domain ) const;
+    Scalar maxReduce( const CollOfScalar& x, const CollOfFace& domain ) const;
+    Scalar sumReduce( const CollOfScalar& x, const CollOfCell& domain ) const;
+    Scalar sumReduce( const CollOfScalar& x, const CollOfFace& domain ) const;
+    Scalar prodReduce( const CollOfScalar& x, const CollOfCell& domain ) const;
+    Scalar prodReduce( const CollOfScalar& x, const CollOfFace& domain ) const;
+    ///@}
+
+    ///@{ Output
+    void output( const String& tag, const Scalar val ) const;
+
+    /**
+     * @brief output writes a collection on all cells or all faces.
+     *
+     * With output_to_file=true every node writes its own part, nothing is gathered:
+     * - output_format=binary: the nodes write their values collectively (MPI-IO) into
+     *   <tag>.eqbin, in the global order, giving the same file as the serial backend.
+     * - output_format=text: node r writes <tag>-<count>.<r>.output with the values of its
+     *   entities, and once <tag>.<r>.index with their global indices, for merging
+     *   (see examples/simulators/mergeEquelleOutput.m).
+     * Otherwise the collection is gathered to rank 0, which prints it.
+     * Without a domain, a collection is taken to be on all cells or all faces by its size.
+     */
+    void output( const String& tag, const CollOfScalar& vals );
+    void output( const String& tag, const CollOfScalar& vals, const CollOfCell& domain );
+    void output( const String& tag, const CollOfScalar& vals, const CollOfFace& domain );
+    ///@}
+
+    ///@{ Solver functions
+
+    /**
+     * @brief newtonSolve Distributed Newton solve for an unknown on all cells.
+     *
+     * The unknowns of the ghost cells are kept equal to those of their owners, and the
+     * global Jacobian is formed by the rows of the owned cells on every node. The linear
+     * systems are solved with DistributedKrylovSolver, and the convergence criteria
+     * (abs_res_tol, rel_res_tol and max_res_tol, as for EquelleRuntimeCPU) are evaluated
+     * on the global residual norms. Inexact Newton and line search are not supported.
+     */
+    template <class ResidualFunctor>
+    CollOfScalar newtonSolve( const ResidualFunctor& rescomp, const CollOfScalar& u_initialguess );
+
+    template <int Num>
+    std::array<CollOfScalar, Num> newtonSolveSystem( const std::array<typename ResCompType<Num>::type, Num>& rescomp,
+                                                     const std::array<CollOfScalar, Num>& u_initialguess );
+    ///@}
 
     ///@{ Communication between nodes
 
     /**
      * @brief allGather Assembles a distributed collection of scalar to all nodes
-     * @param coll
+     * @param coll A collection on all cells or all faces. Only the values of owned entities are sent.
+     * @param domain The domain of coll, allCells() or allFaces(). Without it, the domain is
+     *               taken from the size of coll.
      * @todo So far only the constant (value) part of an CollOfScalar is returned.
      * @return
      */
     CollOfScalar allGather( const CollOfScalar& coll );
+    CollOfScalar allGather( const CollOfScalar& coll, const CollOfCell& domain );
+    CollOfScalar allGather( const CollOfScalar& coll, const CollOfFace& domain );
+
+    /**
+     * @brief haloExchange Sets the values on the ghost cells to those of the owning nodes.
+     * @param coll A collection on all local cells.
+     * @note Only the values can be exchanged. A collection with derivatives is returned as it
+     *       is, after checking that its ghost values already agree with the owners' (throws
+     *       std::logic_error otherwise).
+     * @return
+     */
+    CollOfScalar haloExchange( const CollOfScalar& coll ) const;
 
     ///@}
 
@@ -91,13 +262,104 @@ public:
      *  with the name runtimempi-<rank>.log. This fstream is set up in the constructor.
      */
     std::ofstream logstream;
+
+    /**
+     *  @brief trace records the time of the runtime calls and the communication of this node.
+     *
+     *  With the parameter trace=true, the events are written to runtimempi-<rank>.trace.json
+     *  (Chrome trace format), and at the end of the run a summary over all nodes, with the
+     *  load imbalance of each event, is written to runtimempi-trace-summary.txt. Simulators
+     *  may add their own regions, such as the time steps.
+     */
+    mutable Trace trace;
 private:
     std::unique_ptr<Zoltan> zoltan;
     std::unique_ptr<equelle::EquelleRuntimeCPU> runtime;
+    std::unique_ptr<equelle::HaloExchange> halo; //! Built by decompose.
+    std::unique_ptr<equelle::DistributedKrylovSolver> linsolver; //! Built by decompose.
     Opm::parameter::ParameterGroup param_;
 
+    bool scatter_grid_; //! True if only rank 0 reads the grid.
+    String partition_file_; //! The prefix of a precomputed partition, or empty.
+    int global_number_of_cells_; //! Set by decompose.
+    int global_number_of_faces_; //! Set by decompose.
+
+    /// The local entities owned by this node, sorted by global index. Set by decompose.
+    struct OwnedEntities {
+        std::vector<int> local;
+        std::vector<int> global;
+        int global_count;
+    };
+    OwnedEntities owned_cells_;
+    OwnedEntities owned_faces_;
+    std::map<String, int> outputcount_;
+
+    // Newton solver parameters.
+    int verbose_;
+    int max_iter_;
+    double abs_res_tol_;
+    double rel_res_tol_;
+    double max_res_tol_;
+    bool throw_on_newton_failure_;
+
+    bool newtonConverged( const Scalar norm, const Scalar max_norm, const Scalar initial_norm ) const;
+    void newtonFailure( const int iter, const Scalar norm ) const;
+    /// Norms of a number of residuals on all cells, over the owned cells of all nodes.
+    Scalar twoNorm( const CollOfScalar* residual, const int num ) const;
+    Scalar maxNorm( const CollOfScalar* residual, const int num ) const;
+    /// Solves the Newton system for a number of residuals, and returns the update of each
+    /// unknown on all cells, with the ghost values exchanged.
+    void solveForUpdate( const CollOfScalar* residual, const int num, CollOfScalar::V* du );
+
+    /// The owned entities of a collection on all cells or all faces, chosen by its size, or null
+    /// for other sizes. Only for the overloads without a domain.
+    const OwnedEntities* ownedEntities( const CollOfScalar& coll ) const;
+    /// The owned entities of a collection on domain, throws unless domain is all cells (all faces).
+    const OwnedEntities& ownedEntities( const CollOfScalar& coll, const CollOfCell& domain ) const;
+    const OwnedEntities& ownedEntities( const CollOfScalar& coll, const CollOfFace& domain ) const;
+    /// The owned cells, throws unless residual is on all cells.
+    const std::vector<int>& residualIndices( const CollOfScalar& residual ) const;
+    /// The owned elements of a collection on all cells or all faces, throws for other collections.
+    const std::vector<int>& reductionIndices( const CollOfScalar& coll ) const;
+    /// The positions in a collection on domain of the entities owned by this node.
+    std::vector<int> ownedPositions( const CollOfScalar& coll, const CollOfCell& domain ) const;
+    std::vector<int> ownedPositions( const CollOfScalar& coll, const CollOfFace& domain ) const;
+    /// Reduces the given elements of x on each node, then over all nodes with op
+    /// (MPI_MIN, MPI_MAX, MPI_SUM or MPI_PROD).
+    Scalar reduce( const CollOfScalar& x, const std::vector<int>& indices, MPI_Op op ) const;
+    Scalar allReduce( const Scalar local, MPI_Op op ) const;
+    CollOfScalar gather( const CollOfScalar& coll, const OwnedEntities* owned, const bool to_all );
+    void output( const String& tag, const CollOfScalar& vals, const OwnedEntities* owned );
+    void writeBinary( const String& filename, const bool append,
+                      const OwnedEntities& owned, const CollOfScalar& vals ) const;
+
     void initializeZoltan();
+    /// Build the runtime, halo exchange and solver of the subGrid. The halo exchange plan is
+    /// computed collectively unless given.
+    void initializeSubGrid( const HaloExchange::Plan* halo_plan = nullptr );
+    zoltanReturns partition( ZoltanGrid& zgrid );
+    std::vector<float> readCellWeights( const String& filename ) const;
+    void initializeNewton();
     void initializeGrid();
+    SubGrid scatterSubGrids( const zoltanReturns& zr );
+
+    CollOfScalar splitPhaseGradient( const CollOfScalar& cell_scalarfield, const double sign ) const;
+    /// Throws if the local values of the ghost cells differ from the exchanged ones.
+    void requireConsistentGhosts( const CollOfScalar::V& local, const CollOfScalar::V& exchanged,
+                                  const std::vector<int>& ghost_cells, const char* op ) const;
+    void requireConsistentGhost( const CollOfScalar::V& local, const CollOfScalar::V& exchanged,
+                                 const int cell, const double tol, const char* op ) const;
+    /// The largest difference between a local and an exchanged value that is taken as rounding.
+    static double ghostTolerance( const CollOfScalar::V& local );
+
+    /// An interior face with a ghost cell on either side, at the given position in interiorFaces().
+    struct BoundaryLayerFace {
+        int position;
+        int first;
+        int second;
+    };
+    std::vector<BoundaryLayerFace> boundary_layer_faces_; //! Built by decompose.
+    std::vector<int> ghost_cells_; //! The local indices of the ghost cells. Built by decompose.
 };
 
 } // namespace equelle
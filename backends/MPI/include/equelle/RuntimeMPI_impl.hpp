@@ -1,6 +1,108 @@
 #pragma once
 
+#include <cmath>
+#include <iostream>
+
+#include "equelle/EquelleRuntimeCPU.hpp"
+
 namespace equelle {
 
+template <class EntityCollection>
+CollOfScalar RuntimeMPI::operatorExtend( const Scalar data, const EntityCollection& to_set )
+{
+    return runtime->operatorExtend( data, to_set );
+}
+
+
+template <class SomeCollection, class EntityCollection>
+SomeCollection RuntimeMPI::operatorExtend( const SomeCollection& data, const EntityCollection& from_set,
+                                           const EntityCollection& to_set )
+{
+    return runtime->operatorExtend( data, from_set, to_set );
+}
+
+
+template <class SomeCollection, class EntityCollection>
+typename CollType<SomeCollection>::Type
+RuntimeMPI::operatorOn( const SomeCollection& data, const EntityCollection& from_set, const EntityCollection& to_set )
+{
+    // Only scalars are exchanged (by the non-template overloads). Other collections
+    // are restricted from their local values.
+    return runtime->operatorOn( data, from_set, to_set );
+}
+
+
+template <class SomeCollection1, class SomeCollection2>
+typename CollType<SomeCollection1>::Type
+RuntimeMPI::trinaryIf( const CollOfBool& predicate, const SomeCollection1& iftrue, const SomeCollection2& iffalse ) const
+{
+    return runtime->trinaryIf( predicate, iftrue, iffalse );
+}
+
+
+template <class ResidualFunctor>
+CollOfScalar RuntimeMPI::newtonSolve( const ResidualFunctor& rescomp, const CollOfScalar& u_initialguess )
+{
+    const std::array<typename ResCompType<1>::type, 1> rescomp_system = {{ rescomp }};
+    const std::array<CollOfScalar, 1> u_system = {{ u_initialguess }};
+    return newtonSolveSystem<1>( rescomp_system, u_system )[0];
+}
+
+
+template <int Num>
+std::array<CollOfScalar, Num> RuntimeMPI::newtonSolveSystem( const std::array<typename ResCompType<Num>::type, Num>& rescomp,
+                                                             const std::array<CollOfScalar, Num>& u_initialguess )
+{
+    Trace::Region region( trace, "newton" );
+    const double startTime = MPI_Wtime();
+    const bool root = getMPIRank() == 0;
+
+    // Every local cell, owned or ghost, has its own unknown. The Jacobian columns of the
+    // ghost cells are what couples the nodes in the linear solver.
+    const std::vector<int> block_pattern( Num, subGrid.c_grid->number_of_cells );
+    std::array<CollOfScalar, Num> u;
+    for( int i = 0; i < Num; ++i ) {
+        u[i] = CollOfScalar::variable( i, haloExchange( CollOfScalar( u_initialguess[i].value() ) ).value(), block_pattern );
+    }
+    std::array<CollOfScalar, Num> residual = evaluateSystem( rescomp, u );
+
+    int iter = 0;
+    Scalar norm = twoNorm( residual.data(), Num );
+    const Scalar initial_norm = norm;
+    if ( verbose_ > 1 && root ) {
+        std::cout << "    newtonSolve: iter = " << iter << " (max = " << max_iter_
+                  << "), norm(residual) = " << norm << " (tol = " << abs_res_tol_ << ")" << std::endl;
+    }
+
+    bool converged = newtonConverged( norm, maxNorm( residual.data(), Num ), initial_norm );
+    std::array<CollOfScalar::V, Num> du;
+    while ( !converged && iter < max_iter_ && std::isfinite( norm ) ) {
+        solveForUpdate( residual.data(), Num, du.data() );
+        for( int i = 0; i < Num; ++i ) {
+            u[i] = CollOfScalar::variable( i, u[i].value() - du[i], block_pattern );
+        }
+        residual = evaluateSystem( rescomp, u );
+        norm = twoNorm( residual.data(), Num );
+        ++iter;
+        converged = newtonConverged( norm, maxNorm( residual.data(), Num ), initial_norm );
+
+        if ( verbose_ > 1 && root ) {
+            std::cout << "    newtonSolve: iter = " << iter << " (max = " << max_iter_
+                      << "), norm(residual) = " << norm << " (tol = " << abs_res_tol_ << ")" << std::endl;
+        }
+    }
+    if ( !converged ) {
+        newtonFailure( iter, norm );
+    } else if ( verbose_ > 0 && root ) {
+        std::cout << "Newton solver converged in " << iter << " iterations" << std::endl;
+    }
+    logstream << "Newton solver used " << iter << " iterations and " << MPI_Wtime() - startTime << " seconds" << std::endl;
+
+    std::array<CollOfScalar, Num> result;
+    for( int i = 0; i < Num; ++i ) {
+        result[i] = CollOfScalar( u[i].value() );
+    }
+    return result;
+}
 
 } // namespace equelle
@@ -1,8 +1,7 @@
 #pragma once
 
 #include <vector>
-#include <unordered_map>
-#include <set>
+#include <utility>
 
 #include "equelle/equelleTypes.hpp"
 
@@ -11,6 +10,32 @@ class UnstructuredGrid;
 
 namespace equelle {
 
+/** IndexMap maps global indices to local indices. It is a flat array of (global, local) pairs
+ *  sorted by the global index, so a lookup is a binary search without any hashing.
+ */
+class IndexMap {
+public:
+    typedef std::pair<int, int> value_type;
+    typedef std::vector<value_type>::const_iterator const_iterator;
+
+    IndexMap() {}
+    /// The inverse of local_to_global, which must not contain duplicates.
+    explicit IndexMap( const std::vector<int>& local_to_global );
+
+    /// The entry of a global index, or end() if it is not mapped.
+    const_iterator find( const int global ) const;
+    /// The local index of a global index, or -1 if it is not mapped.
+    int local( const int global ) const;
+
+    const_iterator begin() const { return entries_.begin(); }
+    const_iterator end() const { return entries_.end(); }
+    int size() const { return entries_.size(); }
+    bool empty() const { return entries_.empty(); }
+
+private:
+    std::vector<value_type> entries_;
+};
+
 /** UnstructuredSubGrid is as an augmented Opm::UnstructuredGrid */
 struct SubGrid {
     UnstructuredGrid *c_grid; //! Pointer to data for the subGrid with "local"-indexing. Owned by this class.
@@ -20,12 +45,17 @@ struct SubGrid {
     std::vector<int> cell_local_to_global; //! Maps local cell indices to global cell indices. The ghost cells are the
                                   //! last cells in this range.
 
-    std::unordered_map<int, int> cell_global_to_local; //! Maps global cell indices to local cell indices.
-                                                       //! This is the inverse of global_cell
+    IndexMap cell_global_to_local; //! Maps global cell indices to local cell indices.
+                                   //! This is the inverse of global_cell
 
     std::vector<int> face_local_to_global; //! Maps local face indices to global face indices.
-    std::unordered_map<int, int> face_global_to_local; //! Maps global face indices to local face indices.
-                                                       //! This is the inverse of global_face.
+    IndexMap face_global_to_local; //! Maps global face indices to local face indices.
+                                   //! This is the inverse of global_face.
+
+    std::vector<int> interior_cells; //! Owned cells with no ghost neighbours. Their neighbourhood is
+                                     //! complete without a halo exchange.
+    std::vector<int> partition_boundary_cells; //! Owned cells with at least one ghost neighbour.
+
     CollOfCell map_to_global( const CollOfCell& local_collection );
     CollOfFace map_to_global( const CollOfFace& local_collection );
 
@@ -50,6 +80,20 @@ public:
      */
     static SubGrid build( const UnstructuredGrid* globalGrid, const std::vector<int>& cellsToExtract );
 
+    /**
+     * @brief pack flattens a SubGrid into arrays that can be sent to another node.
+     * @param subGrid
+     * @param ints Filled with the sizes, topology and index mappings.
+     * @param doubles Filled with the geometry.
+     */
+    static void pack( const SubGrid& subGrid, std::vector<int>& ints, std::vector<double>& doubles );
+
+    /**
+     * @brief unpack rebuilds a SubGrid from the arrays written by pack.
+     * @return A new SubGrid, equal to the packed one.
+     */
+    static SubGrid unpack( const std::vector<int>& ints, const std::vector<double>& doubles );
+
 
 private:
     SubGridBuilder();
@@ -61,8 +105,7 @@ private:
     struct face_mapping {
         std::vector<int> cell_facepos; //! Mirrors UnstructuredGrid::cell_facepos.
         std::vector<int> cell_faces;   //! Mirrors UnstructuredGrid::cell_faces.
-        std::vector<int> global_face;  //! The global face index of each face in the subgrid.
-        std::unordered_map<int, int> face_global_to_local; //! The inverse of global_face.
+        std::vector<int> global_face;  //! The global face index of each face in the subgrid, sorted.
     };
 
     /**
@@ -71,15 +114,18 @@ private:
     struct node_mapping {
         std::vector<int> face_nodepos; //! Mirrors UnstructuredGrid::face_nodepos;
         std::vector<int> face_nodes;   //! Mirrors UnstructuredGrid::face_nodes;
-        std::vector<int> global_node;  //! The global node index of each node in the subgrid.
-        std::unordered_map<int, int> node_global_to_local; //! The inverse of global_node.
+        std::vector<int> global_node;  //! The global node index of each node in the subgrid, sorted.
     };
 
-    static std::set<int> extractNeighborCells(const UnstructuredGrid *grid, const std::vector<int>& cellsToExtract);
+    /** Return the cells next to cellsToExtract that are not in it, sorted. */
+    static std::vector<int> extractNeighborCells(const UnstructuredGrid *grid, const std::vector<int>& cellsToExtract);
     static face_mapping extractNeighborFaces(const UnstructuredGrid *grid, const std::vector<int>& cellsToExtract);
     static node_mapping extractNeighborNodes(const UnstructuredGrid *grid, const std::vector<int>& globalFaces);
 
     static void build_face_cells( const face_mapping& participatingFaces, SubGrid& subGrid, const UnstructuredGrid* grid );
+
+    /** Fill SubGrid::interior_cells and SubGrid::partition_boundary_cells. */
+    static void classify_cells( SubGrid& subGrid );
 };
 
 struct GridQuerying {
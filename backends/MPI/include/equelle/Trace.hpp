@@ -0,0 +1,80 @@
+#pragma once
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <mpi.h>
+
+namespace equelle {
+
+/** Trace records where the time of a node goes: the runtime calls, and the messages, bytes
+ *  and waiting of its MPI operations.
+ *
+ *  When opened, every event is written to a file in the Chrome trace event format, one event
+ *  per line, so it can be loaded in chrome://tracing or Perfetto, or read line by line. The
+ *  time stamps are in microseconds from the (collective) call to open. The totals for each
+ *  event name are kept, and summarize reduces them over all nodes at the end of a run.
+ *
+ *  A closed trace records nothing, and a Region then costs a single test.
+ */
+class Trace {
+public:
+    enum Category { compute, communication, wait };
+
+    Trace();
+    ~Trace();
+
+    /// Start recording, writing the events to filename. Collective over comm.
+    void open( const std::string& filename, MPI_Comm comm = MPI_COMM_WORLD );
+    bool enabled() const { return enabled_; }
+
+    /** Region records an event from its construction to its destruction. */
+    class Region {
+    public:
+        Region( Trace& trace, const char* name, const Category category = compute );
+        ~Region();
+        /// Account for messages sent or received in the region.
+        void addMessages( const int messages, const long long bytes );
+    private:
+        Trace& trace_;
+        const char* name_;
+        Category category_;
+        double start_;
+        int messages_;
+        long long bytes_;
+    };
+
+    /// Record an event, with start and end given by MPI_Wtime.
+    void record( const char* name, const Category category, const double start, const double end,
+                 const int messages = 0, const long long bytes = 0 );
+
+    /// Set a per-node quantity for the summary, such as the number of owned cells.
+    void setCounter( const std::string& name, const double value );
+
+    /**
+     * @brief summarize Reduce the totals of all nodes, and write a table on rank 0. Collective.
+     *
+     * For each event name it gives the number of calls, the time per node (minimum, mean and
+     * maximum, and the imbalance max/mean), and the messages and bytes summed over the nodes.
+     * The counters are given by their minimum, mean and maximum.
+     */
+    void summarize( std::ostream& out, MPI_Comm comm = MPI_COMM_WORLD ) const;
+
+private:
+    struct Totals {
+        Category category;
+        long long calls;
+        double time;
+        long long messages;
+        long long bytes;
+    };
+
+    bool enabled_;
+    double start_time_;
+    int rank_;
+    std::ofstream file_;
+    std::map<std::string, Totals> totals_;
+    std::map<std::string, double> counters_;
+};
+
+} // namespace equelle
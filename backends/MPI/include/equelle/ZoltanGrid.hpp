@@ -4,6 +4,12 @@
 #include <zoltan_cpp.h>
 #pragma GCC diagnostic pop
 
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+struct UnstructuredGrid;
+
 namespace equelle {
 
 /**
@@ -20,13 +26,36 @@ struct zoltanReturns {
 /**
  * ZoltanGrid is a wrapper for Opm::UnstructuredGrid that provides the neccessarry function
  *  that is required by the Zoltan-domain decomposition library to use perform graph-partitioning
- *  on Opm::UnstructuredGrid.
+ *  or geometric partitioning on Opm::UnstructuredGrid.
  *
  *  The intended usage is for the static-functions to be registered as callbacks to Zoltan
- *  and an Opm::UnstructuredGrid (passed via void*) is accepted as the first argument.
+ *  and a ZoltanGrid (passed via void*) is accepted as the first argument.
+ *
+ *  Each node presents the cells it owns: all cells of the grid for the initial partitioning
+ *  from rank 0, or its part of the current partition when repartitioning. The global id of
+ *  a cell is its index in the grid, and the local id is its position among the presented cells.
+ *  Cells are weighted by their compute cost, and edges (the faces between two cells) by the
+ *  chosen EdgeWeights, so weights are always supplied to Zoltan (OBJ_WEIGHT_DIM=EDGE_WEIGHT_DIM=1).
  */
 class ZoltanGrid {
 public:
+    enum EdgeWeights { unit_weights, face_area, transmissibility };
+
+    /**
+     * @param grid The global grid.
+     * @param edge_weights The weight of the edge between two cells. The transmissibility is the
+     *        two-point transmissibility of the face for a unit permeability.
+     * @param owner The node owning each cell of the grid. If empty, this node presents all cells.
+     */
+    ZoltanGrid( const UnstructuredGrid* grid, const EdgeWeights edge_weights = unit_weights,
+                const std::vector<int>& owner = std::vector<int>() );
+
+    /// Parse the value of the partition_edge_weights parameter: none, area or transmissibility.
+    static EdgeWeights edgeWeights( const std::string& name );
+
+    /// Set the compute cost of each cell of the grid. Cells have unit weight by default.
+    void setCellWeights( const std::vector<float>& weights );
+
     static int getNumberOfObjects( void* data, int *ierr );
 
     static void getCellList( void *data, int sizeGID, int sizeLID,
@@ -42,8 +71,26 @@ public:
                                   int* num_edges, ZOLTAN_ID_PTR nbor_global_id,
                                   int *nbor_procs, int wgt_dim, float *ewgts, int *ierr);
 
+    /** The cell centroids, for the geometric methods (RCB, RIB and HSFC). */
+    static int getNumberOfGeometries( void* data, int* ierr );
+
+    static void getGeometryMulti( void* data, int num_gid_entries, int num_lid_entries, int num_obj,
+                                  ZOLTAN_ID_PTR global_ids, ZOLTAN_ID_PTR local_ids,
+                                  int num_dim, double* geom_vec, int* ierr );
+
     /** Debug function to dump exports to a stream. */
     static void dumpRank0Exports( const int numCells, const zoltanReturns&, std::ostream& out );    
+
+private:
+    const UnstructuredGrid* grid_;
+    std::vector<int> owner_;
+    std::vector<int> cells_;         //! The presented cells, in the order of their local ids.
+    std::vector<float> cell_weights_; //! Weight of each cell of the grid, or empty for unit weights.
+
+    // The neighbours of each presented cell, in compressed rows, with the weight of each edge.
+    std::vector<int> nbor_start_;
+    std::vector<int> nbor_;
+    std::vector<float> nbor_weight_;
 };
 
 
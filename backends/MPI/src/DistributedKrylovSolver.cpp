@@ -0,0 +1,184 @@
+#include "equelle/DistributedKrylovSolver.hpp"
+
+#include <opm/core/utility/ErrorMacros.hpp>
+#include <opm/core/utility/StopWatch.hpp>
+#include <cmath>
+#include <mpi.h>
+
+#include "equelle/equelleTypes.hpp"
+#include "equelle/mpiutils.hpp"
+
+namespace equelle {
+
+namespace {
+
+Trace no_trace;
+
+} // anonymous namespace
+
+DistributedKrylovSolver::DistributedKrylovSolver( const Opm::parameter::ParameterGroup& param, HaloExchange& halo,
+                                                  const int num_local_cells, const int num_owned_cells )
+    : halo_( halo ),
+      num_local_cells_( num_local_cells ),
+      num_owned_cells_( num_owned_cells ),
+      tolerance_( param.getDefault( "linear_solver_tol", 1e-8 ) ),
+      max_iter_( param.getDefault( "linear_solver_max_iter", 1000 ) ),
+      preconditioner_type_( KrylovSolver::preconditionerType( param.getDefault<std::string>( "preconditioner", "ilu0" ) ) ),
+      num_threads_( param.getDefault( "num_threads", 1 ) ),
+      trace_( &no_trace )
+{
+}
+
+KrylovSolver::Report DistributedKrylovSolver::solve( const RowMatrix& A, const int num_fields, const double* rhs,
+                                                     double* x, const double tolerance )
+{
+    if ( A.rows() != num_fields*num_owned_cells_ || A.cols() != num_fields*num_local_cells_ || !A.isCompressed() ) {
+        OPM_THROW( std::logic_error, "DistributedKrylovSolver: expected a compressed " << num_fields*num_owned_cells_
+                   << " x " << num_fields*num_local_cells_ << " matrix, got " << A.rows() << " x " << A.cols() );
+    }
+    const double tol = tolerance > 0.0 ? tolerance : tolerance_;
+    KrylovSolver::Report report;
+    report.reused_preconditioner = false;
+    Opm::time::StopWatch clock;
+    clock.start();
+
+    setupPreconditioner( A, num_fields, report );
+    report.setup_time = clock.secsSinceLast();
+
+    report.iterations = solveBiCGStab( A, num_fields, rhs, tol, x, report.residual );
+    report.converged = report.residual <= tol;
+    report.solve_time = clock.secsSinceLast();
+    return report;
+}
+
+std::string DistributedKrylovSolver::name() const
+{
+    const char* precond_names[] = { "none", "jacobi", "ilu0" };
+    return std::string( "bicgstab+" ) + precond_names[preconditioner_type_] + " (block-Jacobi)";
+}
+
+void DistributedKrylovSolver::setupPreconditioner( const RowMatrix& A, const int num_fields,
+                                                   KrylovSolver::Report& report )
+{
+    // Extract the block of owned unknowns. Owned cells come first in each field, so
+    // the order of the columns within a row is kept.
+    const int n = num_fields*num_owned_cells_;
+    std::vector<int> start( 1, 0 );
+    std::vector<int> index;
+    start.reserve( n + 1 );
+    index.reserve( A.nonZeros() );
+    block_values_.clear();
+    for( int row = 0; row < n; ++row ) {
+        for( RowMatrix::InnerIterator it( A, row ); it; ++it ) {
+            const int field = it.col() / num_local_cells_;
+            const int cell = it.col() % num_local_cells_;
+            if ( cell < num_owned_cells_ ) {
+                index.push_back( field*num_owned_cells_ + cell );
+                block_values_.push_back( it.value() );
+            }
+        }
+        start.push_back( index.size() );
+    }
+
+    report.reused_pattern = preconditioner_ && start == block_start_ && index == block_index_;
+    if ( !report.reused_pattern ) {
+        block_start_.swap( start );
+        block_index_.swap( index );
+        preconditioner_ = KrylovSolver::makePreconditioner( preconditioner_type_, 1, num_threads_ );
+        preconditioner_->analyze( SparseMatrixView{ n, block_start_.data(), block_index_.data(), nullptr, false, 1 } );
+    }
+    preconditioner_->factor( SparseMatrixView{ n, block_start_.data(), block_index_.data(), block_values_.data(), false, 1 } );
+}
+
+void DistributedKrylovSolver::multiply( const RowMatrix& A, const int num_fields, const double* x, double* y )
+{
+    // Spread the owned values to the local numbering and fetch the ghost values.
+    ext_.resize( num_fields*num_local_cells_ );
+    for( int f = 0; f < num_fields; ++f ) {
+        double* field = ext_.data() + f*num_local_cells_;
+        std::copy_n( x + f*num_owned_cells_, num_owned_cells_, field );
+        halo_.exchange( field );
+    }
+
+    const int n = A.rows();
+    const int* outer = A.outerIndexPtr();
+    const int* inner = A.innerIndexPtr();
+    const double* values = A.valuePtr();
+#pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && n > min_parallel_size)
+    for( int i = 0; i < n; ++i ) {
+        double sum = 0.0;
+        for( int p = outer[i]; p < outer[i+1]; ++p ) {
+            sum += values[p] * ext_[inner[p]];
+        }
+        y[i] = sum;
+    }
+}
+
+double DistributedKrylovSolver::dot( const Vec& a, const Vec& b ) const
+{
+    double local = 0.0;
+    for( int i = 0; i < int(a.size()); ++i ) {
+        local += a[i] * b[i];
+    }
+    double global;
+    Trace::Region region( *trace_, "krylov_dot", Trace::wait );
+    MPI_SAFE_CALL( MPI_Allreduce( &local, &global, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD ) );
+    return global;
+}
+
+int DistributedKrylovSolver::solveBiCGStab( const RowMatrix& A, const int num_fields, const double* rhs,
+                                            const double tolerance, double* x, double& residual )
+{
+    // The same iteration as KrylovSolver::solveBiCGStab, with global dot products.
+    const int n = A.rows();
+    std::fill( x, x + n, 0.0 );
+    Vec r( rhs, rhs + n );
+    const double bnorm = std::sqrt( dot( r, r ) );
+    residual = 0.0;
+    if ( bnorm == 0.0 ) {
+        return 0;
+    }
+    const Vec rhat = r;
+    Vec p( n, 0.0 ), v( n, 0.0 ), phat( n ), s( n ), shat( n ), t( n );
+    double rho = 1.0, alpha = 1.0, omega = 1.0;
+    residual = 1.0;
+    int iter = 0;
+    while ( iter < max_iter_ && residual > tolerance ) {
+        ++iter;
+        const double rho_new = dot( rhat, r );
+        if ( rho_new == 0.0 ) {
+            break;
+        }
+        const double beta = ( rho_new / rho ) * ( alpha / omega );
+        for( int i = 0; i < n; ++i ) {
+            p[i] = r[i] + beta * ( p[i] - omega * v[i] );
+        }
+        preconditioner_->apply( p.data(), phat.data() );
+        multiply( A, num_fields, phat.data(), v.data() );
+        alpha = rho_new / dot( rhat, v );
+        for( int i = 0; i < n; ++i ) {
+            s[i] = r[i] - alpha * v[i];
+            x[i] += alpha * phat[i];
+        }
+        residual = std::sqrt( dot( s, s ) ) / bnorm;
+        if ( residual <= tolerance ) {
+            break;
+        }
+        preconditioner_->apply( s.data(), shat.data() );
+        multiply( A, num_fields, shat.data(), t.data() );
+        const double tt = dot( t, t );
+        omega = tt == 0.0 ? 0.0 : dot( t, s ) / tt;
+        for( int i = 0; i < n; ++i ) {
+            x[i] += omega * shat[i];
+            r[i] = s[i] - omega * t[i];
+        }
+        residual = std::sqrt( dot( r, r ) ) / bnorm;
+        rho = rho_new;
+        if ( omega == 0.0 ) {
+            break;
+        }
+    }
+    return iter;
+}
+
+} // namespace equelle
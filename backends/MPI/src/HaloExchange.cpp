@@ -0,0 +1,225 @@
+#include "equelle/HaloExchange.hpp"
+
+#include <opm/core/grid.h>
+#include <opm/core/utility/ErrorMacros.hpp>
+#include <algorithm>
+#include <utility>
+#include <stdexcept>
+
+#include "equelle/mpiutils.hpp"
+
+namespace equelle {
+
+namespace {
+
+const int halo_tag = 17;
+
+Trace no_trace;
+
+/// Send lists[r] to rank r, and return the lists received from each rank.
+std::vector<std::vector<int>> allToAll( const std::vector<std::vector<int>>& lists, MPI_Comm comm )
+{
+    const int size = lists.size();
+    std::vector<int> sendcounts( size ), recvcounts( size );
+    std::vector<int> sdispls( size + 1 ), rdispls( size + 1 );
+    for( int r = 0; r < size; ++r ) {
+        sendcounts[r] = lists[r].size();
+        sdispls[r+1] = sdispls[r] + sendcounts[r];
+    }
+    MPI_SAFE_CALL( MPI_Alltoall( sendcounts.data(), 1, MPI_INT, recvcounts.data(), 1, MPI_INT, comm ) );
+    for( int r = 0; r < size; ++r ) {
+        rdispls[r+1] = rdispls[r] + recvcounts[r];
+    }
+
+    std::vector<int> sendbuf( sdispls.back() );
+    for( int r = 0; r < size; ++r ) {
+        std::copy( lists[r].begin(), lists[r].end(), sendbuf.begin() + sdispls[r] );
+    }
+    // Avoid handing MPI a null pointer for an empty buffer.
+    std::vector<int> recvbuf( rdispls.back() + 1 );
+    sendbuf.push_back( 0 );
+    MPI_SAFE_CALL( MPI_Alltoallv( sendbuf.data(), sendcounts.data(), sdispls.data(), MPI_INT,
+                                  recvbuf.data(), recvcounts.data(), rdispls.data(), MPI_INT, comm ) );
+
+    std::vector<std::vector<int>> received( size );
+    for( int r = 0; r < size; ++r ) {
+        received[r].assign( recvbuf.begin() + rdispls[r], recvbuf.begin() + rdispls[r+1] );
+    }
+    return received;
+}
+
+} // anonymous namespace
+
+
+HaloExchange::HaloExchange( const SubGrid& subGrid, MPI_Comm comm )
+    : comm_( comm ),
+      in_progress_( false ),
+      trace_( &no_trace )
+{
+    int rank, size;
+    MPI_SAFE_CALL( MPI_Comm_rank( comm, &rank ) );
+    MPI_SAFE_CALL( MPI_Comm_size( comm, &size ) );
+
+    const int num_cells = subGrid.c_grid->number_of_cells;
+    const int num_owned = num_cells - subGrid.number_of_ghost_cells;
+    const std::vector<int>& local_to_global = subGrid.cell_local_to_global;
+
+    // Register our owned cells in the directory.
+    std::vector<std::vector<int>> lists( size );
+    for( int i = 0; i < num_owned; ++i ) {
+        lists[local_to_global[i] % size].push_back( local_to_global[i] );
+    }
+    std::vector<std::vector<int>> registered = allToAll( lists, comm );
+    std::vector<std::pair<int, int>> owner_of; // (cell, owner), sorted by cell.
+    for( int r = 0; r < size; ++r ) {
+        for( int cell : registered[r] ) {
+            owner_of.emplace_back( cell, r );
+        }
+    }
+    std::sort( owner_of.begin(), owner_of.end() );
+
+    // Ask the directory for the owners of our ghost cells.
+    for( auto& l : lists ) {
+        l.clear();
+    }
+    for( int i = num_owned; i < num_cells; ++i ) {
+        lists[local_to_global[i] % size].push_back( local_to_global[i] );
+    }
+    std::vector<std::vector<int>> answers = allToAll( lists, comm );
+    for( auto& a : answers ) {
+        for( int& cell : a ) {
+            auto it = std::lower_bound( owner_of.begin(), owner_of.end(), std::make_pair( cell, -1 ) );
+            if ( it == owner_of.end() || it->first != cell ) {
+                OPM_THROW( std::runtime_error, "Ghost cell " << cell << " is not owned by any rank." );
+            }
+            cell = it->second;
+        }
+    }
+    const std::vector<std::vector<int>> owners = allToAll( answers, comm );
+
+    // Group our ghost cells by owner. The answers come back in the order of the queries.
+    std::vector<std::vector<int>> recv_lists( size );
+    std::vector<int> next( size, 0 );
+    for( auto& l : lists ) {
+        l.clear();
+    }
+    for( int i = num_owned; i < num_cells; ++i ) {
+        const int dir = local_to_global[i] % size;
+        const int owner = owners[dir][next[dir]++];
+        recv_lists[owner].push_back( i );
+        lists[owner].push_back( local_to_global[i] );
+    }
+
+    // Tell the owners which of their cells we need, in the order we will unpack them.
+    const std::vector<std::vector<int>> requested = allToAll( lists, comm );
+
+    plan_.send_start.push_back( 0 );
+    plan_.recv_start.push_back( 0 );
+    for( int r = 0; r < size; ++r ) {
+        if ( requested[r].empty() && recv_lists[r].empty() ) {
+            continue;
+        }
+        if ( r == rank ) {
+            OPM_THROW( std::logic_error, "Rank " << rank << " has a ghost copy of its own cell." );
+        }
+        for( int cell : requested[r] ) {
+            auto it = subGrid.cell_global_to_local.find( cell );
+            if ( it == subGrid.cell_global_to_local.end() || it->second >= num_owned ) {
+                OPM_THROW( std::runtime_error, "Rank " << r << " requested cell " << cell
+                           << ", which is not owned by rank " << rank << "." );
+            }
+            plan_.send_index.push_back( it->second );
+        }
+        plan_.recv_index.insert( plan_.recv_index.end(), recv_lists[r].begin(), recv_lists[r].end() );
+        plan_.neighbour_ranks.push_back( r );
+        plan_.send_start.push_back( plan_.send_index.size() );
+        plan_.recv_start.push_back( plan_.recv_index.size() );
+    }
+
+    allocateBuffers();
+}
+
+HaloExchange::HaloExchange( const Plan& plan, MPI_Comm comm )
+    : comm_( comm ),
+      plan_( plan ),
+      in_progress_( false ),
+      trace_( &no_trace )
+{
+    const int num_neighbours = plan_.neighbour_ranks.size();
+    if ( int(plan_.send_start.size()) != num_neighbours + 1 || int(plan_.recv_start.size()) != num_neighbours + 1
+         || plan_.send_start.back() != int(plan_.send_index.size())
+         || plan_.recv_start.back() != int(plan_.recv_index.size()) ) {
+        OPM_THROW( std::runtime_error, "Inconsistent halo exchange plan." );
+    }
+    allocateBuffers();
+}
+
+void HaloExchange::allocateBuffers()
+{
+    send_buffer_.resize( plan_.send_index.size() );
+    recv_buffer_.resize( plan_.recv_index.size() );
+    requests_.reserve( 2 * plan_.neighbour_ranks.size() );
+}
+
+HaloExchange::~HaloExchange()
+{
+    if ( in_progress_ ) {
+        MPI_Waitall( requests_.size(), requests_.data(), MPI_STATUSES_IGNORE );
+    }
+}
+
+void HaloExchange::begin( const double* values )
+{
+    if ( in_progress_ ) {
+        OPM_THROW( std::logic_error, "A halo exchange is already in progress." );
+    }
+    in_progress_ = true;
+    requests_.clear();
+    Trace::Region region( *trace_, "halo_begin", Trace::communication );
+
+    const int num_neighbours = plan_.neighbour_ranks.size();
+    for( int n = 0; n < num_neighbours; ++n ) {
+        const int count = plan_.recv_start[n+1] - plan_.recv_start[n];
+        if ( count > 0 ) {
+            requests_.emplace_back();
+            MPI_SAFE_CALL( MPI_Irecv( recv_buffer_.data() + plan_.recv_start[n], count, MPI_DOUBLE,
+                                      plan_.neighbour_ranks[n], halo_tag, comm_, &requests_.back() ) );
+        }
+    }
+    for( int i = 0; i < int(plan_.send_index.size()); ++i ) {
+        send_buffer_[i] = values[plan_.send_index[i]];
+    }
+    for( int n = 0; n < num_neighbours; ++n ) {
+        const int count = plan_.send_start[n+1] - plan_.send_start[n];
+        if ( count > 0 ) {
+            requests_.emplace_back();
+            MPI_SAFE_CALL( MPI_Isend( send_buffer_.data() + plan_.send_start[n], count, MPI_DOUBLE,
+                                      plan_.neighbour_ranks[n], halo_tag, comm_, &requests_.back() ) );
+        }
+    }
+    region.addMessages( requests_.size(), sizeof( double ) * ( send_buffer_.size() + recv_buffer_.size() ) );
+}
+
+void HaloExchange::end( double* values )
+{
+    if ( !in_progress_ ) {
+        OPM_THROW( std::logic_error, "No halo exchange is in progress." );
+    }
+    {
+        Trace::Region region( *trace_, "halo_wait", Trace::wait );
+        MPI_SAFE_CALL( MPI_Waitall( requests_.size(), requests_.data(), MPI_STATUSES_IGNORE ) );
+    }
+    in_progress_ = false;
+
+    for( int i = 0; i < int(plan_.recv_index.size()); ++i ) {
+        values[plan_.recv_index[i]] = recv_buffer_[i];
+    }
+}
+
+void HaloExchange::exchange( double* values )
+{
+    begin( values );
+    end( values );
+}
+
+} // namespace equelle
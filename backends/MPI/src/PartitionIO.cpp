@@ -0,0 +1,166 @@
+#include "equelle/PartitionIO.hpp"
+
+#include <opm/core/utility/ErrorMacros.hpp>
+#include <opm/core/grid.h>
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+#include "equelle/BinaryIO.hpp"
+
+namespace equelle {
+
+namespace {
+
+std::string ownerFilename( const std::string& prefix )
+{
+    return prefix + ".owner.eqbin";
+}
+
+std::string pieceFilename( const std::string& prefix, const int rank, const char* part )
+{
+    std::stringstream ss;
+    ss << prefix << "." << rank << "." << part << ".eqbin";
+    return ss.str();
+}
+
+std::vector<int> readRecord( const MappedBinaryFile& file, const int record )
+{
+    const std::int32_t* values = file.ints( record );
+    return std::vector<int>( values, values + file.recordSize( record ) );
+}
+
+} // anonymous namespace
+
+
+std::vector<HaloExchange::Plan> PartitionIO::haloPlans( const UnstructuredGrid* grid,
+                                                        const std::vector<int>& owner, const int num_nodes )
+{
+    // The local index of each cell on its owner, where the owned cells are numbered in increasing order.
+    std::vector<int> num_owned( num_nodes, 0 );
+    std::vector<int> local_in_owner( grid->number_of_cells );
+    for( int cell = 0; cell < grid->number_of_cells; ++cell ) {
+        local_in_owner[cell] = num_owned[ owner[cell] ]++;
+    }
+
+    // The ghost cells of each node are its face neighbours owned by other nodes, numbered
+    // after the owned cells in increasing order, as by SubGridBuilder.
+    std::vector<std::vector<int>> ghosts( num_nodes );
+    for( int face = 0; face < grid->number_of_faces; ++face ) {
+        const int first = grid->face_cells[2*face];
+        const int second = grid->face_cells[2*face + 1];
+        if ( first >= 0 && second >= 0 && owner[first] != owner[second] ) {
+            ghosts[ owner[first] ].push_back( second );
+            ghosts[ owner[second] ].push_back( first );
+        }
+    }
+
+    // A node receives its ghosts from each owner in its own order, and the owner sends them
+    // in the same order.
+    std::vector<std::map<int, std::vector<int>>> recv( num_nodes ), send( num_nodes );
+    for( int r = 0; r < num_nodes; ++r ) {
+        std::vector<int>& g = ghosts[r];
+        std::sort( g.begin(), g.end() );
+        g.erase( std::unique( g.begin(), g.end() ), g.end() );
+        for( int i = 0; i < int(g.size()); ++i ) {
+            const int q = owner[ g[i] ];
+            recv[r][q].push_back( num_owned[r] + i );
+            send[q][r].push_back( local_in_owner[ g[i] ] );
+        }
+    }
+
+    std::vector<HaloExchange::Plan> plans( num_nodes );
+    for( int r = 0; r < num_nodes; ++r ) {
+        HaloExchange::Plan& plan = plans[r];
+        plan.send_start.push_back( 0 );
+        plan.recv_start.push_back( 0 );
+        // Face neighbourship is symmetric, so the nodes we send to are those we receive from.
+        for( const auto& n : recv[r] ) {
+            const std::vector<int>& s = send[r][n.first];
+            plan.neighbour_ranks.push_back( n.first );
+            plan.recv_index.insert( plan.recv_index.end(), n.second.begin(), n.second.end() );
+            plan.send_index.insert( plan.send_index.end(), s.begin(), s.end() );
+            plan.recv_start.push_back( plan.recv_index.size() );
+            plan.send_start.push_back( plan.send_index.size() );
+        }
+    }
+    return plans;
+}
+
+void PartitionIO::write( const std::string& prefix, const UnstructuredGrid* grid,
+                         const std::vector<int>& owner, const int num_nodes )
+{
+    if ( int(owner.size()) != grid->number_of_cells ) {
+        OPM_THROW( std::runtime_error, "PartitionIO: expected an owner for each of the "
+                   << grid->number_of_cells << " cells, got " << owner.size() );
+    }
+    std::vector<std::vector<int>> cells( num_nodes );
+    for( int cell = 0; cell < grid->number_of_cells; ++cell ) {
+        if ( owner[cell] < 0 || owner[cell] >= num_nodes ) {
+            OPM_THROW( std::runtime_error, "PartitionIO: cell " << cell << " has owner " << owner[cell]
+                       << ", expected 0 to " << num_nodes - 1 );
+        }
+        cells[ owner[cell] ].push_back( cell );
+    }
+    const std::vector<HaloExchange::Plan> plans = haloPlans( grid, owner, num_nodes );
+
+    {
+        BinaryWriter out( ownerFilename( prefix ), binaryio::Int32, false );
+        const int counts[3] = { num_nodes, grid->number_of_cells, grid->number_of_faces };
+        out.write( counts, 3 );
+        out.write( owner.data(), owner.size() );
+    }
+
+    std::vector<int> ints;
+    std::vector<double> doubles;
+    for( int rank = 0; rank < num_nodes; ++rank ) {
+        SubGrid piece = SubGridBuilder::build( grid, cells[rank] );
+        SubGridBuilder::pack( piece, ints, doubles );
+        destroy_grid( piece.c_grid );
+
+        const HaloExchange::Plan& plan = plans[rank];
+        BinaryWriter int_out( pieceFilename( prefix, rank, "ints" ), binaryio::Int32, false );
+        int_out.write( ints.data(), ints.size() );
+        int_out.write( plan.neighbour_ranks.data(), plan.neighbour_ranks.size() );
+        int_out.write( plan.send_start.data(), plan.send_start.size() );
+        int_out.write( plan.send_index.data(), plan.send_index.size() );
+        int_out.write( plan.recv_start.data(), plan.recv_start.size() );
+        int_out.write( plan.recv_index.data(), plan.recv_index.size() );
+        BinaryWriter double_out( pieceFilename( prefix, rank, "doubles" ), binaryio::Float64, false );
+        double_out.write( doubles.data(), doubles.size() );
+    }
+}
+
+PartitionIO::Piece PartitionIO::read( const std::string& prefix, const int rank, const int num_nodes )
+{
+    Piece piece;
+    {
+        const MappedBinaryFile owner( ownerFilename( prefix ) );
+        owner.checkSize( 0, 3, "the partition sizes" );
+        const std::int32_t* counts = owner.ints( 0 );
+        if ( counts[0] != num_nodes ) {
+            OPM_THROW( std::runtime_error, "The partition " << prefix << " is for " << counts[0]
+                       << " nodes, but this run has " << num_nodes << "." );
+        }
+        piece.global_number_of_cells = counts[1];
+        piece.global_number_of_faces = counts[2];
+    }
+
+    const MappedBinaryFile ints( pieceFilename( prefix, rank, "ints" ) );
+    const MappedBinaryFile doubles( pieceFilename( prefix, rank, "doubles" ) );
+    if ( ints.numRecords() != 6 || doubles.numRecords() != 1 ) {
+        OPM_THROW( std::runtime_error, "The partition " << prefix << " has an invalid piece for rank " << rank );
+    }
+    piece.plan.neighbour_ranks = readRecord( ints, 1 );
+    piece.plan.send_start = readRecord( ints, 2 );
+    piece.plan.send_index = readRecord( ints, 3 );
+    piece.plan.recv_start = readRecord( ints, 4 );
+    piece.plan.recv_index = readRecord( ints, 5 );
+    const double* geometry = doubles.doubles( 0 );
+    piece.subGrid = SubGridBuilder::unpack( readRecord( ints, 0 ),
+                                            std::vector<double>( geometry, geometry + doubles.recordSize( 0 ) ) );
+    return piece;
+}
+
+} // namespace equelle
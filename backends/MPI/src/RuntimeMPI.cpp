@@ -1,6 +1,12 @@
 #include "equelle/RuntimeMPI.hpp"
 #include <iostream>
 #include <fstream>
+#include <iomanip>
+#include <limits>
+#include <cstring>
+#include <algorithm>
+#include <numeric>
+#include <cctype>
 
 #include <mpi.h>
 
@@ -13,6 +19,7 @@
 #include "equelle/EquelleRuntimeCPU.hpp"
 #include "equelle/mpiutils.hpp"
 #include "equelle/SubGridBuilder.hpp"
+#include "equelle/PartitionIO.hpp"
 
 
 namespace equelle {
@@ -35,11 +42,35 @@ void RuntimeMPI::initializeZoltan()
     ZOLTAN_SAFE_CALL( zoltan->Set_Param( "DEBUG_LEVEL", "2" ) );
 #endif
 
-    // Use hypergraph partitioning
-    ZOLTAN_SAFE_CALL( zoltan->Set_Param( "LB_METHOD", "GRAPH" ) );
-    // Partition everything without concern for cost.
+    // Use graph partitioning by default, or a geometric method on the cell centroids.
+    std::string method = param_.getDefault<std::string>( "partition_method", "graph" );
+    if ( method != "graph" && method != "rcb" && method != "rib" && method != "hsfc" ) {
+        OPM_THROW( std::runtime_error, "Unknown partition_method: " << method << ", expected graph, rcb, rib or hsfc." );
+    }
+    std::transform( method.begin(), method.end(), method.begin(), ::toupper );
+    ZOLTAN_SAFE_CALL( zoltan->Set_Param( "LB_METHOD", method.c_str() ) );
+    // Partition everything without concern for cost. Repartitioning is done by repartition().
     ZOLTAN_SAFE_CALL( zoltan->Set_Param( "LB_APPROACH", "PARTITION" ) );
     ZOLTAN_SAFE_CALL( zoltan->Set_Param( "PHG_EDGE_SIZE_THRESHOLD", "1.0" ) );
+    // The cells and edges are always weighted, see ZoltanGrid.
+    ZOLTAN_SAFE_CALL( zoltan->Set_Param( "OBJ_WEIGHT_DIM", "1" ) );
+    ZOLTAN_SAFE_CALL( zoltan->Set_Param( "EDGE_WEIGHT_DIM", "1" ) );
+    if ( param_.has( "partition_imbalance_tol" ) ) {
+        ZOLTAN_SAFE_CALL( zoltan->Set_Param( "IMBALANCE_TOL", param_.get<std::string>( "partition_imbalance_tol" ).c_str() ) );
+    }
+    if ( param_.has( "repartition_multiplier" ) ) {
+        ZOLTAN_SAFE_CALL( zoltan->Set_Param( "PHG_REPART_MULTIPLIER", param_.get<std::string>( "repartition_multiplier" ).c_str() ) );
+    }
+}
+
+void RuntimeMPI::initializeNewton()
+{
+    verbose_ = param_.getDefault( "verbose", 0 );
+    max_iter_ = param_.getDefault( "max_iter", 10 );
+    abs_res_tol_ = param_.getDefault( "abs_res_tol", 1e-6 );
+    rel_res_tol_ = param_.getDefault( "rel_res_tol", 0.0 );
+    max_res_tol_ = param_.getDefault( "max_res_tol", 0.0 );
+    throw_on_newton_failure_ = param_.getDefault( "throw_on_newton_failure", false );
 }
 
 void RuntimeMPI::initializeGrid()
@@ -48,76 +79,277 @@ void RuntimeMPI::initializeGrid()
 
 }
 
+namespace {
+
+bool scatterGrid( const Opm::parameter::ParameterGroup& param )
+{
+    const std::string mode = param.getDefault<std::string>( "grid_distribution", "replicated" );
+    if ( mode != "replicated" && mode != "scatter" ) {
+        OPM_THROW( std::runtime_error, "Unknown grid_distribution: " << mode );
+    }
+    return mode == "scatter";
+}
+
+} // anonymous namespace
+
 RuntimeMPI::RuntimeMPI()
-    : logstream( logfilename() )
+    : logstream( logfilename() ),
+      scatter_grid_( false ),
+      global_number_of_cells_( 0 ),
+      global_number_of_faces_( 0 )
 {     
     param_.disableOutput();
     initializeZoltan();
+    initializeNewton();
     initializeGrid();
 }
 
 RuntimeMPI::RuntimeMPI(const Opm::parameter::ParameterGroup &param)
     : logstream( logfilename() ),
-      param_( param )
-
+      param_( param ),
+      scatter_grid_( scatterGrid( param ) ),
+      partition_file_( param.getDefault<std::string>( "partition_file", "" ) ),
+      global_number_of_cells_( 0 ),
+      global_number_of_faces_( 0 )
 {
     param_.disableOutput();
     initializeZoltan();
-    globalGrid.reset( equelle::createGridManager( param_ ) );
+    initializeNewton();
+    if ( param_.getDefault( "trace", false ) ) {
+        std::stringstream ss;
+        ss << "runtimempi-" << equelle::getMPIRank() << ".trace.json";
+        trace.open( ss.str() );
+    }
+    // With a precomputed partition, the pieces are read by decompose instead of the grid.
+    if ( partition_file_.empty() && ( !scatter_grid_ || getMPIRank() == 0 ) ) {
+        Trace::Region region( trace, "read_grid" );
+        globalGrid.reset( equelle::createGridManager( param_ ) );
+    }
 
     logstream << "Hello from rank " << equelle::getMPIRank() << std::endl;
 }
 
 RuntimeMPI::~RuntimeMPI()
 {
+    int finalized;
+    MPI_Finalized( &finalized );
+    if ( trace.enabled() && !finalized ) {
+        std::ofstream summary;
+        if ( getMPIRank() == 0 ) {
+            summary.open( "runtimempi-trace-summary.txt" );
+        }
+        trace.summarize( summary );
+    }
     // Zoltan resources must be deleted before we call MPI_Finalize.
     zoltan.release();
 }
 
 void RuntimeMPI::decompose()
 {
+    Trace::Region region( trace, "decompose" );
     auto startTime = MPI_Wtime();
 
+    if ( !partition_file_.empty() ) {
+        PartitionIO::Piece piece;
+        {
+            Trace::Region region( trace, "read_partition" );
+            piece = PartitionIO::read( partition_file_, getMPIRank(), getMPISize() );
+        }
+        global_number_of_cells_ = piece.global_number_of_cells;
+        global_number_of_faces_ = piece.global_number_of_faces;
+        subGrid = piece.subGrid;
+        initializeSubGrid( &piece.plan );
+
+        auto endTime = MPI_Wtime();
+        logstream << "Reading the partition " << partition_file_ << " took " << endTime-startTime << " seconds\n";
+        return;
+    }
+
+    int global_counts[2] = { 0, 0 };
+    if ( globalGrid ) {
+        global_counts[0] = globalGrid->c_grid()->number_of_cells;
+        global_counts[1] = globalGrid->c_grid()->number_of_faces;
+    }
+    if ( scatter_grid_ ) {
+        MPI_SAFE_CALL( MPI_Bcast( global_counts, 2, MPI_INT, 0, MPI_COMM_WORLD ) );
+    }
+    global_number_of_cells_ = global_counts[0];
+    global_number_of_faces_ = global_counts[1];
+
     auto zr = computePartition();
-    std::vector<int> localCells;
 
-    if ( getMPIRank() == 0 ) {
-        // Node 0 must compute which cells not to export.
-        std::set_difference( boost::counting_iterator<int>(0), boost::counting_iterator<int>( globalGrid->c_grid()->number_of_cells ),
-                             zr.exportGlobalGids, zr.exportGlobalGids + zr.numExport, std::back_inserter( localCells ) );
+    if ( scatter_grid_ ) {
+        subGrid = scatterSubGrids( zr );
+        // The grid is distributed, so we no longer need it on rank 0.
+        globalGrid.reset();
     } else {
-        localCells.resize( zr.numImport );
-        std::copy_n( zr.importGlobalGids, zr.numImport, localCells.begin() );
+        std::vector<int> localCells;
+
+        if ( getMPIRank() == 0 ) {
+            // Node 0 must compute which cells not to export.
+            std::set_difference( boost::counting_iterator<int>(0), boost::counting_iterator<int>( globalGrid->c_grid()->number_of_cells ),
+                                 zr.exportGlobalGids, zr.exportGlobalGids + zr.numExport, std::back_inserter( localCells ) );
+        } else {
+            localCells.resize( zr.numImport );
+            std::copy_n( zr.importGlobalGids, zr.numImport, localCells.begin() );
+        }
+
+        subGrid = SubGridBuilder::build( globalGrid->c_grid(), localCells );
     }
 
-    subGrid = SubGridBuilder::build( globalGrid->c_grid(), localCells );
+    initializeSubGrid();
+
+    auto endTime = MPI_Wtime();
+    logstream << "Decomposing took " << endTime-startTime << " seconds\n";
+}
 
+void RuntimeMPI::initializeSubGrid( const HaloExchange::Plan* halo_plan )
+{
     runtime.reset( new EquelleRuntimeCPU( subGrid.c_grid, param_ ) );
+    if ( halo_plan ) {
+        halo.reset( new HaloExchange( *halo_plan ) );
+    } else {
+        halo.reset( new HaloExchange( subGrid ) );
+    }
+    halo->setTrace( &trace );
 
-    auto endTime = MPI_Wtime();
+    const int num_owned = subGrid.c_grid->number_of_cells - subGrid.number_of_ghost_cells;
+    if ( param_.has( "linear_solver" ) && param_.get<std::string>( "linear_solver" ) != "bicgstab" ) {
+        logstream << "The MPI backend always uses bicgstab, ignoring linear_solver." << std::endl;
+    }
+    linsolver.reset( new DistributedKrylovSolver( param_, *halo, subGrid.c_grid->number_of_cells, num_owned ) );
+    linsolver->setTrace( &trace );
+    trace.setCounter( "owned_cells", num_owned );
+    trace.setCounter( "ghost_cells", subGrid.number_of_ghost_cells );
+    trace.setCounter( "halo_neighbours", halo->numNeighbours() );
+    trace.setCounter( "halo_values", halo->numSendValues() + halo->numRecvValues() );
+    const CollOfFace& interior_faces = runtime->interiorFaces();
+    boundary_layer_faces_.clear();
+    for( int k = 0; k < int(interior_faces.size()); ++k ) {
+        const int face = interior_faces[k].index;
+        const int first = subGrid.c_grid->face_cells[2*face];
+        const int second = subGrid.c_grid->face_cells[2*face + 1];
+        if ( first >= num_owned || second >= num_owned ) {
+            boundary_layer_faces_.push_back( BoundaryLayerFace{ k, first, second } );
+        }
+    }
+    // The ghost cells are numbered after the owned cells.
+    ghost_cells_.resize( subGrid.number_of_ghost_cells );
+    std::iota( ghost_cells_.begin(), ghost_cells_.end(), num_owned );
+
+    // A face is owned by the node that owns its first cell, or its second cell if the
+    // first is outside the domain. The other nodes see it as a face of a ghost cell.
+    const UnstructuredGrid* grid = subGrid.c_grid;
+    std::vector<std::pair<int, int>> owned;
+    for( int cell = 0; cell < num_owned; ++cell ) {
+        owned.emplace_back( subGrid.cell_local_to_global[cell], cell );
+    }
+    std::sort( owned.begin(), owned.end() );
+    owned_cells_ = OwnedEntities{ {}, {}, global_number_of_cells_ };
+    for( const auto& e : owned ) {
+        owned_cells_.global.push_back( e.first );
+        owned_cells_.local.push_back( e.second );
+    }
+    owned.clear();
+    for( int face = 0; face < grid->number_of_faces; ++face ) {
+        const int first = grid->face_cells[2*face];
+        const int cell = first == Boundary::outer ? grid->face_cells[2*face + 1] : first;
+        if ( cell >= 0 && cell < num_owned ) {
+            owned.emplace_back( subGrid.face_local_to_global[face], face );
+        }
+    }
+    std::sort( owned.begin(), owned.end() );
+    owned_faces_ = OwnedEntities{ {}, {}, global_number_of_faces_ };
+    for( const auto& e : owned ) {
+        owned_faces_.global.push_back( e.first );
+        owned_faces_.local.push_back( e.second );
+    }
 
-    logstream << "Decomposing took " << endTime-startTime << " seconds\n";
     logstream << "subGrid.number_of_ghost_cells: " << subGrid.number_of_ghost_cells << std::endl;
     logstream << "subGrid.global_cell.size(): " << subGrid.cell_local_to_global.size() << std::endl;
+    logstream << "Halo exchange with " << halo->numNeighbours() << " neighbours, sending "
+              << halo->numSendValues() << " and receiving " << halo->numRecvValues() << " values." << std::endl;
+    logstream << "Interior cells: " << subGrid.interior_cells.size() << ", partition boundary cells: "
+              << subGrid.partition_boundary_cells.size() << ", boundary layer faces: "
+              << boundary_layer_faces_.size() << std::endl;
+}
+
+SubGrid RuntimeMPI::scatterSubGrids( const zoltanReturns& zr )
+{
+    Trace::Region region( trace, "scatter_grid", Trace::communication );
+    const int size = getMPISize();
+    std::vector<int> ints;
+    std::vector<double> doubles;
+
+    if ( getMPIRank() != 0 ) {
+        int sizes[2];
+        MPI_SAFE_CALL( MPI_Recv( sizes, 2, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE ) );
+        ints.resize( sizes[0] );
+        doubles.resize( sizes[1] );
+        MPI_SAFE_CALL( MPI_Recv( ints.data(), sizes[0], MPI_INT, 0, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE ) );
+        MPI_SAFE_CALL( MPI_Recv( doubles.data(), sizes[1], MPI_DOUBLE, 0, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE ) );
+        region.addMessages( 3, sizeof( sizes ) + sizeof( int ) * ints.size() + sizeof( double ) * doubles.size() );
+        return SubGridBuilder::unpack( ints, doubles );
+    }
+
+    // All cells start out on rank 0, so its export list is the whole partition.
+    const UnstructuredGrid* grid = globalGrid->c_grid();
+    std::vector<int> owner( grid->number_of_cells, 0 );
+    for( int i = 0; i < zr.numExport; ++i ) {
+        owner[ zr.exportGlobalGids[i] ] = zr.exportProcs[i];
+    }
+    std::vector<std::vector<int>> cells( size );
+    for( int cell = 0; cell < grid->number_of_cells; ++cell ) {
+        cells[ owner[cell] ].push_back( cell );
+    }
+
+    // Build and send one piece at a time, to keep the memory use on rank 0 down.
+    for( int rank = 1; rank < size; ++rank ) {
+        SubGrid piece = SubGridBuilder::build( grid, cells[rank] );
+        SubGridBuilder::pack( piece, ints, doubles );
+        destroy_grid( piece.c_grid );
+
+        int sizes[2] = { int( ints.size() ), int( doubles.size() ) };
+        MPI_SAFE_CALL( MPI_Send( sizes, 2, MPI_INT, rank, 0, MPI_COMM_WORLD ) );
+        MPI_SAFE_CALL( MPI_Send( ints.data(), sizes[0], MPI_INT, rank, 1, MPI_COMM_WORLD ) );
+        MPI_SAFE_CALL( MPI_Send( doubles.data(), sizes[1], MPI_DOUBLE, rank, 2, MPI_COMM_WORLD ) );
+        region.addMessages( 3, sizeof( sizes ) + sizeof( int ) * ints.size() + sizeof( double ) * doubles.size() );
+        logstream << "Sent subGrid with " << piece.cell_local_to_global.size() << " cells to rank " << rank << std::endl;
+    }
+
+    return SubGridBuilder::build( grid, cells[0] );
 }
 
 zoltanReturns RuntimeMPI::computePartition()
 {
-    zoltanReturns zr;
-    void* grid;
+    const ZoltanGrid::EdgeWeights edge_weights
+        = ZoltanGrid::edgeWeights( param_.getDefault<std::string>( "partition_edge_weights", "none" ) );
     Opm::GridManager emptyGrid( 0, 0 );
-    // Let non rank-0 nodes pass in the empty grid here.l
+    // Let non rank-0 nodes pass in the empty grid here.
+    if ( getMPIRank() != 0 ) {
+        ZoltanGrid zgrid( emptyGrid.c_grid(), edge_weights );
+        return partition( zgrid );
+    }
 
-    if ( getMPIRank() == 0 ) {
-        grid = const_cast<void*>( reinterpret_cast<const void*>( globalGrid->c_grid() ) );
-    } else {
-        grid = const_cast<void*>( reinterpret_cast<const void*>( emptyGrid.c_grid()) );
+    ZoltanGrid zgrid( globalGrid->c_grid(), edge_weights );
+    if ( param_.has( "partition_cell_weights" ) ) {
+        zgrid.setCellWeights( readCellWeights( param_.get<std::string>( "partition_cell_weights" ) ) );
     }
+    return partition( zgrid );
+}
+
+zoltanReturns RuntimeMPI::partition( ZoltanGrid& zgrid )
+{
+    Trace::Region region( trace, "partition" );
+    zoltanReturns zr;
+    void* grid = &zgrid;
 
     ZOLTAN_SAFE_CALL( zoltan->Set_Num_Obj_Fn( ZoltanGrid::getNumberOfObjects, grid ) );
     ZOLTAN_SAFE_CALL( zoltan->Set_Obj_List_Fn( ZoltanGrid::getCellList, grid ) );
     ZOLTAN_SAFE_CALL( zoltan->Set_Num_Edges_Multi_Fn( ZoltanGrid::getNumberOfEdgesMulti, grid ) );
     ZOLTAN_SAFE_CALL( zoltan->Set_Edge_List_Multi_Fn( ZoltanGrid::getEdgeListMulti, grid ) );
+    ZOLTAN_SAFE_CALL( zoltan->Set_Num_Geom_Fn( ZoltanGrid::getNumberOfGeometries, grid ) );
+    ZOLTAN_SAFE_CALL( zoltan->Set_Geom_Multi_Fn( ZoltanGrid::getGeometryMulti, grid ) );
 
     ZOLTAN_SAFE_CALL(
                 zoltan->LB_Partition( zr.changes,         /* 1 if partitioning was changed, 0 otherwise */
@@ -137,6 +369,192 @@ zoltanReturns RuntimeMPI::computePartition()
     return zr;
 }
 
+std::vector<int> RuntimeMPI::computeOwners( const int num_nodes )
+{
+    if ( getMPIRank() == 0 && !globalGrid ) {
+        OPM_THROW( std::logic_error, "computeOwners requires the grid on rank 0." );
+    }
+    std::stringstream parts;
+    parts << num_nodes;
+    ZOLTAN_SAFE_CALL( zoltan->Set_Param( "NUM_GLOBAL_PARTS", parts.str().c_str() ) );
+    // List the part of every cell, also of those that stay on this node.
+    ZOLTAN_SAFE_CALL( zoltan->Set_Param( "RETURN_LISTS", "PARTS" ) );
+    zoltanReturns zr = computePartition();
+    std::stringstream size;
+    size << getMPISize();
+    ZOLTAN_SAFE_CALL( zoltan->Set_Param( "NUM_GLOBAL_PARTS", size.str().c_str() ) );
+    ZOLTAN_SAFE_CALL( zoltan->Set_Param( "RETURN_LISTS", "ALL" ) );
+
+    std::vector<int> owner;
+    if ( getMPIRank() == 0 ) {
+        owner.assign( globalGrid->c_grid()->number_of_cells, 0 );
+        for( int i = 0; i < zr.numExport; ++i ) {
+            owner[ zr.exportGlobalGids[i] ] = zr.exportToPart[i];
+        }
+    }
+    ZOLTAN_SAFE_CALL( Zoltan::LB_Free_Part( &zr.importGlobalGids, &zr.importLocalGids, &zr.importProcs, &zr.importToPart ) );
+    ZOLTAN_SAFE_CALL( Zoltan::LB_Free_Part( &zr.exportGlobalGids, &zr.exportLocalGids, &zr.exportProcs, &zr.exportToPart ) );
+    return owner;
+}
+
+std::vector<float> RuntimeMPI::readCellWeights( const String& filename ) const
+{
+    std::ifstream is( filename.c_str() );
+    if ( !is ) {
+        OPM_THROW( std::runtime_error, "Could not open cell weights file " << filename );
+    }
+    std::vector<float> weights;
+    float w;
+    while ( is >> w ) {
+        weights.push_back( w );
+    }
+    return weights;
+}
+
+void RuntimeMPI::repartition( const CollOfScalar& cell_cost, const std::vector<CollOfScalar*>& fields )
+{
+    if ( !globalGrid ) {
+        OPM_THROW( std::logic_error, "repartition requires grid_distribution=replicated." );
+    }
+    const int num_cells = subGrid.c_grid->number_of_cells;
+    if ( cell_cost.size() != num_cells ) {
+        OPM_THROW( std::logic_error, "repartition: the cost must be given on all cells." );
+    }
+    for( const CollOfScalar* f : fields ) {
+        if ( f->size() != num_cells ) {
+            OPM_THROW( std::logic_error, "repartition: the fields must be given on all cells." );
+        }
+    }
+    Trace::Region region( trace, "repartition" );
+    auto startTime = MPI_Wtime();
+    const UnstructuredGrid* grid = globalGrid->c_grid();
+    const int rank = getMPIRank();
+
+    // Zoltan needs the owners of our cells and of their neighbours, the ghost cells, whose
+    // owners are those we receive them from in the halo exchange, and the weights of our cells.
+    std::vector<int> owner( grid->number_of_cells, -1 );
+    std::vector<float> weights( grid->number_of_cells, 0.0f );
+    for( int i = 0; i < int(owned_cells_.global.size()); ++i ) {
+        owner[ owned_cells_.global[i] ] = rank;
+        weights[ owned_cells_.global[i] ] = cell_cost.value()[ owned_cells_.local[i] ];
+    }
+    const HaloExchange::Plan& plan = halo->plan();
+    for( int n = 0; n < int(plan.neighbour_ranks.size()); ++n ) {
+        for( int j = plan.recv_start[n]; j < plan.recv_start[n+1]; ++j ) {
+            owner[ subGrid.cell_local_to_global[ plan.recv_index[j] ] ] = plan.neighbour_ranks[n];
+        }
+    }
+    ZoltanGrid zgrid( grid, ZoltanGrid::edgeWeights( param_.getDefault<std::string>( "partition_edge_weights", "none" ) ),
+                      owner );
+    zgrid.setCellWeights( weights );
+
+    ZOLTAN_SAFE_CALL( zoltan->Set_Param( "LB_APPROACH", "REPARTITION" ) );
+    zoltanReturns zr = partition( zgrid );
+    ZOLTAN_SAFE_CALL( zoltan->Set_Param( "LB_APPROACH", "PARTITION" ) );
+
+    // The moved cells, as (rank, global cell), sorted the same way on both sides so that
+    // the values can be sent without their indices.
+    std::vector<std::pair<int, int>> exports;
+    for( int i = 0; i < zr.numExport; ++i ) {
+        exports.emplace_back( zr.exportProcs[i], zr.exportGlobalGids[i] );
+    }
+    std::vector<std::pair<int, int>> imports;
+    for( int i = 0; i < zr.numImport; ++i ) {
+        imports.emplace_back( zr.importProcs[i], zr.importGlobalGids[i] );
+    }
+    std::sort( exports.begin(), exports.end() );
+    std::sort( imports.begin(), imports.end() );
+    const bool changed = zr.changes;
+    ZOLTAN_SAFE_CALL( Zoltan::LB_Free_Part( &zr.importGlobalGids, &zr.importLocalGids, &zr.importProcs, &zr.importToPart ) );
+    ZOLTAN_SAFE_CALL( Zoltan::LB_Free_Part( &zr.exportGlobalGids, &zr.exportLocalGids, &zr.exportProcs, &zr.exportToPart ) );
+    if ( !changed ) {
+        logstream << "Repartitioning kept the partition." << std::endl;
+        return;
+    }
+
+    // Send the field values of the exported cells to their new owners.
+    const int num_fields = fields.size();
+    const int size = getMPISize();
+    std::vector<int> send_counts( size, 0 );
+    std::vector<int> recv_counts( size, 0 );
+    std::vector<double> send_values;
+    for( const auto& e : exports ) {
+        send_counts[e.first] += num_fields;
+        const int pos = std::lower_bound( owned_cells_.global.begin(), owned_cells_.global.end(), e.second )
+            - owned_cells_.global.begin();
+        for( const CollOfScalar* f : fields ) {
+            send_values.push_back( f->value()[ owned_cells_.local[pos] ] );
+        }
+    }
+    for( const auto& e : imports ) {
+        recv_counts[e.first] += num_fields;
+    }
+    std::vector<int> send_displs( size, 0 );
+    std::vector<int> recv_displs( size, 0 );
+    std::partial_sum( send_counts.begin(), send_counts.end() - 1, send_displs.begin() + 1 );
+    std::partial_sum( recv_counts.begin(), recv_counts.end() - 1, recv_displs.begin() + 1 );
+    std::vector<double> recv_values( num_fields * imports.size() );
+    MPI_SAFE_CALL( MPI_Alltoallv( send_values.data(), send_counts.data(), send_displs.data(), MPI_DOUBLE,
+                                  recv_values.data(), recv_counts.data(), recv_displs.data(), MPI_DOUBLE,
+                                  MPI_COMM_WORLD ) );
+    region.addMessages( exports.empty() ? 0 : 1, sizeof( double ) * send_values.size() );
+
+    // Where the value of each new cell comes from: the position of a kept cell in the old
+    // local numbering, or of an imported cell in the received values.
+    std::vector<int> exported;
+    for( const auto& e : exports ) {
+        exported.push_back( e.second );
+    }
+    std::sort( exported.begin(), exported.end() );
+    std::vector<std::pair<int, int>> kept;
+    for( int i = 0; i < int(owned_cells_.global.size()); ++i ) {
+        if ( !std::binary_search( exported.begin(), exported.end(), owned_cells_.global[i] ) ) {
+            kept.emplace_back( owned_cells_.global[i], owned_cells_.local[i] );
+        }
+    }
+    std::vector<std::pair<int, int>> imported;
+    for( int i = 0; i < int(imports.size()); ++i ) {
+        imported.emplace_back( imports[i].second, i );
+    }
+    std::sort( imported.begin(), imported.end() );
+    std::vector<int> cells;
+    for( const auto& c : kept ) {
+        cells.push_back( c.first );
+    }
+    for( const auto& c : imported ) {
+        cells.push_back( c.first );
+    }
+    std::sort( cells.begin(), cells.end() );
+
+    std::vector<CollOfScalar::V> old_values;
+    for( const CollOfScalar* f : fields ) {
+        old_values.push_back( f->value() );
+    }
+    UnstructuredGrid* old_grid = subGrid.c_grid;
+    subGrid = SubGridBuilder::build( grid, cells );
+    initializeSubGrid();
+    destroy_grid( old_grid );
+
+    // The owned values are moved, the ghost values are then filled in by a halo exchange.
+    for( int k = 0; k < num_fields; ++k ) {
+        CollOfScalar::V v = CollOfScalar::V::Zero( subGrid.c_grid->number_of_cells );
+        for( const int local : owned_cells_.local ) {
+            const int global = subGrid.cell_local_to_global[local];
+            const auto it = std::lower_bound( kept.begin(), kept.end(), std::make_pair( global, -1 ) );
+            if ( it != kept.end() && it->first == global ) {
+                v[local] = old_values[k][it->second];
+            } else {
+                const auto im = std::lower_bound( imported.begin(), imported.end(), std::make_pair( global, -1 ) );
+                v[local] = recv_values[ num_fields * im->second + k ];
+            }
+        }
+        *fields[k] = haloExchange( CollOfScalar( std::move( v ) ) );
+    }
+
+    auto endTime = MPI_Wtime();
+    logstream << "Repartitioning imported " << imports.size() << " cells and took " << endTime-startTime << " seconds\n";
+}
+
 CollOfCell RuntimeMPI::allCells() const
 {
     return runtime->allCells();
@@ -166,9 +584,204 @@ CollOfFace RuntimeMPI::boundaryFaces() const
     return boundary;
 }
 
-CollOfScalar RuntimeMPI::inputCollectionOfScalar(const String& /* name */, const CollOfFace & /* coll */ )
+const CollOfCell& RuntimeMPI::interiorCells() const
+{
+    return runtime->interiorCells();
+}
+
+const CollOfFace& RuntimeMPI::interiorFaces() const
+{
+    return runtime->interiorFaces();
+}
+
+CollOfCell RuntimeMPI::firstCell( const CollOfFace& faces ) const
+{
+    return runtime->firstCell( faces );
+}
+
+CollOfCell RuntimeMPI::secondCell( const CollOfFace& faces ) const
+{
+    return runtime->secondCell( faces );
+}
+
+CollOfScalar RuntimeMPI::norm( const CollOfFace& faces ) const
+{
+    return runtime->norm( faces );
+}
+
+CollOfScalar RuntimeMPI::norm( const CollOfCell& cells ) const
+{
+    return runtime->norm( cells );
+}
+
+CollOfScalar RuntimeMPI::norm( const CollOfVector& vectors ) const
+{
+    return runtime->norm( vectors );
+}
+
+CollOfVector RuntimeMPI::centroid( const CollOfFace& faces ) const
+{
+    return runtime->centroid( faces );
+}
+
+CollOfVector RuntimeMPI::centroid( const CollOfCell& cells ) const
+{
+    return runtime->centroid( cells );
+}
+
+CollOfVector RuntimeMPI::normal( const CollOfFace& faces ) const
+{
+    return runtime->normal( faces );
+}
+
+CollOfScalar RuntimeMPI::sqrt( const CollOfScalar& x ) const
+{
+    return runtime->sqrt( x );
+}
+
+CollOfScalar RuntimeMPI::dot( const CollOfVector& v1, const CollOfVector& v2 ) const
+{
+    return runtime->dot( v1, v2 );
+}
+
+CollOfBool RuntimeMPI::isEmpty( const CollOfCell& cells ) const
+{
+    return runtime->isEmpty( cells );
+}
+
+CollOfBool RuntimeMPI::isEmpty( const CollOfFace& faces ) const
+{
+    return runtime->isEmpty( faces );
+}
+
+CollOfScalar RuntimeMPI::gradient( const CollOfScalar& cell_scalarfield ) const
+{
+    return splitPhaseGradient( cell_scalarfield, 1.0 );
+}
+
+CollOfScalar RuntimeMPI::negGradient( const CollOfScalar& cell_scalarfield ) const
+{
+    return splitPhaseGradient( cell_scalarfield, -1.0 );
+}
+
+CollOfScalar RuntimeMPI::splitPhaseGradient( const CollOfScalar& cell_scalarfield, const double sign ) const
+{
+    if ( halo->numNeighbours() == 0 ) {
+        return sign > 0.0 ? runtime->gradient( cell_scalarfield ) : runtime->negGradient( cell_scalarfield );
+    }
+    Trace::Region region( trace, "gradient" );
+    if ( cell_scalarfield.size() != subGrid.c_grid->number_of_cells ) {
+        OPM_THROW( std::logic_error, "Gradient requires a collection on all cells, got size " << cell_scalarfield.size() );
+    }
+    CollOfScalar::V values = cell_scalarfield.value();
+    halo->begin( values.data() );
+
+    // While the ghost values are in flight, apply the operator with the old ones.
+    const CollOfScalar partial = sign > 0.0 ? runtime->gradient( cell_scalarfield )
+                                            : runtime->negGradient( cell_scalarfield );
+
+    halo->end( values.data() );
+
+    if ( !cell_scalarfield.derivative().empty() ) {
+        requireConsistentGhosts( cell_scalarfield.value(), values, ghost_cells_, "gradient" );
+        return partial;
+    }
+    CollOfScalar::V result = partial.value();
+    for( const BoundaryLayerFace& f : boundary_layer_faces_ ) {
+        result[f.position] = sign * ( values[f.second] - values[f.first] );
+    }
+    return CollOfScalar( result );
+}
+
+CollOfScalar RuntimeMPI::divergence( const CollOfScalar& face_fluxes ) const
+{
+    // The fluxes are local, but the result on the ghost cells lacks the faces we do not have.
+    Trace::Region region( trace, "divergence" );
+    return runtime->divergence( face_fluxes );
+}
+
+CollOfScalar RuntimeMPI::interiorDivergence( const CollOfScalar& face_fluxes ) const
+{
+    return runtime->interiorDivergence( face_fluxes );
+}
+
+CollOfScalar RuntimeMPI::operatorOn( const CollOfScalar& data, const CollOfCell& from_set, const CollOfCell& to_set )
+{
+    // The cells of to_set may be ghost cells, such as the first cells of the interior faces.
+    if ( halo->numNeighbours() == 0 || data.size() != subGrid.c_grid->number_of_cells
+         || from_set != runtime->allCells() ) {
+        return runtime->operatorOn( data, from_set, to_set );
+    }
+    Trace::Region region( trace, "operator_on" );
+    CollOfScalar::V values = data.value();
+    halo->begin( values.data() );
+
+    const CollOfScalar partial = runtime->operatorOn( data, from_set, to_set );
+    const int num_owned = subGrid.c_grid->number_of_cells - subGrid.number_of_ghost_cells;
+
+    halo->end( values.data() );
+
+    // Only the ghost cells of to_set matter.
+    if ( !data.derivative().empty() ) {
+        const double tol = ghostTolerance( data.value() );
+        for( const Cell& cell : to_set ) {
+            if ( cell.index >= num_owned ) {
+                requireConsistentGhost( data.value(), values, cell.index, tol, "operatorOn" );
+            }
+        }
+        return partial;
+    }
+    CollOfScalar::V result = partial.value();
+    for( int k = 0; k < int(to_set.size()); ++k ) {
+        if ( to_set[k].index >= num_owned ) {
+            result[k] = values[to_set[k].index];
+        }
+    }
+    return CollOfScalar( result );
+}
+
+double RuntimeMPI::ghostTolerance( const CollOfScalar::V& local )
+{
+    // The owners compute the same values from the same inputs, but possibly with
+    // different rounding (vectorized or not), so they are compared relative to
+    // the magnitude of the field.
+    return local.size() == 0 ? 0.0 : 1e-12 * local.abs().maxCoeff();
+}
+
+void RuntimeMPI::requireConsistentGhost( const CollOfScalar::V& local, const CollOfScalar::V& exchanged,
+                                         const int cell, const double tol, const char* op ) const
+{
+    if ( std::abs( local[cell] - exchanged[cell] ) > tol ) {
+        OPM_THROW( std::logic_error, op << ": the value on ghost cell " << cell << " is " << local[cell]
+                   << ", but " << exchanged[cell] << " on its owner. The derivatives of ghost cells can "
+                   "not be exchanged, so operators that need the neighbours of a cell can not be "
+                   "applied to collections with derivatives that are incomplete on the ghost cells "
+                   "(such as the result of a divergence)." );
+    }
+}
+
+void RuntimeMPI::requireConsistentGhosts( const CollOfScalar::V& local, const CollOfScalar::V& exchanged,
+                                          const std::vector<int>& ghost_cells, const char* op ) const
+{
+    const double tol = ghostTolerance( local );
+    for( int cell : ghost_cells ) {
+        requireConsistentGhost( local, exchanged, cell, tol, op );
+    }
+}
+
+CollOfScalar RuntimeMPI::operatorOn( const CollOfScalar& data, const CollOfFace& from_set, const CollOfFace& to_set )
 {
-    throw std::runtime_error("Not implemented");
+    return runtime->operatorOn( data, from_set, to_set );
+}
+
+CollOfScalar RuntimeMPI::inputCollectionOfScalar(const String& name, const CollOfFace& coll)
+{
+    if ( param_.getDefault(name + "_from_file", false) ) {
+        // The file is ordered as the global collection, which is not known here.
+        throw std::runtime_error("Not implemented");
+    }
+    // Uniform values.
+    return CollOfScalar(CollOfScalar::V::Constant(coll.size(), param_.get<double>(name)));
 }
 
 CollOfScalar RuntimeMPI::inputCollectionOfScalar(const String &name, const CollOfCell &coll)
@@ -177,6 +790,17 @@ CollOfScalar RuntimeMPI::inputCollectionOfScalar(const String &name, const CollO
     const bool from_file = param_.getDefault(name + "_from_file", false);
     if (from_file) {
         const String filename = param_.get<String>(name + "_filename");
+        if (binaryio::isBinaryInput(param_, name, filename)) {
+            // Pick our cells straight from the mapped global field.
+            const MappedBinaryFile file(filename);
+            file.checkSize(0, global_number_of_cells_, name);
+            const double* data = file.doubles(0);
+            CollOfScalar::V localData( size );
+            for( int i = 0; i < size; ++i ) {
+                localData[i] = data[subGrid.cell_local_to_global[i]];
+            }
+            return CollOfScalar( localData );
+        }
         std::ifstream is(filename.c_str());
         if (!is) {
             OPM_THROW(std::runtime_error, "Could not find file " << filename);
@@ -207,22 +831,34 @@ CollOfFace RuntimeMPI::inputDomainSubsetOf(const String &name, const CollOfFace
     // This implementation is based on a copy of EquelleRuntimeCPU::inputDomainSubsetOf
     // but we rewrite the indices into our local index-space.
     const String filename = param_.get<String>(name + "_filename");
-    std::ifstream is(filename.c_str());
-    if (!is) {
-        OPM_THROW(std::runtime_error, "Could not find file " << filename);
-    }
-    std::istream_iterator<int> beg(is);
-    std::istream_iterator<int> end;
-
     CollOfFace data;
-    for (auto it = beg; it != end; ++it) {
-        logstream << "Read " << *it << std::endl;
-        auto jt = subGrid.face_global_to_local.find( *it );
-        if ( jt != subGrid.face_global_to_local.end() ) { // This face is part of our domain
-            data.emplace_back( jt->second );
+    if (binaryio::isBinaryInput(param_, name, filename)) {
+        const MappedBinaryFile file(filename);
+        const std::int32_t* indices = file.ints(0);
+        const int size = file.recordSize(0);
+        for (int i = 0; i < size; ++i) {
+            auto jt = subGrid.face_global_to_local.find( indices[i] );
+            if ( jt != subGrid.face_global_to_local.end() ) { // This face is part of our domain
+                data.emplace_back( jt->second );
+            }
+        }
+    } else {
+        std::ifstream is(filename.c_str());
+        if (!is) {
+            OPM_THROW(std::runtime_error, "Could not find file " << filename);
+        }
+        std::istream_iterator<int> beg(is);
+        std::istream_iterator<int> end;
+
+        for (auto it = beg; it != end; ++it) {
+            logstream << "Read " << *it << std::endl;
+            auto jt = subGrid.face_global_to_local.find( *it );
+            if ( jt != subGrid.face_global_to_local.end() ) { // This face is part of our domain
+                data.emplace_back( jt->second );
 
-            logstream << "Adding " << *it << " -> " << jt->second << std::endl;
-        } // else the face is not part of our domain
+                logstream << "Adding " << *it << " -> " << jt->second << std::endl;
+            } // else the face is not part of our domain
+        }
     }
 
     // Needed to allow for std::includes to give valid results.
@@ -241,22 +877,34 @@ CollOfCell RuntimeMPI::inputDomainSubsetOf(const String &name, const CollOfCell
     // This implementation is based on a copy of EquelleRuntimeCPU::inputDomainSubsetOf
     // but we rewrite the indices into our local index-space.
     const String filename = param_.get<String>(name + "_filename");
-    std::ifstream is(filename.c_str());
-    if (!is) {
-        OPM_THROW(std::runtime_error, "Could not find file " << filename);
-    }
-    std::istream_iterator<int> beg(is);
-    std::istream_iterator<int> end;
-
     CollOfCell data;
-    for (auto it = beg; it != end; ++it) {
-        logstream << "Read " << *it << std::endl;
-        auto jt = subGrid.cell_global_to_local.find( *it );
-        if ( jt != subGrid.cell_global_to_local.end() ) { // This cell is part of our domain
-            data.emplace_back( jt->second );
+    if (binaryio::isBinaryInput(param_, name, filename)) {
+        const MappedBinaryFile file(filename);
+        const std::int32_t* indices = file.ints(0);
+        const int size = file.recordSize(0);
+        for (int i = 0; i < size; ++i) {
+            auto jt = subGrid.cell_global_to_local.find( indices[i] );
+            if ( jt != subGrid.cell_global_to_local.end() ) { // This cell is part of our domain
+                data.emplace_back( jt->second );
+            }
+        }
+    } else {
+        std::ifstream is(filename.c_str());
+        if (!is) {
+            OPM_THROW(std::runtime_error, "Could not find file " << filename);
+        }
+        std::istream_iterator<int> beg(is);
+        std::istream_iterator<int> end;
+
+        for (auto it = beg; it != end; ++it) {
+            logstream << "Read " << *it << std::endl;
+            auto jt = subGrid.cell_global_to_local.find( *it );
+            if ( jt != subGrid.cell_global_to_local.end() ) { // This cell is part of our domain
+                data.emplace_back( jt->second );
 
-            logstream << "Adding " << *it << " -> " << jt->second << std::endl;
-        } // else the cell is not part of our domain
+                logstream << "Adding " << *it << " -> " << jt->second << std::endl;
+            } // else the cell is not part of our domain
+        }
     }
 
     // Needed to allow for std::includes to give valid results.
@@ -276,73 +924,515 @@ Scalar RuntimeMPI::inputScalarWithDefault(const String &name, const Scalar defau
     return runtime->inputScalarWithDefault( name, default_value );
 }
 
-void RuntimeMPI::output(const String &tag, const CollOfScalar &vals)
+SeqOfScalar RuntimeMPI::inputSequenceOfScalar( const String& name )
+{
+    return runtime->inputSequenceOfScalar( name );
+}
+
+namespace {
+
+/// Reduce the given elements of v.
+template <class Op>
+Scalar localReduce( const CollOfScalar::V& v, const std::vector<int>& indices, Scalar result, Op op )
+{
+    for( int i : indices ) {
+        result = op( result, v[i] );
+    }
+    return result;
+}
+
+} // anonymous namespace
+
+Scalar RuntimeMPI::minReduce( const CollOfScalar& x ) const
+{
+    return reduce( x, reductionIndices( x ), MPI_MIN );
+}
+
+Scalar RuntimeMPI::maxReduce( const CollOfScalar& x ) const
+{
+    return reduce( x, reductionIndices( x ), MPI_MAX );
+}
+
+Scalar RuntimeMPI::sumReduce( const CollOfScalar& x ) const
+{
+    return reduce( x, reductionIndices( x ), MPI_SUM );
+}
+
+Scalar RuntimeMPI::prodReduce( const CollOfScalar& x ) const
+{
+    return reduce( x, reductionIndices( x ), MPI_PROD );
+}
+
+Scalar RuntimeMPI::minReduce( const CollOfScalar& x, const CollOfCell& domain ) const
+{
+    return reduce( x, ownedPositions( x, domain ), MPI_MIN );
+}
+
+Scalar RuntimeMPI::minReduce( const CollOfScalar& x, const CollOfFace& domain ) const
+{
+    return reduce( x, ownedPositions( x, domain ), MPI_MIN );
+}
+
+Scalar RuntimeMPI::maxReduce( const CollOfScalar& x, const CollOfCell& domain ) const
+{
+    return reduce( x, ownedPositions( x, domain ), MPI_MAX );
+}
+
+Scalar RuntimeMPI::maxReduce( const CollOfScalar& x, const CollOfFace& domain ) const
+{
+    return reduce( x, ownedPositions( x, domain ), MPI_MAX );
+}
+
+Scalar RuntimeMPI::sumReduce( const CollOfScalar& x, const CollOfCell& domain ) const
+{
+    return reduce( x, ownedPositions( x, domain ), MPI_SUM );
+}
+
+Scalar RuntimeMPI::sumReduce( const CollOfScalar& x, const CollOfFace& domain ) const
+{
+    return reduce( x, ownedPositions( x, domain ), MPI_SUM );
+}
+
+Scalar RuntimeMPI::prodReduce( const CollOfScalar& x, const CollOfCell& domain ) const
+{
+    return reduce( x, ownedPositions( x, domain ), MPI_PROD );
+}
+
+Scalar RuntimeMPI::prodReduce( const CollOfScalar& x, const CollOfFace& domain ) const
+{
+    return reduce( x, ownedPositions( x, domain ), MPI_PROD );
+}
+
+Scalar RuntimeMPI::reduce( const CollOfScalar& x, const std::vector<int>& indices, MPI_Op op ) const
+{
+    Scalar local;
+    if ( op == MPI_MIN ) {
+        local = localReduce( x.value(), indices, std::numeric_limits<Scalar>::max(),
+                             []( const Scalar a, const Scalar b ) { return std::min( a, b ); } );
+    } else if ( op == MPI_MAX ) {
+        local = localReduce( x.value(), indices, -std::numeric_limits<Scalar>::max(),
+                             []( const Scalar a, const Scalar b ) { return std::max( a, b ); } );
+    } else if ( op == MPI_SUM ) {
+        local = localReduce( x.value(), indices, 0.0,
+                             []( const Scalar a, const Scalar b ) { return a + b; } );
+    } else {
+        local = localReduce( x.value(), indices, 1.0,
+                             []( const Scalar a, const Scalar b ) { return a * b; } );
+    }
+    return allReduce( local, op );
+}
+
+Scalar RuntimeMPI::allReduce( const Scalar local, MPI_Op op ) const
+{
+    Scalar global;
+    // The time in a reduction is mostly spent waiting for the slowest node.
+    Trace::Region region( trace, "allreduce", Trace::wait );
+    MPI_SAFE_CALL( MPI_Allreduce( const_cast<Scalar*>( &local ), &global, 1, MPI_DOUBLE, op, MPI_COMM_WORLD ) );
+    return global;
+}
+
+const std::vector<int>& RuntimeMPI::reductionIndices( const CollOfScalar& coll ) const
+{
+    const OwnedEntities* owned = ownedEntities( coll );
+    if ( !owned ) {
+        OPM_THROW( std::runtime_error, "Reduction of a collection of size " << coll.size()
+                   << " without its domain, only collections on all cells or all faces are supported." );
+    }
+    return owned->local;
+}
+
+std::vector<int> RuntimeMPI::ownedPositions( const CollOfScalar& coll, const CollOfCell& domain ) const
+{
+    if ( coll.size() != int( domain.size() ) ) {
+        OPM_THROW( std::logic_error, "Reduction of a collection of size " << coll.size()
+                   << " on a domain of size " << domain.size() );
+    }
+    // The owned cells come first in the local numbering.
+    const int num_owned = subGrid.c_grid->number_of_cells - subGrid.number_of_ghost_cells;
+    std::vector<int> positions;
+    for( int k = 0; k < int( domain.size() ); ++k ) {
+        if ( domain[k].index < num_owned ) {
+            positions.push_back( k );
+        }
+    }
+    return positions;
+}
+
+std::vector<int> RuntimeMPI::ownedPositions( const CollOfScalar& coll, const CollOfFace& domain ) const
+{
+    if ( coll.size() != int( domain.size() ) ) {
+        OPM_THROW( std::logic_error, "Reduction of a collection of size " << coll.size()
+                   << " on a domain of size " << domain.size() );
+    }
+    // Faces are owned as in decompose(): by the owner of the first cell, or of the
+    // second cell if the first is outside the domain.
+    const UnstructuredGrid* grid = subGrid.c_grid;
+    const int num_owned = grid->number_of_cells - subGrid.number_of_ghost_cells;
+    std::vector<int> positions;
+    for( int k = 0; k < int( domain.size() ); ++k ) {
+        const int face = domain[k].index;
+        const int first = grid->face_cells[2*face];
+        const int cell = first == Boundary::outer ? grid->face_cells[2*face + 1] : first;
+        if ( cell >= 0 && cell < num_owned ) {
+            positions.push_back( k );
+        }
+    }
+    return positions;
+}
+
+const RuntimeMPI::OwnedEntities* RuntimeMPI::ownedEntities( const CollOfScalar& coll ) const
+{
+    if ( coll.size() == subGrid.c_grid->number_of_cells ) {
+        return &owned_cells_;
+    }
+    if ( coll.size() == subGrid.c_grid->number_of_faces ) {
+        return &owned_faces_;
+    }
+    return nullptr;
+}
+
+const RuntimeMPI::OwnedEntities& RuntimeMPI::ownedEntities( const CollOfScalar& coll, const CollOfCell& domain ) const
+{
+    if ( coll.size() != int( domain.size() ) || domain != allCells() ) {
+        OPM_THROW( std::runtime_error, "Expected a collection on all cells or all faces." );
+    }
+    return owned_cells_;
+}
+
+const RuntimeMPI::OwnedEntities& RuntimeMPI::ownedEntities( const CollOfScalar& coll, const CollOfFace& domain ) const
+{
+    if ( coll.size() != int( domain.size() ) || domain != allFaces() ) {
+        OPM_THROW( std::runtime_error, "Expected a collection on all cells or all faces." );
+    }
+    return owned_faces_;
+}
+
+const std::vector<int>& RuntimeMPI::residualIndices( const CollOfScalar& residual ) const
+{
+    if ( residual.size() != subGrid.c_grid->number_of_cells ) {
+        OPM_THROW( std::runtime_error, "newtonSolve requires residuals on all cells." );
+    }
+    return owned_cells_.local;
+}
+
+void RuntimeMPI::output( const String& tag, const Scalar val ) const
 {
-    auto val = allGather( vals );
     if ( equelle::getMPIRank() == 0 ) {
         runtime->output( tag, val );
     }
 }
 
-equelle::CollOfScalar equelle::RuntimeMPI::allGather( const equelle::CollOfScalar &coll )
+void RuntimeMPI::output( const String& tag, const CollOfScalar& vals )
 {
-    // Get the size of the collection on every node
-    struct CollOfScalarSize {
-        int size = 0;
-        int numBlocks = 0;
-    };
+    output( tag, vals, ownedEntities( vals ) );
+}
 
-    int rank = equelle::getMPIRank();
-    int world_size = equelle::getMPISize();
-    std::vector<CollOfScalarSize> sizes( world_size );
+void RuntimeMPI::output( const String& tag, const CollOfScalar& vals, const CollOfCell& domain )
+{
+    output( tag, vals, &ownedEntities( vals, domain ) );
+}
 
-    sizes[rank].size = coll.size();
-    sizes[rank].numBlocks = coll.numBlocks();
+void RuntimeMPI::output( const String& tag, const CollOfScalar& vals, const CollOfFace& domain )
+{
+    output( tag, vals, &ownedEntities( vals, domain ) );
+}
 
-    MPI_SAFE_CALL( MPI_Allgather( &sizes[rank], 2, MPI_INT,
-                                  sizes.data(), 2, MPI_INT, MPI_COMM_WORLD ) );
+void RuntimeMPI::output( const String& tag, const CollOfScalar& vals, const OwnedEntities* owned )
+{
+    Trace::Region region( trace, "output", Trace::communication );
+    if ( !param_.getDefault( "output_to_file", false ) ) {
+        auto val = gather( vals, owned, false );
+        if ( equelle::getMPIRank() == 0 ) {
+            runtime->output( tag, val );
+        }
+        return;
+    }
+
+    if ( !owned ) {
+        OPM_THROW( std::runtime_error, "Output of " << tag << " requires a collection on all cells or all faces." );
+    }
+    const int count = outputcount_[tag]++;
 
-    // Get the globalgids for the elements in coll.
-    // NB. These globalgids are the global ID for the collection! As the serial backend would see them.
+    if ( param_.getDefault<std::string>( "output_format", "text" ) == "binary" ) {
+        writeBinary( tag + ".eqbin", count > 0, *owned, vals );
+        return;
+    }
 
-    std::vector<int> recvcounts( world_size); // Number of elements in each node
-    std::vector<int> displacements( world_size +1 ); // Displacements where each node store the data
+    const int rank = equelle::getMPIRank();
+    if ( count == 0 ) {
+        std::ostringstream fname;
+        fname << tag << "." << rank << ".index";
+        std::ofstream file( fname.str().c_str() );
+        if ( !file ) {
+            OPM_THROW( std::runtime_error, "Failed to open " << fname.str() );
+        }
+        std::copy( owned->global.begin(), owned->global.end(), std::ostream_iterator<int>( file, "\n" ) );
+    }
+    std::ostringstream fname;
+    fname << tag << "-" << std::setw(5) << std::setfill('0') << count << "." << rank << ".output";
+    std::ofstream file( fname.str().c_str() );
+    if ( !file ) {
+        OPM_THROW( std::runtime_error, "Failed to open " << fname.str() );
+    }
+    file.precision( 16 );
+    for( int i : owned->local ) {
+        file << vals.value()[i] << "\n";
+    }
+}
 
-    for( int i = 0; i < equelle::getMPISize(); ++i ) {
-        recvcounts[i] = sizes[i].size;
-        displacements[i+1] = displacements[i] + sizes[i].size;
+void RuntimeMPI::writeBinary( const String& filename, const bool append,
+                              const OwnedEntities& owned, const CollOfScalar& vals ) const
+{
+    const int rank = equelle::getMPIRank();
+    std::vector<std::uint64_t> offsets;
+    long long record_start = binaryio::header_size;
+    if ( append ) {
+        // Rank 0 reads the index, as it may extend the file before the others have looked.
+        std::string error;
+        if ( rank == 0 ) {
+            try {
+                std::uint64_t records_end = 0;
+                offsets = binaryio::readIndex( filename, binaryio::Float64, records_end );
+                record_start = records_end;
+            } catch ( const std::runtime_error& e ) {
+                error = e.what();
+                record_start = -1;
+            }
+        }
+        MPI_SAFE_CALL( MPI_Bcast( &record_start, 1, MPI_LONG_LONG, 0, MPI_COMM_WORLD ) );
+        if ( record_start < 0 ) {
+            OPM_THROW( std::runtime_error, ( rank == 0 ? error : "Cannot append to " + filename + "." ) );
+        }
     }
 
-    // Total number of elements, including duplicates
-    const int total_number_of_elements = displacements.back();
-    std::vector<int> global_id_mapping( total_number_of_elements );
+    MPI_File fh;
+    MPI_SAFE_CALL( MPI_File_open( MPI_COMM_WORLD, const_cast<char*>( filename.c_str() ),
+                                  MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &fh ) );
+    if ( !append ) {
+        MPI_SAFE_CALL( MPI_File_set_size( fh, 0 ) );
+    }
+
+    // Rank 0 writes the header, the value count and the index after the
+    // record, as BinaryWriter does. The record is written over the old index.
+    if ( rank == 0 ) {
+        if ( !append ) {
+            char header[binaryio::header_size];
+            const std::uint32_t header_ints[2] = { binaryio::version, std::uint32_t( binaryio::Float64 ) };
+            std::copy( binaryio::magic, binaryio::magic + 8, header );
+            std::memcpy( header + 8, header_ints, sizeof( header_ints ) );
+            MPI_SAFE_CALL( MPI_File_write_at( fh, 0, header, binaryio::header_size, MPI_BYTE, MPI_STATUS_IGNORE ) );
+        }
+        const std::uint64_t count = owned.global_count;
+        MPI_SAFE_CALL( MPI_File_write_at( fh, record_start, const_cast<std::uint64_t*>( &count ), sizeof( count ),
+                                          MPI_BYTE, MPI_STATUS_IGNORE ) );
+        offsets.push_back( record_start );
+        std::vector<char> index = binaryio::indexBytes( offsets );
+        MPI_SAFE_CALL( MPI_File_write_at( fh, record_start + binaryio::recordBytes( binaryio::Float64, count ),
+                                          index.data(), index.size(), MPI_BYTE, MPI_STATUS_IGNORE ) );
+    }
+
+    // Every node writes its values at the positions of their global indices.
+    const int n = owned.local.size();
+    std::vector<double> values( n );
+    for( int i = 0; i < n; ++i ) {
+        values[i] = vals.value()[owned.local[i]];
+    }
+    MPI_Datatype filetype;
+    MPI_SAFE_CALL( MPI_Type_create_indexed_block( n, 1, const_cast<int*>( owned.global.data() ), MPI_DOUBLE, &filetype ) );
+    MPI_SAFE_CALL( MPI_Type_commit( &filetype ) );
+    MPI_SAFE_CALL( MPI_File_set_view( fh, record_start + sizeof( std::uint64_t ), MPI_DOUBLE, filetype,
+                                      const_cast<char*>( "native" ), MPI_INFO_NULL ) );
+    MPI_SAFE_CALL( MPI_File_write_all( fh, values.data(), n, MPI_DOUBLE, MPI_STATUS_IGNORE ) );
+    MPI_SAFE_CALL( MPI_Type_free( &filetype ) );
+    MPI_SAFE_CALL( MPI_File_close( &fh ) );
+}
+
+equelle::CollOfScalar equelle::RuntimeMPI::allGather( const equelle::CollOfScalar &coll )
+{
+    return gather( coll, ownedEntities( coll ), true );
+}
 
-    // We do not need to copy the local data into the global structure.
-    // That is handeled by MPI_Allgatherv
-    MPI_SAFE_CALL(
-        MPI_Allgatherv( subGrid.cell_local_to_global.data(), subGrid.cell_local_to_global.size(), MPI_INT,
-                        global_id_mapping.data(), recvcounts.data(), displacements.data(),
-                        MPI_INT, MPI_COMM_WORLD ) );
+CollOfScalar RuntimeMPI::allGather( const CollOfScalar& coll, const CollOfCell& domain )
+{
+    return gather( coll, &ownedEntities( coll, domain ), true );
+}
 
-    // Send the value part of an AutoDiffBlock, collect them in a global array
-    // offsets are the same as for the global_id_mapping
-    std::vector<double> adbvalues( total_number_of_elements );
+CollOfScalar RuntimeMPI::allGather( const CollOfScalar& coll, const CollOfFace& domain )
+{
+    return gather( coll, &ownedEntities( coll, domain ), true );
+}
 
-    MPI_SAFE_CALL( MPI_Allgatherv( const_cast<double*>( coll.value().data() ), coll.value().size(), MPI_DOUBLE,
-                     adbvalues.data(), recvcounts.data(), displacements.data(),
-                     MPI_DOUBLE, MPI_COMM_WORLD ) );
+CollOfScalar RuntimeMPI::gather( const CollOfScalar& coll, const OwnedEntities* owned, const bool to_all )
+{
+    Trace::Region region( trace, to_all ? "allgather" : "gather", Trace::communication );
+    if ( !owned ) {
+        OPM_THROW( std::runtime_error, "Gathering requires a collection on all cells or all faces." );
+    }
 
-    int unique_number_of_elements = 1 + *std::max_element( global_id_mapping.begin(), global_id_mapping.end() );
+    // Only the owned entities are sent, so every global index is received once.
+    const int rank = equelle::getMPIRank();
+    const int world_size = equelle::getMPISize();
+    int size = owned->local.size();
+    std::vector<int> recvcounts( world_size ); // Number of elements in each node
+    std::vector<int> displacements( world_size + 1 ); // Displacements where each node store the data
+    if ( to_all ) {
+        MPI_SAFE_CALL( MPI_Allgather( &size, 1, MPI_INT, recvcounts.data(), 1, MPI_INT, MPI_COMM_WORLD ) );
+    } else {
+        MPI_SAFE_CALL( MPI_Gather( &size, 1, MPI_INT, recvcounts.data(), 1, MPI_INT, 0, MPI_COMM_WORLD ) );
+    }
+    for( int i = 0; i < world_size; ++i ) {
+        displacements[i+1] = displacements[i] + recvcounts[i];
+    }
 
-    typedef Eigen::Array<Scalar, Eigen::Dynamic, 1> V;
-    V v_new( unique_number_of_elements );
+    std::vector<double> values( size );
+    for( int i = 0; i < size; ++i ) {
+        values[i] = coll.value()[owned->local[i]];
+    }
+    region.addMessages( 3, ( sizeof( int ) + sizeof( double ) ) * size + sizeof( int ) );
+
+    const bool receiving = to_all || rank == 0;
+    std::vector<int> global_id_mapping( receiving ? owned->global_count : 0 );
+    std::vector<double> adbvalues( receiving ? owned->global_count : 0 );
+    int* ids = const_cast<int*>( owned->global.data() );
+    if ( to_all ) {
+        MPI_SAFE_CALL( MPI_Allgatherv( ids, size, MPI_INT, global_id_mapping.data(), recvcounts.data(),
+                                       displacements.data(), MPI_INT, MPI_COMM_WORLD ) );
+        MPI_SAFE_CALL( MPI_Allgatherv( values.data(), size, MPI_DOUBLE, adbvalues.data(), recvcounts.data(),
+                                       displacements.data(), MPI_DOUBLE, MPI_COMM_WORLD ) );
+    } else {
+        MPI_SAFE_CALL( MPI_Gatherv( ids, size, MPI_INT, global_id_mapping.data(), recvcounts.data(),
+                                    displacements.data(), MPI_INT, 0, MPI_COMM_WORLD ) );
+        MPI_SAFE_CALL( MPI_Gatherv( values.data(), size, MPI_DOUBLE, adbvalues.data(), recvcounts.data(),
+                                    displacements.data(), MPI_DOUBLE, 0, MPI_COMM_WORLD ) );
+    }
+    if ( !receiving ) {
+        return CollOfScalar();
+    }
+    if ( displacements.back() != owned->global_count ) {
+        OPM_THROW( std::logic_error, "Gathered " << displacements.back() << " values, expected " << owned->global_count );
+    }
 
-    for( int i = 0; i < total_number_of_elements; ++i ) {
-        int global_id = global_id_mapping[i];
-        v_new[global_id] = adbvalues[i];
+    CollOfScalar::V v_new( owned->global_count );
+    for( int i = 0; i < owned->global_count; ++i ) {
+        v_new[global_id_mapping[i]] = adbvalues[i];
     }
 
     return CollOfScalar( v_new );
 }
 
+bool RuntimeMPI::newtonConverged( const Scalar norm, const Scalar max_norm, const Scalar initial_norm ) const
+{
+    // Converged if any of the enabled criteria is met.
+    return norm <= abs_res_tol_
+        || ( rel_res_tol_ > 0.0 && norm <= rel_res_tol_ * initial_norm )
+        || ( max_res_tol_ > 0.0 && max_norm <= max_res_tol_ );
+}
+
+void RuntimeMPI::newtonFailure( const int iter, const Scalar norm ) const
+{
+    if ( throw_on_newton_failure_ ) {
+        OPM_THROW( std::runtime_error, "newtonSolve failed to converge in " << iter
+                   << " iterations, norm(residual) = " << norm );
+    }
+    if ( verbose_ > 0 && getMPIRank() == 0 ) {
+        std::cout << "Newton solver failed to converge in " << iter << " iterations" << std::endl;
+    }
+}
+
+Scalar RuntimeMPI::twoNorm( const CollOfScalar* residual, const int num ) const
+{
+    Scalar local = 0.0;
+    for( int r = 0; r < num; ++r ) {
+        local += localReduce( residual[r].value(), residualIndices( residual[r] ), 0.0,
+                              []( const Scalar a, const Scalar b ) { return a + b*b; } );
+    }
+    return std::sqrt( allReduce( local, MPI_SUM ) );
+}
+
+Scalar RuntimeMPI::maxNorm( const CollOfScalar* residual, const int num ) const
+{
+    Scalar local = 0.0;
+    for( int r = 0; r < num; ++r ) {
+        local = localReduce( residual[r].value(), residualIndices( residual[r] ), local,
+                             []( const Scalar a, const Scalar b ) { return std::max( a, std::abs( b ) ); } );
+    }
+    return allReduce( local, MPI_MAX );
+}
+
+void RuntimeMPI::solveForUpdate( const CollOfScalar* residual, const int num, CollOfScalar::V* du )
+{
+    Trace::Region region( trace, "solve_for_update" );
+    const double startTime = MPI_Wtime();
+    const int num_cells = subGrid.c_grid->number_of_cells;
+    const int num_owned = num_cells - subGrid.number_of_ghost_cells;
+
+    // The rows of the owned cells, with columns for the unknowns of all local cells.
+    typedef Eigen::Triplet<double> Triplet;
+    std::vector<Triplet> entries;
+    std::vector<double> rhs( num*num_owned );
+    for( int r = 0; r < num; ++r ) {
+        if ( residual[r].size() != num_cells ) {
+            OPM_THROW( std::runtime_error, "newtonSolve requires residuals on all cells." );
+        }
+        const auto& jac = residual[r].derivative();
+        for( int c = 0; c < int(jac.size()); ++c ) {
+            const CollOfScalar::M& block = jac[c];
+            for( int col = 0; col < block.outerSize(); ++col ) {
+                for( CollOfScalar::M::InnerIterator it( block, col ); it; ++it ) {
+                    if ( it.row() < num_owned ) {
+                        entries.emplace_back( r*num_owned + it.row(), c*num_cells + it.col(), it.value() );
+                    }
+                }
+            }
+        }
+        std::copy_n( residual[r].value().data(), num_owned, rhs.begin() + r*num_owned );
+    }
+    DistributedKrylovSolver::RowMatrix jacobian( num*num_owned, num*num_cells );
+    jacobian.setFromTriplets( entries.begin(), entries.end() );
+    jacobian.makeCompressed();
+
+    std::vector<double> x( num*num_owned );
+    KrylovSolver::Report rep;
+    {
+        Trace::Region solve_region( trace, "linear_solve" );
+        rep = linsolver->solve( jacobian, num, rhs.data(), x.data() );
+    }
+    if ( verbose_ > 2 && getMPIRank() == 0 ) {
+        std::cout << "        linearSolve: " << linsolver->name() << ", " << rep.iterations
+                  << " iterations, residual " << rep.residual << std::endl;
+    }
+    logstream << "Linear solve took " << MPI_Wtime() - startTime << " seconds, "
+              << rep.iterations << " iterations" << std::endl;
+    if ( !rep.converged ) {
+        OPM_THROW( std::runtime_error, "Linear solver convergence failure (" << linsolver->name()
+                   << ", residual " << rep.residual << ")" );
+    }
+
+    for( int r = 0; r < num; ++r ) {
+        du[r].resize( num_cells );
+        std::copy_n( x.begin() + r*num_owned, num_owned, du[r].data() );
+        halo->exchange( du[r].data() );
+    }
+}
+
+CollOfScalar RuntimeMPI::haloExchange( const CollOfScalar& coll ) const
+{
+    if ( coll.size() != subGrid.c_grid->number_of_cells ) {
+        OPM_THROW( std::logic_error, "Halo exchange requires a collection on all cells, got size " << coll.size() );
+    }
+    if ( halo->numNeighbours() == 0 ) {
+        return coll;
+    }
+    Trace::Region region( trace, "halo_exchange" );
+    CollOfScalar::V values = coll.value();
+    halo->exchange( values.data() );
+    if ( !coll.derivative().empty() ) {
+        // The derivatives can not be exchanged, so they are only valid if the
+        // ghost values already were.
+        requireConsistentGhosts( coll.value(), values, ghost_cells_, "haloExchange" );
+        return coll;
+    }
+    return CollOfScalar( values );
+}
+
 } // namespace equlle
@@ -1,9 +1,6 @@
 #include "equelle/SubGridBuilder.hpp"
 
 #include <opm/core/grid.h>
-#include <opm/autodiff/AutoDiffHelpers.hpp>
-#include <set>
-#include <unordered_map>
 #include <algorithm>
 #include <iostream>
 #include <iterator>
@@ -13,76 +10,88 @@
 
 namespace equelle {
 
-std::set<int> SubGridBuilder::extractNeighborCells(const UnstructuredGrid *grid, const std::vector<int> &cellsToExtract)
+namespace {
+
+void sortUnique( std::vector<int>& v )
+{
+    std::sort( v.begin(), v.end() );
+    v.erase( std::unique( v.begin(), v.end() ), v.end() );
+}
+
+/// Replace each value by its position in sorted, where it must be present.
+void toPositions( const std::vector<int>& sorted, std::vector<int>& values )
 {
-    std::set<int> neighborCells;
+    for( int& v : values ) {
+        v = std::lower_bound( sorted.begin(), sorted.end(), v ) - sorted.begin();
+    }
+}
 
-    // Extract the inner-neighbors
+} // anonymous namespace
+
+IndexMap::IndexMap( const std::vector<int>& local_to_global )
+{
+    entries_.reserve( local_to_global.size() );
+    for( int local = 0; local < int(local_to_global.size()); ++local ) {
+        entries_.emplace_back( local_to_global[local], local );
+    }
+    std::sort( entries_.begin(), entries_.end() );
+}
 
-    Opm::HelperOps helperOps( *grid );
-    Opm::HelperOps::M adj = helperOps.div * helperOps.ngrad;
+IndexMap::const_iterator IndexMap::find( const int global ) const
+{
+    auto it = std::lower_bound( entries_.begin(), entries_.end(), value_type( global, -1 ) );
+    return ( it != entries_.end() && it->first == global ) ? it : entries_.end();
+}
 
-    //std::cout << helperOps.div << std::endl;
-    //std::cout << adj << std::endl;
+int IndexMap::local( const int global ) const
+{
+    auto it = find( global );
+    return it != entries_.end() ? it->second : -1;
+}
 
-    for( int i = 0; i < cellsToExtract.size(); ++i ) {
-        int cell = cellsToExtract[i];
-        for( Eigen::SparseMatrix<double>::InnerIterator it( adj, cell); it; ++it ) {
-            if( it.row() == it.col() ) { // Skip diagonal elements
-                // NOP
-            } else {
-                // By using it.index() we can ignore what is the inner and outer dimensions. (Ie col-major or row-major.)
-                neighborCells.insert( it.index() );
+std::vector<int> SubGridBuilder::extractNeighborCells(const UnstructuredGrid *grid, const std::vector<int> &cellsToExtract)
+{
+    // Visit the faces of each cell, and take the cell on the other side.
+    std::vector<int> neighborCells;
+    for( int cell : cellsToExtract ) {
+        for( int i = grid->cell_facepos[cell]; i < grid->cell_facepos[cell+1]; ++i ) {
+            const int face = grid->cell_faces[i];
+            const int c0 = grid->face_cells[2*face];
+            const int other = ( c0 == cell ) ? grid->face_cells[2*face + 1] : c0;
+            if ( other >= 0 ) {
+                neighborCells.push_back( other );
             }
         }
     }
-
-    return neighborCells;
+    sortUnique( neighborCells );
+
+    std::vector<int> owned( cellsToExtract );
+    std::sort( owned.begin(), owned.end() );
+    std::vector<int> ghostCells;
+    std::set_difference( neighborCells.begin(), neighborCells.end(), owned.begin(), owned.end(),
+                         std::back_inserter( ghostCells ) );
+    return ghostCells;
 }
 
 SubGridBuilder::face_mapping
 SubGridBuilder::extractNeighborFaces(const UnstructuredGrid *grid, const std::vector<int> &cellsToExtract )
 {    
-    std::unordered_map<int, int> old2new;
-
-    // new_cell_facepos will be of size numCells + 1, so we make the first element zero.
-    std::vector<int> new_cell_facepos( 1, 0 ); new_cell_facepos.reserve( cellsToExtract.size() );
-    std::vector<int> new_cell_faces;
+    face_mapping fmap;
 
-    for( int cell_index = 0; cell_index < cellsToExtract.size(); cell_index++ ) {
-        const int cell = cellsToExtract[cell_index];
+    // cell_facepos will be of size numCells + 1, so we make the first element zero.
+    fmap.cell_facepos.reserve( cellsToExtract.size() + 1 );
+    fmap.cell_facepos.push_back( 0 );
+    for( int cell : cellsToExtract ) {
         const int startIndex = grid->cell_facepos[cell];
         const int endIndex   = grid->cell_facepos[cell+1];
-
-        for( int i = startIndex; i < endIndex; ++i ) {
-            const auto old_face_index = grid->cell_faces[i];
-
-            // Create the new face index.
-            if ( old2new.find( old_face_index ) == old2new.end() ) {
-                const int new_face_index = old2new.size(); // Get the size before we start looking for the key!
-                old2new[old_face_index] = new_face_index;
-            }
-
-            const auto new_face_index = old2new[old_face_index];
-            new_cell_faces.push_back( new_face_index );
-        }
-
-        new_cell_facepos.push_back( endIndex - startIndex + new_cell_facepos.back() );
+        fmap.cell_faces.insert( fmap.cell_faces.end(), grid->cell_faces + startIndex, grid->cell_faces + endIndex );
+        fmap.cell_facepos.push_back( fmap.cell_faces.size() );
     }
 
-    // Invert the list of indices.
-    std::vector<int> global_face( old2new.size(), -1 );
-
-    for( auto it: old2new ) {
-        global_face[it.second] =  it.first;
-    }
-
-    // Set up the return structure.
-    face_mapping fmap;
-    fmap.cell_facepos = new_cell_facepos;
-    fmap.cell_faces   = new_cell_faces;
-    fmap.global_face  = global_face;
-    fmap.face_global_to_local = old2new;
+    // The local faces are numbered in the order of their global index.
+    fmap.global_face = fmap.cell_faces;
+    sortUnique( fmap.global_face );
+    toPositions( fmap.global_face, fmap.cell_faces );
 
     return fmap;
 }
@@ -90,37 +99,22 @@ SubGridBuilder::extractNeighborFaces(const UnstructuredGrid *grid, const std::ve
 SubGridBuilder::node_mapping
 SubGridBuilder::extractNeighborNodes(const UnstructuredGrid *grid, const std::vector<int> &globalFaces )
 {
-    std::unordered_map<int, int> old2new;
     node_mapping nm;
-    nm.face_nodepos.reserve( globalFaces.size() );
+    nm.face_nodepos.reserve( globalFaces.size() + 1 );
     nm.face_nodepos.push_back( 0 );
 
-    for( auto face: globalFaces ) {
+    for( int face : globalFaces ) {
         const int startIndex = grid->face_nodepos[face];
         const int endIndex   = grid->face_nodepos[face+1];
-
-        for( auto i = startIndex; i < endIndex; ++i ) {
-            const auto old_node_index = grid->face_nodes[i];
-
-            if ( old2new.find( old_node_index ) == old2new.end() ) {
-                const int new_node_index = old2new.size();
-                old2new[old_node_index] = new_node_index;
-            }
-
-            const auto new_node_index = old2new[old_node_index];
-            nm.face_nodes.push_back( new_node_index );
-        }
-
-        nm.face_nodepos.push_back( endIndex - startIndex + nm.face_nodepos.back() );
+        nm.face_nodes.insert( nm.face_nodes.end(), grid->face_nodes + startIndex, grid->face_nodes + endIndex );
+        nm.face_nodepos.push_back( nm.face_nodes.size() );
     }
 
-    // Invert the list of indices.
-    nm.global_node.resize( old2new.size(), -1 );
+    // The local nodes are numbered in the order of their global index.
+    nm.global_node = nm.face_nodes;
+    sortUnique( nm.global_node );
+    toPositions( nm.global_node, nm.face_nodes );
 
-    for( auto it: old2new ) {
-        nm.global_node[it.second] = it.first;
-    }
-    nm.node_global_to_local = old2new;
     return nm;
 }
 
@@ -136,11 +130,6 @@ void reduceAndReindex( const T* src, T* dst, const int* oldIndices, const int nu
 void SubGridBuilder::build_face_cells( const face_mapping &participatingFaces,
                                        SubGrid &subGrid, const UnstructuredGrid* grid)
 {
-    std::unordered_map<int, int> cell_glob2loc;
-    for( int i = 0; i < subGrid.cell_local_to_global.size(); ++i ) {
-        cell_glob2loc[ subGrid.cell_local_to_global[i] ] = i;
-    }
-
     for( int lface = 0; lface < participatingFaces.global_face.size(); ++lface ) {
         int gface = participatingFaces.global_face[lface];
 
@@ -153,8 +142,10 @@ void SubGridBuilder::build_face_cells( const face_mapping &participatingFaces,
             if ( gcell == Boundary::outer ) {
                 lcell = Boundary::outer;
             } else { // Check if the cells is part of the subgrid or an inner-boundary.
-                auto it = cell_glob2loc.find( gcell );
-                lcell = ( it != cell_glob2loc.end() ) ? it->second : Boundary::inner;
+                lcell = subGrid.cell_global_to_local.local( gcell );
+                if ( lcell < 0 ) {
+                    lcell = Boundary::inner;
+                }
             }
 
             subGrid.c_grid->face_cells[2*lface + i] = lcell;
@@ -162,24 +153,42 @@ void SubGridBuilder::build_face_cells( const face_mapping &participatingFaces,
     }
 }
 
+void SubGridBuilder::classify_cells( SubGrid& subGrid )
+{
+    const UnstructuredGrid* grid = subGrid.c_grid;
+    const int num_owned = grid->number_of_cells - subGrid.number_of_ghost_cells;
+
+    for( int cell = 0; cell < num_owned; ++cell ) {
+        bool has_ghost_neighbor = false;
+        for( int i = grid->cell_facepos[cell]; i < grid->cell_facepos[cell+1]; ++i ) {
+            const int face = grid->cell_faces[i];
+            // Ghost cells are numbered after the owned cells.
+            if ( grid->face_cells[2*face] >= num_owned || grid->face_cells[2*face + 1] >= num_owned ) {
+                has_ghost_neighbor = true;
+                break;
+            }
+        }
+        if ( has_ghost_neighbor ) {
+            subGrid.partition_boundary_cells.push_back( cell );
+        } else {
+            subGrid.interior_cells.push_back( cell );
+        }
+    }
+}
+
 SubGrid SubGridBuilder::build(const UnstructuredGrid* grid, const std::vector<int>& cellsToExtract )
 {
     SubGrid subGrid;
 
     // Extract the cells and ghost-cells that that will be part of our subdomain    
-    std::set<int> neighborCells = extractNeighborCells(grid, cellsToExtract);
+    const std::vector<int> ghostCells = extractNeighborCells(grid, cellsToExtract);
 
-    // Build up the local to global mapping based on the input and the additional neighbor cells found above
+    // Build up the local to global mapping based on the input and the ghost cells found above
     subGrid.cell_local_to_global = cellsToExtract;
-    std::set_difference( neighborCells.begin(), neighborCells.end(), cellsToExtract.begin(), cellsToExtract.end(),
-                         std::back_inserter( subGrid.cell_local_to_global ) );
+    subGrid.cell_local_to_global.insert( subGrid.cell_local_to_global.end(), ghostCells.begin(), ghostCells.end() );
 
     // Build the inverse of global_cell
-    subGrid.cell_global_to_local.reserve( subGrid.cell_local_to_global.size() );
-    for( int local_cell_id = 0; local_cell_id < subGrid.cell_local_to_global.size(); ++local_cell_id ) {
-        int global_cell_id = subGrid.cell_local_to_global[ local_cell_id ];
-        subGrid.cell_global_to_local[ global_cell_id ] = local_cell_id;
-    }
+    subGrid.cell_global_to_local = IndexMap( subGrid.cell_local_to_global );
 
     subGrid.number_of_ghost_cells = subGrid.cell_local_to_global.size() - cellsToExtract.size();
 
@@ -187,7 +196,7 @@ SubGrid SubGridBuilder::build(const UnstructuredGrid* grid, const std::vector<in
     auto participatingNodes = extractNeighborNodes(grid, participatingFaces.global_face);
 
     subGrid.face_local_to_global = participatingFaces.global_face;
-    subGrid.face_global_to_local = participatingFaces.face_global_to_local;
+    subGrid.face_global_to_local = IndexMap( subGrid.face_local_to_global );
 
     subGrid.c_grid = allocate_grid( grid->dimensions, subGrid.cell_local_to_global.size(),
                                     participatingFaces.global_face.size(), participatingNodes.face_nodes.size(),
@@ -208,6 +217,7 @@ SubGrid SubGridBuilder::build(const UnstructuredGrid* grid, const std::vector<in
     const int dim = grid->dimensions;
 
     build_face_cells( participatingFaces, subGrid, grid );
+    classify_cells( subGrid );
 
     // Reindex for addressing based on cells
     reduceAndReindex( grid->cell_centroids, subGrid.c_grid->cell_centroids, subGrid.cell_local_to_global.data(), subGrid.cell_local_to_global.size(), dim );
@@ -226,6 +236,88 @@ SubGrid SubGridBuilder::build(const UnstructuredGrid* grid, const std::vector<in
     return subGrid;
 }
 
+namespace {
+
+template<typename T>
+void append( std::vector<T>& dst, const T* src, const int n ) {
+    dst.insert( dst.end(), src, src + n );
+}
+
+template<typename T>
+const T* extract( const T* src, T* dst, const int n ) {
+    std::copy_n( src, n, dst );
+    return src + n;
+}
+
+} // anonymous namespace
+
+void SubGridBuilder::pack( const SubGrid& subGrid, std::vector<int>& ints, std::vector<double>& doubles )
+{
+    const UnstructuredGrid* g = subGrid.c_grid;
+    const int dim = g->dimensions;
+    const int nc = g->number_of_cells;
+    const int nf = g->number_of_faces;
+    const int nn = g->number_of_nodes;
+    const int num_face_nodes = g->face_nodepos[nf];
+    const int num_cell_faces = g->cell_facepos[nc];
+
+    ints = { dim, nc, nf, nn, num_face_nodes, num_cell_faces, subGrid.number_of_ghost_cells };
+    append( ints, g->face_nodes, num_face_nodes );
+    append( ints, g->face_nodepos, nf + 1 );
+    append( ints, g->face_cells, 2*nf );
+    append( ints, g->cell_faces, num_cell_faces );
+    append( ints, g->cell_facepos, nc + 1 );
+    append( ints, subGrid.cell_local_to_global.data(), nc );
+    append( ints, subGrid.face_local_to_global.data(), nf );
+
+    doubles.clear();
+    append( doubles, g->node_coordinates, dim*nn );
+    append( doubles, g->face_centroids, dim*nf );
+    append( doubles, g->face_areas, nf );
+    append( doubles, g->face_normals, dim*nf );
+    append( doubles, g->cell_centroids, dim*nc );
+    append( doubles, g->cell_volumes, nc );
+}
+
+SubGrid SubGridBuilder::unpack( const std::vector<int>& ints, const std::vector<double>& doubles )
+{
+    const int dim = ints[0];
+    const int nc = ints[1];
+    const int nf = ints[2];
+    const int nn = ints[3];
+    const int num_face_nodes = ints[4];
+    const int num_cell_faces = ints[5];
+
+    SubGrid subGrid;
+    subGrid.number_of_ghost_cells = ints[6];
+    subGrid.c_grid = allocate_grid( dim, nc, nf, num_face_nodes, num_cell_faces, nn );
+    UnstructuredGrid* g = subGrid.c_grid;
+
+    const int* ip = ints.data() + 7;
+    ip = extract( ip, g->face_nodes, num_face_nodes );
+    ip = extract( ip, g->face_nodepos, nf + 1 );
+    ip = extract( ip, g->face_cells, 2*nf );
+    ip = extract( ip, g->cell_faces, num_cell_faces );
+    ip = extract( ip, g->cell_facepos, nc + 1 );
+    subGrid.cell_local_to_global.assign( ip, ip + nc );
+    ip += nc;
+    subGrid.face_local_to_global.assign( ip, ip + nf );
+
+    const double* dp = doubles.data();
+    dp = extract( dp, g->node_coordinates, dim*nn );
+    dp = extract( dp, g->face_centroids, dim*nf );
+    dp = extract( dp, g->face_areas, nf );
+    dp = extract( dp, g->face_normals, dim*nf );
+    dp = extract( dp, g->cell_centroids, dim*nc );
+    dp = extract( dp, g->cell_volumes, nc );
+
+    subGrid.cell_global_to_local = IndexMap( subGrid.cell_local_to_global );
+    subGrid.face_global_to_local = IndexMap( subGrid.face_local_to_global );
+    classify_cells( subGrid );
+
+    return subGrid;
+}
+
 SubGridBuilder::SubGridBuilder()
 {
 }
@@ -0,0 +1,223 @@
+#include "equelle/Trace.hpp"
+
+#include <opm/core/utility/ErrorMacros.hpp>
+#include <iomanip>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "equelle/mpiutils.hpp"
+
+namespace equelle {
+
+namespace {
+
+const char* category_names[] = { "compute", "communication", "wait" };
+
+/// The sorted union of the names on all nodes.
+std::vector<std::string> allNames( const std::vector<std::string>& names, MPI_Comm comm )
+{
+    std::string joined;
+    for( const std::string& name : names ) {
+        joined += name + '\n';
+    }
+    int size;
+    MPI_SAFE_CALL( MPI_Comm_size( comm, &size ) );
+    int length = joined.size();
+    std::vector<int> lengths( size ), displs( size + 1, 0 );
+    MPI_SAFE_CALL( MPI_Allgather( &length, 1, MPI_INT, lengths.data(), 1, MPI_INT, comm ) );
+    for( int r = 0; r < size; ++r ) {
+        displs[r+1] = displs[r] + lengths[r];
+    }
+    std::vector<char> all( displs.back() + 1 );
+    MPI_SAFE_CALL( MPI_Allgatherv( const_cast<char*>( joined.c_str() ), length, MPI_CHAR,
+                                   all.data(), lengths.data(), displs.data(), MPI_CHAR, comm ) );
+
+    std::set<std::string> unique;
+    std::istringstream is( std::string( all.data(), displs.back() ) );
+    std::string name;
+    while ( std::getline( is, name ) ) {
+        unique.insert( name );
+    }
+    return std::vector<std::string>( unique.begin(), unique.end() );
+}
+
+/// Reduce each element over the nodes, to rank 0.
+std::vector<double> reduce( const std::vector<double>& local, MPI_Op op, MPI_Comm comm )
+{
+    std::vector<double> result( local.size() );
+    MPI_SAFE_CALL( MPI_Reduce( const_cast<double*>( local.data() ), result.data(), local.size(),
+                               MPI_DOUBLE, op, 0, comm ) );
+    return result;
+}
+
+} // anonymous namespace
+
+
+Trace::Trace()
+    : enabled_( false ),
+      start_time_( 0.0 ),
+      rank_( 0 )
+{
+}
+
+Trace::~Trace()
+{
+    if ( file_.is_open() ) {
+        // Name the process after the rank, and close the event array.
+        file_ << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << rank_
+              << ",\"args\":{\"name\":\"rank " << rank_ << "\"}}\n]\n";
+    }
+}
+
+void Trace::open( const std::string& filename, MPI_Comm comm )
+{
+    file_.open( filename.c_str() );
+    if ( !file_ ) {
+        OPM_THROW( std::runtime_error, "Could not open trace file " << filename );
+    }
+    file_ << "[\n";
+    MPI_SAFE_CALL( MPI_Comm_rank( comm, &rank_ ) );
+    // Line up the time stamps of the nodes.
+    MPI_SAFE_CALL( MPI_Barrier( comm ) );
+    start_time_ = MPI_Wtime();
+    enabled_ = true;
+}
+
+Trace::Region::Region( Trace& trace, const char* name, const Category category )
+    : trace_( trace ),
+      name_( name ),
+      category_( category ),
+      start_( trace.enabled() ? MPI_Wtime() : 0.0 ),
+      messages_( 0 ),
+      bytes_( 0 )
+{
+}
+
+Trace::Region::~Region()
+{
+    if ( trace_.enabled() ) {
+        trace_.record( name_, category_, start_, MPI_Wtime(), messages_, bytes_ );
+    }
+}
+
+void Trace::Region::addMessages( const int messages, const long long bytes )
+{
+    messages_ += messages;
+    bytes_ += bytes;
+}
+
+void Trace::record( const char* name, const Category category, const double start, const double end,
+                    const int messages, const long long bytes )
+{
+    if ( !enabled_ ) {
+        return;
+    }
+    file_ << "{\"name\":\"" << name << "\",\"cat\":\"" << category_names[category]
+          << "\",\"ph\":\"X\",\"pid\":" << rank_ << ",\"tid\":0"
+          << ",\"ts\":" << std::fixed << std::setprecision( 3 ) << ( start - start_time_ ) * 1e6
+          << ",\"dur\":" << ( end - start ) * 1e6;
+    if ( messages > 0 || bytes > 0 ) {
+        file_ << ",\"args\":{\"messages\":" << messages << ",\"bytes\":" << bytes << "}";
+    }
+    file_ << "},\n";
+
+    auto it = totals_.find( name );
+    if ( it == totals_.end() ) {
+        it = totals_.insert( std::make_pair( std::string( name ), Totals{ category, 0, 0.0, 0, 0 } ) ).first;
+    }
+    Totals& t = it->second;
+    t.calls += 1;
+    t.time += end - start;
+    t.messages += messages;
+    t.bytes += bytes;
+}
+
+void Trace::setCounter( const std::string& name, const double value )
+{
+    counters_[name] = value;
+}
+
+void Trace::summarize( std::ostream& out, MPI_Comm comm ) const
+{
+    int rank, size;
+    MPI_SAFE_CALL( MPI_Comm_rank( comm, &rank ) );
+    MPI_SAFE_CALL( MPI_Comm_size( comm, &size ) );
+
+    // Nodes may have events the others lack, so the totals are laid out by the union of the names.
+    std::vector<std::string> names;
+    for( const auto& t : totals_ ) {
+        names.push_back( t.first );
+    }
+    names = allNames( names, comm );
+    const int n = names.size();
+    std::vector<double> category( n, -1.0 ), calls( n, 0.0 ), time( n, 0.0 ), messages( n, 0.0 ), bytes( n, 0.0 );
+    for( int i = 0; i < n; ++i ) {
+        auto it = totals_.find( names[i] );
+        if ( it != totals_.end() ) {
+            category[i] = it->second.category;
+            calls[i] = it->second.calls;
+            time[i] = it->second.time;
+            messages[i] = it->second.messages;
+            bytes[i] = it->second.bytes;
+        }
+    }
+    const std::vector<double> cat_max = reduce( category, MPI_MAX, comm );
+    const std::vector<double> time_min = reduce( time, MPI_MIN, comm );
+    const std::vector<double> time_max = reduce( time, MPI_MAX, comm );
+    const std::vector<double> time_sum = reduce( time, MPI_SUM, comm );
+    const std::vector<double> calls_sum = reduce( calls, MPI_SUM, comm );
+    const std::vector<double> messages_sum = reduce( messages, MPI_SUM, comm );
+    const std::vector<double> bytes_sum = reduce( bytes, MPI_SUM, comm );
+
+    std::vector<std::string> counter_names;
+    for( const auto& c : counters_ ) {
+        counter_names.push_back( c.first );
+    }
+    counter_names = allNames( counter_names, comm );
+    const int m = counter_names.size();
+    std::vector<double> values( m, 0.0 );
+    for( int i = 0; i < m; ++i ) {
+        auto it = counters_.find( counter_names[i] );
+        if ( it != counters_.end() ) {
+            values[i] = it->second;
+        }
+    }
+    const std::vector<double> value_min = reduce( values, MPI_MIN, comm );
+    const std::vector<double> value_max = reduce( values, MPI_MAX, comm );
+    const std::vector<double> value_sum = reduce( values, MPI_SUM, comm );
+
+    if ( rank != 0 ) {
+        return;
+    }
+    out << "Trace summary over " << size << " nodes. Times in seconds per node, "
+        << "messages and bytes summed over the nodes.\n";
+    out << std::left << std::setw( 28 ) << "event" << std::setw( 15 ) << "category" << std::right
+        << std::setw( 10 ) << "calls" << std::setw( 12 ) << "min" << std::setw( 12 ) << "mean"
+        << std::setw( 12 ) << "max" << std::setw( 10 ) << "max/mean" << std::setw( 12 ) << "messages"
+        << std::setw( 14 ) << "bytes" << "\n";
+    for( int i = 0; i < n; ++i ) {
+        const double mean = time_sum[i] / size;
+        out << std::left << std::setw( 28 ) << names[i] << std::setw( 15 ) << category_names[ int( cat_max[i] ) ]
+            << std::right << std::setw( 10 ) << static_cast<long long>( calls_sum[i] )
+            << std::scientific << std::setprecision( 3 )
+            << std::setw( 12 ) << time_min[i] << std::setw( 12 ) << mean << std::setw( 12 ) << time_max[i]
+            << std::fixed << std::setprecision( 2 ) << std::setw( 10 ) << ( mean > 0.0 ? time_max[i] / mean : 1.0 )
+            << std::setw( 12 ) << static_cast<long long>( messages_sum[i] )
+            << std::setw( 14 ) << static_cast<long long>( bytes_sum[i] ) << "\n";
+    }
+    if ( m > 0 ) {
+        out << "\n" << std::left << std::setw( 28 ) << "counter" << std::right << std::setw( 14 ) << "min"
+            << std::setw( 14 ) << "mean" << std::setw( 14 ) << "max" << std::setw( 10 ) << "max/mean" << "\n";
+    }
+    for( int i = 0; i < m; ++i ) {
+        const double mean = value_sum[i] / size;
+        out << std::left << std::setw( 28 ) << counter_names[i] << std::right << std::setprecision( 1 )
+            << std::setw( 14 ) << value_min[i] << std::setw( 14 ) << mean << std::setw( 14 ) << value_max[i]
+            << std::setprecision( 2 ) << std::setw( 10 ) << ( mean > 0.0 ? value_max[i] / mean : 1.0 ) << "\n";
+    }
+    out.flush();
+}
+
+} // namespace equelle
@@ -5,93 +5,205 @@
 #include <iterator>
 #include <ostream>
 #include <fstream>
+#include <cassert>
+#include <cmath>
 
 #include <opm/core/grid.h>
-#include <opm/autodiff/AutoDiffHelpers.hpp>
+#include <opm/core/utility/ErrorMacros.hpp>
 
 
 #include "equelle/mpiutils.hpp"
 
+namespace {
+
+/// Half transmissibility of a face seen from a cell, for a unit permeability.
+double halfTransmissibility( const UnstructuredGrid* grid, const int cell, const int face )
+{
+    const int dim = grid->dimensions;
+    double dn = 0.0, dd = 0.0;
+    for( int d = 0; d < dim; ++d ) {
+        const double dist = grid->face_centroids[dim*face + d] - grid->cell_centroids[dim*cell + d];
+        dn += dist * grid->face_normals[dim*face + d]; // The normals are scaled by the face area.
+        dd += dist * dist;
+    }
+    return std::abs( dn ) / dd;
+}
+
+float edgeWeight( const UnstructuredGrid* grid, const equelle::ZoltanGrid::EdgeWeights type, const int face )
+{
+    switch( type ) {
+    case equelle::ZoltanGrid::face_area:
+        return grid->face_areas[face];
+    case equelle::ZoltanGrid::transmissibility: {
+        const double t0 = halfTransmissibility( grid, grid->face_cells[2*face], face );
+        const double t1 = halfTransmissibility( grid, grid->face_cells[2*face + 1], face );
+        return t0 * t1 / ( t0 + t1 );
+    }
+    default:
+        return 1.0f;
+    }
+}
+
+} // anonymous namespace
+
+equelle::ZoltanGrid::ZoltanGrid( const UnstructuredGrid* grid, const EdgeWeights edge_weights,
+                                 const std::vector<int>& owner )
+    : grid_( grid ),
+      owner_( owner )
+{
+    const int rank = equelle::getMPIRank();
+    std::vector<int> local_id( grid->number_of_cells, -1 );
+    for( int cell = 0; cell < grid->number_of_cells; ++cell ) {
+        if ( owner_.empty() || owner_[cell] == rank ) {
+            local_id[cell] = cells_.size();
+            cells_.push_back( cell );
+        }
+    }
+
+    // Collect the neighbours from the interior faces. Cells sharing more than one face
+    // are joined by a single edge, weighted by the sum over the faces.
+    std::vector<std::vector<std::pair<int, float>>> nbors( cells_.size() );
+    for( int face = 0; face < grid->number_of_faces; ++face ) {
+        const int c0 = grid->face_cells[2*face];
+        const int c1 = grid->face_cells[2*face + 1];
+        if ( c0 < 0 || c1 < 0 || ( local_id[c0] < 0 && local_id[c1] < 0 ) ) {
+            continue;
+        }
+        const float weight = edgeWeight( grid, edge_weights, face );
+        if ( local_id[c0] >= 0 ) {
+            nbors[ local_id[c0] ].emplace_back( c1, weight );
+        }
+        if ( local_id[c1] >= 0 ) {
+            nbors[ local_id[c1] ].emplace_back( c0, weight );
+        }
+    }
+
+    nbor_start_.push_back( 0 );
+    for( auto& n : nbors ) {
+        std::sort( n.begin(), n.end() );
+        for( int k = 0; k < int(n.size()); ++k ) {
+            if ( k > 0 && n[k].first == n[k-1].first ) {
+                nbor_weight_.back() += n[k].second;
+            } else {
+                nbor_.push_back( n[k].first );
+                nbor_weight_.push_back( n[k].second );
+            }
+        }
+        nbor_start_.push_back( nbor_.size() );
+    }
+}
+
+equelle::ZoltanGrid::EdgeWeights equelle::ZoltanGrid::edgeWeights( const std::string& name )
+{
+    if ( name == "none" ) {
+        return unit_weights;
+    } else if ( name == "area" ) {
+        return face_area;
+    } else if ( name == "transmissibility" ) {
+        return transmissibility;
+    }
+    OPM_THROW( std::runtime_error, "Unknown partition_edge_weights: " << name
+               << ", expected none, area or transmissibility." );
+}
+
+void equelle::ZoltanGrid::setCellWeights( const std::vector<float>& weights )
+{
+    if ( int(weights.size()) != grid_->number_of_cells ) {
+        OPM_THROW( std::runtime_error, "Expected " << grid_->number_of_cells << " cell weights, got "
+                   << weights.size() );
+    }
+    cell_weights_ = weights;
+}
+
 int equelle::ZoltanGrid::getNumberOfObjects(void *data, int *ierr)
 {
-    auto grid = reinterpret_cast<UnstructuredGrid*>( data );
+    auto zgrid = reinterpret_cast<ZoltanGrid*>( data );
 
     *ierr = ZOLTAN_OK;
 
-    return grid->number_of_cells;
+    return zgrid->cells_.size();
 }
 
 void equelle::ZoltanGrid::getCellList( void *data, int /*sizeGID*/, int /*sizeLID*/,
                                        ZOLTAN_ID_PTR globalId, ZOLTAN_ID_PTR localId,
-                                       int /*wgt_dim*/, float* /* weights */, int *ierr )
+                                       int wgt_dim, float* weights, int *ierr )
 {
     *ierr = ZOLTAN_OK;
-    auto grid = reinterpret_cast<UnstructuredGrid*>( data );
+    auto zgrid = reinterpret_cast<ZoltanGrid*>( data );
 
-    for( auto i = 0; i < grid->number_of_cells; ++i ) {
-        globalId[i] = i;
+    for( int i = 0; i < int(zgrid->cells_.size()); ++i ) {
+        const int cell = zgrid->cells_[i];
+        globalId[i] = cell;
         localId[i]  = i;
-        //weights[i]  = 1.0f;
+        if ( wgt_dim > 0 ) {
+            weights[i] = zgrid->cell_weights_.empty() ? 1.0f : zgrid->cell_weights_[cell];
+        }
     }
 }
 
-// Should we call it getNumberOfNeighbors (for a given cell?) In other words, the number of interior edges.
 void equelle::ZoltanGrid::getNumberOfEdgesMulti( void *data, int /* num_gid_entries */, int /* num_lid_entries */,  int num_obj,
-                                           ZOLTAN_ID_PTR  /*global_id*/  , ZOLTAN_ID_PTR /* local_id */ , int* numEdges, int *ierr )
+                                           ZOLTAN_ID_PTR  /*global_id*/  , ZOLTAN_ID_PTR local_id, int* numEdges, int *ierr )
 {
-    *ierr = ZOLTAN_FATAL;
-
-    auto grid = reinterpret_cast<UnstructuredGrid*>( data );
-
-
-    // The connectivity graph contains the number of neighbors for each cell on the diagonal
-    // and the index of the nonzero, and equal to -1, entries of the row contains the neighboring cell ID.
-    // Proof is by assuming c_1 is neighbor to c_2.
-    // - On the diagnoal this sums the number of neighbors.
-    // - On the nonzero entries this is always -1 due to the orientation of the edges (always 1*(-1) or vice versa).
-    Opm::HelperOps helperOps( *grid );
-    Opm::HelperOps::M adj = helperOps.div * helperOps.ngrad;
+    auto zgrid = reinterpret_cast<ZoltanGrid*>( data );
 
-    auto diag = adj.diagonal();
     for( int i = 0; i < num_obj; ++i ) {
-        numEdges[i] = diag[i];
+        const int k = local_id[i];
+        numEdges[i] = zgrid->nbor_start_[k+1] - zgrid->nbor_start_[k];
     }
 
     *ierr = ZOLTAN_OK;
 }
 
 void equelle::ZoltanGrid::getEdgeListMulti(void *data, int /* num_gid_entries */, int /* num_lid_entries */, int num_obj,
-                                           ZOLTAN_ID_PTR /* global_ids */, ZOLTAN_ID_PTR /* local_ids */ , int *num_edges,
+                                           ZOLTAN_ID_PTR /* global_ids */, ZOLTAN_ID_PTR local_ids, int *num_edges,
                                            ZOLTAN_ID_PTR nbor_global_id, int *nbor_procs,
-                                           int /* wgt_dim */ , float */* ewgts */, int *ierr )
+                                           int wgt_dim, float* ewgts, int *ierr )
 {
     *ierr = ZOLTAN_FATAL;
-    auto grid = reinterpret_cast<UnstructuredGrid*>( data );
-    assert( num_obj == grid->number_of_cells );
-
-    // The connectivity graph contains the number of neighbors for each cell on the diagonal
-    // and the index of the nonzero, and equal to -1, entries of the row contains the neighboring cell ID.
-    // Proof is by assuming c_1 is neighbor to c_2.
-    // - On the diagnoal this sums the number of neighbors.
-    // - On the nonzero entries this is always -1 due to the orientation of the edges (always 1*(-1) or vice versa).
-    Opm::HelperOps helperOps( *grid );
-    Opm::HelperOps::M adj = helperOps.div * helperOps.ngrad;
-
-    // The global id of the neighbors of a cell are given by the column-index of the nonzero, non-diagonal, entries of each row.
-    // These values are always -1.
+    auto zgrid = reinterpret_cast<ZoltanGrid*>( data );
+    const int rank = equelle::getMPIRank();
+
     int global_offset = 0;
-    for( int k = 0; k < adj.outerSize(); ++k ) {
-        for( Eigen::SparseMatrix<double>::InnerIterator it( adj, k); it; ++it ) {                       
-            if( it.row() == it.col() ) { // Skip diagonal elements
-                assert( it.value() == num_edges[k] );
-            } else {
-                // By using it.index() we can ignore what is the inner and outer dimensions. (Ie col-major or row-major.)
-                nbor_global_id[global_offset] = it.index();
-                nbor_procs[global_offset] = equelle::getMPIRank();
-                global_offset++;
+    for( int i = 0; i < num_obj; ++i ) {
+        const int k = local_ids[i];
+        assert( num_edges[i] == zgrid->nbor_start_[k+1] - zgrid->nbor_start_[k] );
+        for( int p = zgrid->nbor_start_[k]; p < zgrid->nbor_start_[k+1]; ++p ) {
+            const int nbor = zgrid->nbor_[p];
+            nbor_global_id[global_offset] = nbor;
+            nbor_procs[global_offset] = zgrid->owner_.empty() ? rank : zgrid->owner_[nbor];
+            if ( wgt_dim > 0 ) {
+                ewgts[global_offset] = zgrid->nbor_weight_[p];
             }
-        }       
-    }    
+            global_offset++;
+        }
+    }
+
+    *ierr = ZOLTAN_OK;
+}
+
+int equelle::ZoltanGrid::getNumberOfGeometries( void* data, int* ierr )
+{
+    auto zgrid = reinterpret_cast<ZoltanGrid*>( data );
+
+    *ierr = ZOLTAN_OK;
+
+    return zgrid->grid_->dimensions;
+}
+
+void equelle::ZoltanGrid::getGeometryMulti( void* data, int /* num_gid_entries */, int /* num_lid_entries */, int num_obj,
+                                            ZOLTAN_ID_PTR global_ids, ZOLTAN_ID_PTR /* local_ids */,
+                                            int num_dim, double* geom_vec, int* ierr )
+{
+    auto zgrid = reinterpret_cast<ZoltanGrid*>( data );
+    const UnstructuredGrid* grid = zgrid->grid_;
+    if ( num_dim != grid->dimensions ) {
+        *ierr = ZOLTAN_FATAL;
+        return;
+    }
+
+    for( int i = 0; i < num_obj; ++i ) {
+        std::copy_n( grid->cell_centroids + num_dim*global_ids[i], num_dim, geom_vec + num_dim*i );
+    }
 
     *ierr = ZOLTAN_OK;
 }
@@ -4,6 +4,7 @@
 #include "equelle/RuntimeMPI.hpp"
 #include "equelle/EquelleRuntimeCPU.hpp"
 #include "equelle/mpiutils.hpp"
+#include "equelle/PartitionIO.hpp"
 
 using namespace equelle;
 
@@ -30,7 +31,7 @@ BOOST_AUTO_TEST_CASE( allGather ) {
     er.decompose();
 
     const CollOfScalar a = er.inputCollectionOfScalar("a", er.allCells());
-    const CollOfScalar a_global = er.allGather( a );
+    const CollOfScalar a_global = er.allGather( a, er.allCells() );
 
     BOOST_REQUIRE_EQUAL( er.globalGrid->c_grid()->number_of_cells, a_global.size() );
 
@@ -255,3 +256,327 @@ BOOST_AUTO_TEST_CASE( logging ) {
     BOOST_CHECK_MESSAGE( true, "If this compiles, the observeable state of the program is corret");
 }
 
+
+BOOST_AUTO_TEST_CASE( haloExchange ) {
+    BOOST_REQUIRE_MESSAGE( equelle::getMPISize() > 1, "Test requires program to be run with mpirun." );
+    Opm::parameter::ParameterGroup param;
+    param.disableOutput();
+
+    param.insertParameter( "nx", "4" );
+    param.insertParameter( "ny", "4" );
+
+    equelle::RuntimeMPI er( param );
+    er.decompose();
+
+    // Owned cells hold their global index, ghost cells garbage.
+    const int num_cells = er.subGrid.c_grid->number_of_cells;
+    const int num_owned = num_cells - er.subGrid.number_of_ghost_cells;
+    CollOfScalar::V v( num_cells );
+    for( int i = 0; i < num_cells; ++i ) {
+        v[i] = i < num_owned ? er.subGrid.cell_local_to_global[i] : -1.0;
+    }
+
+    const CollOfScalar u = er.haloExchange( CollOfScalar( v ) );
+
+    BOOST_CHECK_EQUAL_COLLECTIONS( u.value().data(), u.value().data() + u.value().size(),
+                                   er.subGrid.cell_local_to_global.begin(), er.subGrid.cell_local_to_global.end() );
+
+    // The gradient reads the ghost cells, and must see the exchanged values.
+    equelle::EquelleRuntimeCPU ser( er.subGrid.c_grid, param );
+    const CollOfScalar grad = er.gradient( CollOfScalar( v ) );
+    const CollOfScalar gold = ser.gradient( u );
+    BOOST_CHECK_EQUAL_COLLECTIONS( grad.value().data(), grad.value().data() + grad.value().size(),
+                                   gold.value().data(), gold.value().data() + gold.value().size() );
+}
+
+BOOST_AUTO_TEST_CASE( gradientWithDerivatives ) {
+    BOOST_REQUIRE_MESSAGE( equelle::getMPISize() > 1, "Test requires program to be run with mpirun." );
+    Opm::parameter::ParameterGroup param;
+    param.disableOutput();
+
+    param.insertParameter( "nx", "4" );
+    param.insertParameter( "ny", "4" );
+
+    equelle::RuntimeMPI er( param );
+    er.decompose();
+
+    const int num_cells = er.subGrid.c_grid->number_of_cells;
+    const int num_owned = num_cells - er.subGrid.number_of_ghost_cells;
+    const std::vector<int> block_pattern( 1, num_cells );
+    CollOfScalar::V v( num_cells );
+    for( int i = 0; i < num_cells; ++i ) {
+        v[i] = er.subGrid.cell_local_to_global[i];
+    }
+
+    // The ghost values agree with their owners, so the local derivatives are right.
+    const CollOfScalar u = CollOfScalar::variable( 0, v, block_pattern );
+    equelle::EquelleRuntimeCPU ser( er.subGrid.c_grid, param );
+    const CollOfScalar grad = er.gradient( u );
+    const CollOfScalar gold = ser.gradient( u );
+    BOOST_CHECK_EQUAL_COLLECTIONS( grad.value().data(), grad.value().data() + grad.value().size(),
+                                   gold.value().data(), gold.value().data() + gold.value().size() );
+    BOOST_REQUIRE_EQUAL( grad.derivative().size(), 1 );
+    BOOST_CHECK_EQUAL( ( grad.derivative()[0] - gold.derivative()[0] ).norm(), 0.0 );
+    const CollOfScalar exchanged = er.haloExchange( u );
+    BOOST_REQUIRE_EQUAL( exchanged.derivative().size(), 1 );
+    BOOST_CHECK_EQUAL( ( exchanged.derivative()[0] - u.derivative()[0] ).norm(), 0.0 );
+
+    // Stale ghost values come with stale derivatives, which can not be exchanged.
+    for( int i = num_owned; i < num_cells; ++i ) {
+        v[i] = -1.0;
+    }
+    const CollOfScalar stale = CollOfScalar::variable( 0, v, block_pattern );
+    BOOST_CHECK_THROW( er.gradient( stale ), std::logic_error );
+    BOOST_CHECK_THROW( er.operatorOn( stale, er.allCells(), er.boundaryCells() ), std::logic_error );
+    BOOST_CHECK_THROW( er.haloExchange( stale ), std::logic_error );
+}
+
+BOOST_AUTO_TEST_CASE( scatterGrid ) {
+    BOOST_REQUIRE_MESSAGE( equelle::getMPISize() > 1, "Test requires program to be run with mpirun." );
+    Opm::parameter::ParameterGroup param;
+    param.disableOutput();
+
+    param.insertParameter( "nx", "4" );
+    param.insertParameter( "ny", "3" );
+
+    equelle::RuntimeMPI replicated( param );
+    replicated.decompose();
+
+    param.insertParameter( "grid_distribution", "scatter" );
+    equelle::RuntimeMPI scattered( param );
+    scattered.decompose();
+
+    // The grid is released after it is distributed.
+    BOOST_CHECK( !scattered.globalGrid );
+
+    // The scattered pieces must be identical to the subGrids built on every node.
+    const auto& a = replicated.subGrid;
+    const auto& b = scattered.subGrid;
+    BOOST_CHECK_EQUAL( a.number_of_ghost_cells, b.number_of_ghost_cells );
+    BOOST_CHECK_EQUAL_COLLECTIONS( a.cell_local_to_global.begin(), a.cell_local_to_global.end(),
+                                   b.cell_local_to_global.begin(), b.cell_local_to_global.end() );
+    BOOST_CHECK_EQUAL_COLLECTIONS( a.face_local_to_global.begin(), a.face_local_to_global.end(),
+                                   b.face_local_to_global.begin(), b.face_local_to_global.end() );
+    BOOST_CHECK_EQUAL_COLLECTIONS( a.c_grid->face_cells, a.c_grid->face_cells + 2*a.c_grid->number_of_faces,
+                                   b.c_grid->face_cells, b.c_grid->face_cells + 2*b.c_grid->number_of_faces );
+    BOOST_CHECK_EQUAL_COLLECTIONS( a.c_grid->cell_volumes, a.c_grid->cell_volumes + a.c_grid->number_of_cells,
+                                   b.c_grid->cell_volumes, b.c_grid->cell_volumes + b.c_grid->number_of_cells );
+
+    const CollOfCell boundary = scattered.boundaryCells();
+    const CollOfCell gold = replicated.boundaryCells();
+    BOOST_CHECK( boundary == gold );
+}
+
+BOOST_AUTO_TEST_CASE( reductions ) {
+    BOOST_REQUIRE_MESSAGE( equelle::getMPISize() > 1, "Test requires program to be run with mpirun." );
+    Opm::parameter::ParameterGroup param;
+    param.disableOutput();
+
+    param.insertParameter( "nx", "4" );
+    param.insertParameter( "ny", "3" );
+
+    equelle::RuntimeMPI er( param );
+    er.decompose();
+
+    const int num_cells = er.globalGrid->c_grid()->number_of_cells;
+    const int num_faces = er.globalGrid->c_grid()->number_of_faces;
+
+    // Ghost cells and shared faces must only be counted once.
+    const CollOfScalar cell_ones( CollOfScalar::V::Ones( er.allCells().size() ) );
+    const CollOfScalar face_ones( CollOfScalar::V::Ones( er.allFaces().size() ) );
+    BOOST_CHECK_EQUAL( er.sumReduce( cell_ones ), num_cells );
+    BOOST_CHECK_EQUAL( er.sumReduce( face_ones ), num_faces );
+
+    CollOfScalar::V ids( er.subGrid.cell_local_to_global.size() );
+    for( int i = 0; i < ids.size(); ++i ) {
+        ids[i] = er.subGrid.cell_local_to_global[i] + 1;
+    }
+    BOOST_CHECK_EQUAL( er.minReduce( CollOfScalar( ids ) ), 1 );
+    BOOST_CHECK_EQUAL( er.maxReduce( CollOfScalar( ids ) ), num_cells );
+    BOOST_CHECK_EQUAL( er.sumReduce( CollOfScalar( ids ) ), num_cells * ( num_cells + 1 ) / 2 );
+    BOOST_CHECK_EQUAL( er.prodReduce( CollOfScalar( ids ) ), 479001600 ); // 12!
+}
+
+BOOST_AUTO_TEST_CASE( reductionsOnSubsets ) {
+    BOOST_REQUIRE_MESSAGE( equelle::getMPISize() > 1, "Test requires program to be run with mpirun." );
+    Opm::parameter::ParameterGroup param;
+    param.disableOutput();
+
+    param.insertParameter( "nx", "4" );
+    param.insertParameter( "ny", "3" );
+
+    equelle::RuntimeMPI er( param );
+    er.decompose();
+
+    // On the 4x3 grid: 10 boundary cells, 17 interior and 14 boundary faces.
+    const CollOfCell boundary_cells = er.boundaryCells();
+    const CollOfFace interior_faces = er.interiorFaces();
+    const CollOfFace boundary_faces = er.boundaryFaces();
+    const CollOfScalar on_boundary_cells( CollOfScalar::V::Ones( boundary_cells.size() ) );
+    const CollOfScalar on_interior_faces( CollOfScalar::V::Ones( interior_faces.size() ) );
+    const CollOfScalar on_boundary_faces( CollOfScalar::V::Ones( boundary_faces.size() ) );
+    BOOST_CHECK_EQUAL( er.sumReduce( on_boundary_cells, boundary_cells ), 10 );
+    BOOST_CHECK_EQUAL( er.sumReduce( on_interior_faces, interior_faces ), 17 );
+    BOOST_CHECK_EQUAL( er.sumReduce( on_boundary_faces, boundary_faces ), 14 );
+
+    // All cells but 5 and 6 are boundary cells, here numbered from one.
+    CollOfScalar::V ids( boundary_cells.size() );
+    for( int i = 0; i < ids.size(); ++i ) {
+        ids[i] = er.subGrid.cell_local_to_global[boundary_cells[i].index] + 1;
+    }
+    BOOST_CHECK_EQUAL( er.minReduce( CollOfScalar( ids ), boundary_cells ), 1 );
+    BOOST_CHECK_EQUAL( er.maxReduce( CollOfScalar( ids ), boundary_cells ), 12 );
+    BOOST_CHECK_EQUAL( er.sumReduce( CollOfScalar( ids ), boundary_cells ), 78 - 6 - 7 );
+
+    // Without the domain, subsets can not be told apart.
+    const int num_local_cells = er.allCells().size();
+    const int num_local_faces = er.allFaces().size();
+    if ( int( interior_faces.size() ) != num_local_cells && int( interior_faces.size() ) != num_local_faces ) {
+        BOOST_CHECK_THROW( er.sumReduce( on_interior_faces ), std::runtime_error );
+    }
+}
+
+BOOST_AUTO_TEST_CASE( newtonSolve ) {
+    BOOST_REQUIRE_MESSAGE( equelle::getMPISize() > 1, "Test requires program to be run with mpirun." );
+    Opm::parameter::ParameterGroup param;
+    param.disableOutput();
+
+    param.insertParameter( "nx", "6" );
+    param.insertParameter( "ny", "5" );
+    param.insertParameter( "abs_res_tol", "1e-10" );
+    param.insertParameter( "linear_solver_tol", "1e-12" );
+
+    equelle::RuntimeMPI er( param );
+    er.decompose();
+
+    // A nonlinear implicit diffusion step, u*u + u - div(grad u) = 2, has the constant
+    // solution u = 1, which couples the unknowns across the partition boundaries.
+    const CollOfScalar two( CollOfScalar::V::Constant( er.allCells().size(), 2.0 ) );
+    auto residual = [&]( const CollOfScalar& u ) -> CollOfScalar {
+        const CollOfScalar flux = er.negGradient( u );
+        return u*u + u + er.divergence( flux ) - two;
+    };
+    const CollOfScalar u0( CollOfScalar::V::Constant( er.allCells().size(), 0.5 ) );
+    const CollOfScalar u = er.newtonSolve( residual, u0 );
+
+    BOOST_CHECK_EQUAL( u.size(), er.allCells().size() );
+    for( int i = 0; i < u.size(); ++i ) {
+        BOOST_CHECK_CLOSE( u.value()[i], 1.0, 1e-6 );
+    }
+}
+
+BOOST_AUTO_TEST_CASE( repartition ) {
+    BOOST_REQUIRE_MESSAGE( equelle::getMPISize() > 1, "Test requires program to be run with mpirun." );
+    Opm::parameter::ParameterGroup param;
+    param.disableOutput();
+
+    param.insertParameter( "nx", "8" );
+    param.insertParameter( "ny", "4" );
+    param.insertParameter( "partition_edge_weights", "area" );
+
+    equelle::RuntimeMPI er( param );
+    er.decompose();
+
+    // Make the cells of rank 0 ten times as expensive, and carry the global cell ids along.
+    const int num_cells = er.allCells().size();
+    const CollOfScalar cost( CollOfScalar::V::Constant( num_cells, equelle::getMPIRank() == 0 ? 10.0 : 1.0 ) );
+    CollOfScalar::V ids( num_cells );
+    for( int i = 0; i < num_cells; ++i ) {
+        ids[i] = er.subGrid.cell_local_to_global[i];
+    }
+    CollOfScalar field( ids );
+    const int owned_before = num_cells - er.subGrid.number_of_ghost_cells;
+
+    er.repartition( cost, { &field } );
+
+    const int owned_after = er.allCells().size() - er.subGrid.number_of_ghost_cells;
+    if ( equelle::getMPIRank() == 0 ) {
+        BOOST_CHECK_LT( owned_after, owned_before );
+    }
+    BOOST_CHECK_EQUAL( er.sumReduce( CollOfScalar( CollOfScalar::V::Ones( er.allCells().size() ) ) ), 32 );
+    BOOST_REQUIRE_EQUAL( field.size(), er.allCells().size() );
+    for( int i = 0; i < field.size(); ++i ) {
+        BOOST_CHECK_EQUAL( field.value()[i], er.subGrid.cell_local_to_global[i] );
+    }
+}
+
+BOOST_AUTO_TEST_CASE( trace ) {
+    BOOST_REQUIRE_MESSAGE( equelle::getMPISize() > 1, "Test requires program to be run with mpirun." );
+    Opm::parameter::ParameterGroup param;
+    param.disableOutput();
+
+    param.insertParameter( "nx", "6" );
+    param.insertParameter( "ny", "2" );
+    param.insertParameter( "trace", "true" );
+
+    std::stringstream fname;
+    fname << "runtimempi-" << equelle::getMPIRank() << ".trace.json";
+    {
+        equelle::RuntimeMPI er( param );
+        er.decompose();
+        const CollOfScalar u( CollOfScalar::V::Ones( er.allCells().size() ) );
+        er.gradient( u );
+        er.sumReduce( u );
+    }
+
+    // The events are written one per line, and the summary on rank 0 when the runtime is destroyed.
+    std::ifstream events( fname.str().c_str() );
+    std::string all( ( std::istreambuf_iterator<char>( events ) ), std::istreambuf_iterator<char>() );
+    BOOST_CHECK( all.find( "\"name\":\"decompose\"" ) != std::string::npos );
+    BOOST_CHECK( all.find( "\"name\":\"gradient\"" ) != std::string::npos );
+    BOOST_CHECK( all.find( "\"name\":\"allreduce\"" ) != std::string::npos );
+    BOOST_CHECK_EQUAL( all.substr( all.size() - 2 ), "]\n" );
+    if ( equelle::getMPIRank() == 0 ) {
+        std::ifstream summary( "runtimempi-trace-summary.txt" );
+        BOOST_CHECK( summary.good() );
+    }
+}
+
+BOOST_AUTO_TEST_CASE( partitionFile ) {
+    BOOST_REQUIRE_MESSAGE( equelle::getMPISize() > 1, "Test requires program to be run with mpirun." );
+    Opm::parameter::ParameterGroup param;
+    param.disableOutput();
+
+    param.insertParameter( "nx", "8" );
+    param.insertParameter( "ny", "4" );
+
+    // Partition offline, as tools/standalonepartition does.
+    {
+        equelle::RuntimeMPI er( param );
+        const std::vector<int> owner = er.computeOwners( equelle::getMPISize() );
+        if ( equelle::getMPIRank() == 0 ) {
+            BOOST_REQUIRE_EQUAL( owner.size(), 32 );
+            equelle::PartitionIO::write( "partitionFileTest", er.globalGrid->c_grid(), owner, equelle::getMPISize() );
+        }
+        MPI_SAFE_CALL( MPI_Barrier( MPI_COMM_WORLD ) );
+    }
+
+    param.insertParameter( "partition_file", "partitionFileTest" );
+    equelle::RuntimeMPI er( param );
+    BOOST_CHECK( !er.globalGrid );
+    er.decompose();
+
+    // The stored plan must be the one computed from the subGrids.
+    const equelle::HaloExchange computed( er.subGrid );
+    const equelle::PartitionIO::Piece piece = equelle::PartitionIO::read( "partitionFileTest", equelle::getMPIRank(),
+                                                                          equelle::getMPISize() );
+    const equelle::HaloExchange::Plan& a = computed.plan();
+    const equelle::HaloExchange::Plan& b = piece.plan;
+    BOOST_CHECK( a.neighbour_ranks == b.neighbour_ranks );
+    BOOST_CHECK( a.send_start == b.send_start );
+    BOOST_CHECK( a.send_index == b.send_index );
+    BOOST_CHECK( a.recv_start == b.recv_start );
+    BOOST_CHECK( a.recv_index == b.recv_index );
+    destroy_grid( piece.subGrid.c_grid );
+
+    BOOST_CHECK_EQUAL( er.sumReduce( CollOfScalar( CollOfScalar::V::Ones( er.allCells().size() ) ) ), 32 );
+    const int num_cells = er.allCells().size();
+    CollOfScalar::V ids( num_cells );
+    for( int i = 0; i < num_cells; ++i ) {
+        ids[i] = i < num_cells - er.subGrid.number_of_ghost_cells ? er.subGrid.cell_local_to_global[i] : -1;
+    }
+    const CollOfScalar exchanged = er.haloExchange( CollOfScalar( ids ) );
+    for( int i = 0; i < num_cells; ++i ) {
+        BOOST_CHECK_EQUAL( exchanged.value()[i], er.subGrid.cell_local_to_global[i] );
+    }
+}
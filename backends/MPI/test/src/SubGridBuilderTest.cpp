@@ -125,3 +125,39 @@ BOOST_AUTO_TEST_CASE( GridQueryingFunctions ) {
     auto grid = runtime.globalGrid->c_grid();
     BOOST_CHECK_EQUAL( equelle::GridQuerying::numFaces( grid, 0), 4 );
 }
+
+BOOST_AUTO_TEST_CASE( SubGridCellClassification ) {
+    equelle::RuntimeMPI runtime;
+    runtime.globalGrid.reset( new Opm::GridManager( 6, 1 ) );
+    std::vector<int> cellsForSubGrid = { 3, 4, 5 };
+
+    equelle::SubGrid subGrid = equelle::SubGridBuilder::build( runtime.globalGrid->c_grid(), cellsForSubGrid );
+
+    // Only global cell 3 (local cell 0) is next to the ghost cell 2.
+    std::vector<int> interior = { 1, 2 };
+    std::vector<int> boundary = { 0 };
+    BOOST_CHECK_EQUAL_COLLECTIONS( subGrid.interior_cells.begin(), subGrid.interior_cells.end(),
+                                   interior.begin(), interior.end() );
+    BOOST_CHECK_EQUAL_COLLECTIONS( subGrid.partition_boundary_cells.begin(), subGrid.partition_boundary_cells.end(),
+                                   boundary.begin(), boundary.end() );
+}
+
+BOOST_AUTO_TEST_CASE( SubGridUnsortedCells ) {
+    equelle::RuntimeMPI runtime;
+    runtime.globalGrid.reset( new Opm::GridManager( 6, 1 ) );
+    std::vector<int> cellsForSubGrid = { 5, 2 };
+
+    equelle::SubGrid subGrid = equelle::SubGridBuilder::build( runtime.globalGrid->c_grid(), cellsForSubGrid );
+
+    // The owned cells keep their order, and are followed by the sorted ghost cells.
+    std::vector<int> cells = { 5, 2, 1, 3, 4 };
+    BOOST_CHECK_EQUAL_COLLECTIONS( subGrid.cell_local_to_global.begin(), subGrid.cell_local_to_global.end(),
+                                   cells.begin(), cells.end() );
+    BOOST_CHECK_EQUAL( subGrid.number_of_ghost_cells, 3 );
+    BOOST_CHECK_EQUAL( subGrid.cell_global_to_local.local( 3 ), 3 );
+    BOOST_CHECK_EQUAL( subGrid.cell_global_to_local.local( 0 ), -1 );
+    BOOST_CHECK( subGrid.face_global_to_local.find( 0 ) == subGrid.face_global_to_local.end() );
+
+    // The local faces are numbered in global order.
+    BOOST_CHECK( std::is_sorted( subGrid.face_local_to_global.begin(), subGrid.face_local_to_global.end() ) );
+}
@@ -51,7 +51,8 @@ BOOST_AUTO_TEST_CASE( RuntimeMPI_6x1grid ) {
 
 
     int ierr;
-    void* grid = const_cast<void*>( reinterpret_cast<const void*>(runtime.globalGrid->c_grid() ) );
+    equelle::ZoltanGrid zgrid( runtime.globalGrid->c_grid() );
+    void* grid = &zgrid;
 
     BOOST_CHECK_EQUAL( runtime.globalGrid->c_grid()->number_of_cells, 6 );
     BOOST_CHECK_EQUAL( equelle::ZoltanGrid::getNumberOfObjects( grid, &ierr ), 6 );
@@ -136,6 +137,77 @@ BOOST_AUTO_TEST_CASE( RuntimeMPI_6x2grid ) {
     }
 }
 
+BOOST_AUTO_TEST_CASE( ZoltanGrid_weights ) {
+    Opm::GridManager gm( 3, 2 );
+    const UnstructuredGrid* g = gm.c_grid();
+
+    // Present the second row of cells only, as when repartitioning.
+    std::vector<int> owner = { 1, 1, 1, 0, 0, 0 };
+    equelle::ZoltanGrid zgrid( g, equelle::ZoltanGrid::face_area, owner );
+    zgrid.setCellWeights( { 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f } );
+    void* grid = &zgrid;
+
+    int ierr;
+    if ( equelle::getMPIRank() != 0 ) {
+        BOOST_CHECK_EQUAL( equelle::ZoltanGrid::getNumberOfObjects( grid, &ierr ), 0 );
+        return;
+    }
+    BOOST_REQUIRE_EQUAL( equelle::ZoltanGrid::getNumberOfObjects( grid, &ierr ), 3 );
+
+    std::vector<ZOLTAN_ID_TYPE> gids( 3 ), lids( 3 );
+    std::vector<float> weights( 3 );
+    equelle::ZoltanGrid::getCellList( grid, 1, 1, gids.data(), lids.data(), 1, weights.data(), &ierr );
+    BOOST_CHECK_EQUAL( gids[0], 3 );
+    BOOST_CHECK_EQUAL( lids[2], 2 );
+    BOOST_CHECK_EQUAL( weights[1], 5.0f );
+
+    std::vector<int> numEdges( 3 );
+    equelle::ZoltanGrid::getNumberOfEdgesMulti( grid, 1, 1, 3, gids.data(), lids.data(), numEdges.data(), &ierr );
+    BOOST_CHECK_EQUAL( numEdges[0], 2 );
+    BOOST_CHECK_EQUAL( numEdges[1], 3 );
+    BOOST_CHECK_EQUAL( numEdges[2], 2 );
+
+    // Cell 4 has neighbours 1 (on rank 1), 3 and 5.
+    std::vector<ZOLTAN_ID_TYPE> nbors( 7 );
+    std::vector<int> procs( 7 );
+    std::vector<float> ewgts( 7 );
+    equelle::ZoltanGrid::getEdgeListMulti( grid, 1, 1, 3, gids.data(), lids.data(), numEdges.data(),
+                                           nbors.data(), procs.data(), 1, ewgts.data(), &ierr );
+    BOOST_CHECK_EQUAL( ierr, ZOLTAN_OK );
+    BOOST_CHECK_EQUAL( nbors[2], 1 );
+    BOOST_CHECK_EQUAL( procs[2], 1 );
+    BOOST_CHECK_EQUAL( nbors[3], 3 );
+    BOOST_CHECK_EQUAL( procs[3], 0 );
+    BOOST_CHECK_EQUAL( nbors[4], 5 );
+    BOOST_CHECK_CLOSE( ewgts[2], 1.0f, 1e-4 );
+
+    BOOST_CHECK_EQUAL( equelle::ZoltanGrid::getNumberOfGeometries( grid, &ierr ), 2 );
+    std::vector<double> xy( 6 );
+    equelle::ZoltanGrid::getGeometryMulti( grid, 1, 1, 3, gids.data(), lids.data(), 2, xy.data(), &ierr );
+    BOOST_CHECK_EQUAL( ierr, ZOLTAN_OK );
+    BOOST_CHECK_CLOSE( xy[2], 1.5, 1e-8 );
+    BOOST_CHECK_CLOSE( xy[3], 1.5, 1e-8 );
+}
+
+BOOST_AUTO_TEST_CASE( geometricDecompose ) {
+    const char* methods[] = { "rcb", "rib", "hsfc" };
+    for( const char* method : methods ) {
+        Opm::parameter::ParameterGroup param;
+        param.disableOutput();
+        param.insertParameter( "nx", "8" );
+        param.insertParameter( "ny", "4" );
+        param.insertParameter( "partition_method", method );
+
+        equelle::RuntimeMPI runtime( param );
+        runtime.decompose();
+
+        int numOwnedCells = runtime.subGrid.cell_local_to_global.size() - runtime.subGrid.number_of_ghost_cells;
+        int totalCells = 0;
+        MPI_Allreduce( &numOwnedCells, &totalCells, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD );
+        BOOST_CHECK_EQUAL( totalCells, 32 );
+    }
+}
+
 BOOST_AUTO_TEST_CASE( decompose ) {
     equelle::RuntimeMPI runtime;
     runtime.globalGrid.reset( new Opm::GridManager( 6, 2, 5 ) );
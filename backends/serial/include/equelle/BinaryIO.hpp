@@ -0,0 +1,139 @@
+/*
+  Copyright 2013 SINTEF ICT, Applied Mathematics.
+*/
+
+#pragma once
+
+#include <opm/core/utility/parameters/ParameterGroup.hpp>
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace equelle {
+
+/// Binary file format for collections, an alternative to the text
+/// files used for input and output.
+///
+/// A file starts with a 16 byte header: the magic string "EQUELLEB",
+/// the format version and the type of the values, the last two as
+/// 32-bit unsigned integers. Then follow any number of records, each a
+/// 64-bit unsigned value count followed by that many values, padded
+/// with zeros to a multiple of 8 bytes. The file ends with an index of
+/// the records: their byte offsets in the file, the number of records,
+/// all as 64-bit unsigned integers, and the magic string "EQBINDEX".
+/// Everything is little-endian and 8-byte aligned, so that the values
+/// can be used directly from a memory mapping of the file.
+///
+/// A record is appended by writing it over the index and writing the
+/// extended index after it, so a file is complete after every record.
+/// Files of version 1 have no index, their records are found by
+/// stepping from one to the next.
+///
+/// Output files hold one record per call to output() for a tag, in
+/// order, so that a whole simulation is found in a single file. Input
+/// is read from the first record of a file.
+namespace binaryio {
+
+    const char magic[8] = { 'E', 'Q', 'U', 'E', 'L', 'L', 'E', 'B' };
+    const char index_magic[8] = { 'E', 'Q', 'B', 'I', 'N', 'D', 'E', 'X' };
+    const std::uint32_t version = 2;
+    const std::size_t header_size = 16;
+
+    /// Type of the values in a file.
+    enum ValueType { Float64 = 1, Int32 = 2 };
+
+    /// Size in bytes of a value.
+    std::size_t valueSize(const ValueType type);
+
+    /// Size in bytes of a record with the given number of values,
+    /// including the count and padding.
+    std::size_t recordBytes(const ValueType type, const std::uint64_t count);
+
+    /// The index that ends a file with records at the given offsets.
+    std::vector<char> indexBytes(const std::vector<std::uint64_t>& offsets);
+
+    /// Reads the index of a file to append to, and sets records_end to
+    /// where the index starts. Throws unless the file is of this version
+    /// and holds values of the given type.
+    std::vector<std::uint64_t> readIndex(const std::string& filename, const ValueType type,
+                                         std::uint64_t& records_end);
+
+    /// Throws if the host is not little-endian, the format is only
+    /// implemented for such hosts.
+    void checkByteOrder();
+
+    /// True if the input file for the given name is binary: if the
+    /// parameter <name>_format is "binary", or it is not given and the
+    /// file name ends with ".eqbin".
+    bool isBinaryInput(const Opm::parameter::ParameterGroup& param,
+                       const std::string& name, const std::string& filename);
+
+} // namespace binaryio
+
+
+/// Writes records to a binary file.
+class BinaryWriter
+{
+public:
+    /// Opens the file. Unless appending, it is truncated and a new
+    /// header is written. Appending to a file with a different value
+    /// type is an error.
+    BinaryWriter(const std::string& filename, const binaryio::ValueType type, const bool append);
+
+    /// Writes a record.
+    void write(const double* values, const std::uint64_t count);
+    void write(const int* values, const std::uint64_t count);
+
+private:
+    void writeRecord(const char* data, const std::uint64_t count, const binaryio::ValueType type);
+
+    std::string filename_;
+    binaryio::ValueType type_;
+    std::ofstream file_;
+    // Offsets of the records written so far, and where the index starts.
+    std::vector<std::uint64_t> offsets_;
+    std::uint64_t records_end_;
+};
+
+
+
+/// Read-only memory mapping of a binary file. The values can be used
+/// in place, without parsing or intermediate copies.
+class MappedBinaryFile
+{
+public:
+    /// Maps the file and checks its header and index.
+    explicit MappedBinaryFile(const std::string& filename);
+    ~MappedBinaryFile();
+
+    binaryio::ValueType valueType() const { return type_; }
+    int numRecords() const { return records_.size(); }
+
+    /// Number of values in a record.
+    std::uint64_t recordSize(const int record) const;
+
+    /// Values of a record. Throws if the file holds another type.
+    const double* doubles(const int record) const;
+    const std::int32_t* ints(const int record) const;
+
+    /// Throws unless the record holds the expected number of values.
+    void checkSize(const int record, const std::uint64_t expected, const std::string& name) const;
+
+private:
+    MappedBinaryFile(const MappedBinaryFile&);
+    MappedBinaryFile& operator=(const MappedBinaryFile&);
+    const char* recordData(const int record, const binaryio::ValueType type) const;
+
+    std::string filename_;
+    const char* data_;
+    std::size_t length_;
+    binaryio::ValueType type_;
+    // Offsets of the records (their counts) in the file, and where the
+    // records end. The sizes are checked as the records are used.
+    std::vector<std::uint64_t> records_;
+    std::uint64_t records_end_;
+};
+
+} // namespace equelle
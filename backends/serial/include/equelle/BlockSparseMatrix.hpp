@@ -0,0 +1,169 @@
+/*
+  Copyright 2013 SINTEF ICT, Applied Mathematics.
+*/
+
+#pragma once
+
+#include <Eigen/Eigen>
+#include <Eigen/Sparse>
+
+#include <array>
+#include <vector>
+#include <algorithm>
+
+#include "equelle/equelleTypes.hpp"
+#include "equelle/KrylovSolver.hpp"
+
+namespace equelle {
+
+/// A sparse matrix made of dense BlockSize x BlockSize blocks, stored
+/// in block compressed row (BSR) format.
+///
+/// Used for the Jacobian of a system of BlockSize equations in as many
+/// unknowns, all defined on the same entities. Unknown k on entity i
+/// has (scalar) index i*BlockSize + k, so all unknowns of an entity are
+/// adjacent. Only one column index is stored per block, and the
+/// blocks are small dense matrices, stored row-major.
+template <int BlockSize>
+class BlockSparseMatrix
+{
+public:
+    typedef Eigen::Matrix<double, BlockSize, BlockSize, Eigen::RowMajor> Block;
+
+    BlockSparseMatrix()
+        : rows_(0), cols_(0), num_threads_(1), row_start_(1, 0)
+    {
+    }
+
+    /// Assemble from the Jacobian of a system, where jac[r][c] is the
+    /// derivative of equation r with respect to unknown c. Empty
+    /// matrices are treated as zero. The assembly and toScalarCSR() run
+    /// on num_threads threads.
+    template <class Matrix>
+    explicit BlockSparseMatrix(const std::array<std::array<Matrix, BlockSize>, BlockSize>& jac,
+                               const int num_threads = 1)
+        : rows_(0), cols_(0), num_threads_(num_threads), row_start_(1, 0)
+    {
+        typedef Eigen::SparseMatrix<double, Eigen::RowMajor> RowMatrix;
+        std::array<std::array<RowMatrix, BlockSize>, BlockSize> rowjac;
+        for (int r = 0; r < BlockSize; ++r) {
+            for (int c = 0; c < BlockSize; ++c) {
+                if (jac[r][c].size() != 0) {
+                    rows_ = jac[r][c].rows();
+                    cols_ = jac[r][c].cols();
+                }
+            }
+        }
+        for (int r = 0; r < BlockSize; ++r) {
+            for (int c = 0; c < BlockSize; ++c) {
+                if (jac[r][c].size() != 0) {
+                    rowjac[r][c] = jac[r][c];
+                } else {
+                    rowjac[r][c].resize(rows_, cols_);
+                }
+            }
+        }
+
+        // Find the block pattern, then add the entries.
+        row_start_.resize(rows_ + 1);
+        row_start_[0] = 0;
+        std::vector<int> cols;
+        for (int i = 0; i < rows_; ++i) {
+            cols.clear();
+            for (int r = 0; r < BlockSize; ++r) {
+                for (int c = 0; c < BlockSize; ++c) {
+                    for (typename RowMatrix::InnerIterator it(rowjac[r][c], i); it; ++it) {
+                        cols.push_back(it.col());
+                    }
+                }
+            }
+            std::sort(cols.begin(), cols.end());
+            cols.erase(std::unique(cols.begin(), cols.end()), cols.end());
+            col_index_.insert(col_index_.end(), cols.begin(), cols.end());
+            row_start_[i + 1] = col_index_.size();
+        }
+        values_.assign(col_index_.size() * BlockSize * BlockSize, 0.0);
+#pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && rows_ * BlockSize > min_parallel_size)
+        for (int i = 0; i < rows_; ++i) {
+            const int* const row_begin = col_index_.data() + row_start_[i];
+            const int* const row_end = col_index_.data() + row_start_[i + 1];
+            for (int r = 0; r < BlockSize; ++r) {
+                for (int c = 0; c < BlockSize; ++c) {
+                    for (typename RowMatrix::InnerIterator it(rowjac[r][c], i); it; ++it) {
+                        const int b = std::lower_bound(row_begin, row_end, it.col()) - col_index_.data();
+                        values_[(b * BlockSize + r) * BlockSize + c] += it.value();
+                    }
+                }
+            }
+        }
+    }
+
+    /// Number of block rows and columns.
+    int rows() const { return rows_; }
+    int cols() const { return cols_; }
+
+    /// Number of stored blocks.
+    int nonZeroBlocks() const { return col_index_.size(); }
+
+    /// Block row i consists of blocks rowStart(i) to rowStart(i+1) - 1.
+    int rowStart(const int i) const { return row_start_[i]; }
+
+    /// Block column of stored block b.
+    int blockColumn(const int b) const { return col_index_[b]; }
+
+    /// Stored block b.
+    Eigen::Map<const Block> block(const int b) const
+    {
+        return Eigen::Map<const Block>(values_.data() + b * BlockSize * BlockSize);
+    }
+
+    /// A view for KrylovSolver, which works on the blocks directly. The
+    /// vectors use the interleaved ordering.
+    SparseMatrixView view() const
+    {
+        return SparseMatrixView{ rows_, row_start_.data(), col_index_.data(), values_.data(), false, BlockSize };
+    }
+
+    /// Expands to scalar compressed row storage, as expected by
+    /// Opm::LinearSolverInterface (which does not handle blocks). The scalar rows and columns use the
+    /// interleaved ordering.
+    void toScalarCSR(std::vector<int>& row_start,
+                     std::vector<int>& col_index,
+                     std::vector<double>& values) const
+    {
+        const int nnz = values_.size();
+        row_start.resize(rows_ * BlockSize + 1);
+        col_index.resize(nnz);
+        values.resize(nnz);
+        row_start[0] = 0;
+        for (int i = 0; i < rows_; ++i) {
+            const int row_len = (row_start_[i + 1] - row_start_[i]) * BlockSize;
+            for (int r = 0; r < BlockSize; ++r) {
+                row_start[i * BlockSize + r + 1] = row_start[i * BlockSize + r] + row_len;
+            }
+        }
+#pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && rows_ * BlockSize > min_parallel_size)
+        for (int i = 0; i < rows_; ++i) {
+            for (int r = 0; r < BlockSize; ++r) {
+                int pos = row_start[i * BlockSize + r];
+                for (int b = row_start_[i]; b < row_start_[i + 1]; ++b) {
+                    for (int c = 0; c < BlockSize; ++c) {
+                        col_index[pos] = col_index_[b] * BlockSize + c;
+                        values[pos] = values_[(b * BlockSize + r) * BlockSize + c];
+                        ++pos;
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    int rows_;
+    int cols_;
+    int num_threads_;
+    std::vector<int> row_start_;
+    std::vector<int> col_index_;
+    std::vector<double> values_;
+};
+
+} // namespace equelle
@@ -12,11 +12,61 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <list>
+#include <memory>
+#include <algorithm>
 
 #include "equelle/equelleTypes.hpp"
+#include "equelle/BlockSparseMatrix.hpp"
+#include "equelle/KrylovSolver.hpp"
+#include "equelle/BinaryIO.hpp"
+#include "equelle/StructuredGridOps.hpp"
 
 namespace equelle {
 
+/// A cache of index maps computed by operatorOn() and operatorExtend(),
+/// for pairs of the entity sets owned by the runtime (allCells(),
+/// interiorFaces() etc.). There are only a few of those, so the cache
+/// stays small and is searched by set identity (see
+/// TopologicalCollection::sameIdentity()) in constant time per entry.
+/// Sets built by the program are never added: their identities are new
+/// every time, so they would never be found again.
+template <class EntityCollection>
+class IndexMapCache
+{
+public:
+    /// Returns the cached indices for the pair, or null if not present.
+    const std::vector<int>* find(const EntityCollection& superset,
+                                 const EntityCollection& subset) const
+    {
+        for (const Entry& e : entries_) {
+            if (e.superset.sameIdentity(superset) && e.subset.sameIdentity(subset)) {
+                return &e.indices;
+            }
+        }
+        return nullptr;
+    }
+
+    /// Adds an entry. The sets share their storage with the arguments.
+    const std::vector<int>& insert(const EntityCollection& superset,
+                                   const EntityCollection& subset,
+                                   std::vector<int> indices)
+    {
+        entries_.push_back(Entry{superset, subset, std::move(indices)});
+        return entries_.back().indices;
+    }
+
+private:
+    struct Entry
+    {
+        EntityCollection superset;
+        EntityCollection subset;
+        std::vector<int> indices;
+    };
+    // A list, so that the returned references stay valid.
+    std::list<Entry> entries_;
+};
+
 /// The Equelle runtime class.
 /// Contains methods corresponding to Equelle built-ins to make
 /// it easy to generate C++ code for an Equelle program.
@@ -24,18 +74,25 @@ class EquelleRuntimeCPU
 {
 public:
     /// Constructor.
+    /// If the grid is logically Cartesian, as those created from nx, ny
+    /// (and nz), gradients and divergences are computed by StructuredGridOps
+    /// and no operator matrices are built. The parameter matrix_free_ops
+    /// (default true) can be set to false to use the matrices anyway.
+    /// The parameter num_threads (default 1) sets the number of OpenMP
+    /// threads used by this runtime. It does not change the process-wide
+    /// OpenMP settings, and OMP_NUM_THREADS is ignored.
     EquelleRuntimeCPU( const Opm::parameter::ParameterGroup& param );
     EquelleRuntimeCPU( const UnstructuredGrid* grid, const Opm::parameter::ParameterGroup& param );
 
     /** @name Topology
      * Topology and geometry related. */
     ///@{
-    CollOfCell allCells() const;
-    CollOfCell boundaryCells() const;
-    CollOfCell interiorCells() const;
-    CollOfFace allFaces() const;
-    CollOfFace boundaryFaces() const;
-    CollOfFace interiorFaces() const;
+    const CollOfCell& allCells() const;
+    const CollOfCell& boundaryCells() const;
+    const CollOfCell& interiorCells() const;
+    const CollOfFace& allFaces() const;
+    const CollOfFace& boundaryFaces() const;
+    const CollOfFace& interiorFaces() const;
     CollOfCell firstCell(const CollOfFace& faces) const;
     CollOfCell secondCell(const CollOfFace& faces) const;
     CollOfScalar norm(const CollOfFace& faces) const;
@@ -85,6 +142,16 @@ public:
     ///@}
 
     /// @name Solver functions.
+    /// Newton's method, controlled by the parameters
+    ///   max_iter, abs_res_tol    iteration limit and 2-norm tolerance
+    ///   rel_res_tol, max_res_tol optional tolerances relative to the initial
+    ///                            residual and on the max-norm (0 disables)
+    ///   inexact_newton           use Eisenstat-Walker forcing terms as linear
+    ///                            solver tolerances, at most forcing_term_max
+    ///   line_search              backtrack (halve the step, at most
+    ///                            line_search_max_cuts times) if the residual
+    ///                            does not decrease enough
+    ///   throw_on_newton_failure  throw instead of returning the last iterate
     ///@{
     template <class ResidualFunctor>
     CollOfScalar newtonSolve(const ResidualFunctor& rescomp,
@@ -122,28 +189,96 @@ public:
 private:
     /// Topology helpers
     bool boundaryCell(const int cell_index) const;
+    const std::vector<char>& boundaryCellFlags() const;
+    int numInternalFaces() const;
+    int internalFace(const int i) const;
+    CollOfCell faceCells(const CollOfFace& faces, const int side) const;
+
+    /// Topology cache helpers.
+    IndexMapCache<CollOfCell>& indexMapCache(const CollOfCell&) { return cell_index_maps_; }
+    IndexMapCache<CollOfFace>& indexMapCache(const CollOfFace&) { return face_index_maps_; }
+    bool runtimeSet(const CollOfCell& cells) const;
+    bool runtimeSet(const CollOfFace& faces) const;
+    /// The indices of subset in superset, cached if both are runtime
+    /// sets, otherwise computed into uncached.
+    template <class EntityCollection>
+    const std::vector<int>& cachedSubsetIndices(const EntityCollection& superset,
+                                                const EntityCollection& subset,
+                                                std::vector<int>& uncached);
+
+    /// Validate num_threads_.
+    void setupThreads();
+
+    /// Create the native linear solver, if one is selected.
+    void setupLinearSolver();
 
     /// Creating primary variables.
-    static CollOfScalar singlePrimaryVariable(const CollOfScalar& initial_values);
+    template <int Num>
+    static std::array<CollOfScalar, Num> systemPrimaryVariables(const std::array<CollOfScalar, Num>& initial_values);
 
-    /// Solver helper.
-    CollOfScalar solveForUpdate(const CollOfScalar& residual) const;
+    /// Solver helpers. A positive tolerance overrides the relative
+    /// tolerance of the (native) linear solver.
+    CollOfScalar solveForUpdate(const CollOfScalar& residual, const double tolerance = 0.0) const;
+    template <int Num>
+    std::array<CollOfScalar::V, Num> solveSystemForUpdate(const std::array<CollOfScalar, Num>& residual,
+                                                          const double tolerance = 0.0) const;
+    void linearSolve(const SparseMatrixView& matrix,
+                     const double* rhs, double* solution, const double tolerance = 0.0) const;
+
+    /// Newton iteration control.
+    bool newtonConverged(const Scalar norm, const Scalar max_norm, const Scalar initial_norm) const;
+    Scalar forcingTerm(const Scalar norm, const Scalar prev_norm, const Scalar prev_forcing) const;
+    bool sufficientDecrease(const Scalar new_norm, const Scalar norm, const Scalar step, const Scalar forcing) const;
+    void newtonFailure(const std::string& solver, const int iter, const Scalar norm) const;
 
     /// Norms.
     Scalar twoNorm(const CollOfScalar& vals) const;
+    template <int Num>
+    Scalar twoNorm(const std::array<CollOfScalar, Num>& vals) const;
+    Scalar maxNorm(const CollOfScalar& vals) const;
+    template <int Num>
+    Scalar maxNorm(const std::array<CollOfScalar, Num>& vals) const;
 
     /// Data members.
     std::unique_ptr<Opm::GridManager> grid_manager_;
     const UnstructuredGrid& grid_;
-    Opm::HelperOps ops_;
+    // Exactly one of these is set, see the constructor.
+    std::unique_ptr<StructuredGridOps> structured_ops_;
+    std::unique_ptr<Opm::HelperOps> ops_;
     Opm::LinearSolverFactory linsolver_;
+    // Native linear solver, used instead of linsolver_ if not null.
+    std::unique_ptr<KrylovSolver> krylov_;
     bool output_to_file_;
+    // Write output files in the binary format instead of as text.
+    bool binary_output_;
     int verbose_;
     const Opm::parameter::ParameterGroup& param_;
     std::map<std::string, int> outputcount_;
-    // For newtonSolve().
+    // For newtonSolve() and newtonSolveSystem().
     int max_iter_;
     double abs_res_tol_;
+    double rel_res_tol_;
+    double max_res_tol_;
+    bool inexact_newton_;
+    double forcing_term_max_;
+    bool line_search_;
+    int line_search_max_cuts_;
+    bool throw_on_newton_failure_;
+    // Number of threads used for entity loops, reductions and the native
+    // solvers, 1 (no threading) if not given.
+    int num_threads_;
+    // Topology cache. The grid never changes, so the canonical entity
+    // sets are built on first use and kept for the lifetime of the runtime.
+    mutable std::shared_ptr<const CollOfCell> all_cells_;
+    mutable std::shared_ptr<const CollOfCell> boundary_cells_;
+    mutable std::shared_ptr<const CollOfCell> interior_cells_;
+    mutable std::shared_ptr<const CollOfFace> all_faces_;
+    mutable std::shared_ptr<const CollOfFace> boundary_faces_;
+    mutable std::shared_ptr<const CollOfFace> interior_faces_;
+    mutable std::shared_ptr<const CollOfCell> interior_face_cells_[2];
+    mutable std::vector<char> boundary_cell_flags_;
+    IndexMapCache<CollOfCell> cell_index_maps_;
+    IndexMapCache<CollOfFace> face_index_maps_;
 };
 
 
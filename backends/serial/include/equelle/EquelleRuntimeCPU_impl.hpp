@@ -6,6 +6,7 @@
 
 #include <fstream>
 #include <iterator>
+#include <algorithm>
 #include <opm/core/utility/StopWatch.hpp>
 #include <opm/autodiff/AutoDiffHelpers.hpp>
 
@@ -26,37 +27,41 @@ namespace
 
     template <class EntityCollection>
     std::vector<int> subsetIndices(const EntityCollection& superset,
-                                   const EntityCollection& subset)
+                                   const EntityCollection& subset,
+                                   const int num_threads)
     {
         if (subset.empty()) {
             return std::vector<int>();
         }
 
+        const int sub_sz = subset.size();
+        std::vector<int> indices(sub_sz);
+
+        if (superset.isSpan()) {
+            // The position of an entity in a range is found directly.
+            const ESpan& span = superset.span();
+            assert(span.stride() > 0);
+            #pragma omp parallel for num_threads(num_threads) if (num_threads > 1 && sub_sz > min_parallel_size)
+            for (int elem = 0; elem < sub_sz; ++elem) {
+                const int offset = subset[elem].index - span.start();
+                assert(offset >= 0 && offset % span.stride() == 0 && offset / span.stride() < span.size());
+                indices[elem] = offset / span.stride();
+            }
+            return indices;
+        }
+
         assert(std::is_sorted(superset.begin(), superset.end()));
         assert(std::adjacent_find(superset.begin(), superset.end()) == superset.end());
         assert(superset[0].index >= 0);
 
-        const std::size_t sub_sz = subset.size();
-        typedef typename EntityCollection::value_type Entity;
-        std::vector<std::pair<Entity, int> > sub_indexed(sub_sz);
-        for (std::size_t elem = 0; elem < sub_sz; ++elem) {
-            sub_indexed[elem] = std::make_pair(subset[elem], elem);
-        }
-        std::sort(sub_indexed.begin(), sub_indexed.end());
-        assert(sub_indexed[0].first.index >= 0);
-
-        const std::size_t super_sz = superset.size();
-        std::vector<int> indices(sub_sz);
-        std::size_t sub_index = 0;
-        for (std::size_t i = 0; i < super_sz; ++i) {
-            while (sub_indexed[sub_index].first == superset[i]) {
-                indices[sub_indexed[sub_index].second] = i;
-                ++sub_index;
-            }
-            if (sub_index == sub_sz) {
-                // All subset elements have been matched.
-                break;
-            }
+        // Every subset element is located by binary search in the
+        // (sorted, unique) superset. The searches are independent,
+        // so this parallelizes without changing the result.
+        #pragma omp parallel for num_threads(num_threads) if (num_threads > 1 && sub_sz > min_parallel_size)
+        for (int elem = 0; elem < sub_sz; ++elem) {
+            const auto it = std::lower_bound(superset.begin(), superset.end(), subset[elem]);
+            assert(it != superset.end() && *it == subset[elem]);
+            indices[elem] = it - superset.begin();
         }
 #if 0
         // Debugging output.
@@ -77,48 +82,137 @@ namespace
         std::cout << std::endl;
         std::cout << "Sizes = " << indices.size() << ' ' << subset.size() << std::endl;
 #endif
-        assert(sub_index == sub_sz);
         return indices;
     }
 
-    template <class EntityType, class IntVec>
-    std::vector<EntityType> subset(const std::vector<EntityType>& x,
-                                   const IntVec& indices)
+    template <int Codim, class IntVec>
+    TopologicalCollection<Codim> subset(const TopologicalCollection<Codim>& x,
+                                        const IntVec& indices,
+                                        const int num_threads)
     {
-        const size_t sz = indices.size();
-        std::vector<EntityType> retval;
-        retval.reserve(sz);
-        for (size_t i = 0; i < sz; ++i) {
-            retval.push_back(x[indices[i]]);
+        const int sz = indices.size();
+        TopologicalCollection<Codim> retval(sz);
+        #pragma omp parallel for num_threads(num_threads) if (num_threads > 1 && sz > min_parallel_size)
+        for (int i = 0; i < sz; ++i) {
+            retval[i] = x[indices[i]];
         }
         return retval;
     }
 
-    template <class EntityType, class IntVec>
-    std::vector<EntityType> superset(const std::vector<EntityType>& x,
-                                     const IntVec& indices,
-                                     const int n)
+    template <int Codim, class IntVec>
+    TopologicalCollection<Codim> superset(const TopologicalCollection<Codim>& x,
+                                          const IntVec& indices,
+                                          const int n,
+                                          const int num_threads)
     {
         assert(x.size() == indices.size());
-        const size_t sz = indices.size();
-        std::vector<EntityType> retval(n);
-        for (size_t i = 0; i < sz; ++i) {
+        const int sz = indices.size();
+        TopologicalCollection<Codim> retval(n);
+        // The indices are distinct (they come from subsetIndices()),
+        // so the scattered writes never collide.
+        #pragma omp parallel for num_threads(num_threads) if (num_threads > 1 && sz > min_parallel_size)
+        for (int i = 0; i < sz; ++i) {
             retval[indices[i]] = x[i];
         }
         return retval;
     }
+
+    /// Opm::subset and Opm::superset for values and AD collections, with
+    /// the signatures of the threaded topological versions above.
+    template <class SomeCollection, class IntVec>
+    auto subset(const SomeCollection& x, const IntVec& indices, const int /*num_threads*/)
+        -> decltype(Opm::subset(x, indices))
+    {
+        return Opm::subset(x, indices);
+    }
+
+    template <class SomeCollection, class IntVec>
+    auto superset(const SomeCollection& x, const IntVec& indices, const int n, const int /*num_threads*/)
+        -> decltype(Opm::superset(x, indices, n))
+    {
+        return Opm::superset(x, indices, n);
+    }
+
+    /// Collections that are written to from several threads must
+    /// have their final representation before the threads start.
+    template <class SomeCollection>
+    void prepareForWrite(SomeCollection&)
+    {
+    }
+
+    template <int Codim>
+    void prepareForWrite(TopologicalCollection<Codim>& x)
+    {
+        x.makeExplicit();
+    }
+
+    /// Evaluate all residual functions of a system for the unknowns u.
+    inline std::array<CollOfScalar, 1> evaluateSystem(const std::array<ResCompType<1>::type, 1>& rescomp,
+                                                      const std::array<CollOfScalar, 1>& u)
+    {
+        return std::array<CollOfScalar, 1>{{ rescomp[0](u[0]) }};
+    }
+
+    inline std::array<CollOfScalar, 2> evaluateSystem(const std::array<ResCompType<2>::type, 2>& rescomp,
+                                                      const std::array<CollOfScalar, 2>& u)
+    {
+        return std::array<CollOfScalar, 2>{{ rescomp[0](u[0], u[1]),
+                                             rescomp[1](u[0], u[1]) }};
+    }
+
+    inline std::array<CollOfScalar, 3> evaluateSystem(const std::array<ResCompType<3>::type, 3>& rescomp,
+                                                      const std::array<CollOfScalar, 3>& u)
+    {
+        return std::array<CollOfScalar, 3>{{ rescomp[0](u[0], u[1], u[2]),
+                                             rescomp[1](u[0], u[1], u[2]),
+                                             rescomp[2](u[0], u[1], u[2]) }};
+    }
+
+    inline std::array<CollOfScalar, 4> evaluateSystem(const std::array<ResCompType<4>::type, 4>& rescomp,
+                                                      const std::array<CollOfScalar, 4>& u)
+    {
+        return std::array<CollOfScalar, 4>{{ rescomp[0](u[0], u[1], u[2], u[3]),
+                                             rescomp[1](u[0], u[1], u[2], u[3]),
+                                             rescomp[2](u[0], u[1], u[2], u[3]),
+                                             rescomp[3](u[0], u[1], u[2], u[3]) }};
+    }
 } // anon namespace
 
+
+template <class EntityCollection>
+const std::vector<int>& EquelleRuntimeCPU::cachedSubsetIndices(const EntityCollection& superset,
+                                                               const EntityCollection& subset,
+                                                               std::vector<int>& uncached)
+{
+    if (!runtimeSet(superset) || !runtimeSet(subset)) {
+        uncached = subsetIndices(superset, subset, num_threads_);
+        return uncached;
+    }
+    IndexMapCache<EntityCollection>& cache = indexMapCache(superset);
+    const std::vector<int>* indices = cache.find(superset, subset);
+    if (indices) {
+        return *indices;
+    }
+    return cache.insert(superset, subset, subsetIndices(superset, subset, num_threads_));
+}
+
+
 template <class SomeCollection, class EntityCollection>
 SomeCollection EquelleRuntimeCPU::operatorExtend(const SomeCollection& data,
                                                  const EntityCollection& from_set,
                                                  const EntityCollection& to_set)
 {
     assert(size_t(data.size()) == size_t(from_set.size()));
+    if (from_set.sameIdentity(to_set)) {
+        // Extending to the same set, typically a full range, is a no-op.
+        // Only the identities are compared, so this takes constant time.
+        return data;
+    }
     // Expand with zeros.
-    std::vector<int> indices = subsetIndices(to_set, from_set);
+    std::vector<int> uncached;
+    const std::vector<int>& indices = cachedSubsetIndices(to_set, from_set, uncached);
     assert(indices.size() == from_set.size());
-    return superset(data, indices, to_set.size());
+    return superset(data, indices, to_set.size(), num_threads_);
 }
 
 
@@ -133,10 +227,16 @@ EquelleRuntimeCPU::operatorOn(const SomeCollection& data,
     // in the sense that all (possibly repeated) elements of to_set
     // are found in from_set.
     assert(size_t(data.size()) == size_t(from_set.size()));
+    if (from_set.sameIdentity(to_set)) {
+        // Restricting to the same set, typically a full range, is a no-op.
+        // Only the identities are compared, so this takes constant time.
+        return data;
+    }
     // Extract subset.
-    std::vector<int> indices = subsetIndices(from_set, to_set);
+    std::vector<int> uncached;
+    const std::vector<int>& indices = cachedSubsetIndices(from_set, to_set, uncached);
     assert(indices.size() == to_set.size());
-    return subset(data, indices);
+    return subset(data, indices, num_threads_);
 }
 
 
@@ -150,7 +250,9 @@ EquelleRuntimeCPU::trinaryIf(const CollOfBool& predicate,
     const size_t sz = predicate.size();
     assert(sz == size_t(iftrue.size()) && sz == size_t(iffalse.size()));
     SomeCollection1 retval = iftrue;
-    for (size_t i = 0; i < sz; ++i) {
+    prepareForWrite(retval);
+    #pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && sz > min_parallel_size)
+    for (int i = 0; i < int(sz); ++i) {
         if (!predicate[i]) {
             retval[i] = iffalse[i];
         }
@@ -168,6 +270,7 @@ inline CollOfScalar EquelleRuntimeCPU::trinaryIf<CollOfScalar, CollOfScalar>(con
     assert(sz == iftrue.size() && sz == iffalse.size());
     CollOfScalar::V trueones = CollOfScalar::V::Constant(sz, 1.0);
     CollOfScalar::V falseones = CollOfScalar::V::Constant(sz, 0.0);
+    #pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && sz > min_parallel_size)
     for (int i = 0; i < sz; ++i) {
         if (!predicate[i]) {
             trueones[i] = 0.0;
@@ -209,121 +312,252 @@ EquelleRuntimeCPU::trinaryIf<CollOfScalar::ADB, CollOfScalar::ADB>(const CollOfB
 template <class ResidualFunctor>
 CollOfScalar EquelleRuntimeCPU::newtonSolve(const ResidualFunctor& rescomp,
                                             const CollOfScalar& u_initialguess)
+{
+    const std::array<typename ResCompType<1>::type, 1> rescomp_system = {{ rescomp }};
+    const std::array<CollOfScalar, 1> u_system = {{ u_initialguess }};
+    return newtonSolveSystem<1>(rescomp_system, u_system)[0];
+}
+
+
+template <int Num>
+std::array<CollOfScalar, Num> EquelleRuntimeCPU::newtonSolveSystem(const std::array<typename ResCompType<Num>::type, Num>& rescomp,
+                                                                   const std::array<CollOfScalar, Num>& u_initialguess)
 {
     Opm::time::StopWatch clock;
     clock.start();
+    const std::string name = Num == 1 ? "newtonSolve" : "newtonSolveSystem";
 
-    // Set up Newton loop.
-    CollOfScalar u = singlePrimaryVariable(u_initialguess);
+    // Set up Newton loop. Each unknown is a separate primary variable,
+    // so the residuals get one Jacobian block per unknown.
+    std::array<CollOfScalar, Num> u = systemPrimaryVariables<Num>(u_initialguess);
     if (verbose_ > 2) {
-        output("Initial u", u);
-        output("    newtonSolve: norm (initial u)", twoNorm(u));
+        for (int i = 0; i < Num; ++i) {
+            output("Initial u", u[i]);
+        }
+        output("    " + name + ": norm (initial u)", twoNorm<Num>(u));
     }
-    CollOfScalar residual = rescomp(u);
+    std::array<CollOfScalar, Num> residual = evaluateSystem(rescomp, u);
     if (verbose_ > 2) {
-        output("Initial residual", residual);
-        output("    newtonSolve: norm (initial residual)", twoNorm(residual));
+        for (int i = 0; i < Num; ++i) {
+            output("Initial residual", residual[i]);
+        }
+        output("    " + name + ": norm (initial residual)", twoNorm<Num>(residual));
     }
 
     int iter = 0;
+    Scalar norm = twoNorm<Num>(residual);
+    const Scalar initial_norm = norm;
+    Scalar prev_norm = norm;
+    Scalar forcing = 0.0;
 
     // Debugging output not specified in Equelle.
     if (verbose_ > 1) {
-        std::cout << "    newtonSolve: iter = " << iter << " (max = " << max_iter_
-                  << "), norm(residual) = " << twoNorm(residual)
+        std::cout << "    " << name << ": iter = " << iter << " (max = " << max_iter_
+                  << "), norm(residual) = " << norm
                   << " (tol = " << abs_res_tol_ << ")" << std::endl;
     }
 
     // Execute newton loop until residual is small or we have used too many iterations.
-    while ( (twoNorm(residual) > abs_res_tol_) && (iter < max_iter_) ) {
-
-        // Solve linear equations for du, apply update.
-        const CollOfScalar du = solveForUpdate(residual);
-        u = u - du;
-
-        // Recompute residual.
-        residual = rescomp(u);
+    bool converged = newtonConverged(norm, maxNorm<Num>(residual), initial_norm);
+    while (!converged && iter < max_iter_ && std::isfinite(norm)) {
+
+        // Solve linear equations for du, to the accuracy given by the forcing term.
+        forcing = forcingTerm(norm, prev_norm, forcing);
+        const std::array<CollOfScalar::V, Num> du = solveSystemForUpdate<Num>(residual, forcing);
+
+        // Apply update, with backtracking if the residual does not decrease enough.
+        Scalar step = 1.0;
+        std::array<CollOfScalar, Num> u_new;
+        std::array<CollOfScalar, Num> residual_new;
+        Scalar norm_new = 0.0;
+        for (int cut = 0; ; ++cut) {
+            for (int i = 0; i < Num; ++i) {
+                u_new[i] = u[i] - CollOfScalar(step * du[i]);
+            }
+            residual_new = evaluateSystem(rescomp, u_new);
+            norm_new = twoNorm<Num>(residual_new);
+            if (!line_search_ || cut == line_search_max_cuts_
+                || sufficientDecrease(norm_new, norm, step, forcing)) {
+                break;
+            }
+            step *= 0.5;
+        }
+        u = u_new;
+        residual = residual_new;
+        prev_norm = norm;
+        norm = norm_new;
 
         if (verbose_ > 2) {
             // Debugging output not specified in Equelle.
-            output("u", u);
-            output("    newtonSolve: norm(u)", twoNorm(u));
-            output("residual", residual);
-            output("    newtonSolve: norm(residual)", twoNorm(residual));
+            for (int i = 0; i < Num; ++i) {
+                output("u", u[i]);
+            }
+            output("    " + name + ": norm(u)", twoNorm<Num>(u));
+            for (int i = 0; i < Num; ++i) {
+                output("residual", residual[i]);
+            }
+            output("    " + name + ": norm(residual)", norm);
         }
 
         ++iter;
+        converged = newtonConverged(norm, maxNorm<Num>(residual), initial_norm);
 
         // Debugging output not specified in Equelle.
         if (verbose_ > 1) {
-            std::cout << "    newtonSolve: iter = " << iter << " (max = " << max_iter_
-                      << "), norm(residual) = " << twoNorm(residual)
-                      << " (tol = " << abs_res_tol_ << ")" << std::endl;
+            std::cout << "    " << name << ": iter = " << iter << " (max = " << max_iter_
+                      << "), norm(residual) = " << norm
+                      << " (tol = " << abs_res_tol_ << ")";
+            if (inexact_newton_) {
+                std::cout << ", forcing term = " << forcing;
+            }
+            if (step < 1.0) {
+                std::cout << ", step = " << step;
+            }
+            std::cout << std::endl;
         }
 
     }
-    if (verbose_ > 0) {
-        if (twoNorm(residual) > abs_res_tol_) {
-            std::cout << "Newton solver failed to converge in " << max_iter_ << " iterations" << std::endl;
-        } else {
-            std::cout << "Newton solver converged in " << iter << " iterations" << std::endl;
-        }
+    if (!converged) {
+        newtonFailure(name, iter, norm);
+    } else if (verbose_ > 0) {
+        std::cout << "Newton solver converged in " << iter << " iterations" << std::endl;
     }
 
     if (verbose_ > 1) {
         std::cout << "Newton solver took: " << clock.secsSinceLast() << " seconds." << std::endl;
     }
 
-    return u.value();
+    std::array<CollOfScalar, Num> result;
+    for (int i = 0; i < Num; ++i) {
+        result[i] = u[i].value();
+    }
+    return result;
 }
 
 
 template <int Num>
-std::array<CollOfScalar, Num> EquelleRuntimeCPU::newtonSolveSystem(const std::array<typename ResCompType<Num>::type, Num>& rescomp,
-                                                                   const std::array<CollOfScalar, Num>& u_initialguess)
+std::array<CollOfScalar, Num> EquelleRuntimeCPU::systemPrimaryVariables(const std::array<CollOfScalar, Num>& initial_values)
 {
-    // Set up ranges object.
-    std::array<ESpan, Num> ranges{{ ESpan(0), ESpan(0) }}; // Dummy spans that will be overwritten.
-    int start = 0;
+    std::vector<int> block_pattern;
     for (int i = 0; i < Num; ++i) {
-        const int end = start + u_initialguess[i].size();
-        ranges[i] = ESpan(end - start, 1, start);
-        start = end;
+        block_pattern.push_back(initial_values[i].size());
     }
-    const int total_size = start;
-    std::array<CollOfScalar, Num> temp;
-    std::array<CollOfScalar, Num> tempres;
-    // Build combined functor.
-    auto combined_rescomp = [&](const CollOfScalar& u) -> CollOfScalar {
-        // Split into components.
-        for (int i = 0; i < Num; ++i) {
-            temp[i] = subset(u, ranges[i]);
+    std::array<CollOfScalar, Num> vars;
+    for (int i = 0; i < Num; ++i) {
+        vars[i] = CollOfScalar::variable(i, initial_values[i].value(), block_pattern);
+    }
+    return vars;
+}
+
+
+template <int Num>
+std::array<CollOfScalar::V, Num> EquelleRuntimeCPU::solveSystemForUpdate(const std::array<CollOfScalar, Num>& residual,
+                                                                         const double tolerance) const
+{
+    // The Jacobian blocks: jac[r][c] is the derivative of equation r
+    // with respect to unknown c. A residual without derivatives (that
+    // does not depend on any unknown) has empty blocks.
+    std::array<std::array<CollOfScalar::M, Num>, Num> jac;
+    bool same_size = true;
+    for (int r = 0; r < Num; ++r) {
+        same_size = same_size && residual[r].size() == residual[0].size();
+        if (int(residual[r].derivative().size()) == Num) {
+            for (int c = 0; c < Num; ++c) {
+                jac[r][c] = residual[r].derivative()[c];
+                // The unknowns must also live on the same entities as the
+                // equations for the blocks to be square.
+                same_size = same_size && (jac[r][c].size() == 0 || jac[r][c].cols() == residual[0].size());
+            }
         }
-        // Call each part.
-        for (int i = 0; i < Num; ++i) {
-            static_assert(Num == 2, "Only systems of 2 equations can be solved."); // Todo: figure out how to do Num arguments in op() below.
-            tempres[i] = rescomp[i](temp[0], temp[1]);
+    }
+
+    std::array<CollOfScalar::V, Num> du;
+    if (Num == 1 && int(residual[0].derivative().size()) == 1) {
+        // A single unknown: the Jacobian is solved as it is, without the block copy.
+        du[0] = solveForUpdate(residual[0], tolerance).value();
+    } else if (same_size) {
+        // All unknowns live on the same entities: interleave them so
+        // that the Jacobian consists of small dense Num x Num blocks.
+        const int n = residual[0].size();
+        const BlockSparseMatrix<Num> jacobian(jac, num_threads_);
+        std::vector<double> rhs(n * Num);
+        for (int r = 0; r < Num; ++r) {
+            const CollOfScalar::V& res = residual[r].value();
+            for (int i = 0; i < n; ++i) {
+                rhs[i * Num + r] = res[i];
+            }
+        }
+        std::vector<double> du_all(n * Num, 0.0);
+        if (krylov_) {
+            linearSolve(jacobian.view(), rhs.data(), du_all.data(), tolerance);
+        } else {
+            std::vector<int> row_start;
+            std::vector<int> col_index;
+            std::vector<double> values;
+            jacobian.toScalarCSR(row_start, col_index, values);
+            const SparseMatrixView matrix{ n * Num, row_start.data(), col_index.data(), values.data(), false, 1 };
+            linearSolve(matrix, rhs.data(), du_all.data(), tolerance);
+        }
+        for (int r = 0; r < Num; ++r) {
+            du[r].resize(n);
+            for (int i = 0; i < n; ++i) {
+                du[r][i] = du_all[i * Num + r];
+            }
+        }
+    } else {
+        // Unknowns of different sizes are numbered one after another.
+        std::array<int, Num + 1> offset;
+        offset[0] = 0;
+        for (int r = 0; r < Num; ++r) {
+            offset[r + 1] = offset[r] + residual[r].size();
+        }
+        const int total_size = offset[Num];
+        std::vector<Eigen::Triplet<double>> triplets;
+        CollOfScalar::V rhs(total_size);
+        for (int r = 0; r < Num; ++r) {
+            rhs.segment(offset[r], residual[r].size()) = residual[r].value();
+            for (int c = 0; c < Num; ++c) {
+                const CollOfScalar::M& m = jac[r][c];
+                for (int k = 0; k < m.outerSize(); ++k) {
+                    for (CollOfScalar::M::InnerIterator it(m, k); it; ++it) {
+                        triplets.push_back(Eigen::Triplet<double>(offset[r] + it.row(), offset[c] + it.col(), it.value()));
+                    }
+                }
+            }
         }
-        // Recombine
-        CollOfScalar result = superset(tempres[0], ranges[0], total_size);
-        for (int i = 1; i < Num; ++i) {
-            result += superset(tempres[i], ranges[i], total_size);
+        Eigen::SparseMatrix<double, Eigen::RowMajor> matr(total_size, total_size);
+        matr.setFromTriplets(triplets.begin(), triplets.end());
+        matr.makeCompressed();
+        CollOfScalar::V du_all = CollOfScalar::V::Zero(total_size);
+        linearSolve(makeSparseMatrixView(matr), rhs.data(), du_all.data(), tolerance);
+        for (int r = 0; r < Num; ++r) {
+            du[r] = du_all.segment(offset[r], residual[r].size());
         }
-        return result;
-    };
-    // Build combined initial guess.
-    CollOfScalar combined_u_initialguess = superset(u_initialguess[0], ranges[0], total_size);
-    for (int i = 1; i < Num; ++i) {
-        combined_u_initialguess += superset(u_initialguess[i], ranges[i], total_size);
     }
-    std::cout << "Done with setup of combined things." << std::endl;
+    return du;
+}
 
-    // Call regular Newton solver with combined objects.
-    CollOfScalar combined_u = newtonSolve(combined_rescomp, combined_u_initialguess);
+
+template <int Num>
+Scalar EquelleRuntimeCPU::twoNorm(const std::array<CollOfScalar, Num>& vals) const
+{
+    Scalar norm2 = 0.0;
     for (int i = 0; i < Num; ++i) {
-        temp[i] = subset(combined_u, ranges[i]);
+        const Scalar n = twoNorm(vals[i]);
+        norm2 += n * n;
     }
-    return temp;
+    return std::sqrt(norm2);
+}
+
+
+template <int Num>
+Scalar EquelleRuntimeCPU::maxNorm(const std::array<CollOfScalar, Num>& vals) const
+{
+    Scalar norm = 0.0;
+    for (int i = 0; i < Num; ++i) {
+        norm = std::max(norm, maxNorm(vals[i]));
+    }
+    return norm;
 }
 
 
@@ -335,6 +569,12 @@ CollOfScalar EquelleRuntimeCPU::inputCollectionOfScalar(const String& name,
     const bool from_file = param_.getDefault(name + "_from_file", false);
     if (from_file) {
         const String filename = param_.get<String>(name + "_filename");
+        if (binaryio::isBinaryInput(param_, name, filename)) {
+            // Copied once, from the mapped file into the collection.
+            const MappedBinaryFile file(filename);
+            file.checkSize(0, size, name);
+            return CollOfScalar(CollOfScalar::V(Eigen::Map<const CollOfScalar::V>(file.doubles(0), size)));
+        }
         std::ifstream is(filename.c_str());
         if (!is) {
             OPM_THROW(std::runtime_error, "Could not find file " << filename);
@@ -0,0 +1,168 @@
+/*
+  Copyright 2013 SINTEF ICT, Applied Mathematics.
+*/
+
+#pragma once
+
+#include <opm/core/utility/parameters/ParameterGroup.hpp>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace equelle {
+
+/// A square sparse matrix in compressed row (CSR) or compressed
+/// column (CSC) storage. The arrays are not owned, so that matrices
+/// such as the AD Jacobians can be solved without copying them.
+/// Inner indices must be sorted within each row (column).
+///
+/// With block_size > 1 the matrix is in block compressed row (BSR)
+/// storage: size, outer_start and inner_index count block rows and
+/// columns, and values holds a dense block_size x block_size block,
+/// row-major, for each stored block. See BlockSparseMatrix.
+struct SparseMatrixView
+{
+    int size;
+    const int* outer_start;
+    const int* inner_index;
+    const double* values;
+    bool column_major;
+    int block_size;
+
+    /// Number of scalar rows (and columns).
+    int scalarSize() const { return size * block_size; }
+};
+
+/// Creates a view of a compressed Eigen sparse matrix.
+template <class EigenSparseMatrix>
+SparseMatrixView makeSparseMatrixView(const EigenSparseMatrix& m)
+{
+    return SparseMatrixView{ int(m.rows()), m.outerIndexPtr(), m.innerIndexPtr(),
+                             m.valuePtr(), !EigenSparseMatrix::IsRowMajor, 1 };
+}
+
+/// Interface for preconditioners used by KrylovSolver.
+class Preconditioner
+{
+public:
+    virtual ~Preconditioner() {}
+    /// Symbolic phase, depending only on the sparsity pattern (the
+    /// values pointer is null). The pattern arrays stay valid until the
+    /// next call to analyze().
+    virtual void analyze(const SparseMatrixView& pattern) = 0;
+    /// Numeric phase, for a matrix with the analyzed pattern.
+    virtual void factor(const SparseMatrixView& matrix) = 0;
+    /// Computes z = M^{-1} r, for vectors of matrix.scalarSize().
+    virtual void apply(const double* r, double* z) const = 0;
+};
+
+/// Iterative (Krylov subspace) linear solvers, implemented in the
+/// runtime so that threading and preconditioner setup are under our
+/// control. Convergence is decided on the true relative residual
+/// |b - Ax| / |b|: when the residual updated by the iteration gets
+/// below the tolerance, b - Ax is computed, and the iteration restarts
+/// from it if that is still too large. Report::residual is the true one.
+///
+/// Parameters:
+///   linear_solver          "bicgstab", "gmres" or "cg"
+///   preconditioner         "ilu0" (default), "jacobi" or "none"
+///   linear_solver_tol      relative residual tolerance (default 1e-8)
+///   linear_solver_max_iter maximum number of iterations (default 1000)
+///   gmres_restart          Krylov space size for GMRES (default 30)
+///   preconditioner_lag     number of further solves that may reuse a
+///                          preconditioner before it is recomputed (default 0)
+///   num_threads            OpenMP threads for the products and vector
+///                          operations (default 1, no threading)
+///
+/// The symbolic analysis of the preconditioner is redone only when
+/// the sparsity pattern changes, which it does not between Newton
+/// iterations or timesteps on a fixed grid. A lagged (stale)
+/// preconditioner that fails to converge is recomputed and the solve
+/// is retried.
+///
+/// Block (BSR) matrices, as for systems with interleaved unknowns, are
+/// solved block by block: the products use the dense blocks directly,
+/// "ilu0" is a block ILU0 without fill-in outside the block pattern, and
+/// "jacobi" inverts the diagonal block of each cell. For scalar matrices
+/// these are the usual ILU0 and (point) Jacobi methods.
+///
+/// CSC matrices, such as the AD Jacobians, are copied to CSR at the start
+/// of each solve, so that the iterations only run on rows.
+class KrylovSolver
+{
+public:
+    enum Method { BiCGStab, GMRES, CG };
+    enum PreconditionerType { NoPreconditioner, Jacobi, ILU0 };
+
+    struct Report
+    {
+        bool converged;
+        int iterations;
+        double residual;     // Final relative residual.
+        double setup_time;   // Seconds spent computing the preconditioner.
+        double solve_time;   // Seconds spent iterating.
+        bool reused_pattern;         // Symbolic analysis was reused.
+        bool reused_preconditioner;  // A lagged preconditioner was used.
+    };
+
+    explicit KrylovSolver(const Opm::parameter::ParameterGroup& param);
+    ~KrylovSolver();
+
+    /// Solve A x = b. A positive tolerance overrides linear_solver_tol
+    /// for this solve (used for the forcing terms of inexact Newton
+    /// methods).
+    Report solve(const SparseMatrixView& matrix, const double* rhs, double* x,
+                 const double tolerance = 0.0);
+
+    /// A short description such as "bicgstab+ilu0".
+    std::string name() const;
+
+    /// Parses the preconditioner parameter: "ilu0", "jacobi" or "none".
+    static PreconditionerType preconditionerType(const std::string& name);
+
+    /// Creates a preconditioner for matrices with the given block size,
+    /// running on num_threads threads, for solvers built on the ones used
+    /// here (such as the distributed solver of the MPI backend).
+    static std::unique_ptr<Preconditioner> makePreconditioner(const PreconditionerType type,
+                                                              const int block_size,
+                                                              const int num_threads = 1);
+
+private:
+    int iterate(const SparseMatrixView& matrix, const double* rhs, const double tolerance,
+                double* x, double& residual) const;
+    int solveBiCGStab(const SparseMatrixView& matrix, const double* rhs, const double tolerance,
+                      double* x, double& residual) const;
+    int solveGMRES(const SparseMatrixView& matrix, const double* rhs, const double tolerance,
+                   double* x, double& residual) const;
+    int solveCG(const SparseMatrixView& matrix, const double* rhs, const double tolerance,
+                double* x, double& residual) const;
+    bool samePattern(const SparseMatrixView& matrix) const;
+    void storePattern(const SparseMatrixView& matrix);
+    SparseMatrixView patternView() const;
+    SparseMatrixView rowMajorView(const SparseMatrixView& matrix);
+
+    Method method_;
+    PreconditionerType preconditioner_type_;
+    double tolerance_;
+    int max_iter_;
+    int restart_;
+    int lag_;
+    int num_threads_;
+    // The pattern the preconditioner was analyzed for.
+    std::vector<int> outer_start_;
+    std::vector<int> inner_index_;
+    bool column_major_;
+    int block_size_;
+    // For CSC input: the row-major pattern, the position in the input
+    // values of each of its entries, and the values of the current solve.
+    std::vector<int> row_start_;
+    std::vector<int> column_index_;
+    std::vector<int> transpose_source_;
+    std::vector<double> row_values_;
+    // Number of solves the current numeric preconditioner has been reused for.
+    int age_;
+    std::unique_ptr<Preconditioner> preconditioner_;
+};
+
+} // namespace equelle
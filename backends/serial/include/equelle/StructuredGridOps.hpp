@@ -0,0 +1,95 @@
+/*
+  Copyright 2013 SINTEF ICT, Applied Mathematics.
+*/
+
+#pragma once
+
+#include <opm/core/grid.h>
+
+#include <memory>
+
+#include "equelle/equelleTypes.hpp"
+
+namespace equelle {
+
+/// Matrix-free gradient and divergence for logically Cartesian grids.
+///
+/// The grids created by Opm::GridManager from nx, ny (and nz) number the
+/// cells with the x-index running fastest, and the faces family by family:
+/// first the faces normal to the x-axis, then y (and z), each family again
+/// with the x-index running fastest. On such grids the neighbours of a
+/// cell are found by fixed strides, so the operators of Opm::HelperOps can
+/// be applied by loops over the cells instead of as sparse matrices.
+///
+/// The results are the same as those of the HelperOps matrices, including
+/// the order of the floating point additions, the derivatives and their
+/// sparsity patterns (numerically zero entries included).
+class StructuredGridOps
+{
+public:
+    /// Returns the operators for grid if it has the numbering described
+    /// above, otherwise null. Checks all faces, which is cheap compared to
+    /// building the HelperOps matrices. The operators run on num_threads
+    /// threads.
+    static std::unique_ptr<StructuredGridOps> detect(const UnstructuredGrid& grid, const int num_threads);
+
+    /// The internal faces, those with two neighbour cells, in increasing order
+    /// as in Opm::HelperOps::internal_faces.
+    int numInternalFaces() const { return num_internal_faces_; }
+    int internalFace(const int i) const;
+
+    /// Cell differences on the internal faces, second cell minus first cell,
+    /// as HelperOps::grad (and HelperOps::ngrad for negGradient).
+    CollOfScalar gradient(const CollOfScalar& cell_values) const;
+    CollOfScalar negGradient(const CollOfScalar& cell_values) const;
+
+    /// Sum of outgoing fluxes on all faces of each cell, as HelperOps::fulldiv.
+    CollOfScalar divergence(const CollOfScalar& face_fluxes) const;
+
+    /// Sum of outgoing fluxes on the internal faces of each cell, as HelperOps::div.
+    CollOfScalar interiorDivergence(const CollOfScalar& internal_face_fluxes) const;
+
+private:
+    StructuredGridOps(const int dimensions, const int* cartdims, const int num_threads);
+
+    /// Faces normal to one axis. They are ordered as the cells, but with one
+    /// more layer (all faces) or one less (internal faces) along the axis.
+    struct Family
+    {
+        int axis;
+        int stride;             // Difference in cell index between the two neighbours.
+        int all_dims[3];
+        int all_offset;         // Grid index of the first face of the family.
+        int internal_dims[3];
+        int internal_offset;    // Position of the first face among the internal faces.
+    };
+
+    /// The family of a face (grid index or internal position), and its
+    /// position among the faces of the family.
+    const Family& family(const int face, const bool internal, int& local_face) const;
+
+    /// The two neighbour cells of a face, Boundary::outer if missing.
+    void faceCells(const int face, const bool internal, int* cells) const;
+
+    /// Internal positions of the low and high faces of a cell along each
+    /// axis, -1 where the face is on the boundary.
+    void cellInternalFaces(const int cell, int* faces) const;
+
+    CollOfScalar gradient(const CollOfScalar& x, const bool negative) const;
+    CollOfScalar divergence(const CollOfScalar& flux, const bool internal) const;
+
+    /// Multiplies a Jacobian block by the operator matrix whose column j has
+    /// the (row, coefficient) pairs given by column(j, rows, coefs).
+    template <class Column>
+    static CollOfScalar::M applyToJacobian(const int rows, const CollOfScalar::M& jac, const Column& column);
+
+    int dimensions_;
+    int num_threads_;
+    int n_[3];
+    int number_of_cells_;
+    int number_of_faces_;
+    int num_internal_faces_;
+    Family families_[3];
+};
+
+} // namespace equelle
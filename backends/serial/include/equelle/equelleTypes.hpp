@@ -4,9 +4,21 @@
 
 #include <vector>
 #include <string>
+#include <iterator>
+#include <cstddef>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <utility>
 
 namespace equelle {
 
+/// Entity loops over collections smaller than this run on a single
+/// thread even if num_threads > 1, since the threading overhead would
+/// dominate. Parallel loops always give the thread count explicitly,
+/// as num_threads(num_threads) if (num_threads > 1 && n > min_parallel_size).
+const int min_parallel_size = 10000;
+
 /// Codes for inner and outer boundaries
 enum Boundary { outer = -1, inner = -2 };
 
@@ -27,10 +39,6 @@ typedef TopologicalEntity<0> Cell;
 /// Topological entity for cell.
 typedef TopologicalEntity<1> Face;
 
-/// Topological collections.
-typedef std::vector<Cell> CollOfCell;
-typedef std::vector<Face> CollOfFace;
-
 // Basic types. Note that we do not have Vector type defined
 // although the CollOfVector type is.
 typedef double Scalar;
@@ -41,6 +49,11 @@ typedef std::string String;
 typedef Eigen::Array<bool, Eigen::Dynamic, 1> CollOfBool;
 typedef std::vector<Scalar> SeqOfScalar;
 
+/// Value-only Collection Of Scalar. The compiler uses this type for
+/// variables and function arguments that can never carry derivatives,
+/// avoiding the storage and propagation of (zero) Jacobians.
+typedef Eigen::Array<Scalar, Eigen::Dynamic, 1> CollOfScalarValues;
+
 /// The Collection Of Scalar type is based on Eigen and opm-autodiff.
 /// It uses inheritance to provide extra interfaces for ease of use,
 /// notably converting constructors.
@@ -57,10 +70,30 @@ public:
         : ADB(adb)
     {
     }
+    CollOfScalar(ADB&& adb)
+        : ADB(std::move(adb))
+    {
+    }
     CollOfScalar(const ADB::V& x)
         : ADB(ADB::constant(x))
     {
     }
+    /// Takes over the values without copying them.
+    CollOfScalar(ADB::V&& x)
+        : ADB(ADB::constant(std::move(x)))
+    {
+    }
+    /// Evaluates a value-only Eigen array expression, for example
+    /// (a.value() * b.value() + c.value()). Eigen fuses the whole
+    /// expression into a single loop, so unlike the AD operators no
+    /// temporaries or Jacobians are created for the intermediate terms.
+    /// The compiler emits such expressions for values that it has
+    /// found cannot carry derivatives.
+    template <class Derived>
+    explicit CollOfScalar(const Eigen::ArrayBase<Derived>& x)
+        : ADB(ADB::constant(ADB::V(x)))
+    {
+    }
 };
 
 /// This operator is not provided by AutoDiffBlock, so we must add it here.
@@ -342,6 +375,14 @@ public:
     {
         return num_;
     }
+    int stride() const
+    {
+        return stride_;
+    }
+    int start() const
+    {
+        return start_;
+    }
 
 
     class ESpanIterator
@@ -400,7 +441,7 @@ public:
         return ESpanIterator(this, num_);
     }
 
-    bool operator==(const ESpan& rhs)
+    bool operator==(const ESpan& rhs) const
     {
         return num_ == rhs.num_ && start_ == rhs.start_ && stride_ == rhs.stride_;
     }
@@ -411,4 +452,214 @@ private:
     int start_;
 };
 
+
+
+/// A collection of topological entities.
+/// Contiguous or strided ranges of entities, such as all cells of the
+/// grid, are represented by an ESpan and need no per-entity storage.
+/// Other collections are stored as an explicit list of entities, and a
+/// range is converted to an explicit list if it is modified.
+///
+/// Explicit lists are shared between copies until one of them is
+/// modified (copy-on-write), so collections are cheap to copy and
+/// return by value, and copies keep the identity() of the original.
+///
+/// Read-only access (through const references) never changes the
+/// representation. Mutable access converts to an unshared explicit
+/// list first, which is not thread safe, so call makeExplicit() before
+/// writing to a collection from several threads.
+template <int Codim>
+class TopologicalCollection
+{
+public:
+    typedef TopologicalEntity<Codim> Entity;
+    typedef Entity value_type;
+    typedef std::size_t size_type;
+    typedef typename std::vector<Entity>::iterator iterator;
+
+    /// Random access iterator for read-only traversal. Dereferencing
+    /// yields entities by value, since ranges have no stored entities.
+    class const_iterator
+    {
+    public:
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef Entity value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Entity* pointer;
+        typedef Entity reference;
+
+        const_iterator() : coll_(nullptr), index_(0) {}
+        const_iterator(const TopologicalCollection* coll, const difference_type index)
+            : coll_(coll), index_(index) {}
+
+        Entity operator*() const { return (*coll_)[index_]; }
+        Entity operator[](const difference_type n) const { return (*coll_)[index_ + n]; }
+        const_iterator& operator++() { ++index_; return *this; }
+        const_iterator operator++(int) { const_iterator it(*this); ++index_; return it; }
+        const_iterator& operator--() { --index_; return *this; }
+        const_iterator operator--(int) { const_iterator it(*this); --index_; return it; }
+        const_iterator& operator+=(const difference_type n) { index_ += n; return *this; }
+        const_iterator& operator-=(const difference_type n) { index_ -= n; return *this; }
+        const_iterator operator+(const difference_type n) const { return const_iterator(coll_, index_ + n); }
+        const_iterator operator-(const difference_type n) const { return const_iterator(coll_, index_ - n); }
+        difference_type operator-(const const_iterator& rhs) const { return index_ - rhs.index_; }
+        bool operator==(const const_iterator& rhs) const { return index_ == rhs.index_; }
+        bool operator!=(const const_iterator& rhs) const { return index_ != rhs.index_; }
+        bool operator<(const const_iterator& rhs) const { return index_ < rhs.index_; }
+        bool operator>(const const_iterator& rhs) const { return index_ > rhs.index_; }
+        bool operator<=(const const_iterator& rhs) const { return index_ <= rhs.index_; }
+        bool operator>=(const const_iterator& rhs) const { return index_ >= rhs.index_; }
+    private:
+        const TopologicalCollection* coll_;
+        difference_type index_;
+    };
+
+    /// Empty collection.
+    TopologicalCollection()
+        : span_(0), is_span_(false), entities_(std::make_shared<std::vector<Entity>>())
+    {
+    }
+    /// Explicit collection of num empty entities.
+    explicit TopologicalCollection(const int num)
+        : span_(0), is_span_(false), entities_(std::make_shared<std::vector<Entity>>(num))
+    {
+    }
+    /// Range of entities, without per-entity storage.
+    explicit TopologicalCollection(const ESpan& span)
+        : span_(span), is_span_(true)
+    {
+    }
+    /// Explicit collection.
+    TopologicalCollection(std::vector<Entity> entities)
+        : span_(0), is_span_(false), entities_(std::make_shared<std::vector<Entity>>(std::move(entities)))
+    {
+    }
+
+    bool isSpan() const
+    {
+        return is_span_;
+    }
+    const ESpan& span() const
+    {
+        assert(is_span_);
+        return span_;
+    }
+    size_type size() const
+    {
+        return is_span_ ? span_.size() : entities_->size();
+    }
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    Entity operator[](const int i) const
+    {
+        return is_span_ ? Entity(span_[i]) : (*entities_)[i];
+    }
+    Entity& operator[](const int i)
+    {
+        makeExplicit();
+        return (*entities_)[i];
+    }
+
+    const_iterator begin() const
+    {
+        return const_iterator(this, 0);
+    }
+    const_iterator end() const
+    {
+        return const_iterator(this, size());
+    }
+    iterator begin()
+    {
+        makeExplicit();
+        return entities_->begin();
+    }
+    iterator end()
+    {
+        makeExplicit();
+        return entities_->end();
+    }
+
+    void reserve(const size_type n)
+    {
+        makeExplicit();
+        entities_->reserve(n);
+    }
+    void push_back(const Entity& e)
+    {
+        makeExplicit();
+        entities_->push_back(e);
+    }
+    template <class... Args>
+    void emplace_back(Args&&... args)
+    {
+        makeExplicit();
+        entities_->emplace_back(std::forward<Args>(args)...);
+    }
+
+    /// Convert a range to an explicit list of entities, and stop sharing
+    /// the list with copies of the collection.
+    void makeExplicit()
+    {
+        if (is_span_) {
+            const int n = span_.size();
+            entities_ = std::make_shared<std::vector<Entity>>(n);
+            for (int i = 0; i < n; ++i) {
+                (*entities_)[i].index = span_[i];
+            }
+            is_span_ = false;
+        } else if (entities_.use_count() > 1) {
+            entities_ = std::make_shared<std::vector<Entity>>(*entities_);
+        }
+    }
+
+    /// Collections with the same identity are equal: ranges are identified
+    /// by the range, explicit lists by their storage, which is shared by
+    /// copies until one of them is modified. Equal collections built
+    /// separately have different identities. Keeping a copy of a
+    /// collection keeps its identity from being reused.
+    bool sameIdentity(const TopologicalCollection& rhs) const
+    {
+        if (is_span_ != rhs.is_span_) {
+            return false;
+        }
+        return is_span_ ? span_ == rhs.span_ : entities_ == rhs.entities_;
+    }
+
+    /// Two ranges, or collections with the same identity, are compared
+    /// in constant time, other collections element by element.
+    bool operator==(const TopologicalCollection& rhs) const
+    {
+        if (this == &rhs || sameIdentity(rhs)) {
+            return true;
+        }
+        if (size() != rhs.size()) {
+            return false;
+        }
+        if (is_span_ && rhs.is_span_) {
+            return empty() || span_ == rhs.span_;
+        }
+        if (!is_span_ && !rhs.is_span_) {
+            return *entities_ == *rhs.entities_;
+        }
+        return std::equal(begin(), end(), rhs.begin());
+    }
+    bool operator!=(const TopologicalCollection& rhs) const
+    {
+        return !(*this == rhs);
+    }
+
+private:
+    ESpan span_;
+    bool is_span_;
+    // Null for ranges.
+    std::shared_ptr<std::vector<Entity>> entities_;
+};
+
+/// Topological collections.
+typedef TopologicalCollection<0> CollOfCell;
+typedef TopologicalCollection<1> CollOfFace;
+
 } // namespace equelle
@@ -0,0 +1,335 @@
+/*
+  Copyright 2013 SINTEF ICT, Applied Mathematics.
+*/
+
+#include "equelle/BinaryIO.hpp"
+#include <opm/core/utility/ErrorMacros.hpp>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace equelle {
+
+namespace {
+
+    const std::size_t index_tail_size = sizeof(std::uint64_t) + 8;
+
+    /// Returns where the index of a file of the given length starts, from
+    /// the last index_tail_size bytes of the file, and sets the number of
+    /// records. Returns 0 if the file does not end with an index.
+    std::uint64_t indexStart(const char* tail, const std::uint64_t length, std::uint64_t& num_records)
+    {
+        if (length < binaryio::header_size + index_tail_size
+            || !std::equal(binaryio::index_magic, binaryio::index_magic + 8, tail + sizeof(std::uint64_t))) {
+            return 0;
+        }
+        std::uint64_t num;
+        std::memcpy(&num, tail, sizeof(num));
+        if (num > (length - binaryio::header_size - index_tail_size) / sizeof(std::uint64_t)) {
+            return 0;
+        }
+        num_records = num;
+        return length - index_tail_size - num_records * sizeof(std::uint64_t);
+    }
+
+    /// True if the offsets are increasing and aligned, and each leaves room
+    /// for a count before records_end.
+    bool validOffsets(const std::vector<std::uint64_t>& offsets, const std::uint64_t records_end)
+    {
+        std::uint64_t min_offset = binaryio::header_size;
+        for (const std::uint64_t offset : offsets) {
+            if (offset < min_offset || offset % 8 != 0 || offset + sizeof(std::uint64_t) > records_end) {
+                return false;
+            }
+            min_offset = offset + sizeof(std::uint64_t);
+        }
+        return true;
+    }
+
+} // anonymous namespace
+
+
+namespace binaryio {
+
+    std::size_t valueSize(const ValueType type)
+    {
+        switch (type) {
+        case Float64:
+            return sizeof(double);
+        case Int32:
+            return sizeof(std::int32_t);
+        }
+        OPM_THROW(std::runtime_error, "Unknown value type " << int(type) << " in binary file.");
+    }
+
+    std::size_t recordBytes(const ValueType type, const std::uint64_t count)
+    {
+        const std::size_t data = count * valueSize(type);
+        return sizeof(std::uint64_t) + (data + 7) / 8 * 8;
+    }
+
+    std::vector<char> indexBytes(const std::vector<std::uint64_t>& offsets)
+    {
+        const std::uint64_t num_records = offsets.size();
+        const std::size_t offset_bytes = num_records * sizeof(std::uint64_t);
+        std::vector<char> bytes(offset_bytes + index_tail_size);
+        if (num_records > 0) {
+            std::memcpy(bytes.data(), offsets.data(), offset_bytes);
+        }
+        std::memcpy(bytes.data() + offset_bytes, &num_records, sizeof(num_records));
+        std::copy(index_magic, index_magic + 8, bytes.data() + offset_bytes + sizeof(num_records));
+        return bytes;
+    }
+
+    std::vector<std::uint64_t> readIndex(const std::string& filename, const ValueType type,
+                                         std::uint64_t& records_end)
+    {
+        std::ifstream file(filename.c_str(), std::ios::binary | std::ios::ate);
+        const std::uint64_t length = file ? std::uint64_t(file.tellg()) : 0;
+        char header[header_size];
+        if (length < header_size || !file.seekg(0).read(header, header_size)
+            || !std::equal(magic, magic + 8, header)) {
+            OPM_THROW(std::runtime_error, "Cannot append to " << filename << ", it is not an Equelle binary file.");
+        }
+        std::uint32_t header_ints[2];
+        std::memcpy(header_ints, header + 8, sizeof(header_ints));
+        if (header_ints[0] != version) {
+            OPM_THROW(std::runtime_error, "Cannot append to " << filename << ", it has version " << header_ints[0]
+                      << ", not " << version << ".");
+        }
+        if (header_ints[1] != std::uint32_t(type)) {
+            OPM_THROW(std::runtime_error, "Cannot append to " << filename << ", it holds values of another type.");
+        }
+        char tail[index_tail_size];
+        std::uint64_t num_records = 0;
+        records_end = length >= header_size + index_tail_size
+            && file.seekg(length - index_tail_size).read(tail, index_tail_size)
+            ? indexStart(tail, length, num_records) : 0;
+        std::vector<std::uint64_t> offsets(num_records);
+        if (records_end == 0
+            || (num_records > 0 && !file.seekg(records_end).read(reinterpret_cast<char*>(offsets.data()),
+                                                                  num_records * sizeof(std::uint64_t)))
+            || !validOffsets(offsets, records_end)) {
+            OPM_THROW(std::runtime_error, "Cannot append to " << filename << ", its index is missing or corrupt.");
+        }
+        return offsets;
+    }
+
+    void checkByteOrder()
+    {
+        const std::uint32_t one = 1;
+        char first;
+        std::memcpy(&first, &one, 1);
+        if (first != 1) {
+            OPM_THROW(std::runtime_error, "Binary input and output is only supported on little-endian hosts.");
+        }
+    }
+
+    bool isBinaryInput(const Opm::parameter::ParameterGroup& param,
+                       const std::string& name, const std::string& filename)
+    {
+        if (param.has(name + "_format")) {
+            const std::string format = param.get<std::string>(name + "_format");
+            if (format != "text" && format != "binary") {
+                OPM_THROW(std::runtime_error, "Unknown " << name << "_format: " << format);
+            }
+            return format == "binary";
+        }
+        const std::string ext = ".eqbin";
+        return filename.size() >= ext.size()
+            && filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0;
+    }
+
+} // namespace binaryio
+
+
+
+BinaryWriter::BinaryWriter(const std::string& filename, const binaryio::ValueType type, const bool append)
+    : filename_(filename),
+      type_(type),
+      records_end_(binaryio::header_size)
+{
+    binaryio::checkByteOrder();
+    if (append) {
+        // The records are written over the index, which is rewritten after them.
+        offsets_ = binaryio::readIndex(filename, type, records_end_);
+        file_.open(filename.c_str(), std::ios::binary | std::ios::in | std::ios::out);
+    } else {
+        file_.open(filename.c_str(), std::ios::binary | std::ios::trunc);
+    }
+    if (!file_) {
+        OPM_THROW(std::runtime_error, "Failed to open " << filename);
+    }
+    if (!append) {
+        const std::uint32_t header_ints[2] = { binaryio::version, std::uint32_t(type) };
+        file_.write(binaryio::magic, 8);
+        file_.write(reinterpret_cast<const char*>(header_ints), sizeof(header_ints));
+        const std::vector<char> index = binaryio::indexBytes(offsets_);
+        file_.write(index.data(), index.size());
+    }
+}
+
+void BinaryWriter::write(const double* values, const std::uint64_t count)
+{
+    writeRecord(reinterpret_cast<const char*>(values), count, binaryio::Float64);
+}
+
+void BinaryWriter::write(const int* values, const std::uint64_t count)
+{
+    static_assert(sizeof(int) == sizeof(std::int32_t), "Binary files require 32-bit int.");
+    writeRecord(reinterpret_cast<const char*>(values), count, binaryio::Int32);
+}
+
+void BinaryWriter::writeRecord(const char* data, const std::uint64_t count, const binaryio::ValueType type)
+{
+    if (type != type_) {
+        OPM_THROW(std::logic_error, "Writing values of the wrong type to " << filename_);
+    }
+    const std::size_t bytes = count * binaryio::valueSize(type);
+    const std::size_t padding = binaryio::recordBytes(type, count) - sizeof(count) - bytes;
+    const char zeros[8] = { 0 };
+    file_.seekp(records_end_);
+    file_.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    file_.write(data, bytes);
+    file_.write(zeros, padding);
+    // The file only grows, so the new index covers the old one.
+    offsets_.push_back(records_end_);
+    records_end_ += binaryio::recordBytes(type, count);
+    const std::vector<char> index = binaryio::indexBytes(offsets_);
+    file_.write(index.data(), index.size());
+    if (!file_) {
+        OPM_THROW(std::runtime_error, "Failed to write to " << filename_);
+    }
+}
+
+
+
+MappedBinaryFile::MappedBinaryFile(const std::string& filename)
+    : filename_(filename),
+      data_(nullptr),
+      length_(0),
+      records_end_(0)
+{
+    binaryio::checkByteOrder();
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        OPM_THROW(std::runtime_error, "Could not find file " << filename);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || std::size_t(st.st_size) < binaryio::header_size) {
+        ::close(fd);
+        OPM_THROW(std::runtime_error, filename << " is not an Equelle binary file.");
+    }
+    length_ = st.st_size;
+    void* addr = ::mmap(nullptr, length_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        OPM_THROW(std::runtime_error, "Failed to map " << filename);
+    }
+    data_ = static_cast<const char*>(addr);
+
+    // Check the header, then find the records from the index.
+    std::uint32_t header_ints[2];
+    std::memcpy(header_ints, data_ + 8, sizeof(header_ints));
+    if (!std::equal(binaryio::magic, binaryio::magic + 8, data_)) {
+        ::munmap(addr, length_);
+        OPM_THROW(std::runtime_error, filename << " is not an Equelle binary file.");
+    }
+    if ((header_ints[0] != 1 && header_ints[0] != binaryio::version)
+        || (header_ints[1] != binaryio::Float64 && header_ints[1] != binaryio::Int32)) {
+        ::munmap(addr, length_);
+        OPM_THROW(std::runtime_error, filename << " has unsupported version " << header_ints[0]
+                  << " or value type " << header_ints[1]);
+    }
+    type_ = binaryio::ValueType(header_ints[1]);
+    if (header_ints[0] == 1) {
+        // No index, step from record to record.
+        std::size_t pos = binaryio::header_size;
+        while (pos < length_) {
+            std::uint64_t count = 0;
+            if (length_ - pos >= sizeof(count)) {
+                std::memcpy(&count, data_ + pos, sizeof(count));
+            }
+            const std::size_t bytes = binaryio::recordBytes(type_, count);
+            if (length_ - pos < bytes || count > length_) {
+                ::munmap(addr, length_);
+                OPM_THROW(std::runtime_error, filename << " is truncated or corrupt.");
+            }
+            records_.push_back(pos);
+            pos += bytes;
+        }
+        records_end_ = length_;
+        return;
+    }
+    std::uint64_t num_records = 0;
+    if (length_ >= binaryio::header_size + index_tail_size) {
+        records_end_ = indexStart(data_ + length_ - index_tail_size, length_, num_records);
+    }
+    records_.resize(num_records);
+    if (num_records > 0) {
+        std::memcpy(records_.data(), data_ + records_end_, num_records * sizeof(std::uint64_t));
+    }
+    if (records_end_ == 0 || !validOffsets(records_, records_end_)) {
+        ::munmap(addr, length_);
+        OPM_THROW(std::runtime_error, filename << " is truncated or corrupt.");
+    }
+}
+
+MappedBinaryFile::~MappedBinaryFile()
+{
+    ::munmap(const_cast<char*>(data_), length_);
+}
+
+std::uint64_t MappedBinaryFile::recordSize(const int record) const
+{
+    if (record < 0 || record >= numRecords()) {
+        OPM_THROW(std::runtime_error, filename_ << " has no record " << record
+                  << ", it has " << numRecords() << " records.");
+    }
+    std::uint64_t count;
+    std::memcpy(&count, data_ + records_[record], sizeof(count));
+    const std::uint64_t end = record + 1 < numRecords() ? records_[record + 1] : records_end_;
+    if (count > length_ || records_[record] + binaryio::recordBytes(type_, count) > end) {
+        OPM_THROW(std::runtime_error, filename_ << " is truncated or corrupt.");
+    }
+    return count;
+}
+
+const double* MappedBinaryFile::doubles(const int record) const
+{
+    return reinterpret_cast<const double*>(recordData(record, binaryio::Float64));
+}
+
+const std::int32_t* MappedBinaryFile::ints(const int record) const
+{
+    return reinterpret_cast<const std::int32_t*>(recordData(record, binaryio::Int32));
+}
+
+void MappedBinaryFile::checkSize(const int record, const std::uint64_t expected, const std::string& name) const
+{
+    const std::uint64_t size = recordSize(record);
+    if (size != expected) {
+        OPM_THROW(std::runtime_error, "Unexpected size of input data for " << name << " in file " << filename_
+                  << ": expected " << expected << " values, got " << size);
+    }
+}
+
+const char* MappedBinaryFile::recordData(const int record, const binaryio::ValueType type) const
+{
+    const char* names[] = { "", "double", "int32" };
+    if (type != type_) {
+        OPM_THROW(std::runtime_error, filename_ << " holds " << names[type_] << " values, expected "
+                  << names[type] << ".");
+    }
+    recordSize(record); // Checks the record number.
+    return data_ + records_[record] + sizeof(std::uint64_t);
+}
+
+} // namespace equelle
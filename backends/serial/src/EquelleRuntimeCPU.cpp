@@ -11,7 +11,8 @@
 #include <iterator>
 #include <stdexcept>
 #include <set>
-
+#include <algorithm>
+#include <cmath>
 
 
 
@@ -48,43 +49,130 @@ Opm::GridManager* createGridManager(const Opm::parameter::ParameterGroup& param)
     }
 }
 
+namespace {
+
+    /// Reads the output_format parameter, "text" (default) or "binary".
+    bool binaryOutputFormat(const Opm::parameter::ParameterGroup& param)
+    {
+        const std::string format = param.getDefault<std::string>("output_format", "text");
+        if (format != "text" && format != "binary") {
+            OPM_THROW(std::runtime_error, "Unknown output_format: " << format);
+        }
+        return format == "binary";
+    }
+
+    /// The num_threads parameter. Without it everything runs on one
+    /// thread, whatever the OpenMP defaults of the process are.
+    int numThreads(const Opm::parameter::ParameterGroup& param)
+    {
+        return param.getDefault("num_threads", 1);
+    }
+
+    /// The matrix-free operators, if the grid is logically Cartesian and
+    /// they are not disabled by matrix_free_ops.
+    std::unique_ptr<StructuredGridOps> structuredGridOps(const UnstructuredGrid& grid,
+                                                         const Opm::parameter::ParameterGroup& param)
+    {
+        if (!param.getDefault("matrix_free_ops", true)) {
+            return std::unique_ptr<StructuredGridOps>();
+        }
+        return StructuredGridOps::detect(grid, numThreads(param));
+    }
+
+} // anonymous namespace
+
 
 
 
 EquelleRuntimeCPU::EquelleRuntimeCPU(const Opm::parameter::ParameterGroup& param)
     : grid_manager_(equelle::createGridManager(param)),
       grid_(*(grid_manager_->c_grid())),
-      ops_(grid_),
+      structured_ops_(structuredGridOps(grid_, param)),
+      ops_(structured_ops_ ? nullptr : new Opm::HelperOps(grid_)),
       linsolver_(param),
       output_to_file_(param.getDefault("output_to_file", false)),
+      binary_output_(binaryOutputFormat(param)),
       verbose_(param.getDefault("verbose", 0)),
       param_(param),
       max_iter_(param.getDefault("max_iter", 10)),
-      abs_res_tol_(param.getDefault("abs_res_tol", 1e-6))
+      abs_res_tol_(param.getDefault("abs_res_tol", 1e-6)),
+      rel_res_tol_(param.getDefault("rel_res_tol", 0.0)),
+      max_res_tol_(param.getDefault("max_res_tol", 0.0)),
+      inexact_newton_(param.getDefault("inexact_newton", false)),
+      forcing_term_max_(param.getDefault("forcing_term_max", 0.9)),
+      line_search_(param.getDefault("line_search", false)),
+      line_search_max_cuts_(param.getDefault("line_search_max_cuts", 10)),
+      throw_on_newton_failure_(param.getDefault("throw_on_newton_failure", false)),
+      num_threads_(numThreads(param))
 {
+    setupThreads();
+    setupLinearSolver();
 }
 
 EquelleRuntimeCPU::EquelleRuntimeCPU(const UnstructuredGrid *grid, const Opm::parameter::ParameterGroup &param)
     : grid_( *grid ),
-      ops_(grid_),
+      structured_ops_(structuredGridOps(grid_, param)),
+      ops_(structured_ops_ ? nullptr : new Opm::HelperOps(grid_)),
       linsolver_(param),
       output_to_file_(param.getDefault("output_to_file", false)),
+      binary_output_(binaryOutputFormat(param)),
       verbose_(param.getDefault("verbose", 0)),
       param_(param),
       max_iter_(param.getDefault("max_iter", 10)),
-      abs_res_tol_(param.getDefault("abs_res_tol", 1e-6))
+      abs_res_tol_(param.getDefault("abs_res_tol", 1e-6)),
+      rel_res_tol_(param.getDefault("rel_res_tol", 0.0)),
+      max_res_tol_(param.getDefault("max_res_tol", 0.0)),
+      inexact_newton_(param.getDefault("inexact_newton", false)),
+      forcing_term_max_(param.getDefault("forcing_term_max", 0.9)),
+      line_search_(param.getDefault("line_search", false)),
+      line_search_max_cuts_(param.getDefault("line_search_max_cuts", 10)),
+      throw_on_newton_failure_(param.getDefault("throw_on_newton_failure", false)),
+      num_threads_(numThreads(param))
 {
+    setupThreads();
+    setupLinearSolver();
+}
 
+void EquelleRuntimeCPU::setupLinearSolver()
+{
+    // The default "opm" uses Opm::LinearSolverFactory, which is configured
+    // by the "linsolver" parameter.
+    const std::string method = param_.getDefault<std::string>("linear_solver", "opm");
+    if (method != "opm") {
+        krylov_.reset(new KrylovSolver(param_));
+    }
+    if (inexact_newton_ && !krylov_) {
+        OPM_THROW(std::runtime_error, "inexact_newton requires a native linear solver "
+                  "(linear_solver = bicgstab, gmres or cg).");
+    }
+    if (!(forcing_term_max_ > 0.0 && forcing_term_max_ < 1.0)) {
+        OPM_THROW(std::runtime_error, "forcing_term_max must be in (0, 1), got " << forcing_term_max_);
+    }
 }
 
-CollOfCell EquelleRuntimeCPU::allCells() const
+void EquelleRuntimeCPU::setupThreads()
 {
-    const int nc = grid_.number_of_cells;
-    CollOfCell cells(nc);
-    for (int c = 0; c < nc; ++c) {
-        cells[c].index = c;
+    // Every parallel loop is given num_threads_ explicitly, so the
+    // process-wide OpenMP settings (which also apply to other code in the
+    // process, such as the MPI runtime) are left alone.
+    if (num_threads_ < 1) {
+        OPM_THROW(std::runtime_error, "num_threads must be at least 1, got " << num_threads_);
+    }
+#ifndef _OPENMP
+    if (num_threads_ > 1) {
+        OPM_THROW(std::runtime_error, "num_threads = " << num_threads_
+                  << " requested, but the Equelle runtime was built without OpenMP support.");
     }
-    return cells;
+#endif
+}
+
+
+const CollOfCell& EquelleRuntimeCPU::allCells() const
+{
+    if (!all_cells_) {
+        all_cells_ = std::make_shared<const CollOfCell>(ESpan(grid_.number_of_cells));
+    }
+    return *all_cells_;
 }
 
 
@@ -103,105 +191,189 @@ bool EquelleRuntimeCPU::boundaryCell(const int cell_index) const
 }
 
 
-CollOfCell EquelleRuntimeCPU::boundaryCells() const
+const std::vector<char>& EquelleRuntimeCPU::boundaryCellFlags() const
 {
-    CollOfCell cells;
     const int nc = grid_.number_of_cells;
-    cells.reserve(nc);
-    for (int c = 0; c < nc; ++c) {
-        if ( boundaryCell(c) ) {
-            cells.emplace_back( Cell(c) );
+    if (int(boundary_cell_flags_.size()) != nc) {
+        boundary_cell_flags_.resize(nc);
+        #pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && nc > min_parallel_size)
+        for (int c = 0; c < nc; ++c) {
+            boundary_cell_flags_[c] = boundaryCell(c);
         }
     }
-    return cells;
+    return boundary_cell_flags_;
 }
 
 
-CollOfCell EquelleRuntimeCPU::interiorCells() const
+const CollOfCell& EquelleRuntimeCPU::boundaryCells() const
 {
-    CollOfCell cells;
-    const int nc = grid_.number_of_cells;
-    cells.reserve(nc);
-    for (int c = 0; c < nc; ++c) {
-        if ( !boundaryCell(c) ) {
-            cells.emplace_back( Cell(c) );
+    if (!boundary_cells_) {
+        const int nc = grid_.number_of_cells;
+        const std::vector<char>& is_boundary = boundaryCellFlags();
+        std::shared_ptr<CollOfCell> cells(new CollOfCell);
+        cells->reserve(nc);
+        for (int c = 0; c < nc; ++c) {
+            if ( is_boundary[c] ) {
+                cells->emplace_back( Cell(c) );
+            }
+        }
+        boundary_cells_ = cells;
+    }
+    return *boundary_cells_;
+}
+
+
+const CollOfCell& EquelleRuntimeCPU::interiorCells() const
+{
+    if (!interior_cells_) {
+        const int nc = grid_.number_of_cells;
+        const std::vector<char>& is_boundary = boundaryCellFlags();
+        std::shared_ptr<CollOfCell> cells(new CollOfCell);
+        cells->reserve(nc);
+        for (int c = 0; c < nc; ++c) {
+            if ( !is_boundary[c] ) {
+                cells->emplace_back( Cell(c) );
+            }
         }
+        interior_cells_ = cells;
     }
-    return cells;
+    return *interior_cells_;
 }
 
 
-CollOfFace EquelleRuntimeCPU::allFaces() const
+const CollOfFace& EquelleRuntimeCPU::allFaces() const
 {
-    const int nf = grid_.number_of_faces;
-    CollOfFace faces(nf);
-    for (int f = 0; f < nf; ++f) {
-        faces[f].index = f;
+    if (!all_faces_) {
+        all_faces_ = std::make_shared<const CollOfFace>(ESpan(grid_.number_of_faces));
     }
-    return faces;
+    return *all_faces_;
 }
 
 
 // Again... this is kind of botched for a 1D grid implemented as a 2D(n, 1) or 2D(1, n) grid...
 
-CollOfFace EquelleRuntimeCPU::boundaryFaces() const
+const CollOfFace& EquelleRuntimeCPU::boundaryFaces() const
 {
-    const int nif = ops_.internal_faces.size();
+    if (boundary_faces_) {
+        return *boundary_faces_;
+    }
+
+    const int nif = numInternalFaces();
     const int nbf = grid_.number_of_faces - nif;
-    CollOfFace bfaces(nbf);
+    std::shared_ptr<CollOfFace> bfaces(new CollOfFace(nbf));
     int if_cursor = 0;
     int bf_cursor = 0;
 
-    // This works as long as ops_.internal_faces(i)<ops_.internal_faces(i+1), which it currently is.
+    // This works as long as internalFace(i)<internalFace(i+1), which it currently is.
     // Would be better to extend HelperOps to support this functionality.
 
     for (int i = 0; i < grid_.number_of_faces; ++i) {
         // Advance if_cursor so that the next internal face to look out for has larger or equal index to i
-        while ( (if_cursor < nif) && (i > ops_.internal_faces[if_cursor]) ) {
+        while ( (if_cursor < nif) && (i > internalFace(if_cursor)) ) {
             ++if_cursor;
         }
         // Now if_cursor points beyond the last internal face, or internal_face[if_cursor]>=i.
         // If (if_cursor points beyond the last internal face) or (internal_face[if_cursor] is truly > i), we surely have a boundary face...
-        if ( (if_cursor == nif) || (ops_.internal_faces[if_cursor] > i) ) {
-            bfaces[bf_cursor].index = i;
+        if ( (if_cursor == nif) || (internalFace(if_cursor) > i) ) {
+            (*bfaces)[bf_cursor].index = i;
             ++bf_cursor;
         }
     }
 
-    return bfaces;
+    boundary_faces_ = bfaces;
+    return *boundary_faces_;
+}
+
+
+int EquelleRuntimeCPU::numInternalFaces() const
+{
+    return structured_ops_ ? structured_ops_->numInternalFaces() : ops_->internal_faces.size();
 }
 
 
-CollOfFace EquelleRuntimeCPU::interiorFaces() const
+int EquelleRuntimeCPU::internalFace(const int i) const
 {
-    const int nif = ops_.internal_faces.size();
-    CollOfFace ifaces(nif);
-    for (int i = 0; i < nif; ++i) {
-        ifaces[i].index = ops_.internal_faces(i);
+    return structured_ops_ ? structured_ops_->internalFace(i) : ops_->internal_faces[i];
+}
+
+
+const CollOfFace& EquelleRuntimeCPU::interiorFaces() const
+{
+    if (!interior_faces_) {
+        const int nif = numInternalFaces();
+        std::shared_ptr<CollOfFace> ifaces(new CollOfFace(nif));
+        #pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && nif > min_parallel_size)
+        for (int i = 0; i < nif; ++i) {
+            (*ifaces)[i].index = internalFace(i);
+        }
+        interior_faces_ = ifaces;
     }
-    return ifaces;
+    return *interior_faces_;
 }
 
 
-CollOfCell EquelleRuntimeCPU::firstCell(const CollOfFace& faces) const
+CollOfCell EquelleRuntimeCPU::faceCells(const CollOfFace& faces, const int side) const
 {
     const int n = faces.size();
     CollOfCell fcells(n);
+    #pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && n > min_parallel_size)
     for (int i = 0; i < n; ++i) {
-        fcells[i].index = grid_.face_cells[2*faces[i].index];
+        fcells[i].index = grid_.face_cells[2*faces[i].index + side];
     }
     return fcells;
 }
 
 
+bool EquelleRuntimeCPU::runtimeSet(const CollOfCell& cells) const
+{
+    for (const auto* set : { &all_cells_, &boundary_cells_, &interior_cells_,
+                             &interior_face_cells_[0], &interior_face_cells_[1] }) {
+        if (*set && (*set)->sameIdentity(cells)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool EquelleRuntimeCPU::runtimeSet(const CollOfFace& faces) const
+{
+    for (const auto* set : { &all_faces_, &boundary_faces_, &interior_faces_ }) {
+        if (*set && (*set)->sameIdentity(faces)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+CollOfCell EquelleRuntimeCPU::firstCell(const CollOfFace& faces) const
+{
+    // The neighbours of the interior faces are requested far more often
+    // than any other, so we keep those around. Returning them only
+    // copies a reference to their storage, which keeps their identity
+    // for the index map caches.
+    const CollOfFace& ifaces = interiorFaces();
+    if (faces.sameIdentity(ifaces)) {
+        if (!interior_face_cells_[0]) {
+            interior_face_cells_[0].reset(new CollOfCell(faceCells(ifaces, 0)));
+        }
+        return *interior_face_cells_[0];
+    }
+    return faceCells(faces, 0);
+}
+
+
 CollOfCell EquelleRuntimeCPU::secondCell(const CollOfFace& faces) const
 {
-    const int n = faces.size();
-    CollOfCell fcells(n);
-    for (int i = 0; i < n; ++i) {
-        fcells[i].index = grid_.face_cells[2*faces[i].index + 1];
+    const CollOfFace& ifaces = interiorFaces();
+    if (faces.sameIdentity(ifaces)) {
+        if (!interior_face_cells_[1]) {
+            interior_face_cells_[1].reset(new CollOfCell(faceCells(ifaces, 1)));
+        }
+        return *interior_face_cells_[1];
     }
-    return fcells;
+    return faceCells(faces, 1);
 }
 
 
@@ -209,6 +381,7 @@ CollOfScalar EquelleRuntimeCPU::norm(const CollOfFace& faces) const
 {
     const int n = faces.size();
     CollOfScalar::V areas(n);
+    #pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && n > min_parallel_size)
     for (int i = 0; i < n; ++i) {
         areas[i] = grid_.face_areas[faces[i].index];
     }
@@ -220,6 +393,7 @@ CollOfScalar EquelleRuntimeCPU::norm(const CollOfCell& cells) const
 {
     const int n = cells.size();
     CollOfScalar::V volumes(n);
+    #pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && n > min_parallel_size)
     for (int i = 0; i < n; ++i) {
         volumes[i] = grid_.cell_volumes[cells[i].index];
     }
@@ -243,6 +417,7 @@ CollOfVector EquelleRuntimeCPU::centroid(const CollOfFace& faces) const
     const int n = faces.size();
     const int dim = grid_.dimensions;
     Eigen::Array<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor> c(n, dim);
+    #pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && n > min_parallel_size)
     for (int i = 0; i < n; ++i) {
         const double* fc = grid_.face_centroids + dim * faces[i].index;
         for (int d = 0; d < dim; ++d) {
@@ -262,6 +437,7 @@ CollOfVector EquelleRuntimeCPU::centroid(const CollOfCell& cells) const
     const int n = cells.size();
     const int dim = grid_.dimensions;
     Eigen::Array<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor> c(n, dim);
+    #pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && n > min_parallel_size)
     for (int i = 0; i < n; ++i) {
         const double* fc = grid_.cell_centroids + dim * cells[i].index;
         for (int d = 0; d < dim; ++d) {
@@ -281,6 +457,7 @@ CollOfVector EquelleRuntimeCPU::normal(const CollOfFace& faces) const
     const int n = faces.size();
     const int dim = grid_.dimensions;
     Eigen::Array<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor> nor(n, dim);
+    #pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && n > min_parallel_size)
     for (int i = 0; i < n; ++i) {
         const double* fn = grid_.face_normals + dim * faces[i].index;
         for (int d = 0; d < dim; ++d) {
@@ -322,30 +499,42 @@ CollOfScalar EquelleRuntimeCPU::dot(const CollOfVector& v1, const CollOfVector&
 
 CollOfScalar EquelleRuntimeCPU::gradient(const CollOfScalar& cell_scalarfield) const
 {
-    return ops_.grad * cell_scalarfield;//.matrix();
+    if (structured_ops_) {
+        return structured_ops_->gradient(cell_scalarfield);
+    }
+    return ops_->grad * cell_scalarfield;//.matrix();
 }
 
 
 CollOfScalar EquelleRuntimeCPU::negGradient(const CollOfScalar& cell_scalarfield) const
 {
-    return ops_.ngrad * cell_scalarfield;//.matrix();
+    if (structured_ops_) {
+        return structured_ops_->negGradient(cell_scalarfield);
+    }
+    return ops_->ngrad * cell_scalarfield;//.matrix();
 }
 
 
 CollOfScalar EquelleRuntimeCPU::divergence(const CollOfScalar& face_fluxes) const
 {
-    if (face_fluxes.size() == ops_.internal_faces.size()) {
+    if (face_fluxes.size() == numInternalFaces()) {
         // This is actually a hack, the compiler should know to emit interiorDivergence()
         // eventually, but as a temporary measure we do this.
         return interiorDivergence(face_fluxes);
     }
-    return ops_.fulldiv * face_fluxes;//.matrix();
+    if (structured_ops_) {
+        return structured_ops_->divergence(face_fluxes);
+    }
+    return ops_->fulldiv * face_fluxes;//.matrix();
 }
 
 
 CollOfScalar EquelleRuntimeCPU::interiorDivergence(const CollOfScalar& face_fluxes) const
 {
-    return ops_.div * face_fluxes;//.matrix();
+    if (structured_ops_) {
+        return structured_ops_->interiorDivergence(face_fluxes);
+    }
+    return ops_->div * face_fluxes;//.matrix();
 }
 
 
@@ -353,7 +542,8 @@ CollOfBool EquelleRuntimeCPU::isEmpty(const CollOfCell& cells) const
 {
     const size_t sz = cells.size();
     CollOfBool retval = CollOfBool::Constant(sz, false);
-    for (size_t i = 0; i < sz; ++i) {
+    #pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && sz > min_parallel_size)
+    for (int i = 0; i < int(sz); ++i) {
         if (cells[i].index < 0) {
             retval[i] = true;
         }
@@ -366,7 +556,8 @@ CollOfBool EquelleRuntimeCPU::isEmpty(const CollOfFace& faces) const
 {
     const size_t sz = faces.size();
     CollOfBool retval = CollOfBool::Constant(sz, false);
-    for (size_t i = 0; i < sz; ++i) {
+    #pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && sz > min_parallel_size)
+    for (int i = 0; i < int(sz); ++i) {
         if (faces[i].index < 0) {
             retval[i] = true;
         }
@@ -374,32 +565,112 @@ CollOfBool EquelleRuntimeCPU::isEmpty(const CollOfFace& faces) const
     return retval;
 }
 
+namespace
+{
+    /// Length of the chunks used by reduceChunks().
+    const int reduction_chunk_size = 4096;
+
+    // The chunks start at multiples of reduction_chunk_size, so they keep
+    // the alignment of the collection, and a chunk covering the whole
+    // collection is reduced exactly as the collection itself.
+    typedef Eigen::Map<const CollOfScalar::V, Eigen::Aligned> ConstChunk;
+
+    /// Reduce x with chunk_op. Without threading (num_threads 1) this is
+    /// chunk_op on all of x, the same sequential reduction as Eigen's.
+    /// With threading, chunk_op is applied to consecutive chunks of fixed
+    /// length and the partial results are combined with combine_op in
+    /// chunk order. The chunking does not depend on the number of
+    /// threads, so the result is the same for any num_threads > 1.
+    template <class ChunkOp, class CombineOp>
+    Scalar reduceChunks(const CollOfScalar::V& x, const int num_threads,
+                        const ChunkOp& chunk_op, const CombineOp& combine_op)
+    {
+        const int n = x.size();
+        if (num_threads <= 1 || n <= reduction_chunk_size) {
+            return chunk_op(ConstChunk(x.data(), n));
+        }
+        const int num_chunks = (n + reduction_chunk_size - 1) / reduction_chunk_size;
+        std::vector<Scalar> partial(num_chunks);
+        #pragma omp parallel for num_threads(num_threads)
+        for (int chunk = 0; chunk < num_chunks; ++chunk) {
+            const int start = chunk * reduction_chunk_size;
+            const int len = std::min(reduction_chunk_size, n - start);
+            partial[chunk] = chunk_op(ConstChunk(x.data() + start, len));
+        }
+        Scalar result = partial[0];
+        for (int chunk = 1; chunk < num_chunks; ++chunk) {
+            result = combine_op(result, partial[chunk]);
+        }
+        return result;
+    }
+} // anon namespace
+
+
 Scalar EquelleRuntimeCPU::minReduce(const CollOfScalar& x) const
 {
-    return x.value().minCoeff();
+    return reduceChunks(x.value(), num_threads_, [](const ConstChunk& chunk) { return chunk.minCoeff(); },
+                        [](const Scalar a, const Scalar b) { return std::min(a, b); });
 }
 
 Scalar EquelleRuntimeCPU::maxReduce(const CollOfScalar& x) const
 {
-    return x.value().maxCoeff();
+    return reduceChunks(x.value(), num_threads_, [](const ConstChunk& chunk) { return chunk.maxCoeff(); },
+                        [](const Scalar a, const Scalar b) { return std::max(a, b); });
 }
 
 Scalar EquelleRuntimeCPU::sumReduce(const CollOfScalar& x) const
 {
-    return x.value().sum();
+    return reduceChunks(x.value(), num_threads_, [](const ConstChunk& chunk) { return chunk.sum(); },
+                        [](const Scalar a, const Scalar b) { return a + b; });
 }
 
 Scalar EquelleRuntimeCPU::prodReduce(const CollOfScalar& x) const
 {
-    return x.value().prod();
+    return reduceChunks(x.value(), num_threads_, [](const ConstChunk& chunk) { return chunk.prod(); },
+                        [](const Scalar a, const Scalar b) { return a * b; });
 }
 
-CollOfScalar EquelleRuntimeCPU::solveForUpdate(const CollOfScalar& residual) const
+CollOfScalar EquelleRuntimeCPU::solveForUpdate(const CollOfScalar& residual, const double tolerance) const
 {
-    Eigen::SparseMatrix<double, Eigen::RowMajor> matr = residual.derivative()[0];
+    const CollOfScalar::M& jac = residual.derivative()[0];
 
     CollOfScalar::V du = CollOfScalar::V::Zero(residual.size());
 
+    if (krylov_ && jac.isCompressed()) {
+        // The native solver makes its own row-major copy of the Jacobian,
+        // reusing the transposed pattern from one solve to the next.
+        linearSolve(makeSparseMatrixView(jac), residual.value().data(), du.data(), tolerance);
+    } else {
+        Eigen::SparseMatrix<double, Eigen::RowMajor> matr = jac;
+        linearSolve(makeSparseMatrixView(matr), residual.value().data(), du.data(), tolerance);
+    }
+    return du;
+}
+
+
+void EquelleRuntimeCPU::linearSolve(const SparseMatrixView& matrix,
+                                    const double* rhs, double* solution, const double tolerance) const
+{
+    if (krylov_) {
+        const KrylovSolver::Report rep = krylov_->solve(matrix, rhs, solution, tolerance);
+        if (verbose_ > 1) {
+            std::cout << "        linearSolve: " << krylov_->name() << ", " << rep.iterations
+                      << " iterations, relative residual " << rep.residual
+                      << ", setup " << rep.setup_time << " s"
+                      << (rep.reused_preconditioner ? " (lagged)" : rep.reused_pattern ? " (same pattern)" : "")
+                      << ", solve " << rep.solve_time << " s" << std::endl;
+        }
+        if (!rep.converged) {
+            OPM_THROW(std::runtime_error, "Linear solver convergence failure (" << krylov_->name()
+                      << ", " << rep.iterations << " iterations).");
+        }
+        return;
+    }
+
+    if (matrix.column_major || matrix.block_size != 1) {
+        OPM_THROW(std::logic_error, "The Opm linear solvers require row-major scalar matrices.");
+    }
+
     Opm::time::StopWatch clock;
     clock.start();
 
@@ -409,9 +680,9 @@ CollOfScalar EquelleRuntimeCPU::solveForUpdate(const CollOfScalar& residual) con
     // here...), array of actual values ("val") (I guess... '*sa'...),
     // rhs, solution)
     Opm::LinearSolverInterface::LinearSolverReport rep
-            = linsolver_.solve(matr.rows(), matr.nonZeros(),
-                               matr.outerIndexPtr(), matr.innerIndexPtr(), matr.valuePtr(),
-                               residual.value().data(), du.data());
+            = linsolver_.solve(matrix.size, matrix.outer_start[matrix.size],
+                               matrix.outer_start, matrix.inner_index, matrix.values,
+                               rhs, solution);
 
     if (verbose_ > 2) {
         std::cout << "        solveForUpdate: Linear solver took: " << clock.secsSinceLast() << " seconds." << std::endl;
@@ -419,13 +690,83 @@ CollOfScalar EquelleRuntimeCPU::solveForUpdate(const CollOfScalar& residual) con
     if (!rep.converged) {
         OPM_THROW(std::runtime_error, "Linear solver convergence failure.");
     }
-    return du;
 }
 
 
 double EquelleRuntimeCPU::twoNorm(const CollOfScalar& vals) const
 {
-    return vals.value().matrix().norm();
+    const Scalar norm2 = reduceChunks(vals.value(), num_threads_, [](const ConstChunk& chunk) { return chunk.square().sum(); },
+                                      [](const Scalar a, const Scalar b) { return a + b; });
+    return std::sqrt(norm2);
+}
+
+
+double EquelleRuntimeCPU::maxNorm(const CollOfScalar& vals) const
+{
+    if (vals.size() == 0) {
+        return 0.0;
+    }
+    return reduceChunks(vals.value(), num_threads_, [](const ConstChunk& chunk) { return chunk.abs().maxCoeff(); },
+                        [](const Scalar a, const Scalar b) { return std::max(a, b); });
+}
+
+
+bool EquelleRuntimeCPU::newtonConverged(const Scalar norm, const Scalar max_norm, const Scalar initial_norm) const
+{
+    // Converged if any of the enabled criteria is met.
+    return norm <= abs_res_tol_
+        || (rel_res_tol_ > 0.0 && norm <= rel_res_tol_ * initial_norm)
+        || (max_res_tol_ > 0.0 && max_norm <= max_res_tol_);
+}
+
+
+/// Forcing term (relative linear solver tolerance) for the next inexact
+/// Newton step, following choice 2 of Eisenstat and Walker (1996): the
+/// linear systems are solved accurately only when Newton converges
+/// fast enough for the accuracy to pay off. Returns zero (use the
+/// linear solver tolerance) if inexact Newton is disabled.
+Scalar EquelleRuntimeCPU::forcingTerm(const Scalar norm, const Scalar prev_norm, const Scalar prev_forcing) const
+{
+    if (!inexact_newton_) {
+        return 0.0;
+    }
+    if (prev_forcing == 0.0) {
+        // First step.
+        return std::min(0.5, forcing_term_max_);
+    }
+    const Scalar gamma = 0.9;
+    const Scalar ratio = norm / prev_norm;
+    Scalar eta = gamma * ratio * ratio;
+    // Safeguard against decreasing the forcing term too fast.
+    const Scalar safeguard = gamma * prev_forcing * prev_forcing;
+    if (safeguard > 0.1) {
+        eta = std::max(eta, safeguard);
+    }
+    // Do not solve more accurately than the Newton tolerance needs.
+    eta = std::max(eta, 0.5 * abs_res_tol_ / norm);
+    return std::min(eta, forcing_term_max_);
+}
+
+
+/// Armijo condition for the backtracking line search, for a step
+/// computed with the given forcing term.
+bool EquelleRuntimeCPU::sufficientDecrease(const Scalar new_norm, const Scalar norm,
+                                           const Scalar step, const Scalar forcing) const
+{
+    const Scalar alpha = 1e-4;
+    return new_norm <= (1.0 - alpha * step * (1.0 - forcing)) * norm;
+}
+
+
+void EquelleRuntimeCPU::newtonFailure(const std::string& solver, const int iter, const Scalar norm) const
+{
+    if (throw_on_newton_failure_) {
+        OPM_THROW(std::runtime_error, solver << " failed to converge in " << iter
+                  << " iterations, norm(residual) = " << norm);
+    }
+    if (verbose_ > 0) {
+        std::cout << "Newton solver failed to converge in " << iter << " iterations" << std::endl;
+    }
 }
 
 
@@ -447,6 +788,12 @@ void EquelleRuntimeCPU::output(const String& tag, const CollOfScalar& vals)
             count = outputcount_[tag];
             ++outputcount_[tag];
         }
+        if (binary_output_) {
+            // One file per tag, with a record appended by every call.
+            BinaryWriter file(tag + ".eqbin", binaryio::Float64, count > 0);
+            file.write(vals.value().data(), vals.size());
+            return;
+        }
         std::ostringstream fname;
         fname << tag << "-" << std::setw(5) << std::setfill('0') << count << ".output";
         std::ofstream file(fname.str().c_str());
@@ -476,15 +823,26 @@ CollOfFace EquelleRuntimeCPU::inputDomainSubsetOf(const String& name,
                                                   const CollOfFace& face_superset)
 {
     const String filename = param_.get<String>(name + "_filename");
-    std::ifstream is(filename.c_str());
-    if (!is) {
-        OPM_THROW(std::runtime_error, "Could not find file " << filename);
-    }
-    std::istream_iterator<int> beg(is);
-    std::istream_iterator<int> end;
     CollOfFace data;
-    for (auto it = beg; it != end; ++it) {
-        data.push_back(Face(*it));
+    if (binaryio::isBinaryInput(param_, name, filename)) {
+        const MappedBinaryFile file(filename);
+        const std::int32_t* indices = file.ints(0);
+        const int size = file.recordSize(0);
+        std::vector<Face> entities(size);
+        for (int i = 0; i < size; ++i) {
+            entities[i].index = indices[i];
+        }
+        data = CollOfFace(std::move(entities));
+    } else {
+        std::ifstream is(filename.c_str());
+        if (!is) {
+            OPM_THROW(std::runtime_error, "Could not find file " << filename);
+        }
+        std::istream_iterator<int> beg(is);
+        std::istream_iterator<int> end;
+        for (auto it = beg; it != end; ++it) {
+            data.push_back(Face(*it));
+        }
     }
     if (!is_sorted(data.begin(), data.end())) {
         OPM_THROW(std::runtime_error, "Input set of faces was not sorted in ascending order.");
@@ -500,15 +858,26 @@ CollOfCell EquelleRuntimeCPU::inputDomainSubsetOf(const String& name,
                                                   const CollOfCell& cell_superset)
 {
     const String filename = param_.get<String>(name + "_filename");
-    std::ifstream is(filename.c_str());
-    if (!is) {
-        OPM_THROW(std::runtime_error, "Could not find file " << filename);
-    }
-    std::istream_iterator<int> beg(is);
-    std::istream_iterator<int> end;
     CollOfCell data;
-    for (auto it = beg; it != end; ++it) {
-        data.push_back(Cell(*it));
+    if (binaryio::isBinaryInput(param_, name, filename)) {
+        const MappedBinaryFile file(filename);
+        const std::int32_t* indices = file.ints(0);
+        const int size = file.recordSize(0);
+        std::vector<Cell> entities(size);
+        for (int i = 0; i < size; ++i) {
+            entities[i].index = indices[i];
+        }
+        data = CollOfCell(std::move(entities));
+    } else {
+        std::ifstream is(filename.c_str());
+        if (!is) {
+            OPM_THROW(std::runtime_error, "Could not find file " << filename);
+        }
+        std::istream_iterator<int> beg(is);
+        std::istream_iterator<int> end;
+        for (auto it = beg; it != end; ++it) {
+            data.push_back(Cell(*it));
+        }
     }
     if (!is_sorted(data.begin(), data.end())) {
         OPM_THROW(std::runtime_error, "Input set of cells was not sorted in ascending order.");
@@ -523,6 +892,11 @@ CollOfCell EquelleRuntimeCPU::inputDomainSubsetOf(const String& name,
 SeqOfScalar EquelleRuntimeCPU::inputSequenceOfScalar(const String& name)
 {
     const String filename = param_.get<String>(name + "_filename");
+    if (binaryio::isBinaryInput(param_, name, filename)) {
+        const MappedBinaryFile file(filename);
+        const Scalar* values = file.doubles(0);
+        return SeqOfScalar(values, values + file.recordSize(0));
+    }
     std::ifstream is(filename.c_str());
     if (!is) {
         OPM_THROW(std::runtime_error, "Could not find file " << filename);
@@ -545,12 +919,4 @@ void EquelleRuntimeCPU::ensureGridDimensionMin(const int minimum_grid_dimension)
 
 
 
-CollOfScalar EquelleRuntimeCPU::singlePrimaryVariable(const CollOfScalar& initial_values)
-{
-    std::vector<int> block_pattern;
-    block_pattern.push_back(initial_values.size());
-    // Syntax below is: CollOfScalar::variable(block index, initialized from, block structure)
-    return CollOfScalar::variable(0, initial_values.value(), block_pattern);
-}
-
 } // equelle-namespace
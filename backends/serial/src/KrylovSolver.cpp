@@ -0,0 +1,846 @@
+/*
+  Copyright 2013 SINTEF ICT, Applied Mathematics.
+*/
+
+#include "equelle/KrylovSolver.hpp"
+#include "equelle/equelleTypes.hpp"
+#include <opm/core/utility/ErrorMacros.hpp>
+#include <opm/core/utility/StopWatch.hpp>
+#include <Eigen/Dense>
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <cmath>
+
+
+namespace equelle {
+
+namespace
+{
+    typedef std::vector<double> Vec;
+
+    /// Dot products are summed over fixed chunks in a fixed order, so
+    /// that the result does not depend on the number of threads.
+    const int dot_chunk_size = 4096;
+
+    /// The vector operations below run on num_threads threads, given by
+    /// the solver, so that they do not depend on the process-wide OpenMP
+    /// settings.
+    double dot(const int n, const double* a, const double* b, const int num_threads)
+    {
+        const int num_chunks = (n + dot_chunk_size - 1) / dot_chunk_size;
+        Vec partial(num_chunks, 0.0);
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1 && n > min_parallel_size)
+        for (int c = 0; c < num_chunks; ++c) {
+            const int end = std::min(n, (c + 1) * dot_chunk_size);
+            double sum = 0.0;
+            for (int i = c * dot_chunk_size; i < end; ++i) {
+                sum += a[i] * b[i];
+            }
+            partial[c] = sum;
+        }
+        return std::accumulate(partial.begin(), partial.end(), 0.0);
+    }
+
+    double norm(const Vec& a, const int num_threads)
+    {
+        return std::sqrt(dot(a.size(), a.data(), a.data(), num_threads));
+    }
+
+    /// y += alpha * x
+    void axpy(const double alpha, const Vec& x, Vec& y, const int num_threads)
+    {
+        const int n = y.size();
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1 && n > min_parallel_size)
+        for (int i = 0; i < n; ++i) {
+            y[i] += alpha * x[i];
+        }
+    }
+
+    /// y = A x
+    void multiply(const SparseMatrixView& A, const double* x, double* y, const int num_threads)
+    {
+        const int n = A.size;
+        const int b = A.block_size;
+        if (b > 1) {
+            // Each block row is a sum of small dense block-vector products.
+            const int bb = b * b;
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1 && n * b > min_parallel_size)
+            for (int i = 0; i < n; ++i) {
+                double* yi = y + i * b;
+                std::fill(yi, yi + b, 0.0);
+                for (int p = A.outer_start[i]; p < A.outer_start[i + 1]; ++p) {
+                    const double* block = A.values + p * bb;
+                    const double* xj = x + A.inner_index[p] * b;
+                    for (int row = 0; row < b; ++row) {
+                        double sum = 0.0;
+                        for (int col = 0; col < b; ++col) {
+                            sum += block[row * b + col] * xj[col];
+                        }
+                        yi[row] += sum;
+                    }
+                }
+            }
+        } else {
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1 && n > min_parallel_size)
+            for (int i = 0; i < n; ++i) {
+                double sum = 0.0;
+                for (int p = A.outer_start[i]; p < A.outer_start[i + 1]; ++p) {
+                    sum += A.values[p] * x[A.inner_index[p]];
+                }
+                y[i] = sum;
+            }
+        }
+    }
+
+    /// r = b - A x, returns |r| / bnorm. The residuals updated by the
+    /// Krylov recurrences drift from this in finite precision, so it is
+    /// what convergence is decided on.
+    double trueResidual(const SparseMatrixView& A, const double* b, const double* x, const double bnorm,
+                        Vec& r, const int num_threads)
+    {
+        const int n = r.size();
+        multiply(A, x, r.data(), num_threads);
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1 && n > min_parallel_size)
+        for (int i = 0; i < n; ++i) {
+            r[i] = b[i] - r[i];
+        }
+        return norm(r, num_threads) / bnorm;
+    }
+
+    typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Block;
+    typedef Eigen::Map<Block> BlockMap;
+    typedef Eigen::Map<const Block> ConstBlockMap;
+    typedef Eigen::Map<Eigen::VectorXd> VectorMap;
+    typedef Eigen::Map<const Eigen::VectorXd> ConstVectorMap;
+
+    /// Inverts a dense block in place, returns false if it is singular.
+    bool invertBlock(BlockMap block)
+    {
+        if (block.rows() == 1) {
+            if (block(0, 0) == 0.0) {
+                return false;
+            }
+            block(0, 0) = 1.0 / block(0, 0);
+            return true;
+        }
+        Eigen::FullPivLU<Block> lu(block);
+        if (!lu.isInvertible()) {
+            return false;
+        }
+        block = lu.inverse();
+        return true;
+    }
+
+    void checkBlockSize(const SparseMatrixView& A, const int block_size, const char* preconditioner)
+    {
+        if (A.block_size != block_size) {
+            OPM_THROW(std::logic_error, preconditioner << " preconditioner created for block size " << block_size
+                      << ", used for block size " << A.block_size);
+        }
+    }
+
+
+
+    class IdentityPreconditioner : public Preconditioner
+    {
+    public:
+        void analyze(const SparseMatrixView& pattern)
+        {
+            size_ = pattern.scalarSize();
+        }
+        void factor(const SparseMatrixView&)
+        {
+        }
+        void apply(const double* r, double* z) const
+        {
+            std::copy(r, r + size_, z);
+        }
+    private:
+        int size_;
+    };
+
+
+
+    /// Block-Jacobi: inverts the diagonal blocks of a block matrix, or
+    /// the diagonal entries of a scalar one.
+    class BlockJacobiPreconditioner : public Preconditioner
+    {
+    public:
+        BlockJacobiPreconditioner(const int block_size, const int num_threads)
+            : block_size_(block_size),
+              num_threads_(num_threads)
+        {
+        }
+
+        void analyze(const SparseMatrixView& A)
+        {
+            checkBlockSize(A, block_size_, "Jacobi");
+            // The diagonal has inner index i in outer i for both CSR and CSC.
+            const int n = A.size;
+            diagonal_.assign(n, -1);
+            for (int i = 0; i < n; ++i) {
+                const int* begin = A.inner_index + A.outer_start[i];
+                const int* end = A.inner_index + A.outer_start[i + 1];
+                const int* d = std::lower_bound(begin, end, i);
+                if (d != end && *d == i) {
+                    diagonal_[i] = d - A.inner_index;
+                }
+            }
+        }
+
+        void factor(const SparseMatrixView& A)
+        {
+            const int b = block_size_;
+            const int bb = b * b;
+            const int n = diagonal_.size();
+            inverse_.assign(n * bb, 0.0);
+            bool singular = false;
+#pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && n * b > min_parallel_size) reduction(||:singular)
+            for (int i = 0; i < n; ++i) {
+                if (diagonal_[i] < 0) {
+                    singular = true;
+                    continue;
+                }
+                std::copy(A.values + diagonal_[i] * bb, A.values + (diagonal_[i] + 1) * bb, inverse_.begin() + i * bb);
+                if (!invertBlock(BlockMap(inverse_.data() + i * bb, b, b))) {
+                    singular = true;
+                }
+            }
+            if (singular) {
+                OPM_THROW(std::runtime_error, "Block-Jacobi preconditioner: singular diagonal block.");
+            }
+        }
+
+        void apply(const double* r, double* z) const
+        {
+            const int b = block_size_;
+            const int n = diagonal_.size();
+#pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && n * b > min_parallel_size)
+            for (int i = 0; i < n; ++i) {
+                const double* inv = inverse_.data() + i * b * b;
+                for (int row = 0; row < b; ++row) {
+                    double sum = 0.0;
+                    for (int col = 0; col < b; ++col) {
+                        sum += inv[row * b + col] * r[i * b + col];
+                    }
+                    z[i * b + row] = sum;
+                }
+            }
+        }
+
+    private:
+        int block_size_;
+        int num_threads_;
+        std::vector<int> diagonal_;
+        Vec inverse_;
+    };
+
+
+
+    /// Incomplete LU factorization without fill-in, of the scalar entries
+    /// or of the blocks of a block matrix.
+    ///
+    /// The matrix must be row-major (CSR or BSR). KrylovSolver::solve()
+    /// converts CSC matrices before they get here.
+    ///
+    /// The symbolic phase (analyze) records every elimination step, so
+    /// that the numeric phase (factor) is a plain loop over them. It is
+    /// the same for scalar and block matrices, with blocks in place of
+    /// entries.
+    class ILU0Preconditioner : public Preconditioner
+    {
+    public:
+        explicit ILU0Preconditioner(const int block_size)
+            : block_size_(block_size)
+        {
+        }
+
+        void analyze(const SparseMatrixView& A)
+        {
+            checkBlockSize(A, block_size_, "ILU0");
+            if (A.column_major) {
+                OPM_THROW(std::logic_error, "ILU0 preconditioner: the matrix must be row-major.");
+            }
+            pattern_ = A;
+            const int n = A.size;
+            diagonal_.resize(n);
+            for (int i = 0; i < n; ++i) {
+                const int* begin = A.inner_index + A.outer_start[i];
+                const int* end = A.inner_index + A.outer_start[i + 1];
+                const int* d = std::lower_bound(begin, end, i);
+                if (d == end || *d != i) {
+                    OPM_THROW(std::runtime_error, "ILU0 preconditioner: missing diagonal element in row " << i);
+                }
+                diagonal_[i] = d - A.inner_index;
+            }
+
+            // For each entry p = (i, k) below the diagonal, in elimination
+            // order: lu[p] /= lu[(k, k)], then lu[(i, j)] -= lu[p] * lu[(k, j)]
+            // for all j > k where both (i, j) and (k, j) are in the pattern.
+            eliminated_.clear();
+            update_start_.assign(1, 0);
+            update_target_.clear();
+            update_source_.clear();
+            std::vector<int> position(n, -1);
+            for (int i = 0; i < n; ++i) {
+                const int row_begin = A.outer_start[i];
+                const int row_end = A.outer_start[i + 1];
+                for (int p = row_begin; p < row_end; ++p) {
+                    position[A.inner_index[p]] = p;
+                }
+                for (int p = row_begin; p < diagonal_[i]; ++p) {
+                    const int k = A.inner_index[p];
+                    eliminated_.push_back(p);
+                    for (int q = diagonal_[k] + 1; q < A.outer_start[k + 1]; ++q) {
+                        const int pos = position[A.inner_index[q]];
+                        if (pos != -1) {
+                            update_target_.push_back(pos);
+                            update_source_.push_back(q);
+                        }
+                    }
+                    update_start_.push_back(update_target_.size());
+                }
+                for (int p = row_begin; p < row_end; ++p) {
+                    position[A.inner_index[p]] = -1;
+                }
+            }
+        }
+
+        void factor(const SparseMatrixView& A)
+        {
+            if (block_size_ > 1) {
+                factorBlocks(A);
+                return;
+            }
+            const int n = A.size;
+            lu_.assign(A.values, A.values + A.outer_start[n]);
+            const int num_eliminated = eliminated_.size();
+            for (int e = 0; e < num_eliminated; ++e) {
+                const int p = eliminated_[e];
+                lu_[p] /= lu_[diagonal_[A.inner_index[p]]];
+                const double factor = lu_[p];
+                for (int u = update_start_[e]; u < update_start_[e + 1]; ++u) {
+                    lu_[update_target_[u]] -= factor * lu_[update_source_[u]];
+                }
+            }
+            for (int i = 0; i < n; ++i) {
+                if (lu_[diagonal_[i]] == 0.0) {
+                    OPM_THROW(std::runtime_error, "ILU0 preconditioner: zero pivot in row " << i);
+                }
+            }
+        }
+
+        void apply(const double* r, double* z) const
+        {
+            if (block_size_ > 1) {
+                applyBlocks(r, z);
+                return;
+            }
+            const int n = pattern_.size;
+            const int* start = pattern_.outer_start;
+            const int* index = pattern_.inner_index;
+            // Solve L y = r, then U z = y.
+            for (int i = 0; i < n; ++i) {
+                double sum = r[i];
+                for (int p = start[i]; p < diagonal_[i]; ++p) {
+                    sum -= lu_[p] * z[index[p]];
+                }
+                z[i] = sum;
+            }
+            for (int i = n - 1; i >= 0; --i) {
+                double sum = z[i];
+                for (int p = diagonal_[i] + 1; p < start[i + 1]; ++p) {
+                    sum -= lu_[p] * z[index[p]];
+                }
+                z[i] = sum / lu_[diagonal_[i]];
+            }
+        }
+
+    private:
+        /// The block version of factor(): the divisions by the diagonal
+        /// become multiplications by the inverse of the diagonal block,
+        /// which is kept for apply().
+        void factorBlocks(const SparseMatrixView& A)
+        {
+            const int b = block_size_;
+            const int bb = b * b;
+            const int n = A.size;
+            lu_.assign(A.values, A.values + A.outer_start[n] * bb);
+            inverse_diagonal_.assign(n * bb, 0.0);
+            // Row k is complete when it is first used to eliminate in a
+            // later row, so its diagonal block is inverted then.
+            std::vector<char> inverted(n, false);
+            auto invertDiagonal = [&](const int k) {
+                if (!inverted[k]) {
+                    std::copy(lu_.begin() + diagonal_[k] * bb, lu_.begin() + (diagonal_[k] + 1) * bb,
+                              inverse_diagonal_.begin() + k * bb);
+                    if (!invertBlock(BlockMap(inverse_diagonal_.data() + k * bb, b, b))) {
+                        OPM_THROW(std::runtime_error, "ILU0 preconditioner: singular pivot block in row " << k);
+                    }
+                    inverted[k] = true;
+                }
+            };
+            Block factor(b, b);
+            const int num_eliminated = eliminated_.size();
+            for (int e = 0; e < num_eliminated; ++e) {
+                const int p = eliminated_[e];
+                const int k = A.inner_index[p];
+                invertDiagonal(k);
+                BlockMap lp(lu_.data() + p * bb, b, b);
+                factor.noalias() = lp * ConstBlockMap(inverse_diagonal_.data() + k * bb, b, b);
+                lp = factor;
+                for (int u = update_start_[e]; u < update_start_[e + 1]; ++u) {
+                    BlockMap(lu_.data() + update_target_[u] * bb, b, b).noalias()
+                        -= factor * ConstBlockMap(lu_.data() + update_source_[u] * bb, b, b);
+                }
+            }
+            for (int i = 0; i < n; ++i) {
+                invertDiagonal(i);
+            }
+        }
+
+        void applyBlocks(const double* r, double* z) const
+        {
+            const int b = block_size_;
+            const int bb = b * b;
+            const int n = pattern_.size;
+            const int* start = pattern_.outer_start;
+            const int* index = pattern_.inner_index;
+            Eigen::VectorXd sum(b);
+            // Solve L y = r, with unit diagonal blocks, then U z = y.
+            for (int i = 0; i < n; ++i) {
+                sum = ConstVectorMap(r + i * b, b);
+                for (int p = start[i]; p < diagonal_[i]; ++p) {
+                    sum.noalias() -= ConstBlockMap(lu_.data() + p * bb, b, b) * ConstVectorMap(z + index[p] * b, b);
+                }
+                VectorMap(z + i * b, b) = sum;
+            }
+            for (int i = n - 1; i >= 0; --i) {
+                sum = ConstVectorMap(z + i * b, b);
+                for (int p = diagonal_[i] + 1; p < start[i + 1]; ++p) {
+                    sum.noalias() -= ConstBlockMap(lu_.data() + p * bb, b, b) * ConstVectorMap(z + index[p] * b, b);
+                }
+                VectorMap(z + i * b, b).noalias() = ConstBlockMap(inverse_diagonal_.data() + i * bb, b, b) * sum;
+            }
+        }
+
+        int block_size_;
+        SparseMatrixView pattern_;
+        std::vector<int> diagonal_;
+        std::vector<int> eliminated_;
+        std::vector<int> update_start_;
+        std::vector<int> update_target_;
+        std::vector<int> update_source_;
+        Vec lu_;
+        Vec inverse_diagonal_;
+    };
+
+} // anon namespace
+
+
+
+KrylovSolver::KrylovSolver(const Opm::parameter::ParameterGroup& param)
+    : tolerance_(param.getDefault("linear_solver_tol", 1e-8)),
+      max_iter_(param.getDefault("linear_solver_max_iter", 1000)),
+      restart_(param.getDefault("gmres_restart", 30)),
+      lag_(param.getDefault("preconditioner_lag", 0)),
+      num_threads_(param.getDefault("num_threads", 1)),
+      block_size_(0),
+      age_(0)
+{
+    const std::string method = param.get<std::string>("linear_solver");
+    if (method == "bicgstab") {
+        method_ = BiCGStab;
+    } else if (method == "gmres") {
+        method_ = GMRES;
+    } else if (method == "cg") {
+        method_ = CG;
+    } else {
+        OPM_THROW(std::runtime_error, "Unknown linear_solver: " << method);
+    }
+    preconditioner_type_ = preconditionerType(param.getDefault<std::string>("preconditioner", "ilu0"));
+    if (restart_ < 1) {
+        OPM_THROW(std::runtime_error, "gmres_restart must be at least 1, got " << restart_);
+    }
+    if (lag_ < 0) {
+        OPM_THROW(std::runtime_error, "preconditioner_lag must be non-negative, got " << lag_);
+    }
+    if (num_threads_ < 1) {
+        OPM_THROW(std::runtime_error, "num_threads must be at least 1, got " << num_threads_);
+    }
+}
+
+KrylovSolver::~KrylovSolver()
+{
+}
+
+KrylovSolver::Report KrylovSolver::solve(const SparseMatrixView& input, const double* rhs, double* x,
+                                         const double tolerance)
+{
+    const double tol = tolerance > 0.0 ? tolerance : tolerance_;
+    Report report;
+    Opm::time::StopWatch clock;
+    clock.start();
+
+    // The grid never changes, so the Jacobians usually have the same
+    // pattern every time. Only redo the symbolic analysis if it changed.
+    report.reused_pattern = preconditioner_ && samePattern(input);
+    if (!report.reused_pattern) {
+        storePattern(input);
+        preconditioner_ = makePreconditioner(preconditioner_type_, input.block_size, num_threads_);
+        preconditioner_->analyze(patternView());
+    }
+    const SparseMatrixView matrix = rowMajorView(input);
+    // Optionally keep using a preconditioner computed from an earlier
+    // matrix, for up to lag_ further solves.
+    report.reused_preconditioner = report.reused_pattern && age_ < lag_;
+    if (report.reused_preconditioner) {
+        ++age_;
+    } else {
+        preconditioner_->factor(matrix);
+        age_ = 0;
+    }
+    report.setup_time = clock.secsSinceLast();
+
+    report.iterations = iterate(matrix, rhs, tol, x, report.residual);
+    if (report.residual > tol && report.reused_preconditioner) {
+        // The stale preconditioner was not good enough, retry with a fresh one.
+        preconditioner_->factor(matrix);
+        age_ = 0;
+        report.setup_time += clock.secsSinceLast();
+        report.iterations += iterate(matrix, rhs, tol, x, report.residual);
+    }
+    report.converged = report.residual <= tol;
+    report.solve_time = clock.secsSinceLast();
+    return report;
+}
+
+int KrylovSolver::iterate(const SparseMatrixView& matrix, const double* rhs, const double tolerance,
+                          double* x, double& residual) const
+{
+    std::fill(x, x + matrix.scalarSize(), 0.0);
+    switch (method_) {
+    case BiCGStab:
+        return solveBiCGStab(matrix, rhs, tolerance, x, residual);
+    case GMRES:
+        return solveGMRES(matrix, rhs, tolerance, x, residual);
+    case CG:
+        return solveCG(matrix, rhs, tolerance, x, residual);
+    }
+    return 0;
+}
+
+bool KrylovSolver::samePattern(const SparseMatrixView& matrix) const
+{
+    const int n = matrix.size;
+    if (matrix.block_size != block_size_ || matrix.column_major != column_major_
+        || n + 1 != int(outer_start_.size())) {
+        return false;
+    }
+    const int nnz = matrix.outer_start[n];
+    return nnz == int(inner_index_.size())
+        && std::equal(matrix.outer_start, matrix.outer_start + n + 1, outer_start_.begin())
+        && std::equal(matrix.inner_index, matrix.inner_index + nnz, inner_index_.begin());
+}
+
+void KrylovSolver::storePattern(const SparseMatrixView& matrix)
+{
+    const int n = matrix.size;
+    outer_start_.assign(matrix.outer_start, matrix.outer_start + n + 1);
+    inner_index_.assign(matrix.inner_index, matrix.inner_index + matrix.outer_start[n]);
+    column_major_ = matrix.column_major;
+    block_size_ = matrix.block_size;
+    if (!column_major_) {
+        return;
+    }
+    // The row pattern of a CSC matrix is that of its transpose. Taking the
+    // columns in order keeps the column indices sorted within each row.
+    const int nnz = inner_index_.size();
+    row_start_.assign(n + 1, 0);
+    for (int p = 0; p < nnz; ++p) {
+        ++row_start_[inner_index_[p] + 1];
+    }
+    std::partial_sum(row_start_.begin(), row_start_.end(), row_start_.begin());
+    column_index_.resize(nnz);
+    transpose_source_.resize(nnz);
+    std::vector<int> next(row_start_.begin(), row_start_.end() - 1);
+    for (int j = 0; j < n; ++j) {
+        for (int p = outer_start_[j]; p < outer_start_[j + 1]; ++p) {
+            const int q = next[inner_index_[p]]++;
+            column_index_[q] = j;
+            transpose_source_[q] = p;
+        }
+    }
+}
+
+SparseMatrixView KrylovSolver::patternView() const
+{
+    const int n = int(outer_start_.size()) - 1;
+    if (column_major_) {
+        return SparseMatrixView{ n, row_start_.data(), column_index_.data(), nullptr, false, 1 };
+    }
+    return SparseMatrixView{ n, outer_start_.data(), inner_index_.data(), nullptr, false, block_size_ };
+}
+
+SparseMatrixView KrylovSolver::rowMajorView(const SparseMatrixView& matrix)
+{
+    if (!column_major_) {
+        return matrix;
+    }
+    // Products with the columns of a CSC matrix scatter into y and do not
+    // parallelize, so the values are gathered into rows once per solve.
+    const int nnz = transpose_source_.size();
+    row_values_.resize(nnz);
+#pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && nnz > min_parallel_size)
+    for (int q = 0; q < nnz; ++q) {
+        row_values_[q] = matrix.values[transpose_source_[q]];
+    }
+    SparseMatrixView rows = patternView();
+    rows.values = row_values_.data();
+    return rows;
+}
+
+std::string KrylovSolver::name() const
+{
+    const char* method_names[] = { "bicgstab", "gmres", "cg" };
+    const char* precond_names[] = { "none", "jacobi", "ilu0" };
+    return std::string(method_names[method_]) + "+" + precond_names[preconditioner_type_];
+}
+
+KrylovSolver::PreconditionerType KrylovSolver::preconditionerType(const std::string& name)
+{
+    if (name == "ilu0") {
+        return ILU0;
+    } else if (name == "jacobi") {
+        return Jacobi;
+    } else if (name == "none") {
+        return NoPreconditioner;
+    }
+    OPM_THROW(std::runtime_error, "Unknown preconditioner: " << name);
+}
+
+std::unique_ptr<Preconditioner> KrylovSolver::makePreconditioner(const PreconditionerType type,
+                                                                 const int block_size,
+                                                                 const int num_threads)
+{
+    switch (type) {
+    case ILU0:
+        return std::unique_ptr<Preconditioner>(new ILU0Preconditioner(block_size));
+    case Jacobi:
+        return std::unique_ptr<Preconditioner>(new BlockJacobiPreconditioner(block_size, num_threads));
+    case NoPreconditioner:
+        break;
+    }
+    return std::unique_ptr<Preconditioner>(new IdentityPreconditioner());
+}
+
+int KrylovSolver::solveBiCGStab(const SparseMatrixView& A, const double* rhs, const double tolerance,
+                                double* x, double& residual) const
+{
+    const int n = A.scalarSize();
+    Vec r(rhs, rhs + n);
+    const double bnorm = norm(r, num_threads_);
+    residual = 0.0;
+    if (bnorm == 0.0) {
+        return 0;
+    }
+    Vec rhat = r;
+    Vec p(n, 0.0), v(n, 0.0), phat(n), s(n), shat(n), t(n);
+    double rho = 1.0, alpha = 1.0, omega = 1.0;
+    int iter = 0;
+    while (iter < max_iter_) {
+        ++iter;
+        const double rho_new = dot(n, rhat.data(), r.data(), num_threads_);
+        if (rho_new == 0.0) {
+            break;
+        }
+        const double beta = (rho_new / rho) * (alpha / omega);
+#pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && n > min_parallel_size)
+        for (int i = 0; i < n; ++i) {
+            p[i] = r[i] + beta * (p[i] - omega * v[i]);
+        }
+        preconditioner_->apply(p.data(), phat.data());
+        multiply(A, phat.data(), v.data(), num_threads_);
+        alpha = rho_new / dot(n, rhat.data(), v.data(), num_threads_);
+#pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && n > min_parallel_size)
+        for (int i = 0; i < n; ++i) {
+            s[i] = r[i] - alpha * v[i];
+            x[i] += alpha * phat[i];
+        }
+        double estimate = norm(s, num_threads_) / bnorm;
+        if (estimate > tolerance) {
+            preconditioner_->apply(s.data(), shat.data());
+            multiply(A, shat.data(), t.data(), num_threads_);
+            const double tt = dot(n, t.data(), t.data(), num_threads_);
+            omega = tt == 0.0 ? 0.0 : dot(n, t.data(), s.data(), num_threads_) / tt;
+#pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && n > min_parallel_size)
+            for (int i = 0; i < n; ++i) {
+                x[i] += omega * shat[i];
+                r[i] = s[i] - omega * t[i];
+            }
+            estimate = norm(r, num_threads_) / bnorm;
+            rho = rho_new;
+            if (omega == 0.0) {
+                break;
+            }
+        }
+        if (estimate <= tolerance) {
+            // Confirm with the true residual, and restart from it if the
+            // recurrence has drifted too far.
+            residual = trueResidual(A, rhs, x, bnorm, r, num_threads_);
+            if (residual <= tolerance) {
+                return iter;
+            }
+            rhat = r;
+            std::fill(p.begin(), p.end(), 0.0);
+            std::fill(v.begin(), v.end(), 0.0);
+            rho = alpha = omega = 1.0;
+        }
+    }
+    residual = trueResidual(A, rhs, x, bnorm, r, num_threads_);
+    return iter;
+}
+
+int KrylovSolver::solveGMRES(const SparseMatrixView& A, const double* rhs, const double tolerance,
+                             double* x, double& residual) const
+{
+    const int n = A.scalarSize();
+    const int m = restart_;
+    const Vec b(rhs, rhs + n);
+    const double bnorm = norm(b, num_threads_);
+    residual = 0.0;
+    if (bnorm == 0.0) {
+        return 0;
+    }
+    std::vector<Vec> V(m + 1, Vec(n));
+    Eigen::MatrixXd H = Eigen::MatrixXd::Zero(m + 1, m);
+    Vec cs(m), sn(m), g(m + 1);
+    Vec w(n), z(n);
+    int iter = 0;
+    for (;;) {
+        // Each cycle starts from the true residual, which also decides
+        // convergence, the Givens estimate only ends the cycle.
+        residual = trueResidual(A, rhs, x, bnorm, V[0], num_threads_);
+        if (residual <= tolerance || iter >= max_iter_) {
+            break;
+        }
+        const double beta = residual * bnorm;
+        for (int i = 0; i < n; ++i) {
+            V[0][i] /= beta;
+        }
+        std::fill(g.begin(), g.end(), 0.0);
+        g[0] = beta;
+        double estimate = residual;
+        int k = 0;
+        while (k < m && iter < max_iter_ && estimate > tolerance) {
+            preconditioner_->apply(V[k].data(), z.data());
+            multiply(A, z.data(), V[k + 1].data(), num_threads_);
+            const double wnorm = norm(V[k + 1], num_threads_);
+            // Modified Gram-Schmidt.
+            for (int j = 0; j <= k; ++j) {
+                H(j, k) = dot(n, V[k + 1].data(), V[j].data(), num_threads_);
+                axpy(-H(j, k), V[j], V[k + 1], num_threads_);
+            }
+            const double hnext = norm(V[k + 1], num_threads_);
+            // Happy breakdown: the new vector lies in the Krylov space up to
+            // rounding, so the space is invariant and the solution is in it.
+            // Normalizing the remainder would only amplify rounding errors.
+            const bool breakdown = hnext <= 1e-14 * wnorm;
+            H(k + 1, k) = breakdown ? 0.0 : hnext;
+            if (!breakdown) {
+                const double scale = 1.0 / hnext;
+                for (int i = 0; i < n; ++i) {
+                    V[k + 1][i] *= scale;
+                }
+            }
+            // Apply previous Givens rotations, then eliminate H(k+1, k).
+            for (int j = 0; j < k; ++j) {
+                const double tmp = cs[j] * H(j, k) + sn[j] * H(j + 1, k);
+                H(j + 1, k) = -sn[j] * H(j, k) + cs[j] * H(j + 1, k);
+                H(j, k) = tmp;
+            }
+            const double denom = std::sqrt(H(k, k) * H(k, k) + H(k + 1, k) * H(k + 1, k));
+            cs[k] = denom == 0.0 ? 1.0 : H(k, k) / denom;
+            sn[k] = denom == 0.0 ? 0.0 : H(k + 1, k) / denom;
+            H(k, k) = denom;
+            H(k + 1, k) = 0.0;
+            g[k + 1] = -sn[k] * g[k];
+            g[k] = cs[k] * g[k];
+            estimate = std::fabs(g[k + 1]) / bnorm;
+            ++k;
+            ++iter;
+            if (breakdown) {
+                break;
+            }
+        }
+        // Solve the upper triangular system H y = g, and update
+        // x += M^{-1} V y.
+        Eigen::VectorXd y = Eigen::Map<Eigen::VectorXd>(g.data(), k);
+        H.topLeftCorner(k, k).triangularView<Eigen::Upper>().solveInPlace(y);
+        std::fill(w.begin(), w.end(), 0.0);
+        for (int j = 0; j < k; ++j) {
+            axpy(y[j], V[j], w, num_threads_);
+        }
+        preconditioner_->apply(w.data(), z.data());
+        for (int i = 0; i < n; ++i) {
+            x[i] += z[i];
+        }
+    }
+    return iter;
+}
+
+int KrylovSolver::solveCG(const SparseMatrixView& A, const double* rhs, const double tolerance,
+                          double* x, double& residual) const
+{
+    const int n = A.scalarSize();
+    Vec r(rhs, rhs + n);
+    const double bnorm = norm(r, num_threads_);
+    residual = 0.0;
+    if (bnorm == 0.0) {
+        return 0;
+    }
+    Vec z(n), p(n), q(n);
+    preconditioner_->apply(r.data(), z.data());
+    p = z;
+    double rz = dot(n, r.data(), z.data(), num_threads_);
+    int iter = 0;
+    while (iter < max_iter_) {
+        ++iter;
+        multiply(A, p.data(), q.data(), num_threads_);
+        const double pq = dot(n, p.data(), q.data(), num_threads_);
+        if (pq == 0.0) {
+            break;
+        }
+        const double alpha = rz / pq;
+#pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && n > min_parallel_size)
+        for (int i = 0; i < n; ++i) {
+            x[i] += alpha * p[i];
+            r[i] -= alpha * q[i];
+        }
+        double beta = 0.0;
+        if (norm(r, num_threads_) / bnorm <= tolerance) {
+            // Confirm with the true residual, and restart from it if the
+            // recurrence has drifted too far.
+            residual = trueResidual(A, rhs, x, bnorm, r, num_threads_);
+            if (residual <= tolerance) {
+                return iter;
+            }
+            preconditioner_->apply(r.data(), z.data());
+            rz = dot(n, r.data(), z.data(), num_threads_);
+        } else {
+            preconditioner_->apply(r.data(), z.data());
+            const double rz_new = dot(n, r.data(), z.data(), num_threads_);
+            beta = rz_new / rz;
+            rz = rz_new;
+        }
+#pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && n > min_parallel_size)
+        for (int i = 0; i < n; ++i) {
+            p[i] = z[i] + beta * p[i];
+        }
+    }
+    residual = trueResidual(A, rhs, x, bnorm, r, num_threads_);
+    return iter;
+}
+
+} // namespace equelle
@@ -0,0 +1,372 @@
+/*
+  Copyright 2013 SINTEF ICT, Applied Mathematics.
+*/
+
+
+#include "equelle/StructuredGridOps.hpp"
+#include <opm/core/utility/ErrorMacros.hpp>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+
+namespace equelle {
+
+namespace {
+
+    /// Index of the position q in a block of the given dimensions, x running fastest.
+    int blockIndex(const int* q, const int* dims)
+    {
+        return q[0] + dims[0]*(q[1] + dims[1]*q[2]);
+    }
+
+    /// Inverse of blockIndex().
+    void blockPosition(const int index, const int* dims, int* q)
+    {
+        q[0] = index % dims[0];
+        q[1] = (index / dims[0]) % dims[1];
+        q[2] = index / (dims[0]*dims[1]);
+    }
+
+} // anonymous namespace
+
+
+std::unique_ptr<StructuredGridOps> StructuredGridOps::detect(const UnstructuredGrid& grid, const int num_threads)
+{
+    std::unique_ptr<StructuredGridOps> none;
+    const int dim = grid.dimensions;
+    if (dim != 2 && dim != 3) {
+        return none;
+    }
+    // The constructor counts cells and faces in int, so first check in 64
+    // bits that the counts match the grid, which also rules out overflow.
+    long long cells = 1;
+    for (int d = 0; d < dim; ++d) {
+        if (grid.cartdims[d] < 1) {
+            return none;
+        }
+        cells *= grid.cartdims[d];
+        if (cells > grid.number_of_cells) {
+            return none;
+        }
+    }
+    long long faces = 0;
+    for (int d = 0; d < dim; ++d) {
+        faces += cells / grid.cartdims[d] * (grid.cartdims[d] + 1);
+    }
+    if (cells != grid.number_of_cells || faces != grid.number_of_faces) {
+        return none;
+    }
+    std::unique_ptr<StructuredGridOps> ops(new StructuredGridOps(dim, grid.cartdims, num_threads));
+    if (grid.global_cell) {
+        for (int c = 0; c < grid.number_of_cells; ++c) {
+            if (grid.global_cell[c] != c) {
+                return none;
+            }
+        }
+    }
+    for (int f = 0; f < grid.number_of_faces; ++f) {
+        int cells[2];
+        ops->faceCells(f, false, cells);
+        if (cells[0] != grid.face_cells[2*f] || cells[1] != grid.face_cells[2*f + 1]) {
+            return none;
+        }
+    }
+    return ops;
+}
+
+
+StructuredGridOps::StructuredGridOps(const int dimensions, const int* cartdims, const int num_threads)
+    : dimensions_(dimensions),
+      num_threads_(num_threads)
+{
+    n_[0] = cartdims[0];
+    n_[1] = cartdims[1];
+    n_[2] = dimensions == 3 ? cartdims[2] : 1;
+    number_of_cells_ = n_[0] * n_[1] * n_[2];
+    number_of_faces_ = 0;
+    num_internal_faces_ = 0;
+    int stride = 1;
+    for (int a = 0; a < dimensions_; ++a) {
+        Family& fam = families_[a];
+        fam.axis = a;
+        fam.stride = stride;
+        stride *= n_[a];
+        std::copy(n_, n_ + 3, fam.all_dims);
+        std::copy(n_, n_ + 3, fam.internal_dims);
+        fam.all_dims[a] += 1;
+        fam.internal_dims[a] -= 1;
+        fam.all_offset = number_of_faces_;
+        fam.internal_offset = num_internal_faces_;
+        number_of_faces_ += fam.all_dims[0] * fam.all_dims[1] * fam.all_dims[2];
+        num_internal_faces_ += fam.internal_dims[0] * fam.internal_dims[1] * fam.internal_dims[2];
+    }
+}
+
+
+const StructuredGridOps::Family& StructuredGridOps::family(const int face, const bool internal, int& local_face) const
+{
+    // Families without internal faces share their offset with the next one,
+    // so search from the last family.
+    int a = dimensions_ - 1;
+    while (a > 0 && face < (internal ? families_[a].internal_offset : families_[a].all_offset)) {
+        --a;
+    }
+    const Family& fam = families_[a];
+    local_face = face - (internal ? fam.internal_offset : fam.all_offset);
+    return fam;
+}
+
+
+int StructuredGridOps::internalFace(const int i) const
+{
+    int local_face;
+    const Family& fam = family(i, true, local_face);
+    int q[3];
+    blockPosition(local_face, fam.internal_dims, q);
+    ++q[fam.axis];
+    return fam.all_offset + blockIndex(q, fam.all_dims);
+}
+
+
+void StructuredGridOps::faceCells(const int face, const bool internal, int* cells) const
+{
+    int local_face;
+    const Family& fam = family(face, internal, local_face);
+    int q[3];
+    if (internal) {
+        blockPosition(local_face, fam.internal_dims, q);
+        ++q[fam.axis];
+    } else {
+        blockPosition(local_face, fam.all_dims, q);
+    }
+    // The cell index of q is one layer beyond the grid for the high boundary
+    // faces, but then only the first cell is used.
+    const int cell = blockIndex(q, n_);
+    cells[0] = q[fam.axis] > 0 ? cell - fam.stride : Boundary::outer;
+    cells[1] = q[fam.axis] < n_[fam.axis] ? cell : Boundary::outer;
+}
+
+
+void StructuredGridOps::cellInternalFaces(const int cell, int* faces) const
+{
+    int q[3];
+    blockPosition(cell, n_, q);
+    for (int a = 0; a < dimensions_; ++a) {
+        const Family& fam = families_[a];
+        const int high = fam.internal_offset + blockIndex(q, fam.internal_dims);
+        faces[2*a] = q[a] > 0 ? high - fam.stride : -1;
+        faces[2*a + 1] = q[a] < n_[a] - 1 ? high : -1;
+    }
+}
+
+
+/// Follows Eigen's conservative sparse-sparse product, so that the values
+/// are summed in the same order and numerically zero entries are kept.
+template <class Column>
+CollOfScalar::M StructuredGridOps::applyToJacobian(const int rows, const CollOfScalar::M& jac, const Column& column)
+{
+    typedef CollOfScalar::M M;
+    M result(rows, jac.cols());
+    result.reserve(2 * jac.nonZeros());
+    std::vector<char> mask(rows, false);
+    std::vector<double> values(rows);
+    std::vector<int> indices;
+    int col_rows[6];
+    double col_coefs[6];
+    for (int j = 0; j < jac.outerSize(); ++j) {
+        result.startVec(j);
+        indices.clear();
+        for (M::InnerIterator it(jac, j); it; ++it) {
+            const int num = column(it.index(), col_rows, col_coefs);
+            for (int e = 0; e < num; ++e) {
+                const int i = col_rows[e];
+                const double v = col_coefs[e] * it.value();
+                if (!mask[i]) {
+                    mask[i] = true;
+                    values[i] = v;
+                    indices.push_back(i);
+                } else {
+                    values[i] += v;
+                }
+            }
+        }
+        std::sort(indices.begin(), indices.end());
+        for (const int i : indices) {
+            result.insertBack(i, j) = values[i];
+            mask[i] = false;
+        }
+    }
+    result.finalize();
+    return result;
+}
+
+
+CollOfScalar StructuredGridOps::gradient(const CollOfScalar& cell_values) const
+{
+    return gradient(cell_values, false);
+}
+
+
+CollOfScalar StructuredGridOps::negGradient(const CollOfScalar& cell_values) const
+{
+    return gradient(cell_values, true);
+}
+
+
+CollOfScalar StructuredGridOps::divergence(const CollOfScalar& face_fluxes) const
+{
+    return divergence(face_fluxes, false);
+}
+
+
+CollOfScalar StructuredGridOps::interiorDivergence(const CollOfScalar& internal_face_fluxes) const
+{
+    return divergence(internal_face_fluxes, true);
+}
+
+
+CollOfScalar StructuredGridOps::gradient(const CollOfScalar& x, const bool negative) const
+{
+    if (x.size() != number_of_cells_) {
+        OPM_THROW(std::runtime_error, "Gradient of a collection of size " << x.size()
+                  << ", expected one value for each of the " << number_of_cells_ << " cells.");
+    }
+
+    // The cells on either side of each internal face are stride apart, and
+    // the faces of a family are ordered as the cells, so each row of faces
+    // is a difference of two rows of cells.
+    const CollOfScalar::V& xv = x.value();
+    CollOfScalar::V grad(num_internal_faces_);
+    for (int a = 0; a < dimensions_; ++a) {
+        const Family& fam = families_[a];
+        const int* dims = fam.internal_dims;
+        const int rows = dims[1] * dims[2];
+        #pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && num_internal_faces_ > min_parallel_size)
+        for (int row = 0; row < rows; ++row) {
+            const int q[3] = { 0, row % dims[1], row / dims[1] };
+            const double* x0 = xv.data() + blockIndex(q, n_);
+            const double* x1 = x0 + fam.stride;
+            double* g = grad.data() + fam.internal_offset + row * dims[0];
+            if (negative) {
+                for (int i = 0; i < dims[0]; ++i) {
+                    g[i] = x0[i] - x1[i];
+                }
+            } else {
+                for (int i = 0; i < dims[0]; ++i) {
+                    g[i] = x1[i] - x0[i];
+                }
+            }
+        }
+    }
+
+    const auto& xjac = x.derivative();
+    if (xjac.empty()) {
+        return CollOfScalar(grad);
+    }
+    // Column c of the gradient operator has +1 on the internal faces where
+    // c is the second cell (the low faces of c) and -1 where it is the first.
+    const double sign = negative ? -1.0 : 1.0;
+    auto column = [this, sign](const int cell, int* rows, double* coefs) {
+        int faces[6];
+        cellInternalFaces(cell, faces);
+        int num = 0;
+        for (int e = 0; e < 2*dimensions_; ++e) {
+            if (faces[e] >= 0) {
+                rows[num] = faces[e];
+                coefs[num] = e % 2 == 0 ? sign : -sign;
+                ++num;
+            }
+        }
+        return num;
+    };
+    std::vector<CollOfScalar::M> jac(xjac.size());
+    for (size_t block = 0; block < xjac.size(); ++block) {
+        jac[block] = applyToJacobian(num_internal_faces_, xjac[block], column);
+    }
+    return CollOfScalar::ADB::function(grad, jac);
+}
+
+
+CollOfScalar StructuredGridOps::divergence(const CollOfScalar& flux, const bool internal) const
+{
+    const int num_faces = internal ? num_internal_faces_ : number_of_faces_;
+    if (flux.size() != num_faces) {
+        OPM_THROW(std::runtime_error, "Divergence of a collection of size " << flux.size()
+                  << ", expected one value for each of the " << num_faces
+                  << (internal ? " internal" : "") << " faces.");
+    }
+
+    // Outgoing flux is positive on the high faces of a cell and negative on
+    // the low ones. The terms are added in increasing face order, starting
+    // from zero, as in the sparse matrix product.
+    const CollOfScalar::V& fv = flux.value();
+    CollOfScalar::V div(number_of_cells_);
+    const int nx = n_[0];
+    const int rows = n_[1] * n_[2];
+    #pragma omp parallel for num_threads(num_threads_) if (num_threads_ > 1 && number_of_cells_ > min_parallel_size)
+    for (int row = 0; row < rows; ++row) {
+        const int q[3] = { 0, row % n_[1], row / n_[1] };
+        // For each family, the high face of the first cell of the row and
+        // whether the low and high faces of the cells of the row exist.
+        int high[3];
+        bool has_low[3];
+        bool has_high[3];
+        for (int a = 0; a < dimensions_; ++a) {
+            const Family& fam = families_[a];
+            if (internal) {
+                high[a] = fam.internal_offset + blockIndex(q, fam.internal_dims);
+                has_low[a] = q[a] > 0;
+                has_high[a] = q[a] < n_[a] - 1;
+            } else {
+                high[a] = fam.all_offset + blockIndex(q, fam.all_dims) + fam.stride;
+                has_low[a] = true;
+                has_high[a] = true;
+            }
+        }
+        double* d = div.data() + row * nx;
+        for (int i = 0; i < nx; ++i) {
+            double sum = 0.0;
+            for (int a = 0; a < dimensions_; ++a) {
+                const int stride = families_[a].stride;
+                const bool low_exists = a == 0 && internal ? i > 0 : has_low[a];
+                const bool high_exists = a == 0 && internal ? i < nx - 1 : has_high[a];
+                if (low_exists) {
+                    sum -= fv[high[a] + i - stride];
+                }
+                if (high_exists) {
+                    sum += fv[high[a] + i];
+                }
+            }
+            d[i] = sum;
+        }
+    }
+
+    const auto& fjac = flux.derivative();
+    if (fjac.empty()) {
+        return CollOfScalar(div);
+    }
+    // Column f of the divergence operator has +1 on the first cell of face f
+    // and -1 on the second.
+    auto column = [this, internal](const int face, int* rows, double* coefs) {
+        int cells[2];
+        faceCells(face, internal, cells);
+        int num = 0;
+        for (int side = 0; side < 2; ++side) {
+            if (cells[side] >= 0) {
+                rows[num] = cells[side];
+                coefs[num] = side == 0 ? 1.0 : -1.0;
+                ++num;
+            }
+        }
+        return num;
+    };
+    std::vector<CollOfScalar::M> jac(fjac.size());
+    for (size_t block = 0; block < fjac.size(); ++block) {
+        jac[block] = applyToJacobian(number_of_cells_, fjac[block], column);
+    }
+    return CollOfScalar::ADB::function(div, jac);
+}
+
+
+} // namespace equelle
@@ -0,0 +1,71 @@
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "equelle/BinaryIO.hpp"
+
+using namespace equelle;
+
+namespace {
+
+// Removes the file when the test is done with it.
+struct TemporaryFile
+{
+    explicit TemporaryFile( const std::string& name ) : filename( name ) { std::remove( name.c_str() ); }
+    ~TemporaryFile() { std::remove( filename.c_str() ); }
+    const std::string filename;
+};
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE( binaryFileAppendKeepsIndex ) {
+    const TemporaryFile file( "equelle_binary_io_test.eqb" );
+    const std::vector<double> first = { 1.0, 2.5, -3.0 };
+    const std::vector<double> second = { 4.0 };
+    {
+        BinaryWriter writer( file.filename, binaryio::Float64, false );
+        writer.write( first.data(), first.size() );
+    }
+    {
+        BinaryWriter writer( file.filename, binaryio::Float64, true );
+        writer.write( second.data(), second.size() );
+        writer.write( second.data(), 0 );
+    }
+    const MappedBinaryFile mapped( file.filename );
+    BOOST_REQUIRE_EQUAL( mapped.numRecords(), 3 );
+    BOOST_REQUIRE_EQUAL( mapped.recordSize( 0 ), first.size() );
+    BOOST_REQUIRE_EQUAL( mapped.recordSize( 1 ), second.size() );
+    BOOST_REQUIRE_EQUAL( mapped.recordSize( 2 ), 0u );
+    for( size_t i = 0; i < first.size(); ++i ) {
+        BOOST_CHECK_EQUAL( mapped.doubles( 0 )[i], first[i] );
+    }
+    BOOST_CHECK_EQUAL( mapped.doubles( 1 )[0], second[0] );
+    BOOST_CHECK_THROW( BinaryWriter( file.filename, binaryio::Int32, true ), std::runtime_error );
+}
+
+BOOST_AUTO_TEST_CASE( binaryFileRejectsTruncation ) {
+    const TemporaryFile file( "equelle_binary_io_truncated.eqb" );
+    const std::vector<int> values = { 7, 8, 9 };
+    {
+        BinaryWriter writer( file.filename, binaryio::Int32, false );
+        writer.write( values.data(), values.size() );
+    }
+    std::vector<char> bytes;
+    {
+        std::ifstream in( file.filename.c_str(), std::ios::binary );
+        bytes.assign( std::istreambuf_iterator<char>( in ), std::istreambuf_iterator<char>() );
+    }
+    {
+        std::ofstream out( file.filename.c_str(), std::ios::binary | std::ios::trunc );
+        out.write( bytes.data(), bytes.size() - 4 );
+    }
+    BOOST_CHECK_THROW( MappedBinaryFile( file.filename ), std::runtime_error );
+    BOOST_CHECK_THROW( BinaryWriter( file.filename, binaryio::Int32, true ), std::runtime_error );
+}
@@ -0,0 +1,198 @@
+#define BOOST_TEST_MODULE EquelleSerialBackendTest
+
+#include <boost/test/unit_test.hpp>
+#include <opm/core/utility/parameters/ParameterGroup.hpp>
+
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "equelle/BlockSparseMatrix.hpp"
+#include "equelle/KrylovSolver.hpp"
+
+using namespace equelle;
+
+namespace {
+
+typedef Eigen::SparseMatrix<double> ColMatrix;
+typedef Eigen::SparseMatrix<double, Eigen::RowMajor> RowMatrix;
+
+// A coupled two-unknown system on a 1D chain of cells, non-symmetric and
+// with non-trivial 2x2 blocks (jac[1][0] has no diagonal entries, so the
+// blocks are not all full).
+std::array<std::array<ColMatrix, 2>, 2> chainSystem( const int n )
+{
+    std::array<std::array<std::vector<Eigen::Triplet<double>>, 2>, 2> entries;
+    for( int i = 0; i < n; ++i ) {
+        entries[0][0].emplace_back( i, i, 4.0 + 0.1*i );
+        entries[1][1].emplace_back( i, i, 3.0 + 0.05*(i % 7) );
+        entries[0][1].emplace_back( i, i, 0.5 );
+        if ( i > 0 ) {
+            entries[0][0].emplace_back( i, i-1, -1.2 );
+            entries[1][1].emplace_back( i, i-1, -0.7 );
+            entries[1][0].emplace_back( i, i-1, 0.3 );
+        }
+        if ( i < n-1 ) {
+            entries[0][0].emplace_back( i, i+1, -0.8 );
+            entries[1][1].emplace_back( i, i+1, -1.1 );
+            entries[0][1].emplace_back( i, i+1, -0.2 );
+        }
+    }
+    std::array<std::array<ColMatrix, 2>, 2> jac;
+    for( int r = 0; r < 2; ++r ) {
+        for( int c = 0; c < 2; ++c ) {
+            jac[r][c].resize( n, n );
+            jac[r][c].setFromTriplets( entries[r][c].begin(), entries[r][c].end() );
+            jac[r][c].makeCompressed();
+        }
+    }
+    return jac;
+}
+
+// The unknowns numbered one after another, as in the non-interleaved path
+// of EquelleRuntimeCPU::solveSystemForUpdate.
+RowMatrix stackedMatrix( const std::array<std::array<ColMatrix, 2>, 2>& jac )
+{
+    const int n = jac[0][0].rows();
+    std::vector<Eigen::Triplet<double>> triplets;
+    for( int r = 0; r < 2; ++r ) {
+        for( int c = 0; c < 2; ++c ) {
+            for( int k = 0; k < jac[r][c].outerSize(); ++k ) {
+                for( ColMatrix::InnerIterator it( jac[r][c], k ); it; ++it ) {
+                    triplets.emplace_back( r*n + it.row(), c*n + it.col(), it.value() );
+                }
+            }
+        }
+    }
+    RowMatrix m( 2*n, 2*n );
+    m.setFromTriplets( triplets.begin(), triplets.end() );
+    m.makeCompressed();
+    return m;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE( blockSolveMatchesScalarSolve ) {
+    const int n = 50;
+    const std::array<std::array<ColMatrix, 2>, 2> jac = chainSystem( n );
+    const BlockSparseMatrix<2> block_matrix( jac );
+    const RowMatrix stacked = stackedMatrix( jac );
+    BOOST_REQUIRE_EQUAL( block_matrix.view().block_size, 2 );
+    BOOST_REQUIRE_EQUAL( block_matrix.view().scalarSize(), 2*n );
+
+    std::vector<double> rhs_stacked( 2*n );
+    std::vector<double> rhs_interleaved( 2*n );
+    for( int i = 0; i < n; ++i ) {
+        for( int r = 0; r < 2; ++r ) {
+            rhs_stacked[r*n + i] = rhs_interleaved[2*i + r] = 1.0 + 0.01*i - 0.5*r;
+        }
+    }
+
+    const char* methods[] = { "bicgstab", "gmres" };
+    const char* preconditioners[] = { "none", "jacobi", "ilu0" };
+    for( const char* method : methods ) {
+        for( const char* precond : preconditioners ) {
+            Opm::parameter::ParameterGroup param;
+            param.disableOutput();
+            param.insertParameter( "linear_solver", method );
+            param.insertParameter( "preconditioner", precond );
+            param.insertParameter( "linear_solver_tol", "1e-12" );
+            KrylovSolver block_solver( param );
+            KrylovSolver scalar_solver( param );
+
+            std::vector<double> x_block( 2*n );
+            std::vector<double> x_scalar( 2*n );
+            const KrylovSolver::Report block_rep = block_solver.solve( block_matrix.view(), rhs_interleaved.data(),
+                                                                       x_block.data() );
+            const KrylovSolver::Report scalar_rep = scalar_solver.solve( makeSparseMatrixView( stacked ),
+                                                                         rhs_stacked.data(), x_scalar.data() );
+            BOOST_CHECK_MESSAGE( block_rep.converged, block_solver.name() << " (blocks) did not converge" );
+            BOOST_CHECK_MESSAGE( scalar_rep.converged, scalar_solver.name() << " (scalar) did not converge" );
+            for( int i = 0; i < n; ++i ) {
+                for( int r = 0; r < 2; ++r ) {
+                    BOOST_CHECK_CLOSE( x_block[2*i + r], x_scalar[r*n + i], 1e-7 );
+                }
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( columnMajorSolveMatchesRowMajorSolve ) {
+    const int n = 50;
+    const RowMatrix rows = stackedMatrix( chainSystem( n ) );
+    const ColMatrix cols = rows;
+    std::vector<double> rhs( 2*n );
+    for( int i = 0; i < 2*n; ++i ) {
+        rhs[i] = 1.0 - 0.02*i;
+    }
+
+    Opm::parameter::ParameterGroup param;
+    param.disableOutput();
+    param.insertParameter( "linear_solver", "bicgstab" );
+    param.insertParameter( "preconditioner", "ilu0" );
+    KrylovSolver row_solver( param );
+    KrylovSolver col_solver( param );
+    std::vector<double> x_rows( 2*n );
+    std::vector<double> x_cols( 2*n );
+    row_solver.solve( makeSparseMatrixView( rows ), rhs.data(), x_rows.data() );
+    col_solver.solve( makeSparseMatrixView( cols ), rhs.data(), x_cols.data() );
+    for( int i = 0; i < 2*n; ++i ) {
+        BOOST_CHECK_EQUAL( x_cols[i], x_rows[i] );
+    }
+
+    // The second solve reuses the transposed pattern.
+    const KrylovSolver::Report rep = col_solver.solve( makeSparseMatrixView( cols ), rhs.data(), x_cols.data() );
+    BOOST_CHECK( rep.reused_pattern );
+    for( int i = 0; i < 2*n; ++i ) {
+        BOOST_CHECK_EQUAL( x_cols[i], x_rows[i] );
+    }
+}
+
+BOOST_AUTO_TEST_CASE( blockPreconditionerRejectsOtherBlockSize ) {
+    const std::array<std::array<ColMatrix, 2>, 2> jac = chainSystem( 4 );
+    const BlockSparseMatrix<2> block_matrix( jac );
+    std::unique_ptr<Preconditioner> ilu0 = KrylovSolver::makePreconditioner( KrylovSolver::ILU0, 1 );
+    BOOST_CHECK_THROW( ilu0->analyze( block_matrix.view() ), std::logic_error );
+}
+
+BOOST_AUTO_TEST_CASE( reportsTrueResidual ) {
+    // A diagonal matrix with three distinct values: GMRES without a
+    // preconditioner finds the exact solution in three iterations, and
+    // then the Krylov space is invariant (happy breakdown).
+    const int n = 30;
+    RowMatrix diagonal( n, n );
+    for( int i = 0; i < n; ++i ) {
+        diagonal.insert( i, i ) = 1.0 + i % 3;
+    }
+    diagonal.makeCompressed();
+    const RowMatrix chain = stackedMatrix( chainSystem( n/2 ) );
+    std::vector<double> rhs( n );
+    for( int i = 0; i < n; ++i ) {
+        rhs[i] = 1.0 + 0.1*i;
+    }
+    const Eigen::Map<const Eigen::VectorXd> b( rhs.data(), n );
+
+    const RowMatrix* matrices[] = { &diagonal, &chain };
+    const char* methods[] = { "bicgstab", "gmres" };
+    for( const RowMatrix* A : matrices ) {
+        for( const char* method : methods ) {
+            Opm::parameter::ParameterGroup param;
+            param.disableOutput();
+            param.insertParameter( "linear_solver", method );
+            param.insertParameter( "preconditioner", "none" );
+            param.insertParameter( "linear_solver_tol", "1e-10" );
+            KrylovSolver solver( param );
+            std::vector<double> x( n );
+            const KrylovSolver::Report rep = solver.solve( makeSparseMatrixView( *A ), rhs.data(), x.data() );
+            BOOST_CHECK_MESSAGE( rep.converged, solver.name() << " did not converge" );
+            const Eigen::Map<const Eigen::VectorXd> xv( x.data(), n );
+            const double true_residual = ( b - (*A) * xv ).norm() / b.norm();
+            BOOST_CHECK_LE( true_residual, 1e-10 );
+            BOOST_CHECK_CLOSE( rep.residual, true_residual, 1e-6 );
+            if ( A == &diagonal && std::string( method ) == "gmres" ) {
+                BOOST_CHECK_EQUAL( rep.iterations, 3 );
+            }
+        }
+    }
+}
@@ -0,0 +1,111 @@
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+#include <opm/autodiff/AutoDiffHelpers.hpp>
+#include <opm/core/grid.h>
+#include <opm/core/grid/GridManager.hpp>
+
+#include <memory>
+#include <vector>
+
+#include "equelle/StructuredGridOps.hpp"
+
+using namespace equelle;
+
+namespace {
+
+typedef CollOfScalar::ADB ADB;
+typedef CollOfScalar::M M;
+
+// StructuredGridOps promises the results of the HelperOps matrices, bit for
+// bit: the values, the Jacobian values and the sparsity patterns.
+void checkSame( const CollOfScalar& structured, const ADB& helper )
+{
+    BOOST_REQUIRE_EQUAL( structured.size(), helper.size() );
+    for( int i = 0; i < structured.size(); ++i ) {
+        BOOST_CHECK_EQUAL( structured.value()[i], helper.value()[i] );
+    }
+    BOOST_REQUIRE_EQUAL( structured.derivative().size(), helper.derivative().size() );
+    for( size_t block = 0; block < helper.derivative().size(); ++block ) {
+        const M& s = structured.derivative()[block];
+        const M& h = helper.derivative()[block];
+        BOOST_REQUIRE_EQUAL( s.rows(), h.rows() );
+        BOOST_REQUIRE_EQUAL( s.cols(), h.cols() );
+        BOOST_CHECK_EQUAL( s.nonZeros(), h.nonZeros() );
+        for( int j = 0; j < h.outerSize(); ++j ) {
+            M::InnerIterator sit( s, j );
+            M::InnerIterator hit( h, j );
+            for( ; sit && hit; ++sit, ++hit ) {
+                BOOST_CHECK_EQUAL( sit.index(), hit.index() );
+                BOOST_CHECK_EQUAL( sit.value(), hit.value() );
+            }
+            BOOST_CHECK( !sit && !hit );
+        }
+    }
+}
+
+void checkAgainstHelperOps( const UnstructuredGrid& grid )
+{
+    const std::unique_ptr<StructuredGridOps> structured = StructuredGridOps::detect( grid, 1 );
+    BOOST_REQUIRE( structured );
+    const Opm::HelperOps ops( grid );
+    const int nc = grid.number_of_cells;
+    const int nf = grid.number_of_faces;
+
+    const int num_internal = ops.internal_faces.size();
+    BOOST_REQUIRE_EQUAL( structured->numInternalFaces(), num_internal );
+    for( int i = 0; i < num_internal; ++i ) {
+        BOOST_CHECK_EQUAL( structured->internalFace( i ), ops.internal_faces[i] );
+    }
+
+    // Unknowns on the cells and on the faces, so that the Jacobians have one
+    // block that the operators act on and one that they leave empty.
+    ADB::V cell_values( nc );
+    for( int c = 0; c < nc; ++c ) {
+        cell_values[c] = 1.0 + 0.37*c - 0.011*c*c;
+    }
+    ADB::V face_values( nf );
+    for( int f = 0; f < nf; ++f ) {
+        face_values[f] = 0.5 - 0.13*f;
+    }
+    const std::vector<int> blocks = { nc, nf };
+    const ADB u = ADB::variable( 0, cell_values, blocks );
+    const ADB flux = ADB::variable( 1, face_values, blocks );
+    // Derivatives that are not the identity, and values without derivatives.
+    const ADB u2 = u * u;
+    const ADB flux2 = flux * flux;
+
+    for( const ADB& x : { u, u2, ADB::constant( cell_values ) } ) {
+        checkSame( structured->gradient( x ), ops.grad * x );
+        checkSame( structured->negGradient( x ), ops.ngrad * x );
+        const ADB internal_flux = ops.grad * x;
+        checkSame( structured->interiorDivergence( internal_flux ), ops.div * internal_flux );
+    }
+    for( const ADB& x : { flux, flux2, ADB::constant( face_values ) } ) {
+        checkSame( structured->divergence( x ), ops.fulldiv * x );
+    }
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE( structuredGridOpsMatchHelperOps2D ) {
+    const Opm::GridManager gm( 5, 3 );
+    checkAgainstHelperOps( *gm.c_grid() );
+}
+
+BOOST_AUTO_TEST_CASE( structuredGridOpsMatchHelperOps3D ) {
+    const Opm::GridManager gm( 4, 3, 2, 1.0, 1.0, 1.0 );
+    checkAgainstHelperOps( *gm.c_grid() );
+}
+
+BOOST_AUTO_TEST_CASE( structuredGridOpsRejectMismatchedDimensions ) {
+    const Opm::GridManager gm( 4, 3, 2, 1.0, 1.0, 1.0 );
+    UnstructuredGrid grid = *gm.c_grid();
+    // The product overflows int, which must not be mistaken for a match.
+    grid.cartdims[0] = grid.cartdims[1] = grid.cartdims[2] = 65536;
+    BOOST_CHECK( !StructuredGridOps::detect( grid, 1 ) );
+    grid.cartdims[0] = 2;
+    grid.cartdims[1] = 6;
+    grid.cartdims[2] = 2;
+    BOOST_CHECK( !StructuredGridOps::detect( grid, 1 ) );
+}
@@ -0,0 +1,460 @@
+/*
+  Copyright 2013 SINTEF ICT, Applied Mathematics.
+*/
+
+#include "ADRequirementVisitor.hpp"
+#include "ASTNodes.hpp"
+#include "SymbolTable.hpp"
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+
+ADRequirementVisitor::ADRequirementVisitor()
+    : changed_(false),
+      stencil_depth_(0)
+{
+}
+
+ADRequirementVisitor::~ADRequirementVisitor()
+{
+}
+
+void ADRequirementVisitor::analyze(Node& program)
+{
+    // Flags only ever change from false to true, so this terminates.
+    do {
+        changed_ = false;
+        program.accept(*this);
+        if (!frames_.empty() || stencil_depth_ != 0) {
+            throw std::logic_error("Internal compiler error in ADRequirementVisitor::analyze().");
+        }
+    } while (changed_);
+}
+
+bool ADRequirementVisitor::isAD(const Node* node) const
+{
+    auto it = nodes_.find(node);
+    return it != nodes_.end() && it->second;
+}
+
+bool ADRequirementVisitor::isVariableAD(const std::string& scope, const std::string& name) const
+{
+    auto it = variables_.find(VariableKey(scope, name));
+    return it != variables_.end() && it->second;
+}
+
+bool ADRequirementVisitor::isReturnAD(const std::string& function) const
+{
+    auto it = returns_.find(function);
+    return it != returns_.end() && it->second;
+}
+
+
+
+// ============ Expressions ============
+
+
+void ADRequirementVisitor::visit(SequenceNode&)
+{
+}
+
+void ADRequirementVisitor::midVisit(SequenceNode&)
+{
+}
+
+void ADRequirementVisitor::postVisit(SequenceNode&)
+{
+}
+
+void ADRequirementVisitor::visit(NumberNode&)
+{
+    addFlag(false);
+}
+
+void ADRequirementVisitor::visit(StringNode&)
+{
+    addFlag(false);
+}
+
+void ADRequirementVisitor::visit(TypeNode&)
+{
+}
+
+void ADRequirementVisitor::visit(FuncTypeNode&)
+{
+}
+
+void ADRequirementVisitor::visit(BinaryOpNode&)
+{
+    pushFrame();
+}
+
+void ADRequirementVisitor::midVisit(BinaryOpNode&)
+{
+}
+
+void ADRequirementVisitor::postVisit(BinaryOpNode& node)
+{
+    finishExpression(node, node.type());
+}
+
+void ADRequirementVisitor::visit(ComparisonOpNode&)
+{
+    pushFrame();
+}
+
+void ADRequirementVisitor::midVisit(ComparisonOpNode&)
+{
+}
+
+void ADRequirementVisitor::postVisit(ComparisonOpNode& node)
+{
+    // Comparisons produce booleans, which have no derivatives.
+    finishExpression(node, node.type());
+}
+
+void ADRequirementVisitor::visit(NormNode&)
+{
+    pushFrame();
+}
+
+void ADRequirementVisitor::postVisit(NormNode& node)
+{
+    finishExpression(node, node.type());
+}
+
+void ADRequirementVisitor::visit(UnaryNegationNode&)
+{
+    pushFrame();
+}
+
+void ADRequirementVisitor::postVisit(UnaryNegationNode& node)
+{
+    finishExpression(node, node.type());
+}
+
+void ADRequirementVisitor::visit(OnNode&)
+{
+    pushFrame();
+}
+
+void ADRequirementVisitor::midVisit(OnNode&)
+{
+}
+
+void ADRequirementVisitor::postVisit(OnNode& node)
+{
+    finishExpression(node, node.type());
+}
+
+void ADRequirementVisitor::visit(TrinaryIfNode&)
+{
+    pushFrame();
+}
+
+void ADRequirementVisitor::questionMarkVisit(TrinaryIfNode&)
+{
+}
+
+void ADRequirementVisitor::colonVisit(TrinaryIfNode&)
+{
+}
+
+void ADRequirementVisitor::postVisit(TrinaryIfNode& node)
+{
+    finishExpression(node, node.type());
+}
+
+void ADRequirementVisitor::visit(VarNode& node)
+{
+    if (stencil_depth_ > 0) {
+        return;
+    }
+    const bool ad = isVariableAD(SymbolTable::variableScope(node.name()), node.name());
+    markNode(node, ad);
+    addFlag(ad);
+}
+
+void ADRequirementVisitor::visit(FuncRefNode& node)
+{
+    // Function references are only passed to the Newton solvers,
+    // which evaluate the function with AD arguments and need the
+    // derivatives of its result.
+    if (stencil_depth_ > 0) {
+        return;
+    }
+    const Function& f = SymbolTable::getFunction(node.name());
+    for (const Variable& arg : f.functionType().arguments()) {
+        markVariable(f.name(), arg.name(), true);
+    }
+    markReturn(f.name(), true);
+    addFlag(false);
+}
+
+void ADRequirementVisitor::visit(JustAnIdentifierNode&)
+{
+    addFlag(false);
+}
+
+void ADRequirementVisitor::visit(FuncArgsNode&)
+{
+}
+
+void ADRequirementVisitor::midVisit(FuncArgsNode&)
+{
+}
+
+void ADRequirementVisitor::postVisit(FuncArgsNode&)
+{
+}
+
+void ADRequirementVisitor::visit(FuncCallNode&)
+{
+    pushFrame();
+}
+
+void ADRequirementVisitor::postVisit(FuncCallNode& node)
+{
+    if (stencil_depth_ > 0) {
+        return;
+    }
+    const std::vector<bool> args = popFrame();
+    const std::string& fname = node.name();
+    bool ad = false;
+    if (std::isupper(fname[0])) {
+        // Built-in function. The Newton solvers return plain values,
+        // other functions propagate derivatives from their arguments.
+        if (fname != "NewtonSolve" && fname != "NewtonSolveSystem") {
+            ad = std::find(args.begin(), args.end(), true) != args.end();
+        }
+    } else {
+        // User-defined function: its arguments need AD if any call
+        // passes AD values to them.
+        const Function& f = SymbolTable::getFunction(fname);
+        const std::vector<Variable>& fargs = f.functionType().arguments();
+        for (size_t i = 0; i < args.size() && i < fargs.size(); ++i) {
+            markVariable(f.name(), fargs[i].name(), args[i]);
+        }
+        ad = isReturnAD(fname);
+    }
+    ad = ad && canCarryDerivatives(node.type());
+    markNode(node, ad);
+    addFlag(ad);
+}
+
+void ADRequirementVisitor::visit(ArrayNode&)
+{
+    pushFrame();
+}
+
+void ADRequirementVisitor::postVisit(ArrayNode& node)
+{
+    finishExpression(node, node.type());
+}
+
+void ADRequirementVisitor::visit(RandomAccessNode&)
+{
+    pushFrame();
+}
+
+void ADRequirementVisitor::postVisit(RandomAccessNode& node)
+{
+    finishExpression(node, node.type());
+}
+
+
+
+// ============ Statements and declarations ============
+
+
+void ADRequirementVisitor::visit(VarDeclNode&)
+{
+}
+
+void ADRequirementVisitor::postVisit(VarDeclNode&)
+{
+}
+
+void ADRequirementVisitor::visit(VarAssignNode&)
+{
+    pushFrame();
+}
+
+void ADRequirementVisitor::postVisit(VarAssignNode& node)
+{
+    const std::vector<bool> rhs = popFrame();
+    const bool ad = !rhs.empty() && rhs.front();
+    markVariable(SymbolTable::variableScope(node.name()), node.name(), ad);
+}
+
+void ADRequirementVisitor::visit(FuncArgsDeclNode&)
+{
+}
+
+void ADRequirementVisitor::midVisit(FuncArgsDeclNode&)
+{
+}
+
+void ADRequirementVisitor::postVisit(FuncArgsDeclNode&)
+{
+}
+
+void ADRequirementVisitor::visit(FuncDeclNode&)
+{
+}
+
+void ADRequirementVisitor::postVisit(FuncDeclNode&)
+{
+}
+
+void ADRequirementVisitor::visit(FuncStartNode&)
+{
+    // The argument list of a function definition is not an expression.
+    pushFrame();
+}
+
+void ADRequirementVisitor::postVisit(FuncStartNode&)
+{
+    popFrame();
+}
+
+void ADRequirementVisitor::visit(FuncAssignNode&)
+{
+}
+
+void ADRequirementVisitor::postVisit(FuncAssignNode&)
+{
+}
+
+void ADRequirementVisitor::visit(ReturnStatementNode&)
+{
+    pushFrame();
+}
+
+void ADRequirementVisitor::postVisit(ReturnStatementNode&)
+{
+    const std::vector<bool> rhs = popFrame();
+    const bool ad = !rhs.empty() && rhs.front();
+    markReturn(SymbolTable::getCurrentFunction().name(), ad);
+}
+
+void ADRequirementVisitor::visit(FuncCallStatementNode&)
+{
+    pushFrame();
+}
+
+void ADRequirementVisitor::postVisit(FuncCallStatementNode&)
+{
+    popFrame();
+}
+
+void ADRequirementVisitor::visit(LoopNode&)
+{
+}
+
+void ADRequirementVisitor::postVisit(LoopNode&)
+{
+}
+
+// Stencils work on single values, they are ignored by the analysis.
+
+void ADRequirementVisitor::visit(StencilAccessNode&)
+{
+    ++stencil_depth_;
+}
+
+void ADRequirementVisitor::midVisit(StencilAccessNode&)
+{
+}
+
+void ADRequirementVisitor::postVisit(StencilAccessNode&)
+{
+    --stencil_depth_;
+    addFlag(false);
+}
+
+void ADRequirementVisitor::visit(StencilStatementNode&)
+{
+    ++stencil_depth_;
+}
+
+void ADRequirementVisitor::midVisit(StencilStatementNode&)
+{
+}
+
+void ADRequirementVisitor::postVisit(StencilStatementNode&)
+{
+    --stencil_depth_;
+}
+
+
+
+// ============ Helpers ============
+
+
+bool ADRequirementVisitor::canCarryDerivatives(const EquelleType& et) const
+{
+    return et.isCollection() && (et.basicType() == Scalar || et.basicType() == Vector);
+}
+
+void ADRequirementVisitor::pushFrame()
+{
+    if (stencil_depth_ == 0) {
+        frames_.push_back(std::vector<bool>());
+    }
+}
+
+std::vector<bool> ADRequirementVisitor::popFrame()
+{
+    if (stencil_depth_ > 0) {
+        return std::vector<bool>();
+    }
+    std::vector<bool> frame = frames_.back();
+    frames_.pop_back();
+    return frame;
+}
+
+void ADRequirementVisitor::addFlag(const bool ad)
+{
+    if (stencil_depth_ == 0 && !frames_.empty()) {
+        frames_.back().push_back(ad);
+    }
+}
+
+/// An expression can carry derivatives if any of its subexpressions
+/// can, and its type allows it.
+void ADRequirementVisitor::finishExpression(const Node& node, const EquelleType& et)
+{
+    if (stencil_depth_ > 0) {
+        return;
+    }
+    const std::vector<bool> children = popFrame();
+    const bool ad = canCarryDerivatives(et)
+        && std::find(children.begin(), children.end(), true) != children.end();
+    markNode(node, ad);
+    addFlag(ad);
+}
+
+void ADRequirementVisitor::setFlag(bool& flag, const bool ad)
+{
+    if (ad && !flag) {
+        flag = true;
+        changed_ = true;
+    }
+}
+
+void ADRequirementVisitor::markVariable(const std::string& scope, const std::string& name, const bool ad)
+{
+    setFlag(variables_[VariableKey(scope, name)], ad);
+}
+
+void ADRequirementVisitor::markReturn(const std::string& function, const bool ad)
+{
+    setFlag(returns_[function], ad);
+}
+
+void ADRequirementVisitor::markNode(const Node& node, const bool ad)
+{
+    setFlag(nodes_[&node], ad);
+}
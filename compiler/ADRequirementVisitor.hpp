@@ -0,0 +1,130 @@
+/*
+  Copyright 2013 SINTEF ICT, Applied Mathematics.
+*/
+
+#ifndef ADREQUIREMENTVISITOR_HEADER_INCLUDED
+#define ADREQUIREMENTVISITOR_HEADER_INCLUDED
+
+#include "ASTVisitorInterface.hpp"
+#include "EquelleType.hpp"
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+class Node;
+
+/// Finds the variables, function arguments, function results and
+/// expressions that can carry derivatives (automatic differentiation).
+///
+/// Derivatives are introduced by the Newton solvers only: the
+/// functions given to NewtonSolve() and NewtonSolveSystem() are called
+/// with AD arguments and must return AD results. From there the
+/// requirement is traced through assignments, returns and calls until
+/// nothing changes. Everything else can use value-only types.
+class ADRequirementVisitor : public ASTVisitorInterface
+{
+public:
+    ADRequirementVisitor();
+    ~ADRequirementVisitor();
+
+    /// Run the analysis on a whole program.
+    void analyze(Node& program);
+
+    /// True if the expression node can carry derivatives.
+    bool isAD(const Node* node) const;
+
+    /// True if the variable (or function argument) declared in the
+    /// given scope can carry derivatives.
+    bool isVariableAD(const std::string& scope, const std::string& name) const;
+
+    /// True if the result of the (user-defined) function can carry derivatives.
+    bool isReturnAD(const std::string& function) const;
+
+    void visit(SequenceNode& node);
+    void midVisit(SequenceNode& node);
+    void postVisit(SequenceNode& node);
+    void visit(NumberNode& node);
+    void visit(StringNode& node);
+    void visit(TypeNode& node);
+    void visit(FuncTypeNode& node);
+    void visit(BinaryOpNode& node);
+    void midVisit(BinaryOpNode& node);
+    void postVisit(BinaryOpNode& node);
+    void visit(ComparisonOpNode& node);
+    void midVisit(ComparisonOpNode& node);
+    void postVisit(ComparisonOpNode& node);
+    void visit(NormNode& node);
+    void postVisit(NormNode& node);
+    void visit(UnaryNegationNode& node);
+    void postVisit(UnaryNegationNode& node);
+    void visit(OnNode& node);
+    void midVisit(OnNode& node);
+    void postVisit(OnNode& node);
+    void visit(TrinaryIfNode& node);
+    void questionMarkVisit(TrinaryIfNode& node);
+    void colonVisit(TrinaryIfNode& node);
+    void postVisit(TrinaryIfNode& node);
+    void visit(VarDeclNode& node);
+    void postVisit(VarDeclNode& node);
+    void visit(VarAssignNode& node);
+    void postVisit(VarAssignNode& node);
+    void visit(VarNode& node);
+    void visit(FuncRefNode& node);
+    void visit(JustAnIdentifierNode& node);
+    void visit(FuncArgsDeclNode& node);
+    void midVisit(FuncArgsDeclNode& node);
+    void postVisit(FuncArgsDeclNode& node);
+    void visit(FuncDeclNode& node);
+    void postVisit(FuncDeclNode& node);
+    void visit(FuncStartNode& node);
+    void postVisit(FuncStartNode& node);
+    void visit(FuncAssignNode& node);
+    void postVisit(FuncAssignNode& node);
+    void visit(FuncArgsNode& node);
+    void midVisit(FuncArgsNode& node);
+    void postVisit(FuncArgsNode& node);
+    void visit(ReturnStatementNode& node);
+    void postVisit(ReturnStatementNode& node);
+    void visit(FuncCallNode& node);
+    void postVisit(FuncCallNode& node);
+    void visit(FuncCallStatementNode& node);
+    void postVisit(FuncCallStatementNode& node);
+    void visit(LoopNode& node);
+    void postVisit(LoopNode& node);
+    void visit(ArrayNode& node);
+    void postVisit(ArrayNode& node);
+    void visit(RandomAccessNode& node);
+    void postVisit(RandomAccessNode& node);
+
+    void visit( StencilAccessNode& node );
+    void midVisit( StencilAccessNode& node );
+    void postVisit( StencilAccessNode& node );
+    void visit( StencilStatementNode& node );
+    void midVisit( StencilStatementNode& node );
+    void postVisit( StencilStatementNode& node );
+
+private:
+    typedef std::pair<std::string, std::string> VariableKey;
+
+    bool changed_;
+    int stencil_depth_;
+    // One frame per expression or statement being visited, holding
+    // the AD flags of its (direct) subexpressions.
+    std::vector<std::vector<bool>> frames_;
+    std::map<VariableKey, bool> variables_;
+    std::map<std::string, bool> returns_;
+    std::map<const Node*, bool> nodes_;
+
+    bool canCarryDerivatives(const EquelleType& et) const;
+    void pushFrame();
+    std::vector<bool> popFrame();
+    void addFlag(const bool ad);
+    void finishExpression(const Node& node, const EquelleType& et);
+    void setFlag(bool& flag, const bool ad);
+    void markVariable(const std::string& scope, const std::string& name, const bool ad);
+    void markReturn(const std::string& function, const bool ad);
+    void markNode(const Node& node, const bool ad);
+};
+
+#endif // ADREQUIREMENTVISITOR_HEADER_INCLUDED
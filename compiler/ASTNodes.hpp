@@ -423,6 +423,10 @@ public:
     {
         return expr_->type();
     }
+    const Node* expression() const
+    {
+        return expr_;
+    }
     virtual void accept(ASTVisitorInterface& visitor)
     {
         visitor.visit(*this);
@@ -969,6 +973,12 @@ public:
         return lhs->name();
     }
 
+    /// The stencil access on the left hand side, as in u@i,j@.
+    const StencilAccessNode& target() const
+    {
+        return *lhs;
+    }
+
 	// All stencils are at this time scalars
 	EquelleType type() const
 	{
@@ -612,16 +612,18 @@ SequenceNode *handleStencilStatement( StencilAccessNode *lhsStencilAccess,
                                               Node *expr)
 {
     SequenceNode* seq = new SequenceNode;
-    TypeNode* type = new TypeNode(EquelleType(Scalar));
-    /**FIXME: Need stencilDeclnode here.........
-    Right now it ends up with
-    const Scalar u = auto cell_stencil = [&] (int i, int j) { ...
-    instead of the more sensible
-    equelle::CartesianGrid::CartesianCollectionOfScalar u = grid.inputCellScalarWithDefault( "u", 1.0 );
-    auto cell_stencil = [&] (int i, int j) { ...
-    */
+    const std::string& name = lhsStencilAccess->name();
+    // A stencil statement assigns to all cells. The variable is declared here unless it
+    // is a previously declared (Mutable) Collection Of Scalar On AllCells().
+    const EquelleType cells_type(Scalar, Collection, AllCells);
+    if (!SymbolTable::isVariableDeclared(name)) {
+        seq->pushNode(handleDeclaration(name, new TypeNode(cells_type)));
+    } else if (SymbolTable::variableType(name) != cells_type) {
+        std::string err_msg = "a stencil statement must assign to a Collection Of Scalar On AllCells(), not to ";
+        err_msg += name;
+        yyerror(err_msg.c_str());
+    }
     StencilStatementNode* stencil = new StencilStatementNode( lhsStencilAccess, expr );
-    seq->pushNode(handleDeclaration(lhsStencilAccess->name(), type));
-    seq->pushNode(handleAssignment(lhsStencilAccess->name(), stencil));
+    seq->pushNode(handleAssignment(name, stencil));
     return seq;
 }
@@ -18,9 +18,12 @@ namespace
 }
 
 PrintCPUBackendASTVisitor::PrintCPUBackendASTVisitor()
-    : suppressed_(false),
+    : fuse_values_(true),
+      suppressed_(false),
       indent_(1),
-      sequence_depth_(0)
+      sequence_depth_(0),
+      context_(1, Plain),
+      pending_call_(0)
 {
 }
 
@@ -32,6 +35,8 @@ void PrintCPUBackendASTVisitor::visit(SequenceNode&)
 {
     if (sequence_depth_ == 0) {
         // This is the root node of the program.
+        // Find out what can carry derivatives before emitting anything.
+        ad_.analyze(*SymbolTable::program());
         std::cout << cppStartString();
         endl();
     }
@@ -51,7 +56,7 @@ void PrintCPUBackendASTVisitor::postVisit(SequenceNode&)
         // Emit ensureRequirements() function.
         std::cout <<
             "\n"
-            "void ensureRequirements(const equelle::EquelleRuntimeCPU& er)\n"
+            "void ensureRequirements(const " << runtimeTypeString() << "& er)\n"
             "{\n";
         if (requirement_strings_.empty()) {
             std::cout << "    (void)er;\n";
@@ -85,8 +90,21 @@ void PrintCPUBackendASTVisitor::visit(FuncTypeNode&)
     // std::cout << node.funcType().equelleString();
 }
 
-void PrintCPUBackendASTVisitor::visit(BinaryOpNode&)
+void PrintCPUBackendASTVisitor::visit(BinaryOpNode& node)
 {
+    const ExpressionContext context = context_.back();
+    if (context != NoFusion && fuse_values_ && isCollOfScalar(node.type()) && !ad_.isAD(&node)) {
+        // A value-only expression, which is evaluated by
+        // Eigen in a single loop without temporaries.
+        if (context == Plain) {
+            std::cout << "CollOfScalar(";
+        }
+        context_.push_back(Values);
+    } else if (context == NoFusion || !node.type().isCollection()) {
+        context_.push_back(context);
+    } else {
+        context_.push_back(Plain);
+    }
     std::cout << '(';
 }
 
@@ -112,13 +130,21 @@ void PrintCPUBackendASTVisitor::midVisit(BinaryOpNode& node)
     std::cout << ' ' << op << ' ';
 }
 
-void PrintCPUBackendASTVisitor::postVisit(BinaryOpNode&)
+void PrintCPUBackendASTVisitor::postVisit(BinaryOpNode& node)
 {
     std::cout << ')';
+    const ExpressionContext context = context_.back();
+    context_.pop_back();
+    if (context == Values && context_.back() == Plain) {
+        std::cout << ')';
+    } else if (context != Values && context_.back() == Values && isCollOfScalar(node.type())) {
+        std::cout << ".value()";
+    }
 }
 
 void PrintCPUBackendASTVisitor::visit(ComparisonOpNode&)
 {
+    enterSubexpression();
     std::cout << '(';
 }
 
@@ -150,19 +176,22 @@ void PrintCPUBackendASTVisitor::midVisit(ComparisonOpNode& node)
     std::cout << ' ' << op << ' ';
 }
 
-void PrintCPUBackendASTVisitor::postVisit(ComparisonOpNode&)
+void PrintCPUBackendASTVisitor::postVisit(ComparisonOpNode& node)
 {
     std::cout << ')';
+    leaveSubexpression(node.type());
 }
 
 void PrintCPUBackendASTVisitor::visit(NormNode&)
 {
+    enterSubexpression();
     std::cout << "er.norm(";
 }
 
-void PrintCPUBackendASTVisitor::postVisit(NormNode&)
+void PrintCPUBackendASTVisitor::postVisit(NormNode& node)
 {
     std::cout << ')';
+    leaveSubexpression(node.type());
 }
 
 void PrintCPUBackendASTVisitor::visit(UnaryNegationNode&)
@@ -176,6 +205,7 @@ void PrintCPUBackendASTVisitor::postVisit(UnaryNegationNode&)
 
 void PrintCPUBackendASTVisitor::visit(OnNode& node)
 {
+    enterSubexpression();
     if (node.isExtend()) {
         std::cout << "er.operatorExtend(";
     } else {
@@ -193,26 +223,32 @@ void PrintCPUBackendASTVisitor::midVisit(OnNode& node)
     // a On AllFaces() ===> er.operatorOn(a, InteriorFaces(), AllFaces()).
     std::cout << ", ";
     if (node.lefttype().isCollection()) {
-        const std::string esname = SymbolTable::entitySetName(node.lefttype().gridMapping());
-        // Now esname can be either a user-created named set or an Equelle built-in
-        // function call such as AllCells(). If the second, we must transform to
-        // proper call syntax for the C++ backend.
-        const char first = esname[0];
-        const std::string cppterm = std::isupper(first) ?
-            std::string("er.") + char(std::tolower(first)) + esname.substr(1)
-            : esname;
-        std::cout << cppterm;
+        std::cout << entitySetCppTerm(node.lefttype().gridMapping());
         std::cout << ", ";
     }
 }
 
-void PrintCPUBackendASTVisitor::postVisit(OnNode&)
+void PrintCPUBackendASTVisitor::postVisit(OnNode& node)
 {
     std::cout << ')';
+    leaveSubexpression(node.type());
+}
+
+std::string PrintCPUBackendASTVisitor::entitySetCppTerm(const int gridmapping) const
+{
+    const std::string esname = SymbolTable::entitySetName(gridmapping);
+    // Now esname can be either a user-created named set or an Equelle built-in
+    // function call such as AllCells(). If the second, we must transform to
+    // proper call syntax for the C++ backend.
+    const char first = esname[0];
+    return std::isupper(first) ?
+        std::string("er.") + char(std::tolower(first)) + esname.substr(1)
+        : esname;
 }
 
 void PrintCPUBackendASTVisitor::visit(TrinaryIfNode&)
 {
+    enterSubexpression();
     std::cout << "er.trinaryIf(";
 }
 
@@ -226,15 +262,17 @@ void PrintCPUBackendASTVisitor::colonVisit(TrinaryIfNode&)
     std::cout << ", ";
 }
 
-void PrintCPUBackendASTVisitor::postVisit(TrinaryIfNode&)
+void PrintCPUBackendASTVisitor::postVisit(TrinaryIfNode& node)
 {
     std::cout << ')';
+    leaveSubexpression(node.type());
 }
 
 void PrintCPUBackendASTVisitor::visit(VarDeclNode& node)
 {
     if (node.type().isMutable()) {
-        std::cout << indent() << cppTypeString(node.type()) << " " << node.name() << ';';
+        const bool values = isValueVariable(node.name(), node.type());
+        std::cout << indent() << cppTypeString(node.type(), values) << " " << node.name() << ';';
         endl();
     }
     // suppress();
@@ -248,20 +286,23 @@ void PrintCPUBackendASTVisitor::postVisit(VarDeclNode&)
 void PrintCPUBackendASTVisitor::visit(VarAssignNode& node)
 {
     std::cout << indent();
+    const bool values = isValueVariable(node.name(), node.type());
     if (!SymbolTable::variableType(node.name()).isMutable()) {
     	if (node.type() == StencilI || node.type() == StencilJ || node.type() == StencilK) {
     		//This goes into the stencil-lambda definition. Let's keep the comment for now
     		std::cout << "// Not necessary: " << cppTypeString(node.type()) << " ";
     	}
     	else {
-    		std::cout << "const " << cppTypeString(node.type()) << " ";
+    		std::cout << "const " << cppTypeString(node.type(), values) << " ";
     	}
     }
     std::cout << node.name() << " = ";
+    context_.push_back(values ? Values : Plain);
 }
 
 void PrintCPUBackendASTVisitor::postVisit(VarAssignNode&)
 {
+    context_.pop_back();
     std::cout << ';';
     endl();
 }
@@ -269,7 +310,15 @@ void PrintCPUBackendASTVisitor::postVisit(VarAssignNode&)
 void PrintCPUBackendASTVisitor::visit(VarNode& node)
 {
     if (!suppressed_) {
-        std::cout << node.name();
+        const ExpressionContext context = context_.back();
+        const bool values = context != NoFusion && isValueVariable(node.name(), node.type());
+        if (context == Plain && values) {
+            std::cout << "CollOfScalar(" << node.name() << ')';
+        } else if (context == Values && !values && isCollOfScalar(node.type())) {
+            std::cout << node.name() << ".value()";
+        } else {
+            std::cout << node.name();
+        }
     }
 }
 
@@ -312,10 +361,15 @@ void PrintCPUBackendASTVisitor::visit(FuncStartNode& node)
     // std::cout << indent() << "auto " << node.name() << " = [&](";
     const FunctionType& ft = SymbolTable::getFunction(node.name()).functionType();
     const size_t n = ft.arguments().size();
-    std::cout << indent() << "std::function<" << cppTypeString(ft.returnType()) << '(';
+    std::vector<bool> values(n);
+    for (int i = 0; i < n; ++i) {
+        values[i] = isValueVariable(node.name(), ft.arguments()[i].name(), ft.arguments()[i].type());
+    }
+    const bool values_result = isValueFunction(node.name(), ft.returnType());
+    std::cout << indent() << "std::function<" << cppTypeString(ft.returnType(), values_result) << '(';
     for (int i = 0; i < n; ++i) {
         std::cout << "const "
-                  << cppTypeString(ft.arguments()[i].type())
+                  << cppTypeString(ft.arguments()[i].type(), values[i])
                   << "&";
         if (i < n - 1) {
             std::cout << ", ";
@@ -324,7 +378,7 @@ void PrintCPUBackendASTVisitor::visit(FuncStartNode& node)
     std::cout << ")> " << node.name() << " = [&](";
     for (int i = 0; i < n; ++i) {
         std::cout << "const "
-                  << cppTypeString(ft.arguments()[i].type())
+                  << cppTypeString(ft.arguments()[i].type(), values[i])
                   << "& " << ft.arguments()[i].name();
         if (i < n - 1) {
             std::cout << ", ";
@@ -338,7 +392,8 @@ void PrintCPUBackendASTVisitor::postVisit(FuncStartNode& node)
 {
     unsuppress();
     const FunctionType& ft = SymbolTable::getFunction(node.name()).functionType();
-    std::cout << ") -> " << cppTypeString(ft.returnType()) << " {";
+    const bool values_result = isValueFunction(node.name(), ft.returnType());
+    std::cout << ") -> " << cppTypeString(ft.returnType(), values_result) << " {";
     endl();
 }
 
@@ -355,6 +410,11 @@ void PrintCPUBackendASTVisitor::postVisit(FuncAssignNode&)
 
 void PrintCPUBackendASTVisitor::visit(FuncArgsNode&)
 {
+    // If these are the arguments of a user-defined function, each
+    // argument is emitted in the context given by its parameter type.
+    call_stack_.push_back(std::make_pair(pending_call_ ? pending_call_->name() : std::string(), 0));
+    pending_call_ = 0;
+    argumentContext();
 }
 
 void PrintCPUBackendASTVisitor::midVisit(FuncArgsNode&)
@@ -362,19 +422,26 @@ void PrintCPUBackendASTVisitor::midVisit(FuncArgsNode&)
     if (!suppressed_) {
         std::cout << ", ";
     }
+    ++call_stack_.back().second;
+    argumentContext();
 }
 
 void PrintCPUBackendASTVisitor::postVisit(FuncArgsNode&)
 {
+    call_stack_.pop_back();
 }
 
 void PrintCPUBackendASTVisitor::visit(ReturnStatementNode&)
 {
+    const Function& f = SymbolTable::getCurrentFunction();
+    const bool values = isValueFunction(f.name(), f.functionType().returnType());
+    context_.push_back(values ? Values : Plain);
     std::cout << indent() << "return ";
 }
 
 void PrintCPUBackendASTVisitor::postVisit(ReturnStatementNode&)
 {
+    context_.pop_back();
     std::cout << ';';
     endl();
 }
@@ -396,12 +463,24 @@ void PrintCPUBackendASTVisitor::visit(FuncCallNode& node)
         extra << "<" << node.type().arraySize() << ">";
         cppname += extra.str();
     }
+    const bool user_function = !std::isupper(first);
+    const bool values = user_function && isValueFunction(fname, node.type());
+    if (values && context_.back() == Plain) {
+        std::cout << "CollOfScalar(";
+    }
+    enterSubexpression();
+    if (user_function) {
+        pending_call_ = &node;
+    }
     std::cout << cppname << '(';
 }
 
-void PrintCPUBackendASTVisitor::postVisit(FuncCallNode&)
+void PrintCPUBackendASTVisitor::postVisit(FuncCallNode& node)
 {
     std::cout << ')';
+    const bool user_function = !std::isupper(node.name()[0]);
+    const bool values = user_function && isValueFunction(node.name(), node.type());
+    leaveSubexpression(node.type(), values);
 }
 
 void PrintCPUBackendASTVisitor::visit(FuncCallStatementNode&)
@@ -433,18 +512,21 @@ void PrintCPUBackendASTVisitor::postVisit(LoopNode&)
 
 void PrintCPUBackendASTVisitor::visit(ArrayNode&)
 {
+    enterSubexpression();
     // std::cout << cppTypeString(node.type()) << "({{";
     std::cout << "makeArray(";
 }
 
-void PrintCPUBackendASTVisitor::postVisit(ArrayNode&)
+void PrintCPUBackendASTVisitor::postVisit(ArrayNode& node)
 {
     // std::cout << "}})";
     std::cout << ")";
+    leaveSubexpression(node.type());
 }
 
 void PrintCPUBackendASTVisitor::visit(RandomAccessNode& node)
 {
+    enterSubexpression();
     if (!node.arrayAccess()) {
         // This is Vector access.
         std::cout << "CollOfScalar(";
@@ -465,6 +547,7 @@ void PrintCPUBackendASTVisitor::postVisit(RandomAccessNode& node)
         // Random access op is taking the column of the underlying Eigen array.
         std::cout << ".col(" << node.index() << "))";
     }
+    leaveSubexpression(node.type());
 }
 
 const char *PrintCPUBackendASTVisitor::cppStartString() const
@@ -477,6 +560,11 @@ const char *PrintCPUBackendASTVisitor::cppEndString() const
     return ::impl_cppEndString();
 }
 
+const char *PrintCPUBackendASTVisitor::runtimeTypeString() const
+{
+    return "equelle::EquelleRuntimeCPU";
+}
+
 
 void PrintCPUBackendASTVisitor::endl() const
 {
@@ -498,6 +586,11 @@ void PrintCPUBackendASTVisitor::unsuppress()
     suppressed_ = false;
 }
 
+std::string PrintCPUBackendASTVisitor::cppTypeString(const EquelleType& et, const bool values) const
+{
+    return values ? "CollOfScalarValues" : cppTypeString(et);
+}
+
 std::string PrintCPUBackendASTVisitor::cppTypeString(const EquelleType& et) const
 {
     std::string cppstring;
@@ -521,47 +614,93 @@ void PrintCPUBackendASTVisitor::addRequirementString(const std::string& req)
     requirement_strings_.insert(req);
 }
 
-void PrintCPUBackendASTVisitor::visit(StencilAccessNode &node)
+bool PrintCPUBackendASTVisitor::isCollOfScalar(const EquelleType& et) const
 {
-    std::cout << "grid.cellAt( ";
+    return et.isCollection() && !et.isArray() && et.basicType() == Scalar;
 }
 
-void PrintCPUBackendASTVisitor::midVisit(StencilAccessNode &node)
+/// True if the variable or function argument of type et, declared in
+/// the given scope, is stored as CollOfScalarValues.
+bool PrintCPUBackendASTVisitor::isValueVariable(const std::string& scope,
+                                                const std::string& name,
+                                                const EquelleType& et) const
 {
-    throw std::runtime_error( std::string(__PRETTY_FUNCTION__) + "is not implemented yet" );
+    return fuse_values_ && isCollOfScalar(et) && !ad_.isVariableAD(scope, name);
 }
 
-void PrintCPUBackendASTVisitor::postVisit(StencilAccessNode &node)
+bool PrintCPUBackendASTVisitor::isValueVariable(const std::string& name, const EquelleType& et) const
 {
-    std::cout <<  ", "  << node.grid_variable << " )";
+    return isCollOfScalar(et) && isValueVariable(SymbolTable::variableScope(name), name, et);
 }
 
-void PrintCPUBackendASTVisitor::visit(StencilStatementNode &node)
+/// True if the user-defined function returning et returns CollOfScalarValues.
+bool PrintCPUBackendASTVisitor::isValueFunction(const std::string& name, const EquelleType& et) const
 {
-	//FIXME: This will not work if node.name() is already defined elsewhere...
-	//std::cout << indent() << "equelle::CartesianGrid::CartesianCollectionOfScalar " << node.name()
-	//		<< " = grid.inputCellScalarWithDefault( \"" << node.name() << "\", 0.0 );" << std::endl;
-    std::cout << indent() << "//Start of stencil-lambda" << std::endl;
-    std::cout << indent() << "auto cell_stencil = [&]( int i, int j ) {" << std::endl;
-    indent_++;
-    std::cout << indent();
+    return fuse_values_ && isCollOfScalar(et) && !ad_.isReturnAD(name);
 }
 
-void PrintCPUBackendASTVisitor::midVisit(StencilStatementNode &node)
+/// Called before emitting the arguments of a function call or similar
+/// construct. Those arguments are ordinary (non-fused) expressions even
+/// if the construct itself is part of a fused expression.
+void PrintCPUBackendASTVisitor::enterSubexpression()
 {
-    std::cout << " = " << std::endl;
-    indent_++;
-    std::cout << indent();
+    context_.push_back(context_.back() == NoFusion ? NoFusion : Plain);
+}
+
+/// Called after a construct whose value is of type et, which is a
+/// CollOfScalarValues if values is true. Converts the result to the
+/// representation expected by the enclosing context.
+void PrintCPUBackendASTVisitor::leaveSubexpression(const EquelleType& et, const bool values)
+{
+    context_.pop_back();
+    if (values && context_.back() == Plain) {
+        std::cout << ')';
+    } else if (!values && context_.back() == Values && isCollOfScalar(et)) {
+        std::cout << ".value()";
+    }
+}
+
+/// Sets the context of the next argument of a user-defined function
+/// call, according to the type of the corresponding parameter.
+void PrintCPUBackendASTVisitor::argumentContext()
+{
+    const std::pair<std::string, int>& call = call_stack_.back();
+    if (call.first.empty() || context_.back() == NoFusion) {
+        return;
+    }
+    const Function& f = SymbolTable::getFunction(call.first);
+    const std::vector<Variable>& args = f.functionType().arguments();
+    if (call.second < int(args.size())) {
+        const Variable& arg = args[call.second];
+        context_.back() = isValueVariable(f.name(), arg.name(), arg.type()) ? Values : Plain;
+    }
+}
+
+// Stencils need a structured grid, see PrintCartesianBackendASTVisitor.
+void PrintCPUBackendASTVisitor::visit(StencilAccessNode&)
+{
+    throw std::runtime_error("Stencils are only supported by the cartesian backend (--backend=cartesian)");
 }
 
-void PrintCPUBackendASTVisitor::postVisit(StencilStatementNode &node)
+void PrintCPUBackendASTVisitor::midVisit(StencilAccessNode&)
 {
-    indent_--;
-    indent_--;
-    std::cout << ";" << std::endl;
-    std::cout << indent() << "} // End of stencil-lambda\n";
-    std::cout << indent() << "grid.allCells().execute( cell_stencil );\n";
+}
+
+void PrintCPUBackendASTVisitor::postVisit(StencilAccessNode&)
+{
+}
 
+void PrintCPUBackendASTVisitor::visit(StencilStatementNode&)
+{
+    throw std::runtime_error("Stencils are only supported by the cartesian backend (--backend=cartesian)");
+}
+
+void PrintCPUBackendASTVisitor::midVisit(StencilStatementNode&)
+{
+}
+
+void PrintCPUBackendASTVisitor::postVisit(StencilStatementNode&)
+{
 }
 
 
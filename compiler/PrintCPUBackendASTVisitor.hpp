@@ -6,9 +6,12 @@
 #define PRINTCPUBACKENDASTVISITOR_HEADER_INCLUDED
 
 #include "ASTVisitorInterface.hpp"
+#include "ADRequirementVisitor.hpp"
 #include "EquelleType.hpp"
 #include <string>
 #include <set>
+#include <utility>
+#include <vector>
 
 class PrintCPUBackendASTVisitor : public ASTVisitorInterface
 {
@@ -80,18 +83,42 @@ public:
     // These are overriden by subclasses who only need to alter the surroundings of the generated code.
     virtual const char* cppStartString() const;
     virtual const char* cppEndString() const;
+    virtual const char* runtimeTypeString() const;
 
-private:
+protected:
+    /// Kinds of expression context. Collection Of Scalar values that
+    /// cannot carry derivatives are stored as CollOfScalarValues, and
+    /// arithmetic on them is emitted as a single fused Eigen
+    /// expression in a Values context.
+    enum ExpressionContext { Plain, Values, NoFusion };
+
+    /// If false, no CollOfScalarValues are used, for runtimes without them.
+    bool fuse_values_;
     bool suppressed_;
     int indent_;
     int sequence_depth_;
+    ADRequirementVisitor ad_;
+    std::vector<ExpressionContext> context_;
+    std::vector<std::pair<std::string, int>> call_stack_;
+    const FuncCallNode* pending_call_;
     std::set<std::string> requirement_strings_;
     void endl() const;
     std::string indent() const;
     void suppress();
     void unsuppress();
-    std::string cppTypeString(const EquelleType& et) const;
+    virtual std::string cppTypeString(const EquelleType& et) const;
+    std::string cppTypeString(const EquelleType& et, const bool values) const;
     void addRequirementString(const std::string& req);
+    bool isCollOfScalar(const EquelleType& et) const;
+    bool isValueVariable(const std::string& scope, const std::string& name, const EquelleType& et) const;
+    bool isValueVariable(const std::string& name, const EquelleType& et) const;
+    bool isValueFunction(const std::string& name, const EquelleType& et) const;
+    void enterSubexpression();
+    void leaveSubexpression(const EquelleType& et, const bool values = false);
+    void argumentContext();
+    /// The C++ expression for an entity set, such as "er.allCells()" for
+    /// AllCells() or the variable name of a named set.
+    std::string entitySetCppTerm(const int gridmapping) const;
 };
 
 #endif // PRINTCPUBACKENDASTVISITOR_HEADER_INCLUDED
@@ -0,0 +1,323 @@
+#include "PrintCartesianBackendASTVisitor.hpp"
+#include "ASTNodes.hpp"
+#include "SymbolTable.hpp"
+#include <cctype>
+#include <cmath>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+namespace
+{
+    const char* impl_cppStartString();
+    const char* impl_cppEndString();
+}
+
+
+PrintCartesianBackendASTVisitor::PrintCartesianBackendASTVisitor()
+    : in_stencil_(false),
+      in_stencil_target_(false),
+      stencil_index_depth_(0)
+{
+    // The cartesian runtime has no automatic differentiation, all collections are values.
+    fuse_values_ = false;
+}
+
+PrintCartesianBackendASTVisitor::~PrintCartesianBackendASTVisitor()
+{
+}
+
+void PrintCartesianBackendASTVisitor::visit(NumberNode& node)
+{
+    if (stencil_index_depth_ == 0) {
+        PrintCPUBackendASTVisitor::visit(node);
+        return;
+    }
+    // Stencil offsets are whole cells.
+    const double number = node.number();
+    if (number != std::floor(number)) {
+        std::ostringstream os;
+        os << "The stencil offset " << number << " is not an integer.";
+        throw std::runtime_error(os.str());
+    }
+    std::cout << int(number);
+}
+
+void PrintCartesianBackendASTVisitor::visit(BinaryOpNode& node)
+{
+    if (!in_stencil_ && node.type().isCollection()) {
+        unsupported("arithmetic on collections outside of stencil statements");
+    }
+    PrintCPUBackendASTVisitor::visit(node);
+}
+
+void PrintCartesianBackendASTVisitor::visit(NormNode& node)
+{
+    // Within a stencil statement the norm is of single values.
+    if (!in_stencil_ && node.type().isCollection()) {
+        unsupported("norms of collections and entities");
+    }
+    enterSubexpression();
+    std::cout << "std::fabs(";
+}
+
+void PrintCartesianBackendASTVisitor::visit(OnNode&)
+{
+    unsupported("On and Extend");
+}
+
+void PrintCartesianBackendASTVisitor::visit(TrinaryIfNode& node)
+{
+    if (!in_stencil_ && node.type().isCollection()) {
+        unsupported("the trinary if on collections outside of stencil statements");
+    }
+    enterSubexpression();
+    std::cout << "((";
+}
+
+void PrintCartesianBackendASTVisitor::questionMarkVisit(TrinaryIfNode&)
+{
+    std::cout << ") ? (";
+}
+
+void PrintCartesianBackendASTVisitor::colonVisit(TrinaryIfNode&)
+{
+    std::cout << ") : (";
+}
+
+void PrintCartesianBackendASTVisitor::postVisit(TrinaryIfNode& node)
+{
+    std::cout << "))";
+    leaveSubexpression(node.type());
+}
+
+void PrintCartesianBackendASTVisitor::visit(VarAssignNode& node)
+{
+    // The stencil statement declares its own result.
+    if (!isStencilAssignment(node)) {
+        PrintCPUBackendASTVisitor::visit(node);
+    }
+}
+
+void PrintCartesianBackendASTVisitor::postVisit(VarAssignNode& node)
+{
+    if (!isStencilAssignment(node)) {
+        PrintCPUBackendASTVisitor::postVisit(node);
+    }
+}
+
+void PrintCartesianBackendASTVisitor::visit(FuncCallNode& node)
+{
+    static const std::set<std::string> supported = {
+        "AllCells", "InputScalarWithDefault", "InputCollectionOfScalar", "InputSequenceOfScalar",
+        "Output", "MinReduce", "MaxReduce", "SumReduce", "ProdReduce",
+        "StencilI", "StencilJ", "StencilK"
+    };
+    const std::string& name = node.name();
+    if (in_stencil_ && name == "Sqrt") {
+        enterSubexpression();
+        std::cout << "std::sqrt(";
+        return;
+    }
+    if (std::isupper(name[0]) && supported.count(name) == 0) {
+        unsupported("the function " + name);
+    }
+    if (name == "InputCollectionOfScalar" && node.type().gridMapping() != AllCells) {
+        unsupported("input of collections on other sets than AllCells()");
+    }
+    PrintCPUBackendASTVisitor::visit(node);
+}
+
+void PrintCartesianBackendASTVisitor::visit(RandomAccessNode& node)
+{
+    if (!node.arrayAccess()) {
+        unsupported("Vector");
+    }
+    PrintCPUBackendASTVisitor::visit(node);
+}
+
+void PrintCartesianBackendASTVisitor::visit(StencilAccessNode&)
+{
+    if (!in_stencil_) {
+        throw std::runtime_error("Stencil accesses, as in u@i,j@, can only be used in stencil statements.");
+    }
+    std::cout << "grid.cellAt( ";
+    ++stencil_index_depth_;
+}
+
+void PrintCartesianBackendASTVisitor::postVisit(StencilAccessNode& node)
+{
+    --stencil_index_depth_;
+    std::cout << ", " << (in_stencil_target_ ? stencil_result_ : node.name()) << " )";
+}
+
+/// A stencil statement $ u@i,j@ = <expr> $ is emitted as a lambda executed for all cells
+/// of the grid. The result is written to a new collection, so the expression may read the
+/// old values of u if it is Mutable.
+void PrintCartesianBackendASTVisitor::visit(StencilStatementNode& node)
+{
+    static const BasicType index_types[] = { StencilI, StencilJ, StencilK };
+    const std::vector<Node*>& indices = node.target().expr_list->arguments();
+    if (indices.size() != 2 && indices.size() != 3) {
+        unsupported("stencils with other than 2 or 3 indices");
+    }
+    std::vector<std::string> index_names;
+    for (size_t d = 0; d < indices.size(); ++d) {
+        const VarNode* var = dynamic_cast<const VarNode*>(indices[d]);
+        if (var == nullptr || var->type().basicType() != index_types[d]) {
+            throw std::runtime_error("The left hand side of a stencil statement must be indexed by the stencil "
+                                     "variables, as in u@i,j@ with i = StencilI() and j = StencilJ().");
+        }
+        index_names.push_back(var->name());
+    }
+    std::ostringstream req;
+    req << "er.ensureGridDimension(" << indices.size() << ");\n";
+    addRequirementString(req.str());
+
+    const bool is_mutable = SymbolTable::variableType(node.name()).isMutable();
+    if (is_mutable) {
+        stencil_result_ = "StencilResult_" + node.name();
+        std::cout << indent() << "{";
+        endl();
+        ++indent_;
+    } else {
+        stencil_result_ = node.name();
+    }
+    std::cout << indent() << cppTypeString(node.type()) << " " << stencil_result_ << " = er.newCellCollection();";
+    endl();
+    std::cout << indent() << "er.allCells().execute( [&]( ";
+    for (size_t d = 0; d < index_names.size(); ++d) {
+        std::cout << (d > 0 ? ", " : "") << "int " << index_names[d];
+    }
+    std::cout << " ) {";
+    endl();
+    ++indent_;
+    std::cout << indent();
+
+    // Stencil expressions work on single values, not collections.
+    context_.push_back(NoFusion);
+    in_stencil_ = true;
+    in_stencil_target_ = true;
+}
+
+void PrintCartesianBackendASTVisitor::midVisit(StencilStatementNode&)
+{
+    in_stencil_target_ = false;
+    std::cout << " =";
+    endl();
+    ++indent_;
+    std::cout << indent();
+}
+
+void PrintCartesianBackendASTVisitor::postVisit(StencilStatementNode& node)
+{
+    in_stencil_ = false;
+    context_.pop_back();
+    indent_ -= 2;
+    std::cout << ';';
+    endl();
+    std::cout << indent() << "} );";
+    endl();
+    if (SymbolTable::variableType(node.name()).isMutable()) {
+        std::cout << indent() << node.name() << " = std::move( " << stencil_result_ << " );";
+        endl();
+        --indent_;
+        std::cout << indent() << "}";
+        endl();
+    }
+}
+
+const char* PrintCartesianBackendASTVisitor::cppStartString() const
+{
+    return ::impl_cppStartString();
+}
+
+const char* PrintCartesianBackendASTVisitor::cppEndString() const
+{
+    return ::impl_cppEndString();
+}
+
+const char* PrintCartesianBackendASTVisitor::runtimeTypeString() const
+{
+    return "equelle::EquelleRuntimeCartesian";
+}
+
+std::string PrintCartesianBackendASTVisitor::cppTypeString(const EquelleType& et) const
+{
+    if (et.isCollection()) {
+        if (!et.isArray() && et.basicType() == Scalar) {
+            return "CartesianCollectionOfScalar";
+        }
+        if (!et.isArray() && et.basicType() == Cell) {
+            return "CartesianGrid::CellRange";
+        }
+        unsupported("the type " + SymbolTable::equelleString(et));
+    }
+    return PrintCPUBackendASTVisitor::cppTypeString(et);
+}
+
+bool PrintCartesianBackendASTVisitor::isStencilAssignment(const VarAssignNode& node) const
+{
+    return dynamic_cast<const StencilStatementNode*>(node.expression()) != nullptr;
+}
+
+void PrintCartesianBackendASTVisitor::unsupported(const std::string& what) const
+{
+    throw std::runtime_error("The cartesian backend does not support " + what + ".");
+}
+
+
+namespace
+{
+    const char* impl_cppStartString()
+    {
+        return
+"\n"
+"// This program was created by the Equelle compiler from SINTEF.\n"
+"\n"
+"#include <opm/core/utility/parameters/ParameterGroup.hpp>\n"
+"#include <opm/core/utility/ErrorMacros.hpp>\n"
+"#include <algorithm>\n"
+"#include <iterator>\n"
+"#include <iostream>\n"
+"#include <cmath>\n"
+"#include <array>\n"
+"#include <utility>\n"
+"\n"
+"#include \"equelle/EquelleRuntimeCartesian.hpp\"\n"
+"\n"
+"void ensureRequirements(const equelle::EquelleRuntimeCartesian& er);\n"
+"void equelleGeneratedCode(equelle::EquelleRuntimeCartesian& er);\n"
+"\n"
+"#ifndef EQUELLE_NO_MAIN\n"
+"int main(int argc, char** argv)\n"
+"{\n"
+"    // Get user parameters.\n"
+"    Opm::parameter::ParameterGroup param(argc, argv, false);\n"
+"\n"
+"    // Create the Equelle runtime.\n"
+"    equelle::EquelleRuntimeCartesian er(param);\n"
+"    equelleGeneratedCode(er);\n"
+"    return 0;\n"
+"}\n"
+"#endif // EQUELLE_NO_MAIN\n"
+"\n"
+"void equelleGeneratedCode(equelle::EquelleRuntimeCartesian& er) {\n"
+"    using namespace equelle;\n"
+"    ensureRequirements(er);\n"
+"    // Used by the stencil statements.\n"
+"    const CartesianGrid& grid = er.grid();\n"
+"    (void)grid;\n"
+"\n"
+"    // ============= Generated code starts here ================\n";
+    }
+
+    const char* impl_cppEndString()
+    {
+        return "\n"
+"    // ============= Generated code ends here ================\n"
+"\n"
+"}\n";
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "PrintCPUBackendASTVisitor.hpp"
+
+/// Prints programs for equelle::EquelleRuntimeCartesian, which runs on a
+/// structured grid (experimental/cartesian). Collections Of Scalar are cell
+/// collections of the grid and are computed by stencil statements, as in
+///     $ u@i,j@ = u0@i,j@ + a*(u0@i+1,j@ - 2*u0@i,j@ + u0@i-1,j@) $
+/// which are executed directly on the grid. The unstructured operators,
+/// such as Gradient, On and Extend, are not supported.
+class PrintCartesianBackendASTVisitor : public PrintCPUBackendASTVisitor
+{
+public:
+    PrintCartesianBackendASTVisitor();
+    virtual ~PrintCartesianBackendASTVisitor();
+
+    using PrintCPUBackendASTVisitor::visit;
+    using PrintCPUBackendASTVisitor::midVisit;
+    using PrintCPUBackendASTVisitor::postVisit;
+
+    void visit(NumberNode& node);
+    void visit(BinaryOpNode& node);
+    void visit(NormNode& node);
+    void visit(OnNode& node);
+    void visit(TrinaryIfNode& node);
+    void questionMarkVisit(TrinaryIfNode& node);
+    void colonVisit(TrinaryIfNode& node);
+    void postVisit(TrinaryIfNode& node);
+    void visit(VarAssignNode& node);
+    void postVisit(VarAssignNode& node);
+    void visit(FuncCallNode& node);
+    void visit(RandomAccessNode& node);
+    void visit( StencilAccessNode& node );
+    void postVisit( StencilAccessNode& node );
+    void visit( StencilStatementNode& node );
+    void midVisit( StencilStatementNode& node );
+    void postVisit( StencilStatementNode& node );
+
+    const char* cppStartString() const;
+    const char* cppEndString() const;
+    const char* runtimeTypeString() const;
+
+protected:
+    std::string cppTypeString(const EquelleType& et) const;
+
+private:
+    bool isStencilAssignment(const VarAssignNode& node) const;
+    void unsupported(const std::string& what) const;
+
+    bool in_stencil_;
+    bool in_stencil_target_;
+    int stencil_index_depth_;
+    std::string stencil_result_;
+};
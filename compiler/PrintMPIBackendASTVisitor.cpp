@@ -1,4 +1,7 @@
 #include "PrintMPIBackendASTVisitor.hpp"
+#include "ASTNodes.hpp"
+#include "SymbolTable.hpp"
+#include <iostream>
 
 namespace
 {
@@ -73,6 +76,28 @@ PrintMPIBackendASTVisitor::~PrintMPIBackendASTVisitor()
 
 }
 
+void PrintMPIBackendASTVisitor::postVisit(FuncCallNode& node)
+{
+    // The reductions and Output need the domain of their collection argument, to
+    // use the entities owned by each node only. Sets without a name are left out,
+    // and the runtime then handles collections on all cells or all faces.
+    const std::string& fname = node.name();
+    int coll_arg = -1;
+    if (fname == "MinReduce" || fname == "MaxReduce" || fname == "SumReduce" || fname == "ProdReduce") {
+        coll_arg = 0;
+    } else if (fname == "Output") {
+        coll_arg = 1;
+    }
+    if (coll_arg >= 0) {
+        const EquelleType& type = node.argumentsNode().argumentTypes()[coll_arg];
+        if (type.isCollection() && type.basicType() == Scalar
+            && SymbolTable::entitySetName(type.gridMapping()) != "AnonymousEntitySet") {
+            std::cout << ", " << entitySetCppTerm(type.gridMapping());
+        }
+    }
+    PrintCPUBackendASTVisitor::postVisit(node);
+}
+
 const char *PrintMPIBackendASTVisitor::cppStartString() const
 {
     return ::impl_cppStartString();
@@ -8,6 +8,8 @@ public:
     PrintMPIBackendASTVisitor();
     virtual ~PrintMPIBackendASTVisitor();
 
+    void postVisit(FuncCallNode& node);
+
     const char* cppStartString() const;
     const char* cppEndString() const;
 };
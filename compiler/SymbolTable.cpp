@@ -240,6 +240,19 @@ bool Function::isVariableDeclared(const std::string& name) const
     }
 }
 
+const std::string& Function::variableScope(const std::string& name) const
+{
+    if (declared(name).first) {
+        return name_;
+    } else if (parent_scope_) {
+        return parent_scope_->variableScope(name);
+    } else {
+        std::string err_msg = "could not find variable ";
+        err_msg += name;
+        throw std::logic_error(err_msg);
+    }
+}
+
 bool Function::isVariableAssigned(const std::string& name) const
 {
     auto lit = local_variables_.find(Variable(name));
@@ -389,6 +402,11 @@ bool SymbolTable::isVariableDeclared(const std::string& name)
     return instance().current_function_->isVariableDeclared(name);
 }
 
+const std::string& SymbolTable::variableScope(const std::string& name)
+{
+    return instance().current_function_->variableScope(name);
+}
+
 bool SymbolTable::isVariableAssigned(const std::string& name)
 {
     return instance().current_function_->isVariableAssigned(name);
@@ -141,6 +141,10 @@ public:
 
     bool isVariableDeclared(const std::string& name) const;
 
+    /// Returns the name of the scope (this function or one of its
+    /// enclosing scopes) in which the variable is declared.
+    const std::string& variableScope(const std::string& name) const;
+
     bool isVariableAssigned(const std::string& name) const;
 
     void setVariableAssigned(const std::string& name, const bool assigned);
@@ -188,6 +192,8 @@ public:
 
     static bool isVariableDeclared(const std::string& name);
 
+    static const std::string& variableScope(const std::string& name);
+
     static bool isVariableAssigned(const std::string& name);
 
     static void setVariableAssigned(const std::string& name, const bool assigned);
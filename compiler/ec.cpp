@@ -12,6 +12,7 @@ extern int yyparse();
 #include "PrintMRSTBackendASTVisitor.hpp"
 #include "PrintCUDABackendASTVisitor.hpp"
 #include "PrintMPIBackendASTVisitor.hpp"
+#include "PrintCartesianBackendASTVisitor.hpp"
 #include "PrintIOVisitor.hpp"
 #include "ASTNodes.hpp"
 #include "CommandLineOptions.hpp"
@@ -92,7 +93,7 @@ int main(int argc, char** argv)
     }
 
     //Write output
-    else {
+    else try {
         std::string backend = cli_vars["backend"].as<std::string>();
         if (backend == "ast") {
             PrintASTVisitor v;
@@ -117,10 +118,18 @@ int main(int argc, char** argv)
             PrintMPIBackendASTVisitor v;
             SymbolTable::program()->accept(v);
         }
+        else if (backend == "cartesian") {
+            PrintCartesianBackendASTVisitor v;
+            SymbolTable::program()->accept(v);
+        }
         else {
             std::cerr << "Unknown back-end choice: " << backend << '\n';
         }
     }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return -1;
+    }
 
     return 0;
 }
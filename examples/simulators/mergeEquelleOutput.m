@@ -0,0 +1,25 @@
+function data = mergeEquelleOutput(tag, count)
+% Merge the per-rank text output of the MPI backend into one field.
+%
+% With output_to_file=true (and output_format=text) rank r writes
+% <tag>-<count>.<r>.output with the values of the cells (or faces) it
+% owns, and <tag>.<r>.index with their global indices, zero-based.
+%
+% Usage:
+%   H = mergeEquelleOutput('q1', 3);   % the same as loading q1-00003.output
+
+data = [];
+r = 0;
+while true
+    indexfile = sprintf('%s.%d.index', tag, r);
+    if ~exist(indexfile, 'file')
+        break;
+    end
+    index = load(indexfile);
+    values = load(sprintf('%s-%05d.%d.output', tag, count, r));
+    data(index + 1, 1) = values; %#ok<AGROW>
+    r = r + 1;
+end
+if r == 0
+    error('No output found for %s', tag);
+end
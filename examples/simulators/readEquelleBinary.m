@@ -0,0 +1,84 @@
+function data = readEquelleBinary(filename)
+% Read an Equelle binary file, as written with output_format=binary.
+%
+% Returns a matrix with one column per record (output step) if all
+% records have the same size, otherwise a cell array of columns.
+%
+% Usage:
+%   H = readEquelleBinary('q1.eqbin');   % replaces loading q1-00000.output ...
+%
+% The file is a 16 byte header ('EQUELLEB', version and value type as
+% uint32) followed by records of a uint64 count and the values, padded
+% to a multiple of 8 bytes. Version 2 files end with an index: the
+% record offsets and their number as uint64, then 'EQBINDEX'.
+% Everything is little-endian.
+
+fid = fopen(filename, 'r', 'ieee-le');
+if fid < 0
+    error('Could not open %s', filename);
+end
+magic = fread(fid, 8, '*char')';
+if ~strcmp(magic, 'EQUELLEB')
+    fclose(fid);
+    error('%s is not an Equelle binary file', filename);
+end
+header = fread(fid, 2, 'uint32');
+switch header(2)
+    case 1
+        type = 'double';
+        bytes = 8;
+    case 2
+        type = 'int32';
+        bytes = 4;
+    otherwise
+        fclose(fid);
+        error('Unknown value type %d in %s', header(2), filename);
+end
+
+counts = [];
+offsets = [];
+if header(1) >= 2
+    % Read the index at the end, then the count of each record.
+    fseek(fid, -16, 'eof');
+    num = fread(fid, 1, 'uint64');
+    if ~strcmp(fread(fid, 8, '*char')', 'EQBINDEX')
+        fclose(fid);
+        error('%s has no record index', filename);
+    end
+    fseek(fid, -16 - 8*num, 'eof');
+    starts = fread(fid, num, 'uint64');
+    for i = 1:num
+        fseek(fid, starts(i), 'bof');
+        counts(i) = fread(fid, 1, 'uint64'); %#ok<AGROW>
+        offsets(i) = starts(i) + 8; %#ok<AGROW>
+    end
+else
+    % Find the records by hopping over them.
+    while true
+        count = fread(fid, 1, 'uint64');
+        if isempty(count)
+            break;
+        end
+        counts(end+1) = count; %#ok<AGROW>
+        offsets(end+1) = ftell(fid); %#ok<AGROW>
+        fseek(fid, ceil(count*bytes/8)*8, 'cof');
+    end
+end
+
+if ~isempty(counts) && all(counts == counts(1)) && strcmp(type, 'double')
+    % Equal records: map the file and view it as a matrix, skipping
+    % the count in front of each column. The records follow each other
+    % from the header on, the index after them is not mapped.
+    fclose(fid);
+    n = counts(1);
+    m = memmapfile(filename, 'Offset', 16, ...
+                   'Format', {'double', [n + 1, numel(counts)], 'x'});
+    data = m.Data.x(2:end, :);
+else
+    data = cell(1, numel(counts));
+    for i = 1:numel(counts)
+        fseek(fid, offsets(i), 'bof');
+        data{i} = fread(fid, counts(i), ['*' type]);
+    end
+    fclose(fid);
+end
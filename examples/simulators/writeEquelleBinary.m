@@ -0,0 +1,31 @@
+function writeEquelleBinary(filename, values)
+% Write an Equelle binary input file with a single record.
+%
+% Double values give a file for InputCollectionOfScalar and
+% InputSequenceOfScalar, int32 values (zero-based indices) a file for
+% InputDomainSubsetOf. Use a file name ending in .eqbin, or set the
+% <name>_format=binary parameter. See readEquelleBinary for the format.
+
+if isa(values, 'int32')
+    type = 2;
+    bytes = 4;
+else
+    values = double(values);
+    type = 1;
+    bytes = 8;
+end
+values = values(:);
+fid = fopen(filename, 'w', 'ieee-le');
+if fid < 0
+    error('Could not open %s', filename);
+end
+fwrite(fid, 'EQUELLEB', 'char');
+fwrite(fid, [2; type], 'uint32');
+fwrite(fid, numel(values), 'uint64');
+fwrite(fid, values, class(values));
+padding = ceil(numel(values)*bytes/8)*8 - numel(values)*bytes;
+fwrite(fid, zeros(padding, 1), 'uint8');
+% The index: the offset of the record and the number of records.
+fwrite(fid, [16; 1], 'uint64');
+fwrite(fid, 'EQBINDEX', 'char');
+fclose(fid);
@@ -5,10 +5,14 @@
 #include <tuple>
 #include <unordered_map>
 #include <map>
-#include <functional>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
 
 #include <opm/core/utility/parameters/ParameterGroup.hpp>
 
+#include "equelle/equelleTypes.hpp"
+
 namespace equelle {
 
 enum Dimension {
@@ -20,6 +24,11 @@ enum Dimension {
 
 /**
  * @brief The CartesianGrid class models Opm::UnstructuredGrid in spirit, but is tailored for cartesian dense grids.
+ *
+ * The grid is 2D or 3D. Collections are stored with the x-index running fastest, then y, then z,
+ * so the cells (and the faces) of a row are contiguous and a stencil over a row has unit stride.
+ * A 2D grid is stored as a 3D grid with one layer of cells in z and no ghost cells in z, so
+ * cartdims[2] is 1, and k is 0 where the 3D methods are used.
  */
 class CartesianGrid {
 public:
@@ -36,7 +45,7 @@ public:
         negX, posX, negY, posY, negZ, posZ
     };
 
-    typedef std::array<int, 2> strideArray;
+    typedef std::array<int, 3> strideArray;
     typedef std::vector<double> CartesianCollectionOfScalar;
 
     CartesianGrid();
@@ -44,10 +53,13 @@ public:
     /**
      * @brief CartesianGrid constructor for a parameter object.
      * @param param Is a parameter object where the following keys are used for grid initialization.
-     *              - grid_dim Dimension of grid. (default 2)
+     *              - grid_dim Dimension of grid, 2 or 3. (default 2)
      *              - nx Number of interior cells in x-direction. (default 3)
      *              - ny Number of interior cells in y-direction. (default 2)
+     *              - nz Number of interior cells in z-direction, for 3D grids. (default 1)
      *              - ghost_width width of ghost boundary. (default 1)
+     *              - cache_size Bytes of cache per thread that tiles are sized for, typically the
+     *                L2 cache. (default 262144)
      *              In addition how to read initial and boundary conditions can be specified.
      */
     CartesianGrid( const Opm::parameter::ParameterGroup& param );
@@ -59,18 +71,27 @@ public:
      */
     explicit CartesianGrid(std::tuple<int, int> dims, int ghostWidth );
 
+    /**
+     * @brief CartesianGrid constructor for 3D-grids.
+     * @param dims number of cells in x, y and z dimension.
+     * @param ghostWidth width of ghost boundary. Assumed to be uniform in all directions.
+     */
+    explicit CartesianGrid(std::tuple<int, int, int> dims, int ghostWidth );
+
     ~CartesianGrid();
 
-    std::array<int, 2> cartdims{{-1,-1}}; //!< Number of interior cells in each dimension.
-    strideArray cellStrides;
+    std::array<int, 3> cartdims{{-1,-1,-1}}; //!< Number of interior cells in each dimension, 1 in z for 2D grids.
+    strideArray cellStrides;                 //!< Distance between neighbouring cells in x, y and z. cellStrides[0] is 1.
 
-    std::array<strideArray, 2>       faceStrides;
-    std::array<int, 2 >              number_of_faces_with_ghost_cells;
+    std::array<strideArray, 3>       faceStrides; //!< Distance between neighbouring faces normal to each dimension.
+    std::array<int, 3 >              number_of_faces_with_ghost_cells; //!< Number of faces along each dimension, ghosts included.
 
     int dimensions;            //!< Number of spatial dimensions.
     int number_of_cells;       //!< Number of interior cells in the grid.
     int ghost_width;           //!< Width of ghost cell boundary. Assumed to be the same for all directions and on every side of the domain.
     int number_of_cells_and_ghost_cells; //!< Total number of cells and ghost cells in grid.
+    int number_of_faces_and_ghost_faces; //!< Total number of faces and ghost faces in grid, the size of a face collection.
+    int cache_size;            //!< Bytes of cache per thread that tiles are sized for.
 
     CartesianCollectionOfScalar inputCellCollectionOfScalar( std::string name );
     CartesianCollectionOfScalar inputFaceCollectionOfScalar( std::string name );
@@ -88,6 +109,10 @@ public:
     double& cellAt( int i, int j, CartesianCollectionOfScalar& coll ) const;
     const double& cellAt( int i, int j, const CartesianCollectionOfScalar& coll ) const ;
 
+    /// cellAt for 3D grids, returning cell (i,j,k).
+    double& cellAt( int i, int j, int k, CartesianCollectionOfScalar& coll ) const;
+    const double& cellAt( int i, int j, int k, const CartesianCollectionOfScalar& coll ) const;
+
     /**
      * @brief faceAt Return a reference to an element of a face adjacent to cell (i,j).
      *
@@ -101,8 +126,37 @@ public:
     double& faceAt( int i, int j, Face face, CartesianCollectionOfScalar& coll ) const;
     const double& faceAt( int i, int j, Face face, const CartesianCollectionOfScalar& coll ) const;
 
+    /// faceAt for 3D grids, for a face of cell (i,j,k). Face::negZ and Face::posZ are only valid on 3D grids.
+    double& faceAt( int i, int j, int k, Face face, CartesianCollectionOfScalar& coll ) const;
+    const double& faceAt( int i, int j, int k, Face face, const CartesianCollectionOfScalar& coll ) const;
+
     /**
-     * @brief dumpGrid a grid to a stream or file.
+     * @brief cellRow Return a pointer to cell (0,j), so that cellRow( j, coll )[i] is cellAt( i, j, coll ).
+     *
+     * The cells of a row are contiguous, and the rows are cellStrides[1] apart, so the neighbours in
+     * y of element i are at [i - cellStrides[1]] and [i + cellStrides[1]]. A loop over i then has
+     * unit stride and can be vectorized.
+     */
+    double* cellRow( int j, CartesianCollectionOfScalar& coll ) const;
+    const double* cellRow( int j, const CartesianCollectionOfScalar& coll ) const;
+
+    /// cellRow for 3D grids, pointing to cell (0,j,k). The neighbours in z are cellStrides[2] apart.
+    double* cellRow( int j, int k, CartesianCollectionOfScalar& coll ) const;
+    const double* cellRow( int j, int k, const CartesianCollectionOfScalar& coll ) const;
+
+    /**
+     * @brief faceRow Return a pointer to the given face of cell (0,j), so that faceRow( j, face, coll )[i]
+     *        is faceAt( i, j, face, coll ). The faces of a row are contiguous, as for cellRow.
+     */
+    double* faceRow( int j, Face face, CartesianCollectionOfScalar& coll ) const;
+    const double* faceRow( int j, Face face, const CartesianCollectionOfScalar& coll ) const;
+
+    /// faceRow for 3D grids, pointing to the given face of cell (0,j,k).
+    double* faceRow( int j, int k, Face face, CartesianCollectionOfScalar& coll ) const;
+    const double* faceRow( int j, int k, Face face, const CartesianCollectionOfScalar& coll ) const;
+
+    /**
+     * @brief dumpGrid a grid to a stream or file. The layers of 3D grids are separated by an empty line.
      * @param grid
      * @param stream
      */
@@ -115,11 +169,68 @@ public:
     CellRange allCells();
     FaceRange allXFaces();
     FaceRange allYFaces();
+    FaceRange allZFaces(); //!< Only for 3D grids.
+
+    /**
+     * @brief tileWidth The width of column tiles for CellRange::executeTiles, such that
+     *        rows_in_working_set rows of a tile fit in half of cache_size.
+     * @param rows_in_working_set The rows of all collections a stencil reads and writes
+     *        while sweeping a tile, 4 for the 5-point stencil (3 input rows, 1 output row).
+     */
+    int tileWidth( int rows_in_working_set ) const;
+
+    /**
+     * @brief executeTimeSteps Advance NumFields cell collections by several explicit time steps,
+     *        blocking in time so that each tile is read from memory once per block_steps
+     *        steps rather than once per step.
+     *
+     * A step computes the new values of the cells in range from the old ones by calling
+     * stencil( in, out, stride, j, i_begin, i_end ) for pieces of row j, where in[f] and out[f]
+     * point to cell (i_begin, j) of field f, so in[f][n] is cell (i_begin + n, j), and its
+     * neighbours in y are at in[f][n +- stride]. The stencil reads at most radius cells away,
+     * and the values outside the range (such as the ghost cells) are kept.
+     *
+     * The range is split into square tiles that are distributed over the threads. Each tile is
+     * copied to thread-local buffers together with the radius*block_steps cells around it,
+     * which are recomputed redundantly, and advanced block_steps steps there (overlapped
+     * tiling). The tiles are sized so that the buffers fit in cache_size. Only for 2D grids.
+     */
+    template <int NumFields, class TimeStepStencil>
+    void executeTimeSteps( const CellRange& range, const TimeStepStencil& stencil,
+                           const std::array<CartesianCollectionOfScalar*, NumFields>& fields,
+                           int steps, int radius, int block_steps ) const;
 
 private:
     const Opm::parameter::ParameterGroup param_;
-    void init2D( std::tuple<int, int> dims, int ghostWidth );
+    void init( std::array<int, 3> dims, int dimensions, int ghostWidth );
+    int faceIndex( int i, int j, int k, Face face ) const;
     int cellOrigin;
+    std::array<int, 3> faceOrigin; //!< Index of face (0,0,0) of each dimension.
+
+    /// Call stencil(i, j, k), or stencil(i, j) if it takes two indices.
+    template <class Stencil>
+    static auto callStencil( const Stencil& stencil, int i, int j, int k, int ) -> decltype( stencil( i, j, k ), void() )
+    {
+        stencil( i, j, k );
+    }
+    template <class Stencil>
+    static void callStencil( const Stencil& stencil, int i, int j, int, long )
+    {
+        stencil( i, j );
+    }
+
+    /// Call stencil(j, k, i_begin, i_end), or stencil(j, i_begin, i_end) if it takes three arguments.
+    template <class RowStencil>
+    static auto callRowStencil( const RowStencil& stencil, int j, int k, int i_begin, int i_end, int )
+        -> decltype( stencil( j, k, i_begin, i_end ), void() )
+    {
+        stencil( j, k, i_begin, i_end );
+    }
+    template <class RowStencil>
+    static void callRowStencil( const RowStencil& stencil, int j, int, int i_begin, int i_end, long )
+    {
+        stencil( j, i_begin, i_end );
+    }
 };
 
 
@@ -131,28 +242,82 @@ private:
  */
 class CartesianGrid::CellRange {
 public:
-    CellRange(int i0, int i1, int j0, int j1)
-        : i_begin(i0), i_end(i1), j_begin(j0), j_end(j1)
+    CellRange(int i0, int i1, int j0, int j1, int k0 = 0, int k1 = 1)
+        : i_begin(i0), i_end(i1), j_begin(j0), j_end(j1), k_begin(k0), k_end(k1)
+    {
+
+    }
+
+    /**
+     * Call stencil(i, j, k) for every cell, or stencil(i, j) if the stencil takes two indices
+     * (on 2D grids). The stencil is a template parameter, so that it is inlined into the loop
+     * rather than called through a function object.
+     * The rows are distributed over the threads, so the stencil may only write to its own cell.
+     */
+    template <class Stencil>
+    void execute(const Stencil& stencil)
     {
+#pragma omp parallel for collapse(2) schedule(static) if (size() > min_parallel_size)
+        for (int k=k_begin; k < k_end; ++k) {
+            for (int j=j_begin; j < j_end; ++j) {
+                for (int i=i_begin; i < i_end; ++i) {
+                    CartesianGrid::callStencil(stencil, i, j, k, 0);
+                }
+            }
+        }
+    }
 
+    /**
+     * Call stencil(j, k, i_begin, i_end), or stencil(j, i_begin, i_end), once for every row,
+     * leaving the loop over i to the stencil. Together with CartesianGrid::cellRow this gives
+     * a unit-stride inner loop. The rows are distributed over the threads.
+     */
+    template <class RowStencil>
+    void executeRows(const RowStencil& stencil)
+    {
+#pragma omp parallel for collapse(2) schedule(static) if (size() > min_parallel_size)
+        for (int k=k_begin; k < k_end; ++k) {
+            for (int j=j_begin; j < j_end; ++j) {
+                CartesianGrid::callRowStencil(stencil, j, k, i_begin, i_end, 0);
+            }
+        }
     }
 
-    void execute(std::function<void(int, int)> stencil)
+    /**
+     * Call stencil(j, k, i0, i1), or stencil(j, i0, i1), for tiles of at most tile_width columns
+     * [i0, i1), sweeping each tile from the first row to the last. The rows a stencil reads
+     * around row j then stay in cache from one row to the next also when whole rows do not fit,
+     * see CartesianGrid::tileWidth. The tiles (and layers in z) are distributed over the threads.
+     */
+    template <class RowStencil>
+    void executeTiles(const RowStencil& stencil, const int tile_width)
     {
-//#pragma omp parallel for here for parallelism
-        for (int j=j_begin; j < j_end; ++j) {
-            for (int i=i_begin; i < i_end; ++i) {
-                stencil(i, j);
+        const int num_tiles = (i_end - i_begin + tile_width - 1) / tile_width;
+#pragma omp parallel for collapse(2) schedule(static) if (size() > min_parallel_size)
+        for (int k=k_begin; k < k_end; ++k) {
+            for (int t = 0; t < num_tiles; ++t) {
+                const int i0 = i_begin + t*tile_width;
+                const int i1 = std::min(i0 + tile_width, i_end);
+                for (int j=j_begin; j < j_end; ++j) {
+                    CartesianGrid::callRowStencil(stencil, j, k, i0, i1, 0);
+                }
             }
         }
     }
 
+    int size() const { return (i_end - i_begin) * (j_end - j_begin) * (k_end - k_begin); }
+
 private:
+    friend class CartesianGrid;
+
     int i_begin;
     int i_end;
 
     int j_begin;
     int j_end;
+
+    int k_begin;
+    int k_end;
 };
 
 /**
@@ -160,30 +325,250 @@ private:
  */
 class CartesianGrid::FaceRange {
 public:
-    FaceRange(int i0, int i1, int j0, int j1)
-        : i_begin(i0), i_end(i1), j_begin(j0), j_end(j1)
+    FaceRange(int i0, int i1, int j0, int j1, int k0 = 0, int k1 = 1)
+        : i_begin(i0), i_end(i1), j_begin(j0), j_end(j1), k_begin(k0), k_end(k1)
     {
 
     }
 
-    void execute(std::function<void(int, int)> stencil)
+    /**
+     * Call stencil(i, j, k) for every face, or stencil(i, j) if the stencil takes two indices
+     * (on 2D grids). The stencil is a template parameter, so that it is inlined into the loop
+     * rather than called through a function object.
+     * The rows are distributed over the threads, so the stencil may only write to its own face.
+     */
+    template <class Stencil>
+    void execute(const Stencil& stencil)
     {
-//#pragma omp parallel for here for parallelism
-        for (int j=j_begin; j < j_end; ++j) {
-            for (int i=i_begin; i < i_end; ++i) {
-                stencil(i, j);
+#pragma omp parallel for collapse(2) schedule(static) if (size() > min_parallel_size)
+        for (int k=k_begin; k < k_end; ++k) {
+            for (int j=j_begin; j < j_end; ++j) {
+                for (int i=i_begin; i < i_end; ++i) {
+                    CartesianGrid::callStencil(stencil, i, j, k, 0);
+                }
             }
         }
     }
 
+    /**
+     * Call stencil(j, k, i_begin, i_end), or stencil(j, i_begin, i_end), once for every row,
+     * leaving the loop over i to the stencil. Together with CartesianGrid::faceRow this gives
+     * a unit-stride inner loop. The rows are distributed over the threads.
+     */
+    template <class RowStencil>
+    void executeRows(const RowStencil& stencil)
+    {
+#pragma omp parallel for collapse(2) schedule(static) if (size() > min_parallel_size)
+        for (int k=k_begin; k < k_end; ++k) {
+            for (int j=j_begin; j < j_end; ++j) {
+                CartesianGrid::callRowStencil(stencil, j, k, i_begin, i_end, 0);
+            }
+        }
+    }
+
+    int size() const { return (i_end - i_begin) * (j_end - j_begin) * (k_end - k_begin); }
+
 private:
     int i_begin;
     int i_end;
 
     int j_begin;
     int j_end;
+
+    int k_begin;
+    int k_end;
 };
 
 
 
+inline double& CartesianGrid::cellAt( const int i, const int j, const int k, CartesianCollectionOfScalar& coll ) const
+{
+    // The x-stride is always 1.
+    return coll[ cellOrigin + k*cellStrides[2] + j*cellStrides[1] + i ];
+}
+
+inline const double& CartesianGrid::cellAt( const int i, const int j, const int k, const CartesianCollectionOfScalar& coll ) const
+{
+    return coll[ cellOrigin + k*cellStrides[2] + j*cellStrides[1] + i ];
+}
+
+inline double& CartesianGrid::cellAt( const int i, const int j, CartesianCollectionOfScalar& coll ) const
+{
+    return coll[ cellOrigin + j*cellStrides[1] + i ];
+}
+
+inline const double& CartesianGrid::cellAt( const int i, const int j, const CartesianCollectionOfScalar& coll ) const
+{
+    return coll[ cellOrigin + j*cellStrides[1] + i ];
+}
+
+inline int CartesianGrid::faceIndex( const int i, const int j, const int k, const Face face ) const
+{
+    // When face is known at the call site, the switch is resolved by the compiler.
+    switch (face) {
+    case Face::negX:
+        return faceOrigin[Dimension::x] + k*faceStrides[Dimension::x][2] + j*faceStrides[Dimension::x][1] + i;
+    case Face::posX:
+        return faceOrigin[Dimension::x] + k*faceStrides[Dimension::x][2] + j*faceStrides[Dimension::x][1] + i + 1;
+    case Face::negY:
+        return faceOrigin[Dimension::y] + k*faceStrides[Dimension::y][2] + j*faceStrides[Dimension::y][1] + i;
+    case Face::posY:
+        return faceOrigin[Dimension::y] + k*faceStrides[Dimension::y][2] + (j+1)*faceStrides[Dimension::y][1] + i;
+    case Face::negZ:
+    case Face::posZ:
+        if ( dimensions < 3 ) {
+            throw std::runtime_error("2D-cartesian grids have no faces in z-direction.");
+        }
+        return faceOrigin[Dimension::z] + (face == Face::posZ ? k+1 : k)*faceStrides[Dimension::z][2]
+                + j*faceStrides[Dimension::z][1] + i;
+    default:
+        throw std::runtime_error("Unknown face position");
+    }
+}
+
+inline double& CartesianGrid::faceAt( const int i, const int j, const Face face, CartesianCollectionOfScalar& coll ) const
+{
+    return coll[ faceIndex( i, j, 0, face ) ];
+}
+
+inline const double& CartesianGrid::faceAt( const int i, const int j, const Face face, const CartesianCollectionOfScalar& coll ) const
+{
+    return coll[ faceIndex( i, j, 0, face ) ];
+}
+
+inline double& CartesianGrid::faceAt( const int i, const int j, const int k, const Face face, CartesianCollectionOfScalar& coll ) const
+{
+    return coll[ faceIndex( i, j, k, face ) ];
+}
+
+inline const double& CartesianGrid::faceAt( const int i, const int j, const int k, const Face face, const CartesianCollectionOfScalar& coll ) const
+{
+    return coll[ faceIndex( i, j, k, face ) ];
+}
+
+inline double* CartesianGrid::cellRow( const int j, CartesianCollectionOfScalar& coll ) const
+{
+    return coll.data() + cellOrigin + j*cellStrides[1];
+}
+
+inline const double* CartesianGrid::cellRow( const int j, const CartesianCollectionOfScalar& coll ) const
+{
+    return coll.data() + cellOrigin + j*cellStrides[1];
+}
+
+inline double* CartesianGrid::cellRow( const int j, const int k, CartesianCollectionOfScalar& coll ) const
+{
+    return coll.data() + cellOrigin + k*cellStrides[2] + j*cellStrides[1];
+}
+
+inline const double* CartesianGrid::cellRow( const int j, const int k, const CartesianCollectionOfScalar& coll ) const
+{
+    return coll.data() + cellOrigin + k*cellStrides[2] + j*cellStrides[1];
+}
+
+inline double* CartesianGrid::faceRow( const int j, const Face face, CartesianCollectionOfScalar& coll ) const
+{
+    return coll.data() + faceIndex( 0, j, 0, face );
+}
+
+inline const double* CartesianGrid::faceRow( const int j, const Face face, const CartesianCollectionOfScalar& coll ) const
+{
+    return coll.data() + faceIndex( 0, j, 0, face );
+}
+
+inline double* CartesianGrid::faceRow( const int j, const int k, const Face face, CartesianCollectionOfScalar& coll ) const
+{
+    return coll.data() + faceIndex( 0, j, k, face );
+}
+
+inline const double* CartesianGrid::faceRow( const int j, const int k, const Face face, const CartesianCollectionOfScalar& coll ) const
+{
+    return coll.data() + faceIndex( 0, j, k, face );
+}
+
+
+template <int NumFields, class TimeStepStencil>
+void CartesianGrid::executeTimeSteps( const CellRange& range, const TimeStepStencil& stencil,
+                                      const std::array<CartesianCollectionOfScalar*, NumFields>& fields,
+                                      const int steps, const int radius, const int block_steps ) const
+{
+    if ( dimensions != 2 ) {
+        throw std::runtime_error( "executeTimeSteps is only implemented for 2D-cartesian grids." );
+    }
+    if ( radius > ghost_width || block_steps < 1 ) {
+        throw std::runtime_error( "executeTimeSteps: the radius must be at most the ghost width, "
+                                  "and block_steps at least 1." );
+    }
+    const int halo = radius * block_steps;
+    // Two buffers per field of (tile + 2*halo)^2 values should fit in the cache, but the
+    // halo should not dominate the tile.
+    const int side = int( std::sqrt( double( cache_size ) / ( 2 * NumFields * sizeof(double) ) ) );
+    const int tile = std::max( side - 2*halo, std::max( 2*halo, 8 ) );
+    const int tiles_i = ( range.i_end - range.i_begin + tile - 1 ) / tile;
+    const int tiles_j = ( range.j_end - range.j_begin + tile - 1 ) / tile;
+
+    // The results go to separate collections, since the tiles read the old values around them.
+    std::array<CartesianCollectionOfScalar, NumFields> next;
+    for ( int f = 0; f < NumFields; ++f ) {
+        next[f] = *fields[f];
+    }
+
+    for ( int done = 0; done < steps; done += block_steps ) {
+        const int k = std::min( block_steps, steps - done );
+#pragma omp parallel if (range.size() > min_parallel_size)
+        {
+            std::array<CartesianCollectionOfScalar, NumFields> a, b;
+            std::array<const double*, NumFields> in;
+            std::array<double*, NumFields> out;
+#pragma omp for schedule(dynamic)
+            for ( int t = 0; t < tiles_i*tiles_j; ++t ) {
+                const int i0 = range.i_begin + ( t % tiles_i )*tile;
+                const int i1 = std::min( i0 + tile, range.i_end );
+                const int j0 = range.j_begin + ( t / tiles_i )*tile;
+                const int j1 = std::min( j0 + tile, range.j_end );
+                // The buffers hold the cells [c0, c1) x [r0, r1), rows of width c1 - c0.
+                const int c0 = std::max( -ghost_width, i0 - k*radius );
+                const int c1 = std::min( cartdims[0] + ghost_width, i1 + k*radius );
+                const int r0 = std::max( -ghost_width, j0 - k*radius );
+                const int r1 = std::min( cartdims[1] + ghost_width, j1 + k*radius );
+                const int width = c1 - c0;
+                for ( int f = 0; f < NumFields; ++f ) {
+                    a[f].resize( width * (r1 - r0) );
+                    for ( int j = r0; j < r1; ++j ) {
+                        const double* src = cellRow( j, *fields[f] );
+                        std::copy( src + c0, src + c1, a[f].data() + (j - r0)*width );
+                    }
+                    b[f] = a[f];
+                }
+                for ( int s = 1; s <= k; ++s ) {
+                    // Each step is valid on radius fewer cells on each side, and the cells
+                    // outside the range are kept.
+                    const int shrink = (k - s)*radius;
+                    const int si0 = std::max( range.i_begin, i0 - shrink );
+                    const int si1 = std::min( range.i_end, i1 + shrink );
+                    const int sj0 = std::max( range.j_begin, j0 - shrink );
+                    const int sj1 = std::min( range.j_end, j1 + shrink );
+                    for ( int j = sj0; j < sj1; ++j ) {
+                        for ( int f = 0; f < NumFields; ++f ) {
+                            in[f] = a[f].data() + (j - r0)*width + (si0 - c0);
+                            out[f] = b[f].data() + (j - r0)*width + (si0 - c0);
+                        }
+                        stencil( in, out, width, j, si0, si1 );
+                    }
+                    std::swap( a, b );
+                }
+                for ( int f = 0; f < NumFields; ++f ) {
+                    for ( int j = j0; j < j1; ++j ) {
+                        const double* src = a[f].data() + (j - r0)*width + (i0 - c0);
+                        std::copy( src, src + (i1 - i0), cellRow( j, next[f] ) + i0 );
+                    }
+                }
+            }
+        }
+        for ( int f = 0; f < NumFields; ++f ) {
+            std::swap( *fields[f], next[f] );
+        }
+    }
+}
+
 } // namespace equelle
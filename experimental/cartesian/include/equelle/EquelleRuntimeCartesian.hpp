@@ -0,0 +1,71 @@
+#pragma once
+
+#include <map>
+#include <string>
+
+#include <opm/core/utility/parameters/ParameterGroup.hpp>
+
+#include "equelle/equelleTypes.hpp"
+#include "equelle/CartesianGrid.hpp"
+
+namespace equelle {
+
+typedef CartesianGrid::CartesianCollectionOfScalar CartesianCollectionOfScalar;
+
+/**
+ * @brief The EquelleRuntimeCartesian class is the runtime of programs compiled with the cartesian
+ *        backend of the compiler (ec --backend=cartesian).
+ *
+ * It owns a CartesianGrid, and provides the inputs, outputs and reductions of the generated code.
+ * Stencil statements are executed directly on the grid, so no sparse operator matrices are built.
+ * Collections are cell collections of the grid, ghost cells included. The ghost cells of inputs and
+ * of stencil results are zero, which is a homogeneous Dirichlet boundary for the stencils.
+ */
+class EquelleRuntimeCartesian {
+public:
+    /**
+     * @brief EquelleRuntimeCartesian constructor.
+     * @param param The grid is created from param, see CartesianGrid. In addition
+     *              - output_to_file Write collections to files instead of to standard output. (default false)
+     *              - output_format "text" or "binary", see BinaryIO.hpp. (default text)
+     */
+    EquelleRuntimeCartesian( const Opm::parameter::ParameterGroup& param );
+
+    const CartesianGrid& grid() const { return grid_; }
+
+    /// All interior cells, the range that stencil statements are executed over.
+    CartesianGrid::CellRange allCells();
+
+    /// A cell collection, all zero, that stencil statements write their result to.
+    CartesianCollectionOfScalar newCellCollection() const;
+
+    /// Reductions over the interior cells of a collection.
+    Scalar minReduce( const CartesianCollectionOfScalar& x ) const;
+    Scalar maxReduce( const CartesianCollectionOfScalar& x ) const;
+    Scalar sumReduce( const CartesianCollectionOfScalar& x ) const;
+    Scalar prodReduce( const CartesianCollectionOfScalar& x ) const;
+
+    /// Output of the interior cells, with the x-index running fastest, as for input.
+    void output( const String& tag, Scalar val ) const;
+    void output( const String& tag, const CartesianCollectionOfScalar& vals );
+
+    Scalar inputScalarWithDefault( const String& name, const Scalar default_value );
+    CartesianCollectionOfScalar inputCollectionOfScalar( const String& name, const CartesianGrid::CellRange& cells );
+    SeqOfScalar inputSequenceOfScalar( const String& name );
+
+    /// Throws unless the grid has the given number of dimensions, the number of indices of the stencils.
+    void ensureGridDimension( const int dimensions ) const;
+
+private:
+    /// Applies op to the interior cells of x, row by row.
+    template <class Op>
+    Scalar reduce( const CartesianCollectionOfScalar& x, Scalar init, const Op& op ) const;
+
+    const Opm::parameter::ParameterGroup param_;
+    CartesianGrid grid_;
+    bool output_to_file_;
+    bool binary_output_;
+    std::map<std::string, int> outputcount_;
+};
+
+} // namespace equelle
@@ -12,55 +12,171 @@
 
 #include "equelle/CartesianGrid.hpp"
 #include "equelle/equelleTypes.hpp"
+#include "equelle/BinaryIO.hpp"
+
+namespace {
+
+    /// Copies input values into a cell collection. The values are for
+    /// the interior cells, x-index running fastest, then y, then z. Used
+    /// both for text input (istream iterators) and mapped binary input (pointers).
+    template <class Iterator>
+    void copyCellValues( const equelle::CartesianGrid& grid, Iterator beg, Iterator end,
+                         const std::string& name, const std::string& filename,
+                         equelle::CartesianGrid::CartesianCollectionOfScalar& v )
+    {
+        for( int k = 0; k < grid.cartdims[2]; ++k ) {
+            for( int j = 0; j < grid.cartdims[1]; ++j ) {
+                for( int i = 0; i < grid.cartdims[0]; ++i ) {
+                    if ( beg == end ) {
+                        OPM_THROW(std::runtime_error, "Unexpected size of input data for " << name << " in file " << filename);
+                    }
+                    grid.cellAt( i, j, k, v ) = *beg;
+                    ++beg;
+                }
+            }
+        }
+    }
+
+    /// Copies input values into a face collection: first the x-faces,
+    /// x-index running fastest, then the y-faces, y-index running fastest,
+    /// and for 3D grids the z-faces, z-index running fastest.
+    template <class Iterator>
+    void copyFaceValues( const equelle::CartesianGrid& grid, Iterator beg, Iterator end,
+                         const std::string& name, const std::string& filename,
+                         equelle::CartesianGrid::CartesianCollectionOfScalar& v )
+    {
+        typedef equelle::CartesianGrid::Face Face;
+        // X-faces
+        for( int k = 0; k < grid.cartdims[2]; ++k ) {
+            for( int j = 0; j < grid.cartdims[1]; ++j ) {
+                for( int i = 0; i <= grid.cartdims[0]; ++i ) {
+                    if ( beg == end ) {
+                        OPM_THROW(std::runtime_error, "Unexpected size of input data for " << name << " in file " << filename);
+                    }
+                    grid.faceAt( i, j, k, Face::negX, v ) = *beg;
+                    ++beg;
+                }
+            }
+        }
+
+        // Y-faces
+        // NB. Here we have switch the order we traverse the dimensions, in order to allow for
+        // the natural indexing of storing y-data in input files.
+        for( int k = 0; k < grid.cartdims[2]; ++k ) {
+            for( int i = 0; i < grid.cartdims[0]; ++i ) {
+                for( int j = 0; j <= grid.cartdims[1]; ++j ) {
+                    if ( beg == end ) {
+                        OPM_THROW(std::runtime_error, "Unexpected size of input data for " << name << " in file " << filename);
+                    }
+                    grid.faceAt( i, j, k, Face::negY, v ) = *beg;
+                    ++beg;
+                }
+            }
+        }
+
+        // Z-faces, likewise with the z-index running fastest.
+        if ( grid.dimensions == 3 ) {
+            for( int j = 0; j < grid.cartdims[1]; ++j ) {
+                for( int i = 0; i < grid.cartdims[0]; ++i ) {
+                    for( int k = 0; k <= grid.cartdims[2]; ++k ) {
+                        if ( beg == end ) {
+                            OPM_THROW(std::runtime_error, "Unexpected size of input data for " << name << " in file " << filename);
+                        }
+                        grid.faceAt( i, j, k, Face::negZ, v ) = *beg;
+                        ++beg;
+                    }
+                }
+            }
+        }
+    }
+
+    /// The number of interior faces and boundary faces of a grid, that is the
+    /// number of values in face input.
+    int numberOfInputFaces( const equelle::CartesianGrid& grid )
+    {
+        const std::array<int, 3>& n = grid.cartdims;
+        int count = (n[0]+1) * n[1] * n[2] + n[0] * (n[1]+1) * n[2];
+        if ( grid.dimensions == 3 ) {
+            count += n[0] * n[1] * (n[2]+1);
+        }
+        return count;
+    }
+
+} // anonymous namespace
 
 equelle::CartesianGrid::CartesianGrid()
+    : cache_size( 262144 )
 {
 
 }
 
 equelle::CartesianGrid::CartesianGrid(const Opm::parameter::ParameterGroup &param)
-    : param_( param )
+    : cache_size( param.getDefault( "cache_size", 262144 ) ),
+      param_( param )
 {
     int grid_dim = param.getDefault( "grid_dim", 2 );
-    if ( grid_dim != 2 ) {
-        throw std::runtime_error( "Only 2D-cartesian grids are supported, so far..." );
+    if ( grid_dim != 2 && grid_dim != 3 ) {
+        throw std::runtime_error( "Only 2D- and 3D-cartesian grids are supported." );
     }
 
-    std::tuple<int, int> dims;
-    std::get<0>( dims ) = param.getDefault( "nx", 3 );
-    std::get<1>( dims ) = param.getDefault( "ny", 5 );
+    std::array<int, 3> dims;
+    dims[0] = param.getDefault( "nx", 3 );
+    dims[1] = param.getDefault( "ny", 5 );
+    dims[2] = grid_dim == 3 ? param.getDefault( "nz", 1 ) : 1;
 
     int ghostWidth = param.getDefault( "ghost_width", 1 );
 
-    init2D( dims, ghostWidth );
+    init( dims, grid_dim, ghostWidth );
 }
 
-void equelle::CartesianGrid::init2D( std::tuple<int, int> dims, int ghostWidth )
+void equelle::CartesianGrid::init( std::array<int, 3> dims, int dimensions, int ghostWidth )
 {
-    cartdims[0] = std::get<0>( dims );
-    cartdims[1] = std::get<1>( dims );
-
-    cellStrides[0] = 1;
-    cellStrides[1] = 2*ghostWidth + cartdims[0];
-
-    faceStrides[Dimension::x] = {{1, cellStrides[1] + 1}};
-    faceStrides[Dimension::y] = {{1, cellStrides[1]}};
-
-
+    cartdims = dims;
     this->ghost_width = ghostWidth;
-    this->dimensions = 2;
-    this->number_of_cells = cartdims[0]*cartdims[1];
+    this->dimensions = dimensions;
 
-    this->number_of_cells_and_ghost_cells = (cartdims[0]+2*ghostWidth) * (cartdims[1]+2*ghostWidth);
-    this->cellOrigin = ghost_width * cellStrides[1] + ghost_width * cellStrides[0];
+    // The number of cells in each dimension, ghost cells included. 2D grids have no ghost cells in z.
+    std::array<int, 3> ghosts = {{ ghostWidth, ghostWidth, dimensions == 3 ? ghostWidth : 0 }};
+    std::array<int, 3> padded;
+    for( int d = 0; d < 3; ++d ) {
+        padded[d] = cartdims[d] + 2*ghosts[d];
+    }
 
-    number_of_faces_with_ghost_cells[Dimension::x] = (cartdims[0]+2*ghostWidth+1);
-    number_of_faces_with_ghost_cells[Dimension::y] = (cartdims[1]+2*ghostWidth+1);
+    cellStrides = {{ 1, padded[0], padded[0]*padded[1] }};
+
+    this->number_of_cells = cartdims[0]*cartdims[1]*cartdims[2];
+    this->number_of_cells_and_ghost_cells = padded[0]*padded[1]*padded[2];
+    this->cellOrigin = ghosts[0]*cellStrides[0] + ghosts[1]*cellStrides[1] + ghosts[2]*cellStrides[2];
+
+    // The faces normal to each dimension are stored in a block of their own, x-faces first,
+    // with one more face than cells in their dimension.
+    int block_start = 0;
+    for( int d = 0; d < 3; ++d ) {
+        number_of_faces_with_ghost_cells[d] = padded[d] + 1;
+        if ( d >= dimensions ) {
+            faceStrides[d] = {{ 1, 0, 0 }};
+            faceOrigin[d] = block_start;
+            continue;
+        }
+        std::array<int, 3> face_dims = padded;
+        ++face_dims[d];
+        faceStrides[d] = {{ 1, face_dims[0], face_dims[0]*face_dims[1] }};
+        faceOrigin[d] = block_start + ghosts[0]*faceStrides[d][0] + ghosts[1]*faceStrides[d][1] + ghosts[2]*faceStrides[d][2];
+        block_start += face_dims[0]*face_dims[1]*face_dims[2];
+    }
+    number_of_faces_and_ghost_faces = block_start;
 }
 
 equelle::CartesianGrid::CartesianGrid( std::tuple<int, int> dims, int ghostWidth )
+    : cache_size( 262144 )
+{
+    init( {{ std::get<0>( dims ), std::get<1>( dims ), 1 }}, 2, ghostWidth );
+}
+
+equelle::CartesianGrid::CartesianGrid( std::tuple<int, int, int> dims, int ghostWidth )
+    : cache_size( 262144 )
 {
-    init2D( dims, ghostWidth );
+    init( {{ std::get<0>( dims ), std::get<1>( dims ), std::get<2>( dims ) }}, 3, ghostWidth );
 }
 
 equelle::CartesianGrid::~CartesianGrid()
@@ -75,23 +191,21 @@ equelle::CartesianGrid::CartesianCollectionOfScalar equelle::CartesianGrid::inpu
     const bool from_file = param_.getDefault(name + "_from_file", false);
     if ( from_file ) {
         const String filename = param_.get<String>(name + "_filename");
-        std::ifstream is(filename.c_str());
-        if (!is) {
-            OPM_THROW(std::runtime_error, "Could not find file " << filename);
-        }
-        std::istream_iterator<double> beg(is);
-        std::istream_iterator<double> end;
 
         v.resize( number_of_cells_and_ghost_cells, 0.0 );
 
-        for( int j = 0; j < cartdims[1]; ++j ) {
-            for( int i = 0; i < cartdims[0]; ++i ) {
-                if ( beg == end ) {
-                    OPM_THROW(std::runtime_error, "Unexpected size of input data for " << name << " in file " << filename);
-                }
-                cellAt( i, j, v ) = *beg;
-                beg++;
+        if ( binaryio::isBinaryInput( param_, name, filename ) ) {
+            const MappedBinaryFile file( filename );
+            file.checkSize( 0, number_of_cells, name );
+            const double* values = file.doubles( 0 );
+            copyCellValues( *this, values, values + file.recordSize( 0 ), name, filename, v );
+        } else {
+            std::ifstream is(filename.c_str());
+            if (!is) {
+                OPM_THROW(std::runtime_error, "Could not find file " << filename);
             }
+            copyCellValues( *this, std::istream_iterator<double>(is), std::istream_iterator<double>(),
+                            name, filename, v );
         }
     } else { // Constant value
         const double value = param_.get<double>( name );
@@ -108,40 +222,21 @@ equelle::CartesianGrid::CartesianCollectionOfScalar equelle::CartesianGrid::inpu
     const bool from_file = param_.getDefault(name + "_from_file", false);
     if ( from_file ) {
         const String filename = param_.get<String>(name + "_filename");
-        std::ifstream is(filename.c_str());
-        if (!is) {
-            OPM_THROW(std::runtime_error, "Could not find file " << filename);
-        }
-        std::istream_iterator<double> beg(is);
-        std::istream_iterator<double> end;
 
-        int num = number_of_faces_with_ghost_cells[Dimension::x] * (cartdims[1]+2*ghost_width) +
-                number_of_faces_with_ghost_cells[Dimension::y] * (cartdims[0]+2*ghost_width);
-
-        v.resize( num, 0.0 );
-
-        // X-faces
-        for( int j = 0; j < cartdims[1]; ++j ) {
-            for( int i = 0; i <= cartdims[0]; ++i ) {
-                if ( beg == end ) {
-                    OPM_THROW(std::runtime_error, "Unexpected size of input data for " << name << " in file " << filename);
-                }
-                faceAt( i, j, Face::negX, v ) = *beg;
-                beg++;
-            }
-        }
-
-        // Y-faces        
-        // NB. Here we have switch the order we traverse the dimensions, in order to allow for
-        // the natural indexing of storing y-data in input files.
-        for( int i = 0; i < cartdims[0]; ++i ) {
-            for( int j = 0; j <= cartdims[1]; ++j ) {
-                if ( beg == end ) {
-                    OPM_THROW(std::runtime_error, "Unexpected size of input data for " << name << " in file " << filename);
-                }
-                faceAt( i, j, Face::negY, v ) = *beg;
-                beg++;
+        v.resize( number_of_faces_and_ghost_faces, 0.0 );
+
+        if ( binaryio::isBinaryInput( param_, name, filename ) ) {
+            const MappedBinaryFile file( filename );
+            file.checkSize( 0, numberOfInputFaces( *this ), name );
+            const double* values = file.doubles( 0 );
+            copyFaceValues( *this, values, values + file.recordSize( 0 ), name, filename, v );
+        } else {
+            std::ifstream is(filename.c_str());
+            if (!is) {
+                OPM_THROW(std::runtime_error, "Could not find file " << filename);
             }
+            copyFaceValues( *this, std::istream_iterator<double>(is), std::istream_iterator<double>(),
+                            name, filename, v );
         }
     } else { // Constant value
         const double value = param_.get<double>( name );
@@ -155,9 +250,9 @@ equelle::CartesianGrid::CartesianCollectionOfScalar equelle::CartesianGrid::inpu
 {    
     CartesianCollectionOfScalar v( number_of_cells_and_ghost_cells, 0.0 );
 
-    for( int j = 0; j < cartdims[1]; ++j ) {
-        for( int i = 0; i < cartdims[0]; ++i ) {
-            cellAt( i, j, v ) = d;
+    for( int k = 0; k < cartdims[2]; ++k ) {
+        for( int j = 0; j < cartdims[1]; ++j ) {
+            std::fill_n( cellRow( j, k, v ), cartdims[0], d );
         }
     }
 
@@ -166,126 +261,42 @@ equelle::CartesianGrid::CartesianCollectionOfScalar equelle::CartesianGrid::inpu
 
 equelle::CartesianGrid::CartesianCollectionOfScalar equelle::CartesianGrid::inputFaceScalarWithDefault(std::string /*name*/, double d )
 {
-    int num = number_of_faces_with_ghost_cells[Dimension::x] * (cartdims[1]+2*ghost_width) +
-            number_of_faces_with_ghost_cells[Dimension::y] * (cartdims[0]+2*ghost_width);
-
-    CartesianCollectionOfScalar v( num, 0.0 );
+    CartesianCollectionOfScalar v( number_of_faces_and_ghost_faces, 0.0 );
 
-    for( int j = 0; j < cartdims[1]; ++j ) {
-        for( int i = 0; i <= cartdims[0]; ++i ) {
-            faceAt( i, j, Face::negX, v ) = d;
+    for( int k = 0; k < cartdims[2]; ++k ) {
+        for( int j = 0; j < cartdims[1]; ++j ) {
+            std::fill_n( faceRow( j, k, Face::negX, v ), cartdims[0]+1, d );
+        }
+        for( int j = 0; j <= cartdims[1]; ++j ) {
+            std::fill_n( faceRow( j, k, Face::negY, v ), cartdims[0], d );
         }
     }
-
-    for( int j = 0; j <= cartdims[1]; ++j ) {
-        for( int i = 0; i < cartdims[0]; ++i ) {
-            faceAt( i, j, Face::negY, v ) = d;
+    if ( dimensions == 3 ) {
+        for( int k = 0; k <= cartdims[2]; ++k ) {
+            for( int j = 0; j < cartdims[1]; ++j ) {
+                std::fill_n( faceRow( j, k, Face::negZ, v ), cartdims[0], d );
+            }
         }
     }
 
     return v;
 }
 
-double& equelle::CartesianGrid::cellAt( const int i, const int j, equelle::CartesianGrid::CartesianCollectionOfScalar &coll ) const
-{
-    const int index = cellOrigin + j*cellStrides[1] + i*cellStrides[0];
-    return coll[ index ];
-}
-
-const double &equelle::CartesianGrid::cellAt( const int i, const int j, const equelle::CartesianGrid::CartesianCollectionOfScalar &coll) const
-{
-    const int index = cellOrigin + j*cellStrides[1] + i*cellStrides[0];
-    return coll[ index ];
-}
-
-double &equelle::CartesianGrid::faceAt(int i, int j, const equelle::CartesianGrid::Face face, equelle::CartesianGrid::CartesianCollectionOfScalar &coll) const
-{
-    i += ghost_width;
-    j += ghost_width;
-
-    // Update index to the correct cell.
-    switch (face) {
-    case Face::posX:
-        ++i;
-        break;
-    case Face::posY:
-        ++j;
-        break;
-    default:
-        // Intentional, the other faces does not need index manipulation.
-        break;
-    }
-
-    int offset = 0;
-    strideArray strides;
-
-    switch (face) {
-    case Face::posX:
-    case Face::negX:
-        offset = 0;
-        strides = faceStrides[Dimension::x];
-        break;
-    case Face::posY:
-    case Face::negY:
-        offset = number_of_faces_with_ghost_cells[Dimension::x] * ( cartdims[1] + 2*ghost_width );
-        strides = faceStrides[Dimension::y];
-        break;
-    default:
-        throw std::runtime_error("Only 2D-cartesian grids are supported, so far...");
-        break;
-    }
-
-    return coll[offset + j*strides[1] + i*strides[0] ];
-}
-
-const double &equelle::CartesianGrid::faceAt(int i, int j, equelle::CartesianGrid::Face face, const equelle::CartesianGrid::CartesianCollectionOfScalar &coll) const
-{
-    i += ghost_width;
-    j += ghost_width;
-
-    // Update index to the correct cell.
-    switch (face) {
-    case Face::posX:
-        ++i;
-        break;
-    case Face::posY:
-        ++j;
-        break;
-    default:
-        // Intentional, the other faces does not need index manipulation.
-        break;
-    }
-
-    int offset = 0;
-    strideArray strides;
-
-    switch (face) {
-    case Face::posX:
-    case Face::negX:
-        offset = 0;
-        strides = faceStrides[Dimension::x];
-        break;
-    case Face::posY:
-    case Face::negY:
-        offset = number_of_faces_with_ghost_cells[Dimension::x] * ( cartdims[1] + 2*ghost_width );
-        strides = faceStrides[Dimension::y];
-        break;
-    default:
-        throw std::runtime_error("Only 2D-cartesian grids are supported, so far...");
-        break;
-    }
-
-    return coll[offset + j*strides[1] + i*strides[0] ];
-}
-
 void equelle::CartesianGrid::dumpGridCells(const equelle::CartesianGrid::CartesianCollectionOfScalar &cells, std::ostream &stream)
 {
+    // The layers of a 3D grid are separated by an empty line.
     int num_columns = cartdims[0] + 2*ghost_width;
-    for( int j = 0; j < cartdims[1] + 2*ghost_width; ++j ) {
-        int row_offset  = j*cellStrides[1];
-        std::copy_n( cells.begin() + row_offset, num_columns - 1, std::ostream_iterator<double>( stream, "," ) );
-        stream << cells[row_offset + num_columns-1];
-        stream << std::endl;
+    int num_layers = dimensions == 3 ? cartdims[2] + 2*ghost_width : 1;
+    for( int k = 0; k < num_layers; ++k ) {
+        if ( k > 0 ) {
+            stream << std::endl;
+        }
+        for( int j = 0; j < cartdims[1] + 2*ghost_width; ++j ) {
+            int row_offset  = j*cellStrides[1] + k*cellStrides[2];
+            std::copy_n( cells.begin() + row_offset, num_columns - 1, std::ostream_iterator<double>( stream, "," ) );
+            stream << cells[row_offset + num_columns-1];
+            stream << std::endl;
+        }
     }
 }
 
@@ -295,6 +306,7 @@ void equelle::CartesianGrid::dumpGridFaces(/*const*/ equelle::CartesianGrid::Car
     Face face = input_face;
     int face_offset_x = 0;
     int face_offset_y = 0;
+    int face_offset_z = 0;
 
     switch(face) {
     case Face::posX:
@@ -307,6 +319,14 @@ void equelle::CartesianGrid::dumpGridFaces(/*const*/ equelle::CartesianGrid::Car
         face = Face::negY;
         face_offset_y = 1;
         break;
+    case Face::posZ:
+    case Face::negZ:
+        if ( dimensions != 3 ) {
+            throw std::runtime_error("Z-faces are only defined for 3D grids");
+        }
+        face = Face::negZ;
+        face_offset_z = 1;
+        break;
     default:
         throw std::runtime_error("Unknown face position");
     }
@@ -317,24 +337,45 @@ void equelle::CartesianGrid::dumpGridFaces(/*const*/ equelle::CartesianGrid::Car
     int start_y = -ghost_width;
     int end_y = cartdims[1] + ghost_width + face_offset_y;
 
+    // 2D grids have a single layer, the layers of a 3D grid are separated by an empty line.
+    int start_z = dimensions == 3 ? -ghost_width : 0;
+    int end_z = dimensions == 3 ? cartdims[2] + ghost_width + face_offset_z : 1;
 
-    for( int j = start_y; j < end_y; ++j ) {
-        stream << faceAt( start_x, j, face, faces);
-        for( int i = start_x+1; i < end_x; ++i ) {
-            stream << "," << faceAt( i, j, face, faces);
+    for( int k = start_z; k < end_z; ++k ) {
+        if ( k > start_z ) {
+            stream << std::endl;
+        }
+        for( int j = start_y; j < end_y; ++j ) {
+            stream << faceAt( start_x, j, k, face, faces);
+            for( int i = start_x+1; i < end_x; ++i ) {
+                stream << "," << faceAt( i, j, k, face, faces);
+            }
+            stream << std::endl;
         }
-        stream << std::endl;
     }
 }
 
 equelle::CartesianGrid::CellRange equelle::CartesianGrid::allCells() {
-    return CellRange(0, cartdims[0], 0, cartdims[1]);
+    return CellRange(0, cartdims[0], 0, cartdims[1], 0, cartdims[2]);
 }
 
 equelle::CartesianGrid::FaceRange equelle::CartesianGrid::allXFaces() {
-    return FaceRange(0, cartdims[0]+1, 0, cartdims[1]);
+    return FaceRange(0, cartdims[0]+1, 0, cartdims[1], 0, cartdims[2]);
 }
 
 equelle::CartesianGrid::FaceRange equelle::CartesianGrid::allYFaces() {
-    return FaceRange(0, cartdims[0], 0, cartdims[1]+1);
+    return FaceRange(0, cartdims[0], 0, cartdims[1]+1, 0, cartdims[2]);
+}
+
+equelle::CartesianGrid::FaceRange equelle::CartesianGrid::allZFaces() {
+    if ( dimensions != 3 ) {
+        throw std::runtime_error( "Z-faces are only defined for 3D grids" );
+    }
+    return FaceRange(0, cartdims[0], 0, cartdims[1], 0, cartdims[2]+1);
+}
+
+int equelle::CartesianGrid::tileWidth( int rows_in_working_set ) const {
+    // Keep half the cache for everything else, and the tiles wide enough to vectorize.
+    const int width = cache_size / ( 2 * rows_in_working_set * int( sizeof(double) ) );
+    return std::max( width, 64 );
 }
@@ -0,0 +1,178 @@
+#include "equelle/EquelleRuntimeCartesian.hpp"
+
+#include <opm/core/utility/ErrorMacros.hpp>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include "equelle/BinaryIO.hpp"
+
+namespace equelle {
+
+namespace {
+
+    /// Reads the output_format parameter, "text" (default) or "binary".
+    bool binaryOutputFormat( const Opm::parameter::ParameterGroup& param )
+    {
+        const std::string format = param.getDefault<std::string>( "output_format", "text" );
+        if ( format != "text" && format != "binary" ) {
+            OPM_THROW( std::runtime_error, "Unknown output_format: " << format );
+        }
+        return format == "binary";
+    }
+
+    /// The interior cells of a collection, x-index running fastest.
+    std::vector<double> interiorValues( const CartesianGrid& grid, const CartesianCollectionOfScalar& coll )
+    {
+        std::vector<double> values;
+        values.reserve( grid.number_of_cells );
+        for( int k = 0; k < grid.cartdims[2]; ++k ) {
+            for( int j = 0; j < grid.cartdims[1]; ++j ) {
+                const double* row = grid.cellRow( j, k, coll );
+                values.insert( values.end(), row, row + grid.cartdims[0] );
+            }
+        }
+        return values;
+    }
+
+} // anonymous namespace
+
+
+EquelleRuntimeCartesian::EquelleRuntimeCartesian( const Opm::parameter::ParameterGroup& param )
+    : param_( param ),
+      grid_( param ),
+      output_to_file_( param.getDefault( "output_to_file", false ) ),
+      binary_output_( binaryOutputFormat( param ) )
+{
+}
+
+CartesianGrid::CellRange EquelleRuntimeCartesian::allCells()
+{
+    return grid_.allCells();
+}
+
+CartesianCollectionOfScalar EquelleRuntimeCartesian::newCellCollection() const
+{
+    return CartesianCollectionOfScalar( grid_.number_of_cells_and_ghost_cells, 0.0 );
+}
+
+template <class Op>
+Scalar EquelleRuntimeCartesian::reduce( const CartesianCollectionOfScalar& x, Scalar init, const Op& op ) const
+{
+    if ( int( x.size() ) != grid_.number_of_cells_and_ghost_cells ) {
+        OPM_THROW( std::runtime_error, "Expected a cell collection of size " << grid_.number_of_cells_and_ghost_cells
+                   << ", got " << x.size() );
+    }
+    Scalar result = init;
+    for( int k = 0; k < grid_.cartdims[2]; ++k ) {
+        for( int j = 0; j < grid_.cartdims[1]; ++j ) {
+            const double* row = grid_.cellRow( j, k, x );
+            for( int i = 0; i < grid_.cartdims[0]; ++i ) {
+                result = op( result, row[i] );
+            }
+        }
+    }
+    return result;
+}
+
+Scalar EquelleRuntimeCartesian::minReduce( const CartesianCollectionOfScalar& x ) const
+{
+    return reduce( x, std::numeric_limits<Scalar>::max(), []( Scalar a, Scalar b ) { return std::min( a, b ); } );
+}
+
+Scalar EquelleRuntimeCartesian::maxReduce( const CartesianCollectionOfScalar& x ) const
+{
+    return reduce( x, -std::numeric_limits<Scalar>::max(), []( Scalar a, Scalar b ) { return std::max( a, b ); } );
+}
+
+Scalar EquelleRuntimeCartesian::sumReduce( const CartesianCollectionOfScalar& x ) const
+{
+    return reduce( x, 0.0, []( Scalar a, Scalar b ) { return a + b; } );
+}
+
+Scalar EquelleRuntimeCartesian::prodReduce( const CartesianCollectionOfScalar& x ) const
+{
+    return reduce( x, 1.0, []( Scalar a, Scalar b ) { return a * b; } );
+}
+
+void EquelleRuntimeCartesian::output( const String& tag, const Scalar val ) const
+{
+    std::cout << tag << " = " << val << std::endl;
+}
+
+void EquelleRuntimeCartesian::output( const String& tag, const CartesianCollectionOfScalar& vals )
+{
+    const std::vector<double> values = interiorValues( grid_, vals );
+    if ( output_to_file_ ) {
+        int count = 0;
+        auto it = outputcount_.find( tag );
+        if ( it == outputcount_.end() ) {
+            outputcount_[tag] = 1; // should contain the count to be used next time for same tag.
+        } else {
+            count = it->second++;
+        }
+        if ( binary_output_ ) {
+            // One file per tag, with a record appended by every call.
+            BinaryWriter file( tag + ".eqbin", binaryio::Float64, count > 0 );
+            file.write( values.data(), values.size() );
+            return;
+        }
+        std::ostringstream fname;
+        fname << tag << "-" << std::setw(5) << std::setfill('0') << count << ".output";
+        std::ofstream file( fname.str().c_str() );
+        if ( !file ) {
+            OPM_THROW( std::runtime_error, "Failed to open " << fname.str() );
+        }
+        file.precision( 16 );
+        std::copy( values.begin(), values.end(), std::ostream_iterator<double>( file, "\n" ) );
+    } else {
+        std::cout << tag << " =\n";
+        for( double value : values ) {
+            std::cout << std::setw(15) << std::left << value << " ";
+        }
+        std::cout << std::endl;
+    }
+}
+
+Scalar EquelleRuntimeCartesian::inputScalarWithDefault( const String& name, const Scalar default_value )
+{
+    return param_.getDefault( name, default_value );
+}
+
+CartesianCollectionOfScalar EquelleRuntimeCartesian::inputCollectionOfScalar( const String& name,
+                                                                              const CartesianGrid::CellRange& )
+{
+    return grid_.inputCellCollectionOfScalar( name );
+}
+
+SeqOfScalar EquelleRuntimeCartesian::inputSequenceOfScalar( const String& name )
+{
+    const String filename = param_.get<String>( name + "_filename" );
+    if ( binaryio::isBinaryInput( param_, name, filename ) ) {
+        const MappedBinaryFile file( filename );
+        const Scalar* values = file.doubles( 0 );
+        return SeqOfScalar( values, values + file.recordSize( 0 ) );
+    }
+    std::ifstream is( filename.c_str() );
+    if ( !is ) {
+        OPM_THROW( std::runtime_error, "Could not find file " << filename );
+    }
+    std::istream_iterator<Scalar> beg( is );
+    std::istream_iterator<Scalar> end;
+    return SeqOfScalar( beg, end );
+}
+
+void EquelleRuntimeCartesian::ensureGridDimension( const int dimensions ) const
+{
+    if ( grid_.dimensions != dimensions ) {
+        OPM_THROW( std::runtime_error, "Equelle simulator has stencils for " << dimensions
+                   << " dimensions, but grid has " << grid_.dimensions << " dimensions." );
+    }
+}
+
+} // namespace equelle
@@ -0,0 +1,103 @@
+/*
+  Memory bandwidth of the row-wise heat equation stencils of CartesianGrid.
+
+  Each step reads u0 and writes u once, so a step moves at least 2*8 bytes
+  per cell. The grids are much larger than the caches, so the bandwidth
+  reported is that of main memory. Usage:
+
+      cartesian_benchmark [steps]
+*/
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <tuple>
+#include <utility>
+
+#include "equelle/CartesianGrid.hpp"
+
+namespace {
+
+    double gigabytesPerSecond( const equelle::CartesianGrid& grid, int steps, const std::chrono::duration<double>& elapsed )
+    {
+        return 2.0 * sizeof(double) * grid.number_of_cells * steps / elapsed.count() / 1e9;
+    }
+
+    /// The 5-point heat equation on a 2D grid.
+    void heatEquationRows( int steps )
+    {
+        const int dim_x = 2000;
+        const int dim_y = 1000;
+        const double a = 1.0/8.0;
+
+        equelle::CartesianGrid grid( std::make_tuple( dim_x, dim_y ), 1 );
+        equelle::CartesianGrid::CartesianCollectionOfScalar u0 = grid.inputCellScalarWithDefault( "u", 1.0 );
+        grid.cellAt( dim_x/2, dim_y/2, u0 ) = 100.0;
+        equelle::CartesianGrid::CartesianCollectionOfScalar u = u0;
+
+        equelle::CartesianGrid::CellRange allCells = grid.allCells();
+        const int stride = grid.cellStrides[1];
+
+        auto start = std::chrono::steady_clock::now();
+        for( int step = 0; step < steps; ++step ) {
+            allCells.executeRows( [&] (int j, int i_begin, int i_end) {
+                const double* c = grid.cellRow( j, u0 );
+                double* out = grid.cellRow( j, u );
+                for( int i = i_begin; i < i_end; ++i ) {
+                    out[i] = c[i] + a * ( c[i+1] + c[i-1] + c[i+stride] + c[i-stride] - 4*c[i] );
+                }
+            } );
+            std::swap( u, u0 );
+        }
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "heatEquationRows (" << dim_x << "x" << dim_y << "): "
+                  << gigabytesPerSecond( grid, steps, elapsed ) << " GB/s" << std::endl;
+    }
+
+    /// The 7-point heat equation on a 3D grid.
+    void heatEquation3DRows( int steps )
+    {
+        const int dim_x = 200;
+        const int dim_y = 100;
+        const int dim_z = 50;
+        const double a = 1.0/12.0;
+
+        equelle::CartesianGrid grid( std::make_tuple( dim_x, dim_y, dim_z ), 1 );
+        equelle::CartesianGrid::CartesianCollectionOfScalar u0 = grid.inputCellScalarWithDefault( "u", 1.0 );
+        grid.cellAt( dim_x/2, dim_y/2, dim_z/2, u0 ) = 100.0;
+        equelle::CartesianGrid::CartesianCollectionOfScalar u = u0;
+
+        equelle::CartesianGrid::CellRange allCells = grid.allCells();
+        const int stride_y = grid.cellStrides[1];
+        const int stride_z = grid.cellStrides[2];
+
+        auto start = std::chrono::steady_clock::now();
+        for( int step = 0; step < steps; ++step ) {
+            allCells.executeRows( [&] (int j, int k, int i_begin, int i_end) {
+                const double* c = grid.cellRow( j, k, u0 );
+                double* out = grid.cellRow( j, k, u );
+                for( int i = i_begin; i < i_end; ++i ) {
+                    out[i] = c[i] + a * ( c[i+1] + c[i-1] + c[i+stride_y] + c[i-stride_y]
+                                          + c[i+stride_z] + c[i-stride_z] - 6*c[i] );
+                }
+            } );
+            std::swap( u, u0 );
+        }
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "heatEquation3DRows (" << dim_x << "x" << dim_y << "x" << dim_z << "): "
+                  << gigabytesPerSecond( grid, steps, elapsed ) << " GB/s" << std::endl;
+    }
+
+}
+
+int main( int argc, char** argv )
+{
+    const int steps = argc > 1 ? std::atoi( argv[1] ) : 20;
+    if( steps < 1 ) {
+        std::cerr << "Usage: " << argv[0] << " [steps]" << std::endl;
+        return 1;
+    }
+    heatEquationRows( steps );
+    heatEquation3DRows( steps );
+    return 0;
+}
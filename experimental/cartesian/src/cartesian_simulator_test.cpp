@@ -9,12 +9,84 @@
 #include <numeric>
 #include <fstream>
 #include <tuple>
+#include <cmath>
 
 #include <boost/test/unit_test.hpp>
 #include <boost/format.hpp>
 #include "equelle/EquelleRuntimeCPU.hpp"
 #include "equelle/CartesianGrid.hpp"
 
+namespace {
+
+    /// The explicit heat equation step, for CartesianGrid::executeTimeSteps.
+    struct HeatStep {
+        double a;
+        void operator()( const std::array<const double*, 1>& in, const std::array<double*, 1>& out,
+                         int stride, int /*j*/, int i_begin, int i_end ) const
+        {
+            const double* c = in[0];
+            for( int n = 0; n < i_end - i_begin; ++n ) {
+                out[0][n] = c[n] + a * ( c[n+1] + c[n-1] + c[n+stride] + c[n-stride] - 4*c[n] );
+            }
+        }
+    };
+
+    /// A Lax-Friedrichs step of the shallow-water equations, for the fields h, hu and hv.
+    struct ShallowWaterStep {
+        double dt_dx;
+        double g;
+        void operator()( const std::array<const double*, 3>& in, const std::array<double*, 3>& out,
+                         int stride, int /*j*/, int i_begin, int i_end ) const
+        {
+            const double* h = in[0];
+            const double* hu = in[1];
+            const double* hv = in[2];
+            for( int n = 0; n < i_end - i_begin; ++n ) {
+                const int e = n+1, w = n-1, north = n+stride, s = n-stride;
+                const double fe[3] = { hu[e], hu[e]*hu[e]/h[e] + 0.5*g*h[e]*h[e], hu[e]*hv[e]/h[e] };
+                const double fw[3] = { hu[w], hu[w]*hu[w]/h[w] + 0.5*g*h[w]*h[w], hu[w]*hv[w]/h[w] };
+                const double gn[3] = { hv[north], hu[north]*hv[north]/h[north], hv[north]*hv[north]/h[north] + 0.5*g*h[north]*h[north] };
+                const double gs[3] = { hv[s], hu[s]*hv[s]/h[s], hv[s]*hv[s]/h[s] + 0.5*g*h[s]*h[s] };
+                for( int f = 0; f < 3; ++f ) {
+                    const double* q = in[f];
+                    out[f][n] = 0.25 * ( q[e] + q[w] + q[north] + q[s] )
+                              - 0.5 * dt_dx * ( fe[f] - fw[f] + gn[f] - gs[f] );
+                }
+            }
+        }
+    };
+
+    /// Advance the fields one step at a time with stencil, as a reference for executeTimeSteps.
+    template <int NumFields, class Stencil>
+    void stepRows( equelle::CartesianGrid& grid, const Stencil& stencil,
+                   std::array<equelle::CartesianGrid::CartesianCollectionOfScalar, NumFields>& fields, int steps )
+    {
+        std::array<equelle::CartesianGrid::CartesianCollectionOfScalar, NumFields> next = fields;
+        for( int step = 0; step < steps; ++step ) {
+            grid.allCells().executeRows( [&] (int j, int i_begin, int i_end) {
+                std::array<const double*, NumFields> in;
+                std::array<double*, NumFields> out;
+                for( int f = 0; f < NumFields; ++f ) {
+                    in[f] = grid.cellRow( j, fields[f] ) + i_begin;
+                    out[f] = grid.cellRow( j, next[f] ) + i_begin;
+                }
+                stencil( in, out, grid.cellStrides[1], j, i_begin, i_end );
+            } );
+            std::swap( fields, next );
+        }
+    }
+
+    double maxDifference( const std::vector<double>& a, const std::vector<double>& b )
+    {
+        double max_diff = 0.0;
+        for( int k = 0; k < int(a.size()); ++k ) {
+            max_diff = std::max( max_diff, std::abs( a[k] - b[k] ) );
+        }
+        return max_diff;
+    }
+
+}
+
 
 
 
@@ -66,6 +138,175 @@ BOOST_AUTO_TEST_CASE( heatEquation ) {
     }
 }
 
+/**
+ * Test that the row-wise heat equation stencil gives the same result as the one on single cells.
+ * Its memory bandwidth is measured by cartesian_benchmark.
+ */
+BOOST_AUTO_TEST_CASE( heatEquationRows ) {
+    int dim_x = 60;
+    int dim_y = 40;
+    int ghostWidth = 1;
+    const int steps = 20;
+    const double a = 1.0/8.0;
+
+    equelle::CartesianGrid grid( std::make_tuple( dim_x, dim_y),  ghostWidth );
+    equelle::CartesianGrid::CartesianCollectionOfScalar u0 = grid.inputCellScalarWithDefault( "u", 1.0 );
+    grid.cellAt( dim_x/2, dim_y/2, u0 ) = 100.0;
+    equelle::CartesianGrid::CartesianCollectionOfScalar u = u0;
+    equelle::CartesianGrid::CartesianCollectionOfScalar v0 = u0;
+    equelle::CartesianGrid::CartesianCollectionOfScalar v = u0;
+
+    equelle::CartesianGrid::CellRange allCells = grid.allCells();
+    const int stride = grid.cellStrides[1];
+
+    for( int step = 0; step < steps; ++step ) {
+        allCells.executeRows( [&] (int j, int i_begin, int i_end) {
+            const double* c = grid.cellRow( j, u0 );
+            double* out = grid.cellRow( j, u );
+            for( int i = i_begin; i < i_end; ++i ) {
+                out[i] = c[i] + a * ( c[i+1] + c[i-1] + c[i+stride] + c[i-stride] - 4*c[i] );
+            }
+        } );
+        std::swap( u, u0 );
+    }
+
+    for( int step = 0; step < steps; ++step ) {
+        allCells.execute( [&] (int i, int j) {
+            grid.cellAt( i, j, v ) = grid.cellAt( i, j, v0 ) +
+                      a * ( grid.cellAt(i+1, j, v0) +
+                            grid.cellAt(i-1, j, v0) +
+                            grid.cellAt(i, j+1, v0) +
+                            grid.cellAt(i, j-1, v0) -
+                            4*grid.cellAt(i, j, v0) );
+        } );
+        std::swap( v, v0 );
+    }
+
+    BOOST_CHECK_SMALL( maxDifference( u0, v0 ), 1e-12 );
+}
+
+
+/**
+ * Test the 7-point heat equation on a 3D grid, row by row, against cell by cell.
+ */
+BOOST_AUTO_TEST_CASE( heatEquation3DRows ) {
+    int dim_x = 30;
+    int dim_y = 20;
+    int dim_z = 10;
+    int ghostWidth = 1;
+    const int steps = 10;
+    const double a = 1.0/12.0;
+
+    equelle::CartesianGrid grid( std::make_tuple( dim_x, dim_y, dim_z ),  ghostWidth );
+    equelle::CartesianGrid::CartesianCollectionOfScalar u0 = grid.inputCellScalarWithDefault( "u", 1.0 );
+    grid.cellAt( dim_x/2, dim_y/2, dim_z/2, u0 ) = 100.0;
+    equelle::CartesianGrid::CartesianCollectionOfScalar u = u0;
+    equelle::CartesianGrid::CartesianCollectionOfScalar v0 = u0;
+    equelle::CartesianGrid::CartesianCollectionOfScalar v = u0;
+
+    equelle::CartesianGrid::CellRange allCells = grid.allCells();
+    const int stride_y = grid.cellStrides[1];
+    const int stride_z = grid.cellStrides[2];
+
+    for( int step = 0; step < steps; ++step ) {
+        allCells.executeRows( [&] (int j, int k, int i_begin, int i_end) {
+            const double* c = grid.cellRow( j, k, u0 );
+            double* out = grid.cellRow( j, k, u );
+            for( int i = i_begin; i < i_end; ++i ) {
+                out[i] = c[i] + a * ( c[i+1] + c[i-1] + c[i+stride_y] + c[i-stride_y]
+                                      + c[i+stride_z] + c[i-stride_z] - 6*c[i] );
+            }
+        } );
+        std::swap( u, u0 );
+    }
+
+    for( int step = 0; step < steps; ++step ) {
+        allCells.execute( [&] (int i, int j, int k) {
+            grid.cellAt( i, j, k, v ) = grid.cellAt( i, j, k, v0 ) +
+                      a * ( grid.cellAt(i+1, j, k, v0) +
+                            grid.cellAt(i-1, j, k, v0) +
+                            grid.cellAt(i, j+1, k, v0) +
+                            grid.cellAt(i, j-1, k, v0) +
+                            grid.cellAt(i, j, k+1, v0) +
+                            grid.cellAt(i, j, k-1, v0) -
+                            6*grid.cellAt(i, j, k, v0) );
+        } );
+        std::swap( v, v0 );
+    }
+
+    BOOST_CHECK_SMALL( maxDifference( u0, v0 ), 1e-12 );
+}
+
+/**
+ * Test that the tiled and time-blocked heat equation give the same result as stepping row by row.
+ */
+BOOST_AUTO_TEST_CASE( heatEquationBlocked ) {
+    int dim_x = 300;
+    int dim_y = 200;
+    int ghostWidth = 1;
+    const int steps = 10;
+    const HeatStep heat = { 1.0/8.0 };
+
+    equelle::CartesianGrid grid( std::make_tuple( dim_x, dim_y),  ghostWidth );
+    // A small cache, to get many tiles.
+    grid.cache_size = 16384;
+    std::array<equelle::CartesianGrid::CartesianCollectionOfScalar, 1> reference = {{ grid.inputCellScalarWithDefault( "u", 1.0 ) }};
+    grid.cellAt( dim_x/3, dim_y/2, reference[0] ) = 100.0;
+    equelle::CartesianGrid::CartesianCollectionOfScalar tiled = reference[0];
+    equelle::CartesianGrid::CartesianCollectionOfScalar blocked = reference[0];
+    equelle::CartesianGrid::CartesianCollectionOfScalar next = reference[0];
+
+    stepRows<1>( grid, heat, reference, steps );
+
+    const int stride = grid.cellStrides[1];
+    const int tile_width = grid.tileWidth( 4 );
+    BOOST_CHECK_LT( tile_width, dim_x );
+    for( int step = 0; step < steps; ++step ) {
+        grid.allCells().executeTiles( [&] (int j, int i_begin, int i_end) {
+            heat( {{ grid.cellRow( j, tiled ) + i_begin }}, {{ grid.cellRow( j, next ) + i_begin }}, stride, j, i_begin, i_end );
+        }, tile_width );
+        std::swap( tiled, next );
+    }
+    BOOST_CHECK_SMALL( maxDifference( tiled, reference[0] ), 1e-12 );
+
+    // Also with a number of steps that is not a multiple of the block.
+    grid.executeTimeSteps<1>( grid.allCells(), heat, {{ &blocked }}, steps, 1, 4 );
+    BOOST_CHECK_SMALL( maxDifference( blocked, reference[0] ), 1e-12 );
+}
+
+/**
+ * Test that the time-blocked shallow-water equations give the same result as stepping row by row.
+ */
+BOOST_AUTO_TEST_CASE( shallowWaterBlocked ) {
+    int dim_x = 120;
+    int dim_y = 80;
+    int ghostWidth = 1;
+    const int steps = 12;
+    const ShallowWaterStep swe = { 0.1, 9.81 };
+
+    equelle::CartesianGrid grid( std::make_tuple( dim_x, dim_y),  ghostWidth );
+    grid.cache_size = 32768;
+    // The water depth is 1 everywhere, also in the ghost cells, with a bump in the middle.
+    std::array<equelle::CartesianGrid::CartesianCollectionOfScalar, 3> reference;
+    reference[0].assign( grid.number_of_cells_and_ghost_cells, 1.0 );
+    reference[1].assign( grid.number_of_cells_and_ghost_cells, 0.0 );
+    reference[2].assign( grid.number_of_cells_and_ghost_cells, 0.0 );
+    for( int j = dim_y/2 - 5; j < dim_y/2 + 5; ++j ) {
+        for( int i = dim_x/2 - 5; i < dim_x/2 + 5; ++i ) {
+            grid.cellAt( i, j, reference[0] ) = 1.5;
+        }
+    }
+    std::array<equelle::CartesianGrid::CartesianCollectionOfScalar, 3> blocked = reference;
+
+    stepRows<3>( grid, swe, reference, steps );
+    grid.executeTimeSteps<3>( grid.allCells(), swe, {{ &blocked[0], &blocked[1], &blocked[2] }}, steps, 1, 3 );
+
+    for( int f = 0; f < 3; ++f ) {
+        BOOST_CHECK_SMALL( maxDifference( blocked[f], reference[f] ), 1e-12 );
+    }
+    BOOST_CHECK( grid.cellAt( dim_x/2 - 10, dim_y/2, reference[0] ) != 1.0 );
+}
+
 
 /**
  * Test that we can solve the heat equation
@@ -7,6 +7,7 @@
 #include <sstream>
 #include <iterator>
 #include <vector>
+#include <set>
 #include <numeric>
 #include <fstream>
 #include <tuple>
@@ -15,6 +16,7 @@
 #include <boost/format.hpp>
 #include "equelle/EquelleRuntimeCPU.hpp"
 #include "equelle/CartesianGrid.hpp"
+#include "equelle/EquelleRuntimeCartesian.hpp"
 
 namespace {
     template<class T>
@@ -167,16 +169,191 @@ BOOST_AUTO_TEST_CASE( faceAtTest ) {
     }
 }
 
+/**
+ * Test that the row accessors address the same elements as cellAt and faceAt
+ */
+BOOST_AUTO_TEST_CASE( rowAccessTest ) {
+    int dim_x = 3;
+    int dim_y = 5;
+    int ghostWidth = 2;
+
+    equelle::CartesianGrid grid( std::make_tuple( dim_x, dim_y),  ghostWidth );
+    equelle::CartesianGrid::CartesianCollectionOfScalar u = grid.inputCellScalarWithDefault( "u", 1.0 );
+    equelle::CartesianGrid::CartesianCollectionOfScalar flux = grid.inputFaceScalarWithDefault( "flux", 0.5 );
+
+    typedef equelle::CartesianGrid::Face Face;
+    const Face faces[] = { Face::negX, Face::posX, Face::negY, Face::posY };
+
+    for ( int j = -ghostWidth; j < dim_y+ghostWidth; ++j ) {
+        const double* row = grid.cellRow( j, u );
+        for( int i = -ghostWidth; i < dim_x+ghostWidth; ++i ) {
+            BOOST_CHECK_EQUAL( &row[i], &grid.cellAt( i, j, u ) );
+        }
+        for( Face face : faces ) {
+            const double* face_row = grid.faceRow( j, face, flux );
+            for( int i = -ghostWidth; i < dim_x+ghostWidth; ++i ) {
+                BOOST_CHECK_EQUAL( &face_row[i], &grid.faceAt( i, j, face, flux ) );
+            }
+        }
+    }
+    BOOST_CHECK_EQUAL( grid.cellRow( 1, u ) - grid.cellRow( 0, u ), grid.cellStrides[1] );
+}
+
+
+BOOST_AUTO_TEST_CASE( cartesianGrid3DTest ) {
+    int dim_x = 3;
+    int dim_y = 5;
+    int dim_z = 4;
+    int ghostWidth = 2;
 
-BOOST_AUTO_TEST_CASE( disallow3DGrids ) {
+    equelle::CartesianGrid grid( std::make_tuple( dim_x, dim_y, dim_z ), ghostWidth );
+    BOOST_CHECK_EQUAL( grid.dimensions, 3 );
+    BOOST_CHECK_EQUAL( grid.number_of_cells, dim_x*dim_y*dim_z );
+    BOOST_CHECK_EQUAL( grid.number_of_cells_and_ghost_cells, 7*9*8 );
+
+    // The x-index runs fastest, then y, then z.
+    BOOST_CHECK_EQUAL( grid.cellStrides[0], 1 );
+    BOOST_CHECK_EQUAL( grid.cellStrides[1], 7 );
+    BOOST_CHECK_EQUAL( grid.cellStrides[2], 7*9 );
+
+    BOOST_CHECK_EQUAL( grid.faceStrides[0][1], 8 );
+    BOOST_CHECK_EQUAL( grid.faceStrides[0][2], 8*9 );
+    BOOST_CHECK_EQUAL( grid.faceStrides[1][2], 7*10 );
+    BOOST_CHECK_EQUAL( grid.faceStrides[2][2], 7*9 );
+    BOOST_CHECK_EQUAL( grid.number_of_faces_and_ghost_faces, 8*9*8 + 7*10*8 + 7*9*9 );
+
+    equelle::CartesianGrid::CartesianCollectionOfScalar u = grid.inputCellScalarWithDefault( "u", 1.0 );
+    BOOST_CHECK_EQUAL( u.size(), grid.number_of_cells_and_ghost_cells );
+    BOOST_CHECK_EQUAL( &grid.cellAt( 0, 0, 1, u ) - &grid.cellAt( 0, 0, 0, u ), grid.cellStrides[2] );
+    BOOST_CHECK_EQUAL( &grid.cellAt( -ghostWidth, -ghostWidth, -ghostWidth, u ), &u[0] );
+    BOOST_CHECK_EQUAL( &grid.cellAt( dim_x+ghostWidth-1, dim_y+ghostWidth-1, dim_z+ghostWidth-1, u ), &u.back() );
+
+    int interior = 0;
+    for( double value : u ) {
+        interior += value == 1.0;
+    }
+    BOOST_CHECK_EQUAL( interior, grid.number_of_cells );
+
+    for( int k = -ghostWidth; k < dim_z+ghostWidth; ++k ) {
+        for( int j = -ghostWidth; j < dim_y+ghostWidth; ++j ) {
+            const double* row = grid.cellRow( j, k, u );
+            for( int i = -ghostWidth; i < dim_x+ghostWidth; ++i ) {
+                BOOST_CHECK_EQUAL( &row[i], &grid.cellAt( i, j, k, u ) );
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( faceAt3DTest ) {
+    int dim_x = 3;
+    int dim_y = 5;
+    int dim_z = 4;
+    int ghostWidth = 1;
+
+    equelle::CartesianGrid grid( std::make_tuple( dim_x, dim_y, dim_z ), ghostWidth );
+    equelle::CartesianGrid::CartesianCollectionOfScalar flux = grid.inputFaceScalarWithDefault( "flux", 0.5 );
+    BOOST_CHECK_EQUAL( flux.size(), grid.number_of_faces_and_ghost_faces );
+
+    typedef equelle::CartesianGrid::Face Face;
+    std::set<const double*> faces;
+    for( int k = -ghostWidth; k < dim_z+ghostWidth; ++k ) {
+        for( int j = -ghostWidth; j < dim_y+ghostWidth; ++j ) {
+            for( int i = -ghostWidth; i < dim_x+ghostWidth; ++i ) {
+                // Neighbouring cells share a face.
+                if ( i > -ghostWidth ) {
+                    BOOST_CHECK_EQUAL( &grid.faceAt( i, j, k, Face::negX, flux ), &grid.faceAt( i-1, j, k, Face::posX, flux ) );
+                }
+                if ( j > -ghostWidth ) {
+                    BOOST_CHECK_EQUAL( &grid.faceAt( i, j, k, Face::negY, flux ), &grid.faceAt( i, j-1, k, Face::posY, flux ) );
+                }
+                if ( k > -ghostWidth ) {
+                    BOOST_CHECK_EQUAL( &grid.faceAt( i, j, k, Face::negZ, flux ), &grid.faceAt( i, j, k-1, Face::posZ, flux ) );
+                }
+                faces.insert( &grid.faceAt( i, j, k, Face::negX, flux ) );
+                faces.insert( &grid.faceAt( i, j, k, Face::posX, flux ) );
+                faces.insert( &grid.faceAt( i, j, k, Face::negY, flux ) );
+                faces.insert( &grid.faceAt( i, j, k, Face::posY, flux ) );
+                faces.insert( &grid.faceAt( i, j, k, Face::negZ, flux ) );
+                faces.insert( &grid.faceAt( i, j, k, Face::posZ, flux ) );
+                BOOST_CHECK_EQUAL( &grid.faceRow( j, k, Face::negZ, flux )[i], &grid.faceAt( i, j, k, Face::negZ, flux ) );
+            }
+        }
+    }
+    // Every face of the grid is distinct and inside the collection.
+    BOOST_CHECK_EQUAL( faces.size(), flux.size() );
+    BOOST_CHECK( *faces.begin() == &flux.front() );
+    BOOST_CHECK( *faces.rbegin() == &flux.back() );
+
+    // The interior and boundary faces hold the default value.
+    double sum = std::accumulate( flux.begin(), flux.end(), 0.0 );
+    int num_faces = (dim_x+1)*dim_y*dim_z + dim_x*(dim_y+1)*dim_z + dim_x*dim_y*(dim_z+1);
+    BOOST_CHECK_CLOSE( sum, 0.5 * num_faces, 1e-12 );
+
+    BOOST_CHECK_EQUAL( grid.allZFaces().size(), dim_x*dim_y*(dim_z+1) );
+    BOOST_CHECK_EQUAL( grid.allCells().size(), dim_x*dim_y*dim_z );
+
+    // A 2D grid has no z-faces.
+    equelle::CartesianGrid grid2D( std::make_tuple( dim_x, dim_y ), ghostWidth );
+    BOOST_CHECK_THROW( grid2D.allZFaces(), std::runtime_error );
+}
+
+BOOST_AUTO_TEST_CASE( execute3DTest ) {
+    int dim_x = 6;
+    int dim_y = 5;
+    int dim_z = 4;
+
+    equelle::CartesianGrid grid( std::make_tuple( dim_x, dim_y, dim_z ), 1 );
+    equelle::CartesianGrid::CartesianCollectionOfScalar u = grid.inputCellScalarWithDefault( "u", 0.0 );
+    equelle::CartesianGrid::CartesianCollectionOfScalar v = grid.inputCellScalarWithDefault( "v", 0.0 );
+
+    grid.allCells().execute( [&]( int i, int j, int k ) {
+        grid.cellAt( i, j, k, u ) = i + 10*j + 100*k;
+    } );
+    grid.allCells().executeRows( [&]( int j, int k, int i_begin, int i_end ) {
+        const double* u_row = grid.cellRow( j, k, u );
+        double* v_row = grid.cellRow( j, k, v );
+        for( int i = i_begin; i < i_end; ++i ) {
+            v_row[i] = 2.0 * u_row[i];
+        }
+    } );
+    for( int k = 0; k < dim_z; ++k ) {
+        for( int j = 0; j < dim_y; ++j ) {
+            for( int i = 0; i < dim_x; ++i ) {
+                BOOST_CHECK_EQUAL( grid.cellAt( i, j, k, v ), 2.0 * ( i + 10*j + 100*k ) );
+            }
+        }
+    }
+    // The ghost cells are untouched.
+    BOOST_CHECK_EQUAL( grid.cellAt( 0, 0, -1, v ), 0.0 );
+    BOOST_CHECK_EQUAL( grid.cellAt( 0, 0, dim_z, v ), 0.0 );
+}
+
+BOOST_AUTO_TEST_CASE( disallow4DGrids ) {
     Opm::parameter::ParameterGroup param;
     param.disableOutput();
 
-    // Test that we do not allow for constructions of other than 2D-grids.
-    param.insertParameter( "grid_dim", "3" );
+    // Test that we do not allow for constructions of other than 2D- and 3D-grids.
+    param.insertParameter( "grid_dim", "4" );
     BOOST_CHECK_THROW( equelle::CartesianGrid grid( param ), std::runtime_error  );
 }
 
+BOOST_AUTO_TEST_CASE( ctor3DFromParamterObject ) {
+    Opm::parameter::ParameterGroup param;
+    param.disableOutput();
+
+    param.insertParameter( "grid_dim", "3");
+    param.insertParameter( "nx", "10" );
+    param.insertParameter( "ny", "12" );
+    param.insertParameter( "nz", "7" );
+
+    equelle::CartesianGrid grid(param);
+    BOOST_CHECK_EQUAL( grid.ghost_width, 1 );
+    BOOST_CHECK_EQUAL( grid.dimensions, 3 );
+    BOOST_CHECK_EQUAL( grid.cartdims[0], 10 );
+    BOOST_CHECK_EQUAL( grid.cartdims[1], 12 );
+    BOOST_CHECK_EQUAL( grid.cartdims[2], 7 );
+}
+
 BOOST_AUTO_TEST_CASE( ctorFromParamterObject ) {
     Opm::parameter::ParameterGroup param;
     param.disableOutput();
@@ -270,3 +447,58 @@ BOOST_AUTO_TEST_CASE( faceDataFromFile ) {
 
 
 }
+
+BOOST_AUTO_TEST_CASE( faceDataFromFile3D ) {
+    Opm::parameter::ParameterGroup param;
+    param.disableOutput();
+
+    param.insertParameter( "grid_dim", "3" );
+    param.insertParameter( "nx", "2" );
+    param.insertParameter( "ny", "2" );
+    param.insertParameter( "nz", "2" );
+
+    // 12 x-faces, 12 y-faces and 12 z-faces.
+    std::vector<double> defaults( 36 );
+    std::iota( defaults.begin(), defaults.end(), 1.0 );
+
+    injectMockData( param, "flux", defaults.begin(), defaults.end() );
+
+    equelle::CartesianGrid grid(param);
+    auto u = grid.inputFaceCollectionOfScalar( "flux" );
+    BOOST_CHECK_EQUAL( grid.faceAt( 0, 0, 0, equelle::CartesianGrid::Face::negX, u ), 1 );
+    BOOST_CHECK_EQUAL( grid.faceAt( 1, 1, 1, equelle::CartesianGrid::Face::posX, u ), 12 );
+
+    BOOST_CHECK_EQUAL( grid.faceAt( 0, 0, 0, equelle::CartesianGrid::Face::negY, u ), 13 );
+    BOOST_CHECK_EQUAL( grid.faceAt( 1, 0, 1, equelle::CartesianGrid::Face::posY, u ), 23 );
+
+    BOOST_CHECK_EQUAL( grid.faceAt( 0, 0, 0, equelle::CartesianGrid::Face::negZ, u ), 25 );
+    BOOST_CHECK_EQUAL( grid.faceAt( 1, 1, 0, equelle::CartesianGrid::Face::negZ, u ), 34 );
+    BOOST_CHECK_EQUAL( grid.faceAt( 1, 1, 1, equelle::CartesianGrid::Face::posZ, u ), 36 );
+}
+
+BOOST_AUTO_TEST_CASE( runtimeCartesianReductions ) {
+    Opm::parameter::ParameterGroup param;
+    param.disableOutput();
+
+    param.insertParameter( "nx", "3" );
+    param.insertParameter( "ny", "2" );
+    param.insertParameter( "u", "2.0" );
+
+    equelle::EquelleRuntimeCartesian er( param );
+    BOOST_CHECK_NO_THROW( er.ensureGridDimension( 2 ) );
+    BOOST_CHECK_THROW( er.ensureGridDimension( 3 ), std::runtime_error );
+
+    equelle::CartesianCollectionOfScalar u = er.inputCollectionOfScalar( "u", er.allCells() );
+    BOOST_CHECK_EQUAL( u.size(), er.grid().number_of_cells_and_ghost_cells );
+    er.grid().cellAt( 2, 1, u ) = 5.0;
+
+    // The reductions are over the interior cells, the ghost cells are zero.
+    BOOST_CHECK_EQUAL( er.minReduce( u ), 2.0 );
+    BOOST_CHECK_EQUAL( er.maxReduce( u ), 5.0 );
+    BOOST_CHECK_EQUAL( er.sumReduce( u ), 15.0 );
+    BOOST_CHECK_EQUAL( er.prodReduce( u ), 160.0 );
+
+    equelle::CartesianCollectionOfScalar v = er.newCellCollection();
+    BOOST_CHECK_EQUAL( v.size(), u.size() );
+    BOOST_CHECK_EQUAL( er.maxReduce( v ), 0.0 );
+}
@@ -5,32 +5,43 @@
 
 #include "equelle/mpiutils.hpp"
 #include "equelle/RuntimeMPI.hpp"
+#include "equelle/PartitionIO.hpp"
 #include "opm/core/grid.h"
 #include "opm/core/grid/GridManager.hpp"
-
-
+#include "opm/core/utility/parameters/ParameterGroup.hpp"
+
+/** Partition a grid once for a run on a given number of nodes, and write the subGrid and
+ *  halo exchange plan of every node (see equelle::PartitionIO). The simulator then reads
+ *  them with partition_file=<prefix> instead of partitioning the grid at every start.
+ *
+ *  Usage: standalone_partition <grid parameters> nodes=<N> partition_output=<prefix>
+ *  The grid parameters and the partitioning parameters (partition_method and so on) are
+ *  those of the simulator. It may be run on any number of MPI processes.
+ */
 int main( int argc, char* argv[] ) {
     MPI_SAFE_CALL( MPI_Init( NULL, NULL ) );
-
-    int size;
-    MPI_SAFE_CALL( MPI_Comm_size( MPI_COMM_WORLD, &size ) );
-
-    if ( argc != 2 ) {
-        std::cerr << "Usage: " << argv[0] << " " << "gridfile\n" << std::endl;
-    } else {
-        equelle::RuntimeMPI runtime;
-        if ( equelle::getMPIRank() == 0 ) {
-            runtime.globalGrid.reset( new Opm::GridManager( argv[1] ) );
-        }
-
-        auto zr = runtime.computePartition();
-
-        if ( equelle::getMPIRank() == 0 ) {
-            std::ofstream f( std::string( argv[1]) + std::string( ".part.out")  );
-            equelle::ZoltanGrid::dumpRank0Exports( runtime.globalGrid->c_grid()->number_of_cells, zr, f );
+    int status = 0;
+    {
+        Opm::parameter::ParameterGroup param( argc, argv, false );
+        if ( !param.has( "nodes" ) || !param.has( "partition_output" ) ) {
+            if ( equelle::getMPIRank() == 0 ) {
+                std::cerr << "Usage: " << argv[0] << " <grid parameters> nodes=<N> partition_output=<prefix>" << std::endl;
+            }
+            status = 1;
+        } else {
+            const int nodes = param.get<int>( "nodes" );
+            const std::string prefix = param.get<std::string>( "partition_output" );
+            equelle::RuntimeMPI runtime( param );
+            const std::vector<int> owner = runtime.computeOwners( nodes );
+
+            if ( equelle::getMPIRank() == 0 ) {
+                equelle::PartitionIO::write( prefix, runtime.globalGrid->c_grid(), owner, nodes );
+                std::cout << "Wrote the partition of " << owner.size() << " cells for " << nodes
+                          << " nodes to " << prefix << ".*" << std::endl;
+            }
         }
     }
 
     MPI_SAFE_CALL( MPI_Finalize() );
-    return 1;
+    return status;
 }